@@ -0,0 +1,594 @@
+/**************************************************************************
+ * microbench.c                                                           *
+ *                                                                        *
+ * Microbenchmarks for the per-packet kernels of tunneludp_v2.c, which it *
+ * includes whole (without its main), so what is timed is exactly what    *
+ * the tunnel runs: header build and parse, peer table and route trie     *
+ * lookups, the replay window, the buffer pool, AEAD seal/open at several *
+ * frame sizes, the LZ4 codec and the FEC multiply-add in its vector and  *
+ * table versions. Each kernel runs until it took at least -t ms; the     *
+ * table gives ns and TSC cycles per operation and, for kernels that      *
+ * touch every payload byte, cycles per byte.                             *
+ *                                                                        *
+ * The AEAD kernels then run again in a child with the SIMD code paths of *
+ * OpenSSL switched off through OPENSSL_ia32cap (x86 only), to show what  *
+ * the vector units are worth. Open timings include copying the sealed    *
+ * frame back in before each call.                                        *
+ *                                                                        *
+ * compile: gcc -O2 -pthread -o microbench microbench.c -lcrypto          *
+ *                                                                        *
+ * running:                                                               *
+ *   ./microbench                  all kernels, native then scalar AEAD   *
+ *   ./microbench -k replay -t 500 kernels with "replay" in their name    *
+ *                                                                        *
+ *************************************************************************/
+
+#define TUNNEL_NO_MAIN
+#include "../tunneludp_v2.c"
+
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define MSEC_DEFAULT 200    /* minimum run time of one kernel */
+#define BENCH_PEERS 1024    /* peers, paths and routes to look up, power of 2 */
+#define BENCH_KEYS 4096     /* lookup keys cycled through, power of 2 */
+#define BULK 512            /* buffers taken at once by the bulk pool kernel */
+#define OPEN_FRAMES 64      /* sealed frames cycled through by open */
+#define FRAME_MAX 9000
+
+/* clears MMX/SSE/SSE2/FXSR and every extended feature word bit: no AES-NI,
+ * PCLMULQDQ, SSSE3, AVX, AVX2 or AVX-512 code in libcrypto */
+#define NO_SIMD_CAP "~0xffffffff07800000:~0xffffffffffffffff"
+
+int bench_msec = MSEC_DEFAULT;
+int scalar;                 /* -n: the child pass without SIMD */
+char *filter;
+volatile uint64_t sink;     /* results go here so nothing is optimized away */
+
+int sizes[] = { 64, 512, 1400, 9000 };
+struct {
+    const char *name;
+    const EVP_CIPHER *(*cipher)(void);
+} ciphers[] = {
+    { "aes-256-gcm", EVP_aes_256_gcm },
+    { "chacha20-poly1305", EVP_chacha20_poly1305 },
+};
+
+/**************************************************************************
+ * struct lookup: what the table and trie kernels look up.                *
+ **************************************************************************/
+struct lookup {
+    uint64_t addr[BENCH_KEYS];
+    uint32_t session[BENCH_KEYS];
+    uint32_t ip[BENCH_KEYS];
+};
+
+/**************************************************************************
+ * struct sealed: what the AEAD kernels work on.                          *
+ **************************************************************************/
+struct sealed {
+    EVP_CIPHER_CTX *enc, *dec;
+    int len;
+    char *frame;                    /* one frame, sealed over and over */
+    char *copies[OPEN_FRAMES];      /* sealed frames, restored before open */
+};
+
+/**************************************************************************
+ * struct zipped: what the compression kernels work on, a packet of text *
+ *                records and its LZ4 block.                             *
+ **************************************************************************/
+struct zipped {
+    struct tunnel t;
+    int len, zlen;
+    uint8_t pkt[ZIP_MAX_LEN], block[ZIP_MAX_LEN], out[ZIP_MAX_LEN];
+};
+
+/**************************************************************************
+ * struct coded: what the FEC kernel works on, one data shard added into  *
+ *               one parity shard by the kernel picked.                   *
+ **************************************************************************/
+struct coded {
+    void (*madd)(uint8_t *dst, const uint8_t *src, uint8_t c, int len);
+    int len;
+    uint8_t data[FEC_SHARD_MAX], parity[FEC_SHARD_MAX];
+};
+
+/**************************************************************************
+ * cycles: the time stamp counter, 0 where there is none.                 *
+ **************************************************************************/
+uint64_t cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**************************************************************************
+ * xorshift: a fixed pseudo random sequence, the same on every run.       *
+ **************************************************************************/
+uint32_t xorshift(void) {
+    
+    static uint32_t x = 2463534242U;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/**************************************************************************
+ * bench_run: times n calls of kernel fn, with n grown until they take    *
+ *            bench_msec, and prints a line. size is the payload bytes    *
+ *            one call works through, 0 for none.                         *
+ **************************************************************************/
+void bench_run(const char *name, int size, void (*fn)(void *arg, long n), void *arg) {
+    
+    uint64_t t0, c0, nsec, cyc, want = bench_msec * 1000000ULL;
+    long n = 1;
+    char label[64], cpb[16] = "-";
+    
+    snprintf(label, sizeof(label), "%s%s", name, scalar ? " (scalar)" : "");
+    if (filter && strstr(label, filter) == NULL)
+        return;
+    
+    fn(arg, 16);
+    for (;;) {
+        t0 = now_nsec();
+        c0 = cycles();
+        fn(arg, n);
+        cyc = cycles() - c0;
+        nsec = now_nsec() - t0;
+        if (nsec >= want)
+            break;
+        n = nsec < want / 100 ? n * 10 : (long)((double)n * want / nsec * 1.1) + 1;
+    }
+    
+#ifdef HAVE_TSC
+    if (size > 0)
+        snprintf(cpb, sizeof(cpb), "%.2f", (double)cyc / n / size);
+    printf("%-36s %6d %10.1f %10.1f %10s\n", label, size, (double)nsec / n, (double)cyc / n, cpb);
+#else
+    printf("%-36s %6d %10.1f %10s %10s\n", label, size, (double)nsec / n, "-", cpb);
+#endif
+    fflush(stdout);
+}
+
+/**************************************************************************
+ * k_*: the kernels, each does n operations on what arg points to.        *
+ **************************************************************************/
+void k_wire_encap(void *arg, long n) {
+    
+    char *frame = arg;
+    long i;
+    
+    for (i = 0; i < n; i++)
+        sink += wire_encap(frame, FRAME_DATA, 1400, 0x12345678, i);
+}
+
+void k_wire_decap(void *arg, long n) {
+    
+    char *frame = arg;
+    struct wire_hdr *hdr = (struct wire_hdr *)frame;
+    long i;
+    
+    for (i = 0; i < n; i++)
+        sink += wire_decap(frame, WIRE_HDR_LEN + 1400, &hdr) + hdr->type;
+}
+
+void k_ptable_hit(void *arg, long n) {
+    
+    struct lookup *l = arg;
+    long i;
+    int path;
+    
+    for (i = 0; i < n; i++)
+        sink += ptable_lookup(l->addr[i & (BENCH_KEYS - 1)], l->session[i & (BENCH_KEYS - 1)], &path)->id;
+}
+
+void k_ptable_miss(void *arg, long n) {
+    
+    struct lookup *l = arg;
+    long i;
+    int path;
+    
+    for (i = 0; i < n; i++)
+        sink += ptable_lookup(l->addr[i & (BENCH_KEYS - 1)] + 1, l->session[i & (BENCH_KEYS - 1)], &path) != NULL;
+}
+
+void k_lpm_lookup(void *arg, long n) {
+    
+    struct lookup *l = arg;
+    struct lpm *t = atomic_load(&routes);
+    long i;
+    
+    for (i = 0; i < n; i++)
+        sink += lpm_lookup(t, l->ip[i & (BENCH_KEYS - 1)]);
+}
+
+void k_replay_new(void *arg, long n) {
+    
+    static uint64_t seq;
+    struct replay *r = arg;
+    long i;
+    
+    for (i = 0; i < n; i++, seq++)
+        if (replay_check(r, seq) == 0)
+            sink += replay_update(r, seq);
+}
+
+void k_replay_dup(void *arg, long n) {
+    
+    struct replay *r = arg;
+    uint64_t top = replay_bound(r) - 32;
+    long i;
+    
+    for (i = 0; i < n; i++)
+        sink += replay_check(r, top - (i & 1023));
+}
+
+void k_pool_single(void *arg, long n) {
+    
+    long i;
+    
+    (void)arg;
+    for (i = 0; i < n; i++)
+        pool_put(pool_get());
+}
+
+void k_pool_bulk(void *arg, long n) {
+    
+    char **bufs = arg;
+    long i, j, m;
+    
+    for (i = 0; i < n; i += m) {
+        m = n - i < BULK ? n - i : BULK;
+        for (j = 0; j < m; j++)
+            bufs[j] = pool_get();
+        for (j = 0; j < m; j++)
+            pool_put(bufs[j]);
+    }
+}
+
+void k_seal(void *arg, long n) {
+    
+    struct sealed *s = arg;
+    struct wire_hdr *hdr = (struct wire_hdr *)s->frame;
+    uint8_t *payload = (uint8_t *)(hdr + 1);
+    long i;
+    
+    for (i = 0; i < n; i++) {
+        hdr->seq = htobe64(i);
+        if (aead_seal(s->enc, hdr, payload, s->len, payload + s->len) < 0) {
+            fprintf(stderr, "seal failed\n");
+            exit(1);
+        }
+    }
+}
+
+void k_open(void *arg, long n) {
+    
+    struct sealed *s = arg;
+    int bytes = WIRE_HDR_LEN + s->len + AEAD_TAG_LEN;
+    long i;
+    
+    for (i = 0; i < n; i++) {
+        memcpy(s->frame, s->copies[i % OPEN_FRAMES], bytes);
+        if (aead_open(s->dec, (struct wire_hdr *)s->frame, s->len + AEAD_TAG_LEN) != s->len) {
+            fprintf(stderr, "open failed\n");
+            exit(1);
+        }
+    }
+}
+
+void k_lz4_compress(void *arg, long n) {
+    
+    struct zipped *z = arg;
+    long i;
+    
+    for (i = 0; i < n; i++) {
+        sink += lz4_compress(z->t.zip, z->pkt, z->len, z->block, z->len);
+        z->t.zip->base += z->len;
+    }
+}
+
+void k_lz4_decompress(void *arg, long n) {
+    
+    struct zipped *z = arg;
+    long i;
+    
+    for (i = 0; i < n; i++)
+        if (lz4_decompress(z->block, z->zlen, z->out, ZIP_MAX_LEN) != z->len) {
+            fprintf(stderr, "decompress failed\n");
+            exit(1);
+        }
+}
+
+void k_zip_bypass(void *arg, long n) {
+    
+    struct zipped *z = arg;
+    long i;
+    
+    for (i = 0; i < n; i++)
+        sink += zip_packet(&z->t, z->out, z->len);
+}
+
+void k_gf_madd(void *arg, long n) {
+    
+    struct coded *c = arg;
+    long i;
+    
+    for (i = 0; i < n; i++)
+        c->madd(c->parity, c->data, fec_coef[i % FEC_M_MAX][i % FEC_K_MAX], c->len);
+    sink += c->parity[0];
+}
+
+/**************************************************************************
+ * bench_framing: header build and parse.                                 *
+ **************************************************************************/
+void bench_framing(void) {
+    
+    char frame[WIRE_HDR_LEN + 1400];
+    
+    memset(frame, 0, sizeof(frame));
+    bench_run("wire_encap", 0, k_wire_encap, frame);
+    wire_encap(frame, FRAME_DATA, 1400, 0x12345678, 1);
+    bench_run("wire_decap", 0, k_wire_decap, frame);
+}
+
+/**************************************************************************
+ * bench_lookup: BENCH_PEERS peers, each with one path and a /24, found   *
+ *               by (path, session) and by random addresses in the /24s.  *
+ **************************************************************************/
+void bench_lookup(void) {
+    
+    static struct lookup l;
+    struct sockaddr_in addr;
+    struct route r;
+    char name[64];
+    int i, k;
+    
+    peers_init();
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    for (i = 0; i < BENCH_PEERS; i++) {
+        addr.sin_addr.s_addr = htonl(0xc0a80000 | i);   /* 192.168.x.y */
+        addr.sin_port = htons(20000 + i);
+        r.prefix = 0x0a000000 | i << 8;                 /* 10.x.y.0/24 */
+        r.len = 24;
+        if (peer_add(0x1000 + i, &addr, 0, &r, 1, 0, 0) == NULL) {
+            fprintf(stderr, "peer_add failed\n");
+            exit(1);
+        }
+    }
+    for (k = 0; k < BENCH_KEYS; k++) {
+        i = xorshift() & (BENCH_PEERS - 1);
+        addr.sin_addr.s_addr = htonl(0xc0a80000 | i);
+        addr.sin_port = htons(20000 + i);
+        l.addr[k] = path_key(&addr);
+        l.session[k] = 0x1000 + i;
+        l.ip[k] = 0x0a000000 | (xorshift() & (BENCH_PEERS * 256 - 1));
+    }
+    
+    snprintf(name, sizeof(name), "ptable_lookup hit, %d peers", BENCH_PEERS);
+    bench_run(name, 0, k_ptable_hit, &l);
+    snprintf(name, sizeof(name), "ptable_lookup miss, %d peers", BENCH_PEERS);
+    bench_run(name, 0, k_ptable_miss, &l);
+    snprintf(name, sizeof(name), "lpm_lookup, %d routes", BENCH_PEERS);
+    bench_run(name, 0, k_lpm_lookup, &l);
+}
+
+/**************************************************************************
+ * bench_replay: in-order frames, the common case, and duplicates.        *
+ **************************************************************************/
+void bench_replay(void) {
+    
+    static struct replay r;
+    
+    replay_reset(&r, 0);
+    bench_run("replay check+update, new", 0, k_replay_new, &r);
+    bench_run("replay check, duplicate", 0, k_replay_dup, &r);
+}
+
+/**************************************************************************
+ * bench_pool: a get/put pair served by the thread's cache, and BULK gets *
+ *             then BULK puts, which go through the shared pool. main     *
+ *             sets the pool up before the table starts.                  *
+ **************************************************************************/
+void bench_pool(void) {
+    
+    static char *bufs[BULK];
+    char name[64];
+    
+    bench_run("pool get+put", 0, k_pool_single, NULL);
+    snprintf(name, sizeof(name), "pool get+put, %d at once", BULK);
+    bench_run(name, 0, k_pool_bulk, bufs);
+}
+
+/**************************************************************************
+ * bench_aead: seal and open with every cipher at every size. The tunnel  *
+ *             seals as one side and opens as the other, so cliserv is    *
+ *             flipped between making the sealed copies and opening them. *
+ **************************************************************************/
+void bench_aead(void) {
+    
+    static struct sealed s;
+    struct wire_hdr *hdr;
+    uint8_t key[AEAD_KEY_LEN];
+    char name[64];
+    int c, z, i;
+    
+    for (i = 0; i < AEAD_KEY_LEN; i++)
+        key[i] = xorshift();
+    if ((s.frame = aligned_alloc(64, 2 * FRAME_MAX)) == NULL) {
+        perror("bench_aead");
+        exit(1);
+    }
+    for (i = 0; i < OPEN_FRAMES; i++)
+        if ((s.copies[i] = aligned_alloc(64, 2 * FRAME_MAX)) == NULL) {
+            perror("bench_aead");
+            exit(1);
+        }
+    
+    for (c = 0; c < (int)(sizeof(ciphers) / sizeof(ciphers[0])); c++) {
+        aead = ciphers[c].cipher();
+        s.enc = aead_ctx(s.enc, key, 1);
+        s.dec = aead_ctx(s.dec, key, 0);
+        for (z = 0; z < (int)(sizeof(sizes) / sizeof(sizes[0])); z++) {
+            s.len = sizes[z];
+            memset(s.frame, 0xa5, 2 * FRAME_MAX);
+            wire_encap(s.frame, FRAME_DATA, s.len + AEAD_TAG_LEN, 1, 0);
+            snprintf(name, sizeof(name), "%s seal", ciphers[c].name);
+            cliserv = CLIENT;
+            bench_run(name, s.len, k_seal, &s);
+    
+            cliserv = SERVER;
+            for (i = 0; i < OPEN_FRAMES; i++) {
+                hdr = (struct wire_hdr *)s.copies[i];
+                memcpy(hdr, s.frame, WIRE_HDR_LEN + s.len);
+                hdr->seq = htobe64(i);
+                aead_seal(s.enc, hdr, (uint8_t *)(hdr + 1), s.len, (uint8_t *)(hdr + 1) + s.len);
+            }
+            snprintf(name, sizeof(name), "%s open", ciphers[c].name);
+            cliserv = CLIENT;
+            bench_run(name, s.len, k_open, &s);
+        }
+    }
+}
+
+/**************************************************************************
+ * bench_zip: the LZ4 codec on packets of JSON-like records, and the      *
+ *            entropy check turning away a random one.                    *
+ **************************************************************************/
+void bench_zip(void) {
+    
+    static const char *words[] = { "\"id\": ", "\"user\": \"", "\"status\": \"ok\", ", "\"items\": [",
+                                   "\"ts\": ", "}, {", "\"name\": \"" };
+    static const int lens[] = { 512, 1400 };
+    static struct zipped z;
+    char name[64];
+    int i, k, w;
+    
+    zip_init(&z.t);
+    for (k = 0; k < (int)(sizeof(lens) / sizeof(lens[0])); k++) {
+        z.len = lens[k];
+        for (i = 0; i < z.len; i += w) {
+            w = snprintf((char *)z.out, sizeof(z.out), "%s%u, ", words[xorshift() % 7], xorshift() % 100000);
+            memcpy(z.pkt + i, z.out, i + w <= z.len ? w : z.len - i);
+        }
+        if ((z.zlen = lz4_compress(z.t.zip, z.pkt, z.len, z.block, z.len)) < 0) {
+            fprintf(stderr, "compress failed\n");
+            exit(1);
+        }
+        snprintf(name, sizeof(name), "lz4 compress, %d%% out", 100 * z.zlen / z.len);
+        bench_run(name, z.len, k_lz4_compress, &z);
+        bench_run("lz4 decompress", z.len, k_lz4_decompress, &z);
+        for (i = 0; i < z.len; i++)
+            z.out[i] = xorshift();
+        bench_run("zip_packet, random bypass", z.len, k_zip_bypass, &z);
+    }
+}
+
+/**************************************************************************
+ * bench_fec: one shard into one parity row, the GF(2^8) multiply-add     *
+ *            FEC spends its time in, with the kernel fec_init picked for *
+ *            this CPU and with the table one it falls back to.           *
+ **************************************************************************/
+void bench_fec(void) {
+    
+    static struct coded c;
+    char name[64];
+    int i, k;
+    
+    fec_init();
+    for (i = 0; i < FEC_SHARD_MAX; i++)
+        c.data[i] = xorshift();
+    for (k = 0; k < 2; k++) {
+        c.len = sizes[k + 1] < FEC_SHARD_MAX ? sizes[k + 1] : FEC_SHARD_MAX;
+        c.madd = gf_madd;
+        snprintf(name, sizeof(name), "gf_madd, %s", gf_kernel);
+        bench_run(name, c.len, k_gf_madd, &c);
+        c.madd = gf_madd_scalar;
+        bench_run("gf_madd, scalar", c.len, k_gf_madd, &c);
+    }
+}
+
+/**************************************************************************
+ * bench_usage: prints usage and exits.                                   *
+ **************************************************************************/
+void bench_usage(void) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [-t <msec>] [-k <kernel>]\n", progname);
+    fprintf(stderr, "%s -h\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-t <msec>: minimum run time of each kernel (default %d)\n", MSEC_DEFAULT);
+    fprintf(stderr, "-k <kernel>: only run kernels whose name contains this\n");
+    fprintf(stderr, "-h: prints this help text\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    
+    char msec[16];
+    int option;
+    pid_t pid;
+    
+    progname = argv[0];
+    while ((option = getopt(argc, argv, "t:k:nh")) > 0) {
+        switch (option) {
+            case 't':
+                bench_msec = atoi(optarg);
+                break;
+            case 'k':
+                filter = optarg;
+                break;
+            case 'n':
+                scalar = 1;
+                break;
+            default:
+                bench_usage();
+        }
+    }
+    if (argc > optind || bench_msec < 1)
+        bench_usage();
+    
+    if (!scalar) {
+        pool_init(POOL_CACHE + 2 * BULK + POOL_SPARE);
+        printf("%-36s %6s %10s %10s %10s\n", "kernel", "bytes", "ns/op", "cycles/op", "cycles/B");
+        bench_framing();
+        bench_lookup();
+        bench_replay();
+        bench_pool();
+        bench_zip();
+        bench_fec();
+    }
+    bench_aead();
+    
+#ifdef HAVE_TSC
+    /* OpenSSL reads its capability mask once at load, so the scalar pass
+     * needs a fresh process */
+    if (!scalar) {
+        fflush(stdout);
+        if ((pid = fork()) < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            snprintf(msec, sizeof(msec), "%d", bench_msec);
+            setenv("OPENSSL_ia32cap", NO_SIMD_CAP, 1);
+            if (filter)
+                execl("/proc/self/exe", progname, "-n", "-t", msec, "-k", filter, (char *)NULL);
+            else
+                execl("/proc/self/exe", progname, "-n", "-t", msec, (char *)NULL);
+            perror("execl");
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+#endif
+    
+    return(0);
+}
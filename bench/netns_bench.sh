@@ -0,0 +1,150 @@
+#!/bin/bash
+# netns_bench.sh: end-to-end benchmark of the tunnel. Two network namespaces
+# joined by a veth pair each run one end; trafgen drives UDP through the
+# tunnel at every size and flow count and the results come out as a table.
+# Run as root from bench/ after make. Settings, from the environment:
+#
+#   SIZES="64 512 1400"  UDP payload bytes sent through the tunnel
+#   FLOWS="1 4"          concurrent flows (source ports) per run
+#   DURATION=10          seconds of traffic per run
+#   PROBES=2000          latency probes per run, idle and under load
+#   TUNNEL_ARGS=""       extra options for both tunnel ends, e.g. "-b 32 -w 2"
+#   CSV=""               also append one line per run to this file
+#   LOG_DIR=/tmp/udptunnel-bench   logs, stats sockets and final metrics
+
+SIZES=${SIZES:-"64 512 1400"}
+FLOWS=${FLOWS:-"1 4"}
+DURATION=${DURATION:-10}
+PROBES=${PROBES:-2000}
+LOG_DIR=${LOG_DIR:-/tmp/udptunnel-bench}
+NS_CLI=udpt_bench_cli
+NS_SRV=udpt_bench_srv
+BIN=$(dirname "$0")/tunneludp
+GEN=$(dirname "$0")/trafgen
+SINK_PORT=9000
+ECHO_PORT=9001
+
+if [ "$(id -u)" != 0 ]; then
+    echo "$0: must run as root" >&2
+    exit 1
+fi
+if [ ! -x "$BIN" ] || [ ! -x "$GEN" ]; then
+    echo "$0: build first (make)" >&2
+    exit 1
+fi
+
+cleanup() {
+    kill $SRV_PID $CLI_PID $ECHO_PID 2>/dev/null
+    wait 2>/dev/null
+    ip netns del $NS_CLI 2>/dev/null
+    ip netns del $NS_SRV 2>/dev/null
+}
+trap cleanup EXIT
+
+# wait_for CMD...: retries CMD for up to 5 seconds
+wait_for() {
+    for i in $(seq 50); do
+        "$@" >/dev/null 2>&1 && return 0
+        sleep 0.1
+    done
+    echo "$0: timed out waiting for: $*" >&2
+    exit 1
+}
+
+# cpu_ticks PID...: user + system clock ticks of all threads of the PIDs
+cpu_ticks() {
+    local sum=0 pid f
+    for pid in "$@"; do
+        f=($(sed 's/^.*) //' /proc/$pid/stat))
+        sum=$((sum + f[11] + f[12]))
+    done
+    echo $sum
+}
+
+mkdir -p "$LOG_DIR"
+cleanup
+ip netns add $NS_CLI
+ip netns add $NS_SRV
+ip link add udpt_va type veth peer name udpt_vb
+ip link set udpt_va netns $NS_CLI
+ip link set udpt_vb netns $NS_SRV
+ip -n $NS_CLI addr add 192.168.99.1/24 dev udpt_va
+ip -n $NS_SRV addr add 192.168.99.2/24 dev udpt_vb
+for ns in $NS_CLI $NS_SRV; do
+    ip -n $ns link set lo up
+done
+ip -n $NS_CLI link set udpt_va up
+ip -n $NS_SRV link set udpt_vb up
+
+# server end: 10.9.0.1, routes the client's 10.9.1.0/24 back into the tunnel
+ip netns exec $NS_SRV stdbuf -oL "$BIN" -i tun0 -s -I 10.9.0.1/24 -R 10.9.1.0/24 -S "$LOG_DIR/server.sock" $TUNNEL_ARGS \
+    > "$LOG_DIR/server.log" 2>&1 &
+SRV_PID=$!
+wait_for grep -q "Waiting for clients" "$LOG_DIR/server.log"
+
+# client end: 10.9.1.1, announces its subnet in the handshake
+ip netns exec $NS_CLI stdbuf -oL "$BIN" -i tun0 -c 192.168.99.2 -l 10.9.1.0/24 -I 10.9.1.1/24 -R 10.9.0.0/24 \
+    -S "$LOG_DIR/client.sock" $TUNNEL_ARGS > "$LOG_DIR/client.log" 2>&1 &
+CLI_PID=$!
+wait_for grep -q "Connection with" "$LOG_DIR/client.log"
+
+ip netns exec $NS_SRV "$GEN" -e -P $ECHO_PORT > /dev/null 2>&1 &
+ECHO_PID=$!
+wait_for ip netns exec $NS_CLI "$GEN" -p 10.9.0.1 -P $ECHO_PORT -n 1
+
+MHZ=$(awk -F: '/^cpu MHz/ { print $2; exit }' /proc/cpuinfo)
+HZ=$(getconf CLK_TCK)
+echo "tunnel options: ${TUNNEL_ARGS:-none}, ${DURATION}s per run, $(nproc) CPUs${MHZ:+ at ${MHZ# } MHz}"
+printf "%6s %5s %11s %11s %6s %7s %7s %8s  %-20s  %-20s\n" size flows sent received loss% Mpps Gbps cyc/pkt \
+    "idle p50/p99/p999us" "load p50/p99/p999us"
+[ -n "$CSV" ] && [ ! -s "$CSV" ] && \
+    echo "size,flows,sent,received,mpps,gbps,cycles_per_pkt,idle_p50_us,idle_p99_us,idle_p999_us,load_p50_us,load_p99_us,load_p999_us,options" > "$CSV"
+
+# ping_pct OUTPUT: p50/p99/p999 of a trafgen ping line
+ping_pct() {
+    echo "$1" | awk '{ for (i = 1; i < NF; i++) v[$i] = $(i + 1);
+                       printf "%s,%s,%s", v["p50_us"], v["p99_us"], v["p999_us"] }'
+}
+
+for size in $SIZES; do
+    idle=$(ping_pct "$(ip netns exec $NS_CLI "$GEN" -p 10.9.0.1 -P $ECHO_PORT -l $size -n $PROBES)")
+    for flows in $FLOWS; do
+        ip netns exec $NS_SRV "$GEN" -s -P $SINK_PORT -f $flows -d $DURATION > "$LOG_DIR/sink.out" &
+        SINK_PID=$!
+        sleep 0.2
+        ticks0=$(cpu_ticks $SRV_PID $CLI_PID)
+        ip netns exec $NS_CLI "$GEN" -t 10.9.0.1 -P $SINK_PORT -l $size -f $flows -d $DURATION > "$LOG_DIR/blast.out" &
+        BLAST_PID=$!
+        # probe the queues while they are full, halfway through the run
+        sleep $((DURATION / 2))
+        load=$(ping_pct "$(ip netns exec $NS_CLI "$GEN" -p 10.9.0.1 -P $ECHO_PORT -l $size -n $PROBES)")
+        wait $BLAST_PID
+        ticks1=$(cpu_ticks $SRV_PID $CLI_PID)
+        wait $SINK_PID
+
+        read -r _ _ sent _ _ _ _ < "$LOG_DIR/blast.out"
+        read -r _ _ recv _ bytes _ secs < "$LOG_DIR/sink.out"
+        awk -v size=$size -v flows=$flows -v sent=$sent -v recv=$recv -v bytes=$bytes -v secs=$secs \
+            -v ticks=$((ticks1 - ticks0)) -v hz=$HZ -v mhz="$MHZ" -v idle="$idle" -v load="$load" \
+            -v csv="$CSV" -v opts="$TUNNEL_ARGS" '
+            BEGIN {
+                mpps = secs > 0 ? recv / secs / 1e6 : 0
+                gbps = secs > 0 ? bytes * 8 / secs / 1e9 : 0
+                loss = sent > 0 ? (sent - recv) * 100 / sent : 0
+                cyc = mhz != "" && recv > 0 ? sprintf("%.0f", ticks / hz * mhz * 1e6 / recv) : "n/a"
+                split(idle, i, ","); split(load, l, ",")
+                printf "%6d %5d %11d %11d %6.2f %7.3f %7.3f %8s  %-20s  %-20s\n", size, flows, sent, recv,
+                       loss, mpps, gbps, cyc, i[1] "/" i[2] "/" i[3], l[1] "/" l[2] "/" l[3]
+                if (csv != "")
+                    printf "%d,%d,%d,%d,%.4f,%.4f,%s,%s,%s,\"%s\"\n", size, flows, sent, recv, mpps, gbps,
+                           cyc, idle, load, opts >> csv
+            }'
+    done
+done
+
+# the tunnel's own view: counters and its latency histograms
+if command -v curl > /dev/null; then
+    curl -s --unix-socket "$LOG_DIR/server.sock" http://localhost/metrics > "$LOG_DIR/server.metrics"
+    curl -s --unix-socket "$LOG_DIR/client.sock" http://localhost/metrics > "$LOG_DIR/client.metrics"
+    echo "tunnel metrics in $LOG_DIR/server.metrics and $LOG_DIR/client.metrics"
+fi
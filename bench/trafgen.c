@@ -0,0 +1,379 @@
+/**************************************************************************
+ * trafgen.c                                                              *
+ *                                                                        *
+ * UDP traffic generator for the tunnel benchmark (netns_bench.sh). It    *
+ * runs in one of four modes on either end of the tunnel:                 *
+ *                                                                        *
+ *   -s  sink: counts what arrives on a port, prints packets, bytes and   *
+ *       the seconds between the first and the last one                   *
+ *   -t  blast: sends datagrams of one size as fast as it can, one        *
+ *       thread and source port (one flow) per -f                         *
+ *   -e  echo: sends every datagram back where it came from               *
+ *   -p  ping: one probe at a time to an echo, prints RTT percentiles     *
+ *                                                                        *
+ * compile: gcc -O2 -pthread -o trafgen trafgen.c                         *
+ *                                                                        *
+ * running:                                                               *
+ *   ./trafgen -s -P 9000 -f 4 -d 10                                      *
+ *   ./trafgen -t 10.9.0.1 -P 9000 -l 64 -f 4 -d 10                       *
+ *   ./trafgen -e -P 9001                                                 *
+ *   ./trafgen -p 10.9.0.1 -P 9001 -l 64 -n 10000                         *
+ *                                                                        *
+ *************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PORT 9000
+#define SIZE_MAX_UDP 65507
+#define BATCH 64            /* datagrams per sendmmsg()/recvmmsg() */
+#define FLOWS_MAX 64
+#define IDLE_MS 1000        /* sink: quiet this long after traffic ends it */
+#define POLL_MS 100         /* sink: how often an idle thread looks at the clock */
+#define PROBES_DEFAULT 1000
+#define PROBE_TIMEOUT_MS 1000
+
+#define MODE_SINK 1
+#define MODE_BLAST 2
+#define MODE_ECHO 3
+#define MODE_PING 4
+
+char *progname;
+int mode, port = PORT, size = 64, flows = 1, duration = 10, probes = PROBES_DEFAULT;
+struct sockaddr_in dst;
+atomic_ulong total_pkts, total_bytes;
+uint64_t start_ns, first_ns, last_ns;   /* sink: start, first and last arrival */
+pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**************************************************************************
+ * now_nsec: monotonic clock in nanoseconds.                              *
+ **************************************************************************/
+uint64_t now_nsec(void) {
+    
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**************************************************************************
+ * udp_socket: a UDP socket bound to port (0 for any), reusing it across *
+ *             the threads of one mode.                                   *
+ **************************************************************************/
+int udp_socket(int bind_port) {
+    
+    struct sockaddr_in addr;
+    int fd, on = 1, buf = 4 << 20;
+    
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket()");
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(bind_port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    return fd;
+}
+
+/**************************************************************************
+ * sink_main: one sink thread, counts datagrams until no thread has seen *
+ *            any for IDLE_MS, or none came for the whole run.            *
+ **************************************************************************/
+void *sink_main(void *arg) {
+    
+    static char bufs[FLOWS_MAX][BATCH][2048];
+    int id = (long)arg, fd = udp_socket(port), i, n;
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovs[BATCH];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    unsigned long pkts, bytes;
+    uint64_t now;
+    int done;
+    
+    for (i = 0; i < BATCH; i++) {
+        iovs[i].iov_base = bufs[id][i];
+        iovs[i].iov_len = sizeof(bufs[id][i]);
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    while (1) {
+        if (poll(&pfd, 1, POLL_MS) <= 0) {
+            /* the other threads may still be busy, it is over when all are idle */
+            now = now_nsec();
+            pthread_mutex_lock(&span_lock);
+            done = first_ns ? now - last_ns >= IDLE_MS * 1000000ULL :
+                   now - start_ns >= (uint64_t)(duration + 5) * 1000000000ULL;
+            pthread_mutex_unlock(&span_lock);
+            if (done)
+                break;
+            continue;
+        }
+        /* MSG_TRUNC: count datagrams bigger than the buffer at full length */
+        if ((n = recvmmsg(fd, msgs, BATCH, MSG_DONTWAIT | MSG_TRUNC, NULL)) <= 0)
+            continue;
+        now = now_nsec();
+        for (i = 0, pkts = n, bytes = 0; i < n; i++)
+            bytes += msgs[i].msg_len;
+        atomic_fetch_add(&total_pkts, pkts);
+        atomic_fetch_add(&total_bytes, bytes);
+        pthread_mutex_lock(&span_lock);
+        if (first_ns == 0)
+            first_ns = now;
+        if (now > last_ns)
+            last_ns = now;
+        pthread_mutex_unlock(&span_lock);
+    }
+    close(fd);
+    return NULL;
+}
+
+/**************************************************************************
+ * blast_main: one flow, sends size byte datagrams BATCH at a time for   *
+ *             the duration. The source port makes the flow.             *
+ **************************************************************************/
+void *blast_main(void *arg) {
+    
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov;
+    char *buf;
+    uint64_t end = now_nsec() + (uint64_t)duration * 1000000000ULL;
+    unsigned long pkts = 0;
+    int fd = udp_socket(0), i, n;
+    
+    (void)arg;
+    if ((buf = calloc(1, size)) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    for (i = 0; i < BATCH; i++) {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    while (now_nsec() < end) {
+        /* a full socket buffer or a tun queue drop just costs a retry */
+        if ((n = sendmmsg(fd, msgs, BATCH, 0)) > 0)
+            pkts += n;
+        else if (errno != EAGAIN && errno != ENOBUFS && errno != ECONNREFUSED && errno != EINTR)
+            perror("sendmmsg");
+    }
+    atomic_fetch_add(&total_pkts, pkts);
+    atomic_fetch_add(&total_bytes, pkts * size);
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+/**************************************************************************
+ * echo_loop: reflects datagrams, runs until killed.                      *
+ **************************************************************************/
+void echo_loop(void) {
+    
+    static char buf[SIZE_MAX_UDP];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    int fd = udp_socket(port), n;
+    
+    while (1) {
+        fromlen = sizeof(from);
+        if ((n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen)) < 0) {
+            perror("recvfrom");
+            continue;
+        }
+        sendto(fd, buf, n, 0, (struct sockaddr *)&from, fromlen);
+    }
+}
+
+/**************************************************************************
+ * cmp_u64: qsort order of RTTs.                                          *
+ **************************************************************************/
+int cmp_u64(const void *a, const void *b) {
+    
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+/**************************************************************************
+ * ping_loop: sends probes one at a time, each carrying its number, and  *
+ *            prints the RTT percentiles of those that came back.        *
+ **************************************************************************/
+void ping_loop(void) {
+    
+    struct pollfd pfd;
+    uint64_t *rtt, t0, seq, got;
+    char *buf, *reply;
+    int fd = udp_socket(0), i, n, nrtt = 0, lost = 0;
+    
+    if ((buf = calloc(1, size)) == NULL || (reply = malloc(SIZE_MAX_UDP)) == NULL ||
+        (rtt = malloc(probes * sizeof(*rtt))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    
+    for (seq = 0; seq < (uint64_t)probes; seq++) {
+        memcpy(buf, &seq, size < 8 ? size : 8);
+        t0 = now_nsec();
+        if (send(fd, buf, size, 0) < 0) {
+            lost++;
+            continue;
+        }
+        /* drop late replies of earlier probes, wait for this one */
+        for (;;) {
+            if (poll(&pfd, 1, PROBE_TIMEOUT_MS) <= 0) {
+                lost++;
+                break;
+            }
+            if ((n = recv(fd, reply, SIZE_MAX_UDP, 0)) < 0)
+                continue;
+            got = 0;
+            memcpy(&got, reply, n < 8 ? n : 8);
+            if (n == size && (size < 8 || got == seq)) {
+                rtt[nrtt++] = now_nsec() - t0;
+                break;
+            }
+        }
+    }
+    
+    if (nrtt == 0) {
+        printf("ping probes %d lost %d\n", probes, lost);
+        return;
+    }
+    qsort(rtt, nrtt, sizeof(*rtt), cmp_u64);
+    i = nrtt - 1;
+    printf("ping probes %d lost %d p50_us %.1f p99_us %.1f p999_us %.1f max_us %.1f\n", probes, lost,
+           rtt[nrtt / 2] / 1e3, rtt[(int)(nrtt * 0.99)] / 1e3, rtt[(int)(nrtt * 0.999)] / 1e3, rtt[i] / 1e3);
+}
+
+/**************************************************************************
+ * usage: prints usage and exits.                                         *
+ **************************************************************************/
+void usage(void) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s -s|-t <dstIP>|-e|-p <dstIP> [-P <port>] [-l <size>] [-f <flows>] [-d <seconds>] [-n <probes>]\n", progname);
+    fprintf(stderr, "%s -h\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-s: sink, count datagrams arriving on the port, one receiving thread per flow\n");
+    fprintf(stderr, "-t <dstIP>: blast datagrams at dstIP for the duration, one sending thread per flow\n");
+    fprintf(stderr, "-e: echo datagrams arriving on the port back to their sender\n");
+    fprintf(stderr, "-p <dstIP>: ping an echo at dstIP with probes one at a time, print RTT percentiles\n");
+    fprintf(stderr, "-P <port>: port to receive on or send to, default %d\n", PORT);
+    fprintf(stderr, "-l <size>: UDP payload bytes, 1-%d, default 64\n", SIZE_MAX_UDP);
+    fprintf(stderr, "-f <flows>: flows (source ports) or sink threads, 1-%d, default 1\n", FLOWS_MAX);
+    fprintf(stderr, "-d <seconds>: how long to blast, default 10\n");
+    fprintf(stderr, "-n <probes>: probes to ping, default %d\n", PROBES_DEFAULT);
+    fprintf(stderr, "-h: prints this help text\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    
+    pthread_t threads[FLOWS_MAX];
+    uint64_t t0;
+    double secs;
+    int option, i;
+    
+    progname = argv[0];
+    
+    while ((option = getopt(argc, argv, "st:ep:P:l:f:d:n:h")) > 0) {
+        switch (option) {
+            case 's':
+                mode = MODE_SINK;
+                break;
+            case 't':
+            case 'p':
+                mode = option == 't' ? MODE_BLAST : MODE_PING;
+                if (inet_aton(optarg, &dst.sin_addr) == 0) {
+                    fprintf(stderr, "Bad address %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'e':
+                mode = MODE_ECHO;
+                break;
+            case 'P':
+                port = atoi(optarg);
+                break;
+            case 'l':
+                size = atoi(optarg);
+                break;
+            case 'f':
+                flows = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'n':
+                probes = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (mode == 0 || size < 1 || size > SIZE_MAX_UDP || flows < 1 || flows > FLOWS_MAX ||
+        duration < 1 || probes < 1)
+        usage();
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(port);
+    
+    switch (mode) {
+        case MODE_ECHO:
+            echo_loop();
+            break;
+        case MODE_PING:
+            ping_loop();
+            break;
+        case MODE_SINK:
+        case MODE_BLAST:
+            t0 = start_ns = now_nsec();
+            for (i = 0; i < flows; i++)
+                if ((errno = pthread_create(&threads[i], NULL, mode == MODE_SINK ? sink_main : blast_main,
+                                            (void *)(long)i)) != 0) {
+                    perror("pthread_create");
+                    exit(1);
+                }
+            for (i = 0; i < flows; i++)
+                pthread_join(threads[i], NULL);
+            secs = mode == MODE_SINK ? (last_ns - first_ns) / 1e9 : (now_nsec() - t0) / 1e9;
+            printf("%s pkts %lu bytes %lu secs %.3f\n", mode == MODE_SINK ? "sink" : "blast",
+                   atomic_load(&total_pkts), atomic_load(&total_bytes), secs);
+            break;
+    }
+    
+    return(0);
+}
@@ -0,0 +1,265 @@
+/**************************************************************************
+ * tunnelcap.c                                                            *
+ *                                                                        *
+ * Reader of the capture ring of tunneludp_v2 (-Y): drains the records    *
+ * the tunnel's workers copy into the shared file and writes them out as  *
+ * pcapng, for wireshark or tcpdump -r. The tunnel never waits for it; a  *
+ * reader that falls a lap behind skips what was overwritten and counts   *
+ * it lost.                                                               *
+ *                                                                        *
+ * The file gets two interfaces: "inner", the tun/tap packets as they     *
+ * are (raw IP, or Ethernet with -a), and "outer", the tunnel datagrams   *
+ * behind an IPv4/UDP header made up from the remote end and the tunnel   *
+ * port (the local address is not known, it reads 0.0.0.0). Each packet   *
+ * carries its direction and, as a comment, the peer. It includes         *
+ * tunneludp_v2.c whole (without its main) for the ring layout.           *
+ *                                                                        *
+ * compile: gcc -O2 -pthread -o tunnelcap tunnelcap.c -lcrypto            *
+ *                                                                        *
+ * running:                                                               *
+ *   ./tunnelcap /dev/shm/tun.cap > tun.pcapng       from now on, ^C ends *
+ *   ./tunnelcap -a -c 1000 -w tun.pcapng /dev/shm/tun.cap                *
+ *                                   what the ring holds, then 1000 more  *
+ *   ./tunnelcap /dev/shm/tun.cap | wireshark -k -i -                     *
+ *                                                                        *
+ *************************************************************************/
+
+#define TUNNEL_NO_MAIN
+#include "tunneludp_v2.c"
+
+#include <signal.h>
+
+#define PCAPNG_SHB 0x0a0d0d0a       /* block types */
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_MAGIC 0x1a2b3c4d
+#define OPT_END 0                   /* options */
+#define OPT_COMMENT 1
+#define OPT_IF_NAME 2
+#define OPT_IF_TSRESOL 9
+#define OPT_EPB_FLAGS 2
+#define IF_INNER 0
+#define IF_OUTER 1
+#define OUTER_HDR_LEN (IP_HDR_LEN + UDP_HDR_LEN)
+#define BLOCK_MAX (64 + OUTER_HDR_LEN + CAP_SNAPLEN + 64)
+#define IDLE_USEC 1000              /* nap when the ring has nothing new */
+#define CLAIM_TRIES 1000            /* usec a claimed record may take to be written */
+
+volatile sig_atomic_t stop;
+uint64_t written, lost;
+
+/**************************************************************************
+ * on_signal: ^C and kill end the capture after the record at hand.       *
+ **************************************************************************/
+void on_signal(int sig) {
+    stop = sig;
+}
+
+/**************************************************************************
+ * opt_put: appends pcapng option code with len bytes of val at p,        *
+ *          padded to 32 bits. Returns where the next goes.               *
+ **************************************************************************/
+uint8_t *opt_put(uint8_t *p, uint16_t code, const void *val, uint16_t len) {
+    
+    memcpy(p, &code, 2);
+    memcpy(p + 2, &len, 2);
+    memcpy(p + 4, val, len);
+    memset(p + 4 + len, 0, (4 - len % 4) % 4);
+    return p + 4 + (len + 3) / 4 * 4;
+}
+
+/**************************************************************************
+ * block_put: writes the pcapng block of type whose body is the len       *
+ *            bytes at body, lengths around it, to out.                   *
+ **************************************************************************/
+void block_put(FILE *out, uint32_t type, const uint8_t *body, uint32_t len) {
+    
+    uint32_t total = len + 12;
+    
+    if (fwrite(&type, 4, 1, out) != 1 || fwrite(&total, 4, 1, out) != 1 ||
+        fwrite(body, 1, len, out) != len || fwrite(&total, 4, 1, out) != 1) {
+        perror("writing pcapng");
+        exit(1);
+    }
+}
+
+/**************************************************************************
+ * header_put: the section header and the inner and outer interfaces.     *
+ **************************************************************************/
+void header_put(FILE *out, uint32_t inner_type) {
+    
+    uint8_t body[64], *p;
+    uint32_t magic = PCAPNG_MAGIC, snap = OUTER_HDR_LEN + CAP_SNAPLEN;
+    uint16_t version[2] = { 1, 0 }, link[2] = { 0, 0 };
+    int64_t section = -1;
+    uint8_t nsec = 9;
+    int i;
+    
+    p = body;
+    memcpy(p, &magic, 4);
+    memcpy(p + 4, version, 4);
+    memcpy(p + 8, &section, 8);
+    block_put(out, PCAPNG_SHB, body, 16);
+    for (i = IF_INNER; i <= IF_OUTER; i++) {
+        link[0] = i == IF_INNER ? inner_type : LINKTYPE_RAW;
+        memcpy(body, link, 4);
+        memcpy(body + 4, &snap, 4);
+        p = opt_put(body + 8, OPT_IF_NAME, i == IF_INNER ? "inner" : "outer", 5);
+        p = opt_put(p, OPT_IF_TSRESOL, &nsec, 1);
+        p = opt_put(p, OPT_END, NULL, 0);
+        block_put(out, PCAPNG_IDB, body, p - body);
+    }
+}
+
+/**************************************************************************
+ * outer_hdr: the made up IPv4/UDP header in front of an outer record r   *
+ *            going out of or into the tunnel on port.                    *
+ **************************************************************************/
+void outer_hdr(uint8_t *h, const struct cap_rec *r, uint16_t port) {
+    
+    uint16_t tot = htons(OUTER_HDR_LEN + r->len), ulen = htons(UDP_HDR_LEN + r->len);
+    uint32_t local = 0;
+    
+    memset(h, 0, OUTER_HDR_LEN);
+    h[0] = 0x45;
+    memcpy(h + 2, &tot, 2);
+    h[6] = 0x40;                    /* DF */
+    h[8] = 64;
+    h[9] = IPPROTO_UDP;
+    memcpy(h + 12, r->dir == CAP_TX ? &local : &r->addr, 4);
+    memcpy(h + 16, r->dir == CAP_TX ? &r->addr : &local, 4);
+    ip4_csum(h, IP_HDR_LEN);
+    memcpy(h + IP_HDR_LEN, r->dir == CAP_TX ? &port : &r->port, 2);
+    memcpy(h + IP_HDR_LEN + 2, r->dir == CAP_TX ? &r->port : &port, 2);
+    memcpy(h + IP_HDR_LEN + 4, &ulen, 2);
+}
+
+/**************************************************************************
+ * record_put: writes record r of the ring as an enhanced packet block.   *
+ **************************************************************************/
+void record_put(FILE *out, const struct cap_rec *r, uint16_t port) {
+    
+    uint8_t body[BLOCK_MAX], *p;
+    uint32_t v[5], flags = r->dir == CAP_RX ? 1 : 2;
+    int pre = r->layer == CAP_OUTER ? OUTER_HDR_LEN : 0;
+    char note[32];
+    
+    v[0] = r->layer == CAP_OUTER ? IF_OUTER : IF_INNER;
+    v[1] = r->stamp >> 32;
+    v[2] = (uint32_t)r->stamp;
+    v[3] = pre + r->caplen;
+    v[4] = pre + r->len;
+    memcpy(body, v, sizeof(v));
+    if (pre)
+        outer_hdr(body + sizeof(v), r, port);
+    memcpy(body + sizeof(v) + pre, r->data, r->caplen);
+    p = body + sizeof(v) + (v[3] + 3) / 4 * 4;
+    memset(body + sizeof(v) + v[3], 0, p - body - sizeof(v) - v[3]);
+    p = opt_put(p, OPT_EPB_FLAGS, &flags, 4);
+    if (r->peer >= 0)
+        p = opt_put(p, OPT_COMMENT, note, snprintf(note, sizeof(note), "peer %d", r->peer));
+    p = opt_put(p, OPT_END, NULL, 0);
+    block_put(out, PCAPNG_EPB, body, p - body);
+    written++;
+}
+
+/**************************************************************************
+ * cap_usage: prints usage and exits.                                     *
+ **************************************************************************/
+void cap_usage(void) {
+    fprintf(stderr, "Usage: %s [-a] [-c <count>] [-w <file>] <ring file>\n"
+                    "-a: start with the oldest record the ring still holds, not with the next one\n"
+                    "-c <count>: stop after this many records\n"
+                    "-w <file>: write pcapng here, default standard output\n", progname);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    
+    struct cap_ring *ring;
+    const struct cap_rec *r;
+    struct cap_rec rec;
+    struct stat st;
+    uint64_t tail, head, seq, limit = 0;
+    FILE *out = stdout;
+    int fd, opt, all = 0, tries = 0;
+    size_t size;
+    
+    progname = argv[0];
+    
+    while ((opt = getopt(argc, argv, "ac:w:h")) > 0) {
+        switch (opt) {
+            case 'a':
+                all = 1;
+                break;
+            case 'c':
+                limit = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                if ((out = fopen(optarg, "w")) == NULL) {
+                    perror(optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                cap_usage();
+        }
+    }
+    if (optind != argc - 1)
+        cap_usage();
+    
+    if ((fd = open(argv[optind], O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    if ((ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    size = st.st_size < (off_t)sizeof(*ring) ? 0 : sizeof(*ring) + (size_t)ring->nslots * sizeof(struct cap_rec);
+    if (size == 0 || ring->magic != CAP_MAGIC || ring->version != CAP_VERSION || (size_t)st.st_size < size ||
+        ring->nslots == 0 || (ring->nslots & (ring->nslots - 1))) {
+        fprintf(stderr, "%s: not a capture ring of this version\n", argv[optind]);
+        exit(1);
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, on_signal);
+    
+    header_put(out, ring->linktype);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = all && head > ring->nslots ? head - ring->nslots : all ? 0 : head;
+    while (!stop && (limit == 0 || written < limit)) {
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head) {
+            fflush(out);
+            usleep(IDLE_USEC);
+            continue;
+        }
+        /* lapped: what is a whole ring behind the writers is gone */
+        if (head - tail > ring->nslots) {
+            lost += head - ring->nslots - tail;
+            tail = head - ring->nslots;
+        }
+        r = &ring->rec[tail & (ring->nslots - 1)];
+        seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        /* claimed, not yet written: give the writer a moment */
+        if (seq < tail + 1 && tries++ < CLAIM_TRIES) {
+            usleep(1);
+            continue;
+        }
+        tries = 0;
+        memcpy(&rec, r, offsetof(struct cap_rec, data));
+        if (rec.caplen <= CAP_SNAPLEN)
+            memcpy(rec.data, r->data, rec.caplen);
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != tail + 1 || atomic_load_explicit(&r->seq, memory_order_relaxed) != seq || rec.caplen > CAP_SNAPLEN)
+            lost++;
+        else
+            record_put(out, &rec, ring->port);
+        tail++;
+    }
+    fflush(out);
+    fprintf(stderr, "%lu records, %lu lost\n", (unsigned long)written, (unsigned long)lost);
+    return 0;
+}
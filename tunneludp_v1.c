@@ -33,6 +33,8 @@
  *                                                                        *
  * -- version                                                             *
  *  v1.0 just complete conversion from TCP version                        *
+ *  v1.1 only send/write the bytes actually read                          *
+ *  v1.2 count packets, per-packet output only with -d                    *
  *                                                                        *
  *************************************************************************/
 
@@ -354,7 +356,7 @@ int main(int argc, char *argv[]) {
     maxfd = (tap_fd > sock_fd)?tap_fd:sock_fd;
     
     while(1) {
-        int ret;
+        int ret, len;
         fd_set rd_set;
         
         FD_ZERO(&rd_set);
@@ -384,11 +386,16 @@ int main(int argc, char *argv[]) {
 //            nwrite = cwrite(net_fd, buffer, nread);
 //            
 //            do_debug("TAP2NET %lu: Written %d bytes to the network\n", tap2net, nwrite);
-            if(read(tap_fd, buffer, sizeof(buffer))) perror("read");
-            if(cliserv==CLIENT){
-                if (sendto(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&server_addr, serverlen) < 0) perror("sendto");
+            if((len = read(tap_fd, buffer, sizeof(buffer))) < 0){
+                perror("read");
             } else {
-                if (sendto(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, clientlen) < 0) perror("sendto");
+                tap2net++;
+                do_debug("TAP2NET %lu: Read %d bytes from the tap interface\n", tap2net, len);
+                if(cliserv==CLIENT){
+                    if (sendto(sock_fd, buffer, len, 0, (struct sockaddr *)&server_addr, serverlen) < 0) perror("sendto");
+                } else {
+                    if (sendto(sock_fd, buffer, len, 0, (struct sockaddr *)&client_addr, clientlen) < 0) perror("sendto");
+                }
             }
             
         }
@@ -414,13 +421,18 @@ int main(int argc, char *argv[]) {
 //            nwrite = cwrite(tap_fd, buffer, nread);
 //            do_debug("NET2TAP %lu: Written %d bytes to the tap interface\n", net2tap, nwrite);
             if(cliserv==CLIENT){
-                if(recvfrom(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&server_addr, &serverlen)) perror("read");
+                len = recvfrom(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&server_addr, &serverlen);
             } else {
-                if(recvfrom(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &clientlen)) perror("read");
+                len = recvfrom(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &clientlen);
+            }
+            if(len < 0){
+                perror("read");
+                continue;
             }
-            printf("Get packet in UDP tunnel\n");
+            net2tap++;
+            do_debug("NET2TAP %lu: Read %d bytes from the network\n", net2tap, len);
             
-            if (write(tap_fd, buffer, sizeof(buffer)) < 0) perror("write");
+            if (write(tap_fd, buffer, len) < 0) perror("write");
         }
     }
     
@@ -17,15 +17,18 @@
  *       it will be captured and decrypted. Just like diagram in the      *
  *       VPN project instruction.                                         *
  *                                                                        *
- * compile: gcc -o simpletun ../simpletun.c                               *
+ * compile: gcc -pthread -o simpletun ../simpletun.c -lcrypto             *
  *                                                                        *
  * running:                                                               *
  *   -- server:                                                           *
- *      1. sudo ./simpletun -i $(NIC name) -s (-p $(port))                *
- *      2. bash init_server.sh                                            *
+ *      1. sudo ./simpletun -i $(NIC name) -s (-p $(port)) (-k $(keyfile)) *
+ *         (-I $(tun address/len) -R $(client subnets) to bring tun up    *
+ *         and route them into it)                                        *
  *   -- client:                                                           *
  *      1. sudo ./simpletun -i $(NIC name) -c $(server ip) (-p $(port))   *
- *      2. bash init_client.sh                                            *
+ *         (-l $(tun subnet) to have the server route it to this client)  *
+ *         (-k $(keyfile), the same 32 byte key as the server, to encrypt) *
+ *         (-I $(tun address/len) -R $(server subnets), likewise)         *
  *                                                                        *
  * reference from:                                                        *
  * http://backreference.org/2010/03/26/tuntap-interface-tutorial          *
@@ -35,14 +38,67 @@
  * -- version                                                             *
  *  v1.0 just complete conversion from TCP version                        *
  *  v1.1 add some comments and improve code structure                     *
+ *  v1.2 length-exact wire framing with a versioned header                *
+ *  v1.3 batched data path with recvmmsg/sendmmsg (-b)                    *
+ *  v1.4 edge-triggered epoll event loop with a housekeeping timerfd      *
+ *  v1.5 multi-queue tun with one pinned worker thread per queue (-w)     *
+ *  v1.6 optional io_uring datapath engine (-e uring)                     *
+ *  v1.7 tun TSO super-packets, UDP GSO/GRO and TCP coalescing (-g)       *
+ *  v1.8 multi-peer server: session ids, peer hash table, route trie (-l) *
+ *  v1.9 AEAD encryption with per-session keys from a shared key (-k, -x) *
+ *  v1.10 lock-free anti-replay window per session                        *
+ *  v1.11 hugepage packet buffer pool with headroom, per-thread caches    *
+ *  v1.12 pipelined I/O and crypto stages linked by SPSC rings (-P, -q)   *
+ *  v1.13 per-thread counters and a Prometheus stats socket (-S), no more *
+ *        per-packet output                                               *
+ *  v1.14 sampled latency histograms per worker and step (-H)             *
+ *  v1.15 AF_XDP underlay: tunnel datagrams bypass the kernel UDP stack   *
+ *        on one network interface (-X)                                   *
+ *  v1.16 per-packet LZ4 compression, bypassed for random-looking packets *
+ *        and flows that do not shrink (-z)                               *
+ *  v1.17 small packets bundled into one datagram per peer (-A)           *
+ *  v1.18 path MTU discovery per peer, TCP MSS clamped to what the path   *
+ *        carries, bundles and GSO segments sized to it                   *
+ *  v1.19 handshake no longer blocks: data flows at once, the HELLO is    *
+ *        resent until answered and after a server RETRY; sessions        *
+ *        resume from a ticket file (-T)                                  *
+ *  v1.20 tun address, MTU, txqueuelen, link state and routes set over    *
+ *        rtnetlink right after tun_alloc() (-I, -M, -Q, -R), no more     *
+ *        init_*.sh racing it                                             *
+ *  v1.21 latency profile: busy polled sockets, spin before blocking,     *
+ *        isolated CPUs, sized socket buffers (-L, -B)                    *
+ *  v1.22 TAP bridging: the server switches Ethernet between its tap      *
+ *        and the clients by learned MAC, floods sealed once, ARP         *
+ *        answered in place (-a)                                          *
+ *  v1.23 forward error correction: Reed-Solomon parity over GF(2^8)      *
+ *        with AVX2/NEON kernels, lost packets rebuilt on arrival,        *
+ *        group shape adapted to the loss the peer reports (-F)           *
+ *  v1.24 multipath bonding: data striped over several client uplinks     *
+ *        by probed RTT and loss, reordered behind a bounded wait,        *
+ *        failed over when an uplink goes silent (-U)                     *
+ *  v1.25 egress scheduling: packets classed by rule or DSCP, realtime    *
+ *        ahead of the others, which share by deficit round robin,        *
+ *        DSCP copied onto the tunnel datagrams (-C, -D)                  *
+ *  v1.26 egress pacing: per-peer token buckets, departure times kept     *
+ *        by fq through SO_TXTIME or by a timer wheel, the rate           *
+ *        following a delay-based estimate of the path (-r)               *
+ *  v1.27 packet capture: filtered, sampled inner and outer packets       *
+ *        copied into a lock-free ring in a shared file, drained to       *
+ *        pcapng by tunnelcap (-Y, -y)                                    *
+ *  v1.28 per-packet loops built per mode and feature set, the one for   *
+ *        the settings picked at startup                                  *
+ *  v1.29 kernel fast path: TC programs forward the data of connected     *
+ *        unencrypted tun peers from BPF maps worker 0 keeps (-K)         *
  *                                                                        *
  *************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <sys/types.h>
@@ -50,10 +106,44 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/virtio_net.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/sockios.h>
+#include <linux/net_tstamp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_arp.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/uio.h>
 #include <sys/time.h>
+#include <stddef.h>
+#include <sys/random.h>
+#include <time.h>
+#include <endian.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 
 /* buffer for reading from tun/tap interface, must be >= 1500 */
@@ -62,86 +152,11018 @@
 #define SERVER 1
 #define PORT 5588
 
+/* datagrams moved per sendmmsg()/recvmmsg() call */
+#define BATCH_DEFAULT 1
+#define BATCH_MAX 1024
+
+/* peers (server side: clients; client side: the server) */
+#define PEERS_MAX 4096
+#define PEER_ROUTES_MAX 8       /* prefixes a client may announce */
+#define PEER_TIMEOUT_SEC 180    /* server forgets clients silent this long */
+#define PATH_TIMEOUT_SEC 60     /* and paths of a client silent this long, but the last */
+#define PEER_TABLE_SIZE 65536   /* hash slots, power of 2 */
+#define PEER_SLOT_EMPTY (-1)
+#define LPM_NODES_MAX 4096      /* 256 entry nodes per route trie */
+
+/* handshake: a client sends its HELLO again until answered, backing off */
+#define HELLO_RTO_SEC 1         /* first wait for the answer */
+#define HELLO_RTO_MAX_SEC 16
+#define HELLO_RESUME_LEN 8      /* behind the routes: where the server's sequence numbers may go on */
+#define HELLO_CHALLENGE_LEN 8   /* behind that: what the latest RETRY asked to echo, 0 for nothing */
+#define HELLO_FLOOR_LEN 8       /* and last: where the client's own sequence numbers started */
+#define HELLO_LEN_MAX ((int)sizeof(MAGIC_WORD) + 1 + 5 * PEER_ROUTES_MAX + HELLO_RESUME_LEN + HELLO_CHALLENGE_LEN + \
+                       HELLO_FLOOR_LEN)
+#define RESUME_SEQ_GAP (1ULL << 24)     /* past the newest frame seen, covers those still in flight */
+#define TICKET_SEQ_GAP (1ULL << 32)     /* reserved ahead in a -T ticket, rewritten at half */
+#define RETRY_PER_SEC 16        /* RETRYs one server worker sends per second at most */
+#define RETRY_QUIET_SEC 2       /* client: a RETRY counts once the server sent nothing that opened for this long */
+
+/* AEAD: both ciphers take 256 bit keys, 96 bit nonces, 128 bit tags */
+#define AEAD_KEY_LEN 32
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN 16
+#define AEAD_SAMPLE 16          /* time one packet in this many */
+#define SEQ_BLOCK 64            /* sequence numbers a worker takes at once */
+
+/* a sequence number is the lane of its sender in the top byte, the kernel fast
+ * path's 0 or a worker's id + 1, over a count all lanes of a peer share, so
+ * blocks one worker takes never age in another's replay window */
+#define SEQ_LANE_SHIFT 56
+#define SEQ_LANES (WORKERS_MAX + 1)
+#define SEQ_LANE(seq) ((unsigned)((seq) >> SEQ_LANE_SHIFT))
+#define SEQ_COUNT(seq) ((seq) & ((1ULL << SEQ_LANE_SHIFT) - 1))
+
+/* anti-replay: per lane REPLAY_SLOTS words of 32 bits, an 8192 frame window
+ * for what the network reorders */
+#define REPLAY_SLOTS 256
+#define REPLAY_WINDOW (REPLAY_SLOTS * 32)
+
+/* compression (-z): LZ4 block format, one packet per block */
+#define ZIP_MIN_LEN 128         /* smaller packets gain too little */
+#define ZIP_MAX_LEN 3072        /* larger ones go as is, so every rx buffer has room to inflate */
+#define ZIP_HASH_BITS 12        /* match finder slots per worker */
+#define ZIP_SAMPLE_LEN 64       /* tail bytes the entropy estimate looks at */
+#define ZIP_DISTINCT_MAX 48     /* more distinct byte values there: random, bypass */
+#define ZIP_GAIN_SHIFT 4        /* must save len / 16 to go out compressed */
+#define ZIP_FLOWS 256           /* per worker flow history slots, power of 2 */
+#define ZIP_BACKOFF_MAX 6       /* a flow that keeps failing skips up to 64 packets */
+#define ZIP_TIME_SAMPLE 16      /* time one packet in this many */
+
+/* worker threads, one tun queue and one UDP socket each */
+#define WORKERS_DEFAULT 1
+#define WORKERS_MAX 64
+
+/* event loop */
+#define EVENTS_MAX 64       /* descriptors served per epoll_wait() */
+#define EVENT_BUDGET 16     /* batches a source may move before yielding */
+#define HOUSEKEEPING_MS 1000
+#define KEEPALIVE_SEC 10    /* send a keepalive after this much tx silence */
+#define REPORT_SEC 60       /* seconds between cost and counter reports */
+
+/* packet buffer pool: BUFSIZE chunks, one page each so the pool can also
+ * serve as AF_XDP UMEM, with room around the packet to frame it in place */
+#define POOL_HEADROOM 64    /* >= WIRE_HDR_LEN + XDP_HDRS_LEN, keeps packets cache line aligned */
+#define POOL_TAILROOM 64    /* >= AEAD_TAG_LEN */
+#define POOL_CACHE 256      /* buffers one thread keeps to itself */
+#define POOL_BULK 64        /* moved between a cache and the shared pool at once */
+#define POOL_SPARE 1024     /* beyond what the batches and caches hold */
+#define POOL_THREADS_MAX (WORKERS_MAX * 2)
+#define COUNTERS_MAX (WORKERS_MAX * 2)  /* counter blocks, one per thread */
+
+/* latency histograms in nanoseconds up to 2^HIST_MAX_BITS: HIST_SUB
+ * buckets per power of 2, none wider than 1/HIST_SUB of its values */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB)
+#define HIST_SAMPLE_DEFAULT 64  /* time one batch in this many */
+#define HUGEPAGE_SIZE (2 << 20)
+#define PKT_ROOM (BUFSIZE - POOL_HEADROOM - POOL_TAILROOM)  /* packet bytes */
+#define FRAME_ROOM (BUFSIZE - POOL_HEADROOM + WIRE_HDR_LEN)  /* from the frame start */
+#define PKT_DATA(buf) ((buf) + POOL_HEADROOM)
+#define PKT_FRAME(buf) ((buf) + POOL_HEADROOM - WIRE_HDR_LEN)
+#define PKT_BUF(frame) ((frame) - POOL_HEADROOM + WIRE_HDR_LEN)
+#define PKT_META(buf) ((struct pkt_meta *)(buf))
+
+/* pipelined mode (-P): rings between a worker's I/O and crypto stages */
+#define RING_DEPTH_DEFAULT 1024
+#define RING_DEPTH_MAX 65536
+
+/* offload (-g): tun hands us TSO super-packets behind a virtio_net_hdr */
+#define VNET_HDR_LEN ((int)sizeof(struct virtio_net_hdr))
+#define GSO_BUFSIZE 65536   /* largest super-packet or GRO datagram */
+#define GSO_OUTSIZE (GSO_BUFSIZE + GSO_BUFSIZE / 2)  /* segmented frames, sent whenever it fills */
+#define GSO_MAX_SEGS 64     /* segments per UDP_SEGMENT send */
+#define GSO_MAX_BYTES 65000 /* bytes per UDP_SEGMENT send, IP length limit */
+
+/* forwarding loop profiles, picked with -L */
+#define PROFILE_BULK 0      /* block as soon as there is nothing to do */
+#define PROFILE_LATENCY 1   /* busy poll and spin a while first */
+#define SPIN_USEC_DEFAULT 50    /* latency: how long before blocking */
+#define BUSY_POLL_BUDGET 64     /* packets per NAPI busy poll */
+#define SOCKBUF_LATENCY (4 << 20)   /* latency: socket buffers, bursts fit while we spin elsewhere */
+
+#ifndef EPIOCSPARAMS
+/* epoll busy poll parameters, linux 6.9, newer than some uapi headers */
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/* datapath engines, picked with -e */
+#define ENGINE_EPOLL 0
+#define ENGINE_URING 1
+
+/* what a build of the epoll engine's per-packet path is for, see dp_pick:
+ * without DP_GENERIC exactly the features of its bits are on and the code of
+ * the others compiles away, DP_GENERIC looks at the settings every time */
+#define DP_CLIENT 0x001
+#define DP_TAP 0x002
+#define DP_AEAD 0x004
+#define DP_ZIP 0x008        /* -z, sending */
+#define DP_FEC 0x010        /* -F, sending */
+#define DP_BOND 0x020       /* striping to bonded peers */
+#define DP_UPLINKS 0x040    /* -U client with more than one uplink */
+#define DP_SCHED 0x080      /* -C */
+#define DP_PACE 0x100       /* -r */
+#define DP_TXCTL 0x200      /* -D or -r: ancillary data on the sends */
+#define DP_CAP 0x400        /* -Y */
+#define DP_KFAST 0x800      /* -K: sequence numbers shared with the kernel */
+#define DP_GENERIC 0x1000
+#define DP(f, bit, on) ((f) & DP_GENERIC ? (on) : ((f) & (bit)) != 0)
+#define DP_INLINE static inline __attribute__((always_inline))
+
+/* io_uring engine */
+#define URING_ENTRIES 512   /* submission queue size */
+#define URING_BUFS 256      /* provided buffers per group, power of 2 */
+#define URING_GROUP_TAP 0   /* buffer group filled by tun/tap reads */
+#define URING_GROUP_SOCK 1  /* buffer group filled by socket receives */
+#define URING_GROUPS 2
+#define URING_FILE_TAP 0    /* fixed file indexes */
+#define URING_FILE_SOCK 1
+
+/* what a completion belongs to, low byte of user_data, buffer id above */
+#define UD_TAP_READ 1
+#define UD_SOCK_RECV 2
+#define UD_SOCK_SEND 3
+#define UD_TAP_WRITE 4
+#define UD_TICK 5
+
+/* AF_XDP underlay (-X): the pool is the UMEM, a buffer is a chunk */
+#define XDP_RING 1024       /* descriptors per fill, completion, rx and tx ring */
+#define XDP_NEIGH_SLOTS 1024    /* learned next hop MACs, power of 2 */
+#define XDP_NEIGH_PROBE 8   /* slots looked at per address */
+
+#ifndef IORING_OP_READ_MULTISHOT
+#define IORING_OP_READ_MULTISHOT 49   /* linux 6.7, newer than some uapi headers */
+#endif
+
+/* tun bring-up (-I, -M, -Q, -R) over rtnetlink */
+#define LINK_ROUTES_MAX 16
+#define NL_BUFSIZE 256      /* one request and its ack */
+#define NL_DUMP_BUFSIZE 8192    /* -r: a batch of a dump's replies */
+
 /* some common lengths */
 #define IP_HDR_LEN 20
+#define IP6_HDR_LEN 40
 #define ETH_HDR_LEN 14
 #define ARP_PKT_LEN 28
+#define UDP_HDR_LEN 8
+#define XDP_HDRS_LEN (ETH_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN)  /* in front of a frame */
+
+/* small-packet aggregation (-A) */
+#define AGG_MTU_DEFAULT 1500    /* outer datagram limit, IP header included */
+#define AGG_LEN 2               /* length in front of each packet of a bundle */
+
+/* path MTU discovery: worker 0 probes every peer with padded DF frames */
+#define PMTU_MIN 576            /* smallest datagram every IPv4 path carries */
+#define PMTU_MAX (IP_HDR_LEN + UDP_HDR_LEN + WIRE_HDR_LEN + PKT_ROOM)  /* largest we can build */
+#define PMTU_PROBES 4           /* probes per round, spread over what is still open */
+#define PMTU_TRIES 3            /* rounds a size goes unanswered before it is too big */
+#define PMTU_REPROBE_SEC 600    /* search again this long after one settled */
+#define PROBE_ACK_LEN 2         /* the probed size, echoed */
+
+/* TAP bridging (-a): the server switches frames between its tap and the clients */
+#define MAC_SLOTS 8192          /* learned MACs, power of 2 */
+#define MAC_PROBE 8             /* slots looked at per MAC */
+#define MAC_AGE_SEC 300         /* forgotten after this much silence, as switches do */
+#define ARP_SLOTS 1024          /* IPv4 addresses ARP may be answered for, power of 2 */
+#define ARP_PROBE 8
+#define ARP_AGE_SEC 60          /* answered for this long after the host last spoke ARP */
+#define SIDE_LOCAL 0xffff       /* behind our own tap rather than a peer */
+#define FLOOD_BATCH 64          /* peers one sendmmsg() floods a frame to */
+#define FLOOD_EPOCH_LEN 4       /* HELLO_ACK payload in TAP mode: the session floods go under */
+#define ETH_TYPE_IP 0x0800
+#define ETH_TYPE_ARP 0x0806
+#define ETH_TYPE_IPV6 0x86dd
+
+/* forward error correction (-F): groups of data packets and parity over GF(2^8) */
+#define FEC_K_MAX 32            /* data packets per group */
+#define FEC_M_MAX 8             /* parity packets per group */
+#define FEC_SHARDS (FEC_K_MAX + FEC_M_MAX)
+#define FEC_SHARD_MAX (2 + PKT_ROOM)    /* a packet behind its 16 bit length */
+#define FEC_K_AUTO 16           /* -F auto: data packets per group while loss is low */
+#define FEC_K_LOSSY 8           /* and past FEC_LOSSY_PPM, so fewer are waited for */
+#define FEC_LOSSY_PPM 50000
+#define FEC_FLUSH_USEC 2000     /* a group that did not fill goes out with what it has */
+#define FEC_GROUPS 8            /* groups of one peer a worker collects at once, power of 2 */
+#define FEC_REPORT_LEN 8        /* shards expected, shards received */
+#define FEC_REPORT_SHARDS 256   /* and sent as soon as it covers this many */
+#define FEC_HDR_LEN ((int)sizeof(struct fec_hdr))
+#define FEC_SHARD(frame) ((uint8_t *)(frame) + WIRE_HDR_LEN + FEC_HDR_LEN)
+
+/* multipath bonding (-U): data striped over a client's uplinks by measured
+ * RTT and loss, put back in order at the other end behind a bounded wait */
+#define UPLINKS_MAX 8
+#define BOND_PROBE_MSEC 100     /* each uplink is probed this often */
+#define BOND_LOSS_PROBES 10     /* probes one loss sample is taken over */
+#define BOND_DEAD_MSEC 1000     /* a path no probe came through for this long is failed over */
+#define BOND_RTT_INIT_USEC 50000    /* what a path counts as until it is measured */
+#define BOND_WAIT_USEC 20000    /* longest a packet waits for those before it */
+#define BOND_SLOTS 64           /* reorder window of one stream, power of 2 */
+#define BOND_HELD 256           /* packets one worker holds back at most */
+#define BOND_RESYNC (BOND_SLOTS * 64)   /* further off than this, the sender started over */
+#define BOND_HDR_LEN ((int)sizeof(struct bond_hdr))
+#define LINK_PROBE_LEN ((int)sizeof(struct link_probe))
+
+/* egress scheduling (-C): packets read from tun/tap wait in a queue per
+ * class, the realtime one goes first, the others share what is left by
+ * deficit round robin; the socket buffer is kept short so they wait here */
+#define SCHED_CLASSES 4
+#define SCHED_REALTIME 0        /* strict priority: EF, CS5 and up */
+#define SCHED_INTERACTIVE 1     /* CS2-CS4, AF2x-AF4x */
+#define SCHED_DEFAULT 2         /* best effort, AF1x */
+#define SCHED_BULK 3            /* CS1, LE */
+#define SCHED_QLEN 128          /* packets one class of one worker queues, power of 2 */
+#define SCHED_QUANTUM 1514      /* DRR bytes per round, times the class weight */
+#define SCHED_RULES_MAX 16
+#define SCHED_SNDBUF (32 << 10) /* socket send buffer asked for, the kernel doubles it */
+#define SCHED_SKB_COST 1024     /* what the kernel charges a datagram beyond its bytes, about */
+
+/* egress pacing (-r): a token bucket per peer gives each datagram its
+ * departure time, which fq honours as SO_TXTIME and a timer wheel keeps
+ * where the route has no fq; -r auto follows the RTT its probes measure */
+#define PACE_BURST 16384        /* bytes a full bucket lets go at once */
+#define PACE_TICK_USEC 100      /* the wheel's resolution */
+#define PACE_SLOTS 256          /* ticks the wheel spans, power of 2 */
+#define PACE_HORIZON_NSEC ((PACE_SLOTS - 1) * PACE_TICK_USEC * 1000ULL)  /* later than this is dropped */
+#define PACE_HELD 512           /* frames one worker's wheel holds at most */
+#define PACE_FLUSH 64           /* frames the wheel sends per sendmmsg() */
+#define PACE_PROBE_MSEC 100     /* -r auto: each peer sent to is probed this often */
+#define PACE_TARGET_USEC 5000   /* queueing delay past which the rate backs off */
+#define PACE_MIN_SEC 10         /* the base RTT is the least of the last one or two windows */
+#define PACE_RATE_MIN 100000    /* bits/s */
+#define DELAY_PROBE_LEN 8       /* the sender's clock */
+#define TX_CTL_LEN (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint64_t)))  /* IP_TOS and SCM_TXTIME */
+
+/* packet capture (-Y, -y): the datapath copies what the filter lets
+ * through into a ring in a shared file, which tunnelcap drains to pcapng */
+#define CAP_MAGIC 0x43504e54    /* "TNPC" */
+#define CAP_VERSION 1
+#define CAP_SLOTS 8192          /* records the ring holds, power of 2 */
+#define CAP_SNAPLEN 2016        /* bytes a record holds, it fills 2 KB */
+#define CAP_INNER 1             /* the packet on tun/tap */
+#define CAP_OUTER 2             /* the tunnel datagram, UDP payload */
+#define CAP_RX 1                /* into tun from the peer, or from the network */
+#define CAP_TX 2                /* from tun to the peer, or to the network */
+#define LINKTYPE_ETHERNET 1     /* pcapng link types of the records */
+#define LINKTYPE_RAW 101
+
+/* -K kernel fast path */
+#define KF_OUTER_LEN (IP_HDR_LEN + UDP_HDR_LEN + WIRE_HDR_LEN)    /* encap puts this and Ethernet before a packet */
+#define KF_HDRS_LEN (ETH_HDR_LEN + KF_OUTER_LEN)
+#define KF_INSNS_MAX 192        /* a program as kf_emit puts it together */
+#define KF_TO_PASS 0x7fff       /* jump offset kf_load points at the pass exit */
+#define KF_IFS_MAX 8            /* underlay interfaces with the decap program */
+#define KF_SEQ_GAP (2 * SEQ_BLOCK * WORKERS_MAX)  /* past blocks workers may still be taking */
+
+#ifndef BPF_TCX_INGRESS
+/* tcx attach points, linux 6.6, newer than some uapi headers */
+#define BPF_TCX_INGRESS 46
+#define BPF_TCX_EGRESS 47
+#endif
+
+/* tunnel wire framing */
+#define WIRE_VERSION 3
+#define WIRE_HDR_LEN ((int)sizeof(struct wire_hdr))
+
+/* flags in the low nibble of wire_hdr.version */
+#define WIRE_F_SEALED   0x1 /* payload is AEAD ciphertext plus tag */
+#define WIRE_F_OPENED   0x2 /* never on the wire: payload decrypted in place */
+#define WIRE_F_COMPRESSED 0x4 /* plaintext is an LZ4 block of the packet */
+
+/* frame types carried in wire_hdr.type */
+#define FRAME_DATA      0   /* payload is one packet read from tun/tap */
+#define FRAME_HELLO     1   /* client -> server connection request */
+#define FRAME_HELLO_ACK 2   /* server -> client connection reply */
+#define FRAME_KEEPALIVE 3   /* no payload, keeps NAT bindings open */
+#define FRAME_BUNDLE    4   /* payload is packets, each behind a 16 bit length */
+#define FRAME_PROBE     5   /* path MTU probe: its size in 16 bits, then padding */
+#define FRAME_PROBE_ACK 6   /* the size of a probe that arrived */
+#define FRAME_RETRY     7   /* server -> client: HELLO again, echoing seq unless 0; never sealed */
+#define FRAME_FEC_DATA  8   /* a packet of an FEC group, its fec_hdr behind it */
+#define FRAME_FEC_PARITY 9  /* fec_hdr, then a parity shard of the group */
+#define FRAME_FEC_REPORT 10 /* FEC shards expected and received since the last report */
+#define FRAME_BOND_DATA 11  /* a packet striped over several paths, its bond_hdr behind it */
+#define FRAME_LINK_PROBE 12 /* client -> server down each uplink: a link_probe */
+#define FRAME_LINK_ECHO 13  /* the probe, sent back the way it came */
+#define FRAME_DELAY_PROBE 14    /* -r auto: the sender's clock, to be sent back */
+#define FRAME_DELAY_ECHO 15     /* the probe, sent back */
+
+/**************************************************************************
+ * wire_hdr: prepended to every datagram sent on the UDP tunnel. Only    *
+ *           'length' bytes of payload follow it, never the whole buffer.*
+ *           All multi-byte fields are in network byte order.            *
+ **************************************************************************/
+struct wire_hdr {
+    uint8_t  version;   /* WIRE_VERSION in the high nibble, flags in the low */
+    uint8_t  type;      /* one of FRAME_* */
+    uint16_t length;    /* payload bytes following the header, tag included */
+    uint32_t session;   /* picked by the client, the same in both directions */
+    uint64_t seq;       /* per session and direction frame counter, AEAD nonce */
+};
+
+/**************************************************************************
+ * fec_hdr: where an FEC frame belongs: behind the packet of a data      *
+ *          frame, in front of the shard of a parity frame. A shard is   *
+ *          the packet behind its 16 bit length, zero padded to the      *
+ *          longest of the group; parity shard j is the sum over the     *
+ *          data shards i of fec_coef[j][i] times shard i.               *
+ **************************************************************************/
+struct fec_hdr {
+    uint32_t group;     /* sender's group number, network byte order */
+    uint8_t  index;     /* data packet or parity row in the group */
+    uint8_t  count;     /* data packets: planned in data frames, final in parity */
+    uint8_t  parity;    /* parity packets of the group */
+    uint8_t  pad;
+};
+
+/**************************************************************************
+ * bond_hdr: where a striped packet goes in its stream, the packets      *
+ *           one worker of the sender stripes to us, behind the packet.  *
+ **************************************************************************/
+struct bond_hdr {
+    uint32_t seq;       /* per stream, network byte order */
+    uint8_t  stream;    /* the sender's worker */
+    uint8_t  pad[3];
+};
+
+/**************************************************************************
+ * link_probe: what a client sends down one of its uplinks and gets      *
+ *             back: its send time, and what it measured of the uplink   *
+ *             so far, which the server weighs the path by. A path       *
+ *             may carry probes one way only, so the client says         *
+ *             whether echoes still come back on it.                     *
+ **************************************************************************/
+struct link_probe {
+    uint64_t stamp;     /* client CLOCK_MONOTONIC ns, only it reads it */
+    uint32_t srtt;      /* smoothed RTT in microseconds, network byte order */
+    uint32_t loss;      /* ppm of probes lost, network byte order */
+    uint8_t  link;      /* uplink index */
+    uint8_t  up;        /* the client hears echoes on it */
+    uint8_t  pad[6];
+};
+
+/**************************************************************************
+ * pool_cache: one thread's private stock of pool buffers. Only its      *
+ *             thread writes it; counters are atomics so reports can     *
+ *             read them from elsewhere.                                 *
+ **************************************************************************/
+struct pool_cache {
+    int n;
+    char *bufs[POOL_CACHE];
+    _Atomic unsigned long gets, puts;
+    _Atomic unsigned long empty;    /* gets that found the pool exhausted */
+};
+
+/**************************************************************************
+ * pool: the packet buffers, one mapping (hugepages when we can get      *
+ *       them) cut into BUFSIZE chunks. The shared free stack is only    *
+ *       touched POOL_BULK buffers at a time by a thread's cache.        *
+ **************************************************************************/
+struct pool {
+    char *base;
+    size_t size;
+    int nbufs;
+    int huge;                   /* MAP_HUGETLB worked */
+    pthread_mutex_t lock;
+    int nfree;
+    char **free;
+    int ncaches;
+    struct pool_cache *caches[POOL_THREADS_MAX];
+};
+
+/**************************************************************************
+ * batch: frame buffers plus the mmsghdr/iovec arrays pointing at them,  *
+ *        so a whole batch moves in one sendmmsg()/recvmmsg() call.       *
+ *        Buffers come from the pool; buf[i] is where the frame starts,  *
+ *        WIRE_HDR_LEN before the packet.                                *
+ **************************************************************************/
+struct batch {
+    int size;                   /* capacity, set with -b */
+    char **buf;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_in *addrs;  /* source addresses filled by recvmmsg() */
+};
+
+/**************************************************************************
+ * event_src: one descriptor registered with the event loop. epoll hands *
+ *            it back as data.ptr, so adding a descriptor only needs a    *
+ *            new handler. The handler must drain fd (edge-triggered) and *
+ *            returns non-zero when it stopped early on EVENT_BUDGET; it  *
+ *            is then called again before the loop blocks.               *
+ **************************************************************************/
+struct event_src {
+    int fd;
+    int (*handler)(struct event_src *src);
+    void *arg;
+    int pending;                /* queued to run on this loop iteration */
+};
+
+/**************************************************************************
+ * route: an IPv4 prefix, host byte order.                                *
+ **************************************************************************/
+struct route {
+    uint32_t prefix;
+    uint8_t len;
+};
+
+/**************************************************************************
+ * replay_window: sliding window of the counts seen in one lane of a     *
+ *                session. Slot i holds the 32 frames of block           *
+ *                (count >> 5) that maps to it, tagged with the upper    *
+ *                bits of that block, so a worker updates one slot with  *
+ *                one compare-and-swap and never has to clear anything   *
+ *                when the window moves. top is the newest block and     *
+ *                bounds how late a frame may be.                        *
+ **************************************************************************/
+struct replay_window {
+    _Atomic uint64_t top;
+    _Atomic uint64_t slots[REPLAY_SLOTS];   /* tag << 32 | bitmap */
+};
+
+/**************************************************************************
+ * replay: what was seen from one session, a window per sender lane,     *
+ *         made when the lane's first frame checks out and kept for the  *
+ *         sessions the peer slot has after, and the count below which   *
+ *         nothing is new, in any lane: where a resumed session's sender *
+ *         went on from.                                                 *
+ **************************************************************************/
+struct replay {
+    struct replay_window *_Atomic lane[SEQ_LANES];
+    _Atomic uint64_t floor;
+};
+
+/**************************************************************************
+ * peer: one remote end of the tunnel, shared by all workers. Every      *
+ *       remote socket we heard from under its session is a path;        *
+ *       outbound packets pick a path by flow hash so each flow stays on *
+ *       one socket pair and keeps its order. Paths are packed as        *
+ *       (ip << 16 | port) so workers can read them without taking       *
+ *       peers_lock, which only serializes updates.                      *
+ **************************************************************************/
+struct peer {
+    int id;
+    int in_use;
+    uint32_t session;
+    atomic_int npaths;
+    _Atomic uint64_t challenge; /* server: nothing is sealed for it until a HELLO echoes this, 0 once one did */
+    _Atomic uint64_t paths[WORKERS_MAX];
+    int nroutes;
+    struct route routes[PEER_ROUTES_MAX];
+    _Atomic time_t last_rx;
+    _Atomic time_t auth_rx;     /* client: when a frame of it last opened */
+    atomic_uint key_gen;        /* odd while key is rewritten */
+    uint8_t key[AEAD_KEY_LEN];  /* this session's key, see aead_derive */
+    _Atomic uint64_t tx_seq;    /* next block of sequence numbers to hand out */
+    struct replay replay;       /* what we received from this session */
+    atomic_int pmtu;            /* largest datagram the path carried, 0 until known */
+    atomic_int mss;             /* IPv4 MSS TCP SYNs to and from it are clamped to, 0 for none */
+    atomic_int probe_acked;     /* largest probe answered since the last round */
+    _Atomic time_t probe_at;    /* when the next search starts, 0 for right away */
+    int probe_lo, probe_hi;     /* worker 0's search: fits, may still fit */
+    int probe_round;            /* a round is out */
+    int probe_misses;           /* rounds in a row probe_hi was left standing */
+    atomic_int fec_loss;        /* ppm of our FEC shards it reports lost, smoothed */
+    atomic_int bonded;          /* -U: data to it is striped, it probes its uplinks */
+    _Atomic uint32_t path_srtt[WORKERS_MAX];    /* server: each path as the client's probes say, us */
+    _Atomic uint32_t path_loss[WORKERS_MAX];    /* and ppm of them lost */
+    _Atomic uint64_t path_seen[WORKERS_MAX];    /* ns of its latest probe, of when it was learned, 0 if it is down */
+    _Atomic uint8_t path_lane[WORKERS_MAX];     /* server: the lane of the client worker sending by it */
+    _Atomic time_t path_rx[WORKERS_MAX];        /* server: coarse_now of the latest frame by it */
+    uint64_t paths_down;        /* server worker 0: the ones it said went silent */
+    _Atomic uint64_t pace_next; /* -r: ns its bucket is spent up to */
+    _Atomic uint64_t pace_cost; /* ns per byte << 16 at its rate */
+    _Atomic uint64_t pace_rate; /* bits/s, worker 0's to change */
+    atomic_uint pace_srtt;      /* -r auto: us, 0 until measured */
+    atomic_uint pace_min, pace_min_next;   /* least RTT of the last window and of this one */
+    uint64_t pace_min_at;       /* ns this window began */
+    atomic_int pace_fq;         /* its route leaves by fq, -1 until looked up */
+    atomic_int kfast;           /* -K: the kernel forwards its data, we seal from kf_peers */
+};
+
+/**************************************************************************
+ * peer_ctx: what one worker keeps per peer, so the data path never locks *
+ *           for crypto: keyed cipher contexts and a block of sequence    *
+ *           numbers taken from the peer; with FEC the group it fills for *
+ *           the peer and the loss it saw in the peer's groups.           *
+ **************************************************************************/
+struct peer_ctx {
+    unsigned key_gen;           /* peer key the contexts were keyed with */
+    EVP_CIPHER_CTX *enc, *dec;
+    uint64_t seq_next, seq_end;
+    struct fec_enc *fec;        /* made on first use */
+    unsigned fec_expected, fec_got;     /* shards, for the next report */
+    struct fec_group *fec_rx;   /* FEC_GROUPS being collected, made on its first FEC frame */
+    struct bond *bond;          /* -U: made on the first packet striped to or from it */
+};
+
+/**************************************************************************
+ * uplink: one -U underlay a client sends from, by address or device.    *
+ **************************************************************************/
+struct uplink {
+    char name[IFNAMSIZ];
+    struct in_addr ip;          /* bound to, INADDR_ANY with a device */
+    int by_dev;                 /* name is an interface, SO_BINDTODEVICE */
+};
+
+/**************************************************************************
+ * uplink_state: what one client worker measured of one uplink           *
+ *               through its socket there.                               *
+ **************************************************************************/
+struct uplink_state {
+    uint32_t srtt;              /* microseconds, 0 until the first echo */
+    uint32_t loss;              /* ppm of probes lost, smoothed */
+    uint64_t echo_at;           /* ns of the latest echo */
+    unsigned sent, acked;       /* probes of the loss sample being taken */
+    int up;
+};
+
+/**************************************************************************
+ * reorder: one stream of striped packets from a peer, put back in       *
+ *          order. A packet ahead of next waits in the slot of its       *
+ *          sequence number until the gap before it fills or             *
+ *          BOND_WAIT_USEC ran out for it.                               *
+ **************************************************************************/
+struct reorder {
+    uint32_t next;              /* the next packet to write */
+    int started, nheld, listed;
+    int peer;
+    struct reorder *next_held;  /* the worker's streams that hold packets */
+    char *buf[BOND_SLOTS];      /* pool buffers, the packet at PKT_DATA */
+    uint16_t len[BOND_SLOTS];
+    uint64_t at[BOND_SLOTS];    /* ns it was held at */
+};
+
+/**************************************************************************
+ * bond: one worker's bonding state for one peer: its stream to the      *
+ *       peer, the credit of each path in its weighted round robin,      *
+ *       and the peer's streams it puts back in order.                   *
+ **************************************************************************/
+struct bond {
+    uint32_t session;           /* of the peer it was made for */
+    uint32_t tx_seq;
+    int credit[WORKERS_MAX];
+    struct reorder rx[WORKERS_MAX];
+};
+
+/**************************************************************************
+ * sched_rule: one -C rule, packets of proto with either port in lo-hi   *
+ *             go in class cls. 0-65535 takes the protocol whole.        *
+ **************************************************************************/
+struct sched_rule {
+    uint8_t proto, cls;
+    uint16_t lo, hi;
+};
+
+/**************************************************************************
+ * sched_pkt: a packet waiting in a class queue, routed, not yet framed. *
+ **************************************************************************/
+struct sched_pkt {
+    char *frame;                /* pool buffer at PKT_FRAME */
+    struct peer *owner;
+    struct sockaddr_in addr;
+    uint64_t stamp;             /* ns it was read at */
+    int len;
+    uint8_t tos;                /* the inner DSCP, ECN bits clear */
+};
+
+/**************************************************************************
+ * sched_queue: one class of one worker, a ring of SCHED_QLEN packets.   *
+ **************************************************************************/
+struct sched_queue {
+    struct sched_pkt pkt[SCHED_QLEN];
+    unsigned head, tail;
+    int deficit;                /* DRR: bytes it may still send this round */
+};
+
+/**************************************************************************
+ * sched: one worker's egress scheduler: its class queues, the class     *
+ *        whose DRR round it is, and how many more bytes the socket      *
+ *        takes before the kernel queues them behind each other.         *
+ **************************************************************************/
+struct sched {
+    struct sched_queue cls[SCHED_CLASSES];
+    int rr;                     /* the DRR class being served */
+    int queued;                 /* packets in all classes */
+    int sndbuf, room;
+    char *spare;                /* the next read lands here */
+};
+
+/**************************************************************************
+ * paced: a sealed frame the timer wheel holds until its tick comes.     *
+ **************************************************************************/
+struct paced {
+    char *frame;                /* pool buffer at PKT_FRAME */
+    int len, link;              /* -U: the uplink it goes by */
+    uint8_t tos;                /* -D */
+    struct sockaddr_in addr;
+    uint64_t tick;
+    struct paced *next;
+};
+
+/**************************************************************************
+ * pace_wheel: one worker's frames held back where the kernel does not   *
+ *             pace: a list per tick of the last PACE_SLOTS, each in the *
+ *             order the frames came. A slot may hold frames of a later  *
+ *             lap, they stay until theirs.                              *
+ **************************************************************************/
+struct pace_wheel {
+    struct paced held[PACE_HELD];
+    struct paced *free;
+    struct paced *head[PACE_SLOTS];
+    struct paced **tail[PACE_SLOTS];
+    uint64_t tick;              /* the next to send */
+    int nheld, armed;
+    struct paced *out[PACE_FLUSH];
+    struct mmsghdr msgs[PACE_FLUSH];
+    struct iovec iovs[PACE_FLUSH];
+};
+
+/**************************************************************************
+ * cap_rec: one record of the capture ring. seq is the record's number   *
+ *          plus one once written and 0 while it is, a reader keeps what *
+ *          it copied only if seq read the same before and after. A      *
+ *          writer a whole lap behind may still tear one, that is        *
+ *          within what a debugging aid may lose.                        *
+ **************************************************************************/
+struct cap_rec {
+    _Atomic uint64_t seq;
+    uint64_t stamp;             /* CLOCK_REALTIME, ns */
+    int32_t peer;               /* -1 for none: floods, strays, no route */
+    uint16_t len, caplen;       /* the packet's bytes, those copied */
+    uint8_t layer, dir;         /* CAP_INNER or CAP_OUTER, CAP_RX or CAP_TX */
+    uint16_t port;              /* outer: the remote end, network order */
+    uint32_t addr;
+    uint8_t data[CAP_SNAPLEN];
+};
+
+/**************************************************************************
+ * cap_ring: the shared file -Y maps: what a reader needs to make sense  *
+ *           of it, then the records, taken in turn by whichever worker  *
+ *           claims head next. Nothing waits for the reader, it notices  *
+ *           when it was lapped.                                         *
+ **************************************************************************/
+struct cap_ring {
+    uint32_t magic, version;
+    uint32_t nslots;
+    uint32_t linktype;          /* of the inner packets */
+    uint16_t port;              /* -p, the local end of the outer frames */
+    _Atomic uint64_t head __attribute__((aligned(64)));
+    struct cap_rec rec[] __attribute__((aligned(64)));
+};
+
+/**************************************************************************
+ * cap_filter: what -y keeps: of a peer, inner packets of a protocol, of *
+ *             a size, one in sample of those, at most snap bytes each.  *
+ **************************************************************************/
+struct cap_filter {
+    int peer, proto;            /* -1 for any */
+    int lo, hi;                 /* length */
+    int layers;                 /* CAP_INNER | CAP_OUTER */
+    int snap;
+    unsigned sample;
+};
+
+/**************************************************************************
+ * kf_peer: what the -K programs know of a peer, element id of an array  *
+ *          map we map as well: where its packets go and by which next   *
+ *          hop, the sequence numbers the kernel and we both seal with,  *
+ *          and what the kernel forwarded. Addresses and ports in        *
+ *          network order.                                               *
+ **************************************************************************/
+struct kf_peer {
+    _Atomic uint64_t seq;       /* next sequence number to seal with */
+    _Atomic uint64_t tx_pkts, tx_bytes, rx_pkts, rx_bytes;
+    _Atomic uint32_t on;        /* 0: the programs leave its packets to us */
+    uint32_t session;
+    uint32_t saddr, daddr;
+    uint16_t sport, dport;
+    uint32_t oif;               /* underlay interface of the route to it */
+    uint32_t mtu;               /* of that interface, longer datagrams are left to us */
+    uint8_t dmac[6], smac[6];   /* next hop's and ours */
+};
+
+/**************************************************************************
+ * kf_state: what the control thread last installed, or tried to, for a *
+ *           peer.                                                       *
+ **************************************************************************/
+struct kf_state {
+    int on;
+    uint32_t session;
+    uint64_t path;              /* 0 to try again */
+    int nroutes;
+    struct route routes[PEER_ROUTES_MAX];
+    uint64_t rx_pkts;           /* at the last sync */
+};
+
+/**************************************************************************
+ * kf_prog: a TC program being put together by kf_emit.                  *
+ **************************************************************************/
+struct kf_prog {
+    struct bpf_insn insn[KF_INSNS_MAX];
+    int n;
+};
+
+/**************************************************************************
+ * aead_stats: sampled cost of seal or open in one worker.                *
+ **************************************************************************/
+struct aead_stats {
+    unsigned long packets, bytes;
+    unsigned long sampled;      /* packets that were timed */
+    uint64_t nsec;              /* time spent in them */
+};
+
+/**************************************************************************
+ * zip: one worker's compression state. The match finder table keeps     *
+ *      base + offset of recent 4 byte strings; base moves past each     *
+ *      packet, so older entries fail the range check without a reset.   *
+ *      Flows whose packets did not shrink are skipped for a while,      *
+ *      twice as long each time.                                         *
+ **************************************************************************/
+struct zip {
+    uint32_t base;
+    uint32_t table[1 << ZIP_HASH_BITS];
+    uint8_t backoff[ZIP_FLOWS];     /* log2 of the next skip of a flow */
+    uint8_t skip[ZIP_FLOWS];        /* packets of a flow still to bypass */
+    unsigned tick;                  /* packets since the last timed one */
+    uint8_t out[ZIP_MAX_LEN];       /* compressor and decompressor output */
+    uint8_t bounce[WIRE_HDR_LEN + ZIP_MAX_LEN + AEAD_TAG_LEN];  /* offload: frame inflated off the GRO buffer */
+};
+
+/**************************************************************************
+ * counter: what the per-thread counters count, see counter_names for    *
+ *          the metric and label each one is exported under.             *
+ **************************************************************************/
+enum counter {
+    C_TUN_RX_PKTS, C_TUN_RX_BYTES,      /* packets read from tun/tap */
+    C_NET_TX_PKTS, C_NET_TX_BYTES,      /* frames handed to the socket */
+    C_NET_RX_PKTS, C_NET_RX_BYTES,      /* datagrams received */
+    C_TUN_TX_PKTS, C_TUN_TX_BYTES,      /* packets written to tun/tap */
+    C_ZIP_PKTS, C_ZIP_NO_GAIN,          /* compressed, or tried in vain */
+    C_ZIP_ENTROPY, C_ZIP_HISTORY,       /* bypassed: looked random, flow did not shrink */
+    C_ZIP_IN_BYTES, C_ZIP_OUT_BYTES,    /* through the compressor, before and after */
+    C_UNZIP_PKTS,                       /* decompressed */
+    C_BUNDLE_TX, C_BUNDLE_TX_PKTS,      /* bundles sent, the packets in them */
+    C_BUNDLE_RX, C_BUNDLE_RX_PKTS,      /* bundles received, the packets in them */
+    C_MSS_TX, C_MSS_RX,                 /* TCP SYNs whose MSS was clamped */
+    C_L2_FLOOD, C_L2_SWITCHED,          /* -a: frames flooded, switched from one peer to another */
+    C_L2_ARP,                           /* -a: ARP requests answered in place */
+    C_FEC_PARITY_TX, C_FEC_REBUILT,     /* -F: parity frames sent, lost packets rebuilt */
+    C_FEC_LATE, C_FEC_LOST,             /* rebuilt before they came, lost for good */
+    C_BOND_REORDERED, C_BOND_LATE,      /* -U: held for those before them, came after their wait */
+    C_BOND_MISSING,                     /* gaps given up on */
+    C_SCHED_TX,                         /* -C: sent, one per class */
+    C_SCHED_DROP = C_SCHED_TX + SCHED_CLASSES,  /* dropped on a full class queue */
+    C_SCHED_END = C_SCHED_DROP + SCHED_CLASSES - 1,
+    C_PACE_TXTIME, C_PACE_HELD,         /* -r: sent with a departure time, held in the wheel */
+    C_CAP_INNER, C_CAP_OUTER,           /* -Y: records written */
+    C_DROP_NO_ROUTE,                    /* no peer owns the destination */
+    C_DROP_SOCK_FULL,                   /* no room in the socket buffer */
+    C_DROP_PACED,                       /* its bucket was spent past the horizon */
+    C_DROP_MALFORMED,                   /* truncated, other version or flags */
+    C_DROP_NO_PEER,                     /* a session we have no peer for */
+    C_DROP_REPLAY,                      /* duplicate or too late */
+    C_DROP_AUTH,                        /* did not verify */
+    C_DROP_RING_FULL,                   /* the other pipeline stage fell behind */
+    C_DROP_POOL_EMPTY,                  /* no buffer to put it in */
+    C_ERR_READ, C_ERR_WRITE,            /* failed syscalls */
+    C_ERR_RECVMMSG, C_ERR_RECVMSG,
+    C_ERR_SENDMMSG, C_ERR_SENDMSG, C_ERR_SENDTO,
+    COUNTERS
+};
+
+/**************************************************************************
+ * hist_id: the latencies histograms are kept of. tun_to_net and         *
+ *          net_to_tun go from a packet's read to its send or write, the *
+ *          rest are the steps of one batch on the way.                  *
+ **************************************************************************/
+enum hist_id {
+    H_TUN_NET, H_NET_TUN,               /* per packet, read to send */
+    H_TX_READ, H_TX_CRYPTO, H_TX_SEND,  /* per batch, tun -> net */
+    H_RX_READ, H_RX_CRYPTO, H_RX_WRITE, /* per batch, net -> tun */
+    H_ZIP, H_UNZIP,                     /* per packet, in the codec */
+    HISTS
+};
+
+/**************************************************************************
+ * hist: log-bucketed histogram in the manner of HDR histograms: values   *
+ *       below HIST_SUB have a bucket each, above that every power of 2  *
+ *       is split into HIST_SUB buckets, see hist_bucket.                *
+ **************************************************************************/
+struct hist {
+    _Atomic unsigned long count, sum;   /* samples, their total in ns */
+    _Atomic unsigned long buckets[HIST_BUCKETS];
+};
+
+/**************************************************************************
+ * counters: one thread's counters, on cache lines of their own. Only    *
+ *           the owning thread writes them, without locked instructions; *
+ *           the stats endpoint sums all blocks when it is read.         *
+ **************************************************************************/
+struct counters {
+    _Alignas(64) _Atomic unsigned long v[COUNTERS];
+    struct hist hist[HISTS];
+    int hist_tick;              /* batches since the last timed one */
+    int worker;                 /* -1 until the thread says which */
+    const char *stage;          /* "io" or "crypto" */
+};
+
+/**************************************************************************
+ * peer_slot: an open addressing slot of the peer table. A path key maps *
+ *            (ip << 16 | port, session) to a peer; the session key with *
+ *            addr 0 finds the peer of a session seen from a new socket. *
+ **************************************************************************/
+struct peer_slot {
+    uint64_t addr;
+    uint32_t session;
+    int16_t peer;               /* index into peers[], PEER_SLOT_EMPTY if free */
+    int16_t path;               /* and into its paths[], -1 for the session key */
+};
+
+/**************************************************************************
+ * retired: a table swapped out, freed once every worker has been        *
+ *          through housekeeping since, so none is still looking in it.  *
+ **************************************************************************/
+struct retired {
+    struct retired *next;
+    void *mem;                  /* the table this is part of */
+    unsigned long epoch;        /* tables_epoch from the swap on */
+};
+
+/**************************************************************************
+ * peer_table: linear probing hash of peer_slots, 4 per cache line.      *
+ *             Readers never lock: they retry if the seqlock moved while *
+ *             they looked. A new path goes in in place, anything else   *
+ *             builds a new table and swaps it in; writers hold          *
+ *             tables_lock.                                              *
+ **************************************************************************/
+struct peer_table {
+    atomic_uint seq;
+    int used;
+    struct retired retired;
+    struct peer_slot slots[PEER_TABLE_SIZE];
+};
+
+/**************************************************************************
+ * lpm: multibit route trie with 8 bit strides, so an IPv4 lookup is at  *
+ *      most 4 dependent loads. Prefixes are expanded into every entry   *
+ *      they cover; each entry keeps the longest one. Tries are rebuilt  *
+ *      and swapped whole when routes change, so readers never lock.     *
+ **************************************************************************/
+struct lpm_entry {
+    int32_t child;              /* node index, 0 for none (root is never a child) */
+    int16_t peer;               /* best peer on this entry, -1 for none */
+    uint8_t len;                /* prefix length of that peer's route */
+};
+
+struct lpm {
+    int nnodes;
+    struct retired retired;
+    struct lpm_entry nodes[][256];
+};
+
+/**************************************************************************
+ * peer_snap: what the tables are built from of a live peer, copied      *
+ *            under peers_lock so the building goes on without it.       *
+ **************************************************************************/
+struct peer_snap {
+    int id;
+    uint32_t session;
+    int nroutes;
+    struct route routes[PEER_ROUTES_MAX];
+};
+
+/**************************************************************************
+ * uring_send: what an in-flight sendmsg of one tun buffer points at. The*
+ *             header goes out from here, the payload straight from the  *
+ *             buffer the kernel read into.                              *
+ **************************************************************************/
+struct uring_send {
+    struct wire_hdr hdr;
+    uint8_t tag[AEAD_TAG_LEN];
+    uint64_t stamp;             /* now_nsec() at read when timed, else 0 */
+    struct iovec iov[3];
+    struct msghdr msg;
+    struct sockaddr_in addr;
+};
+
+/**************************************************************************
+ * uring: one io_uring instance and the memory registered with it.       *
+ **************************************************************************/
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+    unsigned sq_local;          /* our tail, published on submit */
+    unsigned sq_pending;        /* sqes filled since the last submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    char *rings;                /* SQ and CQ rings, one mapping */
+    size_t rings_size, sqes_size;
+    struct io_uring_buf_ring *br[URING_GROUPS];
+    int starved[URING_GROUPS];  /* multishot stopped on ENOBUFS */
+    char *bufs;                 /* URING_GROUPS * URING_BUFS frames, fixed buffer 0 */
+    struct uring_send *sends;   /* one per tun/tap buffer */
+    uint64_t *recv_stamps;      /* one per socket buffer, like uring_send.stamp */
+    struct msghdr recv_msg;     /* layout of multishot recvmsg results */
+    struct __kernel_timespec tick;
+    int read_multishot;         /* kernel has IORING_OP_READ_MULTISHOT */
+};
+
+/**************************************************************************
+ * xsk_ring: one of the four rings of an AF_XDP socket, mapped from the  *
+ *           kernel. cached is our own producer (fill, tx) or consumer   *
+ *           (rx, completion) index.                                     *
+ **************************************************************************/
+struct xsk_ring {
+    unsigned *producer, *consumer, *flags;
+    void *descs;                /* UMEM offsets (fill, completion) or struct xdp_desc */
+    unsigned mask, cached;
+    void *map;
+    size_t map_len;
+};
+
+/**************************************************************************
+ * xsk: a worker's AF_XDP socket on one queue of the underlay            *
+ *      interface. Fill ring buffers belong to the kernel until they     *
+ *      come back on rx, tx ones until they show up on the completion    *
+ *      ring.                                                            *
+ **************************************************************************/
+struct xsk {
+    int fd;
+    struct xsk_ring fill, comp, rx, tx;
+    uint16_t sport;             /* the worker's UDP port, network order */
+};
+
+/**************************************************************************
+ * neigh: next hop MAC of a remote address, learned from frames that     *
+ *        checked out. ip is written last and read again after mac, so a *
+ *        reader never takes the MAC of another address.                 *
+ **************************************************************************/
+struct neigh {
+    _Atomic uint32_t ip;        /* network order, 0 for a free slot */
+    _Atomic uint64_t mac;
+};
+
+/**************************************************************************
+ * mac_slot: where a MAC was last seen from, a peer id or SIDE_LOCAL,    *
+ *           packed with the MAC so one load reads both. Readers         *
+ *           never lock; learners take free slots with a CAS, and        *
+ *           worker 0 clears what went silent.                           *
+ **************************************************************************/
+struct mac_slot {
+    _Atomic uint64_t entry;     /* mac << 16 | side, 0 for a free slot */
+    _Atomic time_t seen;        /* coarse_now when it last sent a frame */
+};
+
+/**************************************************************************
+ * arp_slot: a host ARP has told us about: its MAC and side, packed as   *
+ *           in mac_slot. ip is written last and read again after        *
+ *           entry, as in neigh.                                         *
+ **************************************************************************/
+struct arp_slot {
+    _Atomic uint32_t ip;        /* network order, 0 for a free slot */
+    _Atomic uint64_t entry;
+    _Atomic time_t seen;
+};
+
+/**************************************************************************
+ * coalesce: a TCP super-packet being rebuilt from received segments of  *
+ *           one flow, written to tun in one go with a GSO virtio header.*
+ *           buf starts with room for the virtio_net_hdr.                *
+ **************************************************************************/
+struct coalesce {
+    char *buf;
+    int len;                    /* packet bytes behind the virtio header */
+    int iphlen, hdrlen;         /* IP header, IP + TCP headers */
+    int mss, segs;
+    int v6;
+    int closed;                 /* short or PSH segment seen, nothing may follow */
+    uint32_t next_seq;
+};
+
+/**************************************************************************
+ * bundle: small packets for one peer being packed into one frame (-A),  *
+ *         in a pool buffer all of its own. It goes out when a packet    *
+ *         does not fit or must not overtake it, or at its deadline.     *
+ **************************************************************************/
+struct bundle {
+    char *frame;                /* wire header room, then the packets */
+    struct peer *p;
+    struct sockaddr_in addr;
+    int len, npkts;             /* payload bytes, lengths included */
+    uint64_t first;             /* now_nsec() when the first packet went in */
+    uint64_t stamp;             /* read time of the first packet when timed, else 0 */
+    int armed;                  /* deadline timer running */
+};
+
+/**************************************************************************
+ * fec_enc: the FEC group one worker fills for one peer. Its parity      *
+ *          shards build up in pool buffers behind frame header room as  *
+ *          each packet goes out, so packets are never kept; only the    *
+ *          first len bytes of them are valid, as far as the longest     *
+ *          shard so far.                                                *
+ **************************************************************************/
+struct fec_enc {
+    struct peer *p;
+    uint32_t session;           /* of the peer the group is for */
+    struct sockaddr_in addr;    /* the one path the group goes on */
+    uint32_t group;
+    int k, m;                   /* planned data packets, parity packets */
+    int n, len;                 /* data packets in it, longest shard */
+    uint64_t first;             /* now_nsec() when the first packet went in */
+    struct fec_enc *next;       /* on the worker's list of open groups */
+    int listed;
+    char *parity[FEC_M_MAX];    /* frame starts, taken from the pool as needed */
+};
+
+/**************************************************************************
+ * fec_group: one group a worker collects the shards of, until it can    *
+ *            rebuild what is missing or another group needs the slot.   *
+ *            Size and shard length come with the first parity frame.    *
+ **************************************************************************/
+struct fec_group {
+    uint32_t session, group;    /* session 0 for a free slot */
+    int peer;
+    int count, parity, len;     /* count 0 until a parity frame came */
+    uint64_t have;              /* data shards in bits 0.., parity from FEC_K_MAX on */
+    int got;                    /* shards received */
+    int done;                   /* rebuilt, or all data came */
+    uint16_t slen[FEC_K_MAX];   /* data shard lengths */
+    uint8_t *shard[FEC_SHARDS]; /* FEC_SHARD_MAX bytes each */
+};
+
+/**************************************************************************
+ * pkt_meta: what a pool buffer carries through the pipeline, in the     *
+ *           front of its headroom, ahead of where the wire header goes. *
+ **************************************************************************/
+struct pkt_meta {
+    int len;                    /* packet, datagram or frame bytes, by stage */
+    uint8_t type;               /* FRAME_* to seal on the way out, opened on the way in */
+    struct sockaddr_in addr;    /* destination or source */
+    uint64_t stamp;             /* now_nsec() at read when timed, else 0 */
+};
+
+/**************************************************************************
+ * ring: lock-free single-producer/single-consumer queue of pool buffer  *
+ *       handles. Each side writes only its own cache line and keeps a   *
+ *       copy of the other side's index, so it reads the shared line     *
+ *       only when the copy says the ring looks full (or empty).         *
+ **************************************************************************/
+struct ring {
+    _Alignas(64) atomic_uint head;  /* producer */
+    unsigned tail_cache;
+    _Alignas(64) atomic_uint tail;  /* consumer */
+    unsigned head_cache;
+    _Alignas(64) unsigned mask;
+    char **slots;
+};
+
+/**************************************************************************
+ * pipeline: the stages of one worker in pipelined mode. The I/O thread  *
+ *           (the worker) moves packets between tun, socket and rings;   *
+ *           the crypto thread routes, seals, opens and handles control  *
+ *           frames. Each side sleeps on its eventfd when idle.          *
+ **************************************************************************/
+struct pipeline {
+    struct ring tx_in, tx_out;      /* tun -> crypto -> socket */
+    struct ring rx_in, rx_out;      /* socket -> crypto -> tun */
+    int io_efd, crypto_efd;
+    _Alignas(64) atomic_int crypto_idle;
+    pthread_t thread;
+    int cpu;                        /* crypto stage core */
+    char *scratch;                  /* tun reads land here when the pool is dry */
+};
+
+/**************************************************************************
+ * tunnel: the state one forwarding loop (one worker) works on.          *
+ **************************************************************************/
+struct tunnel {
+    int id, cpu;
+    pthread_t thread;
+    int tap_fd, sock_fd, epoll_fd, timer_fd;
+    struct event_src tap_src, sock_src, timer_src, pipe_src, xsk_src;
+    struct pipeline *pl;        /* set in pipelined mode */
+    struct uring *ring;         /* set when running the io_uring engine */
+    struct xsk *xsk;            /* set when the AF_XDP underlay has this queue */
+    char *gso_in, *gso_out;     /* offload: super-packet read, segmented frames */
+    char *gro_buf;              /* offload: coalesced datagrams from the socket */
+    struct coalesce coal;
+    int udp_gso;                /* socket takes UDP_SEGMENT sends */
+    struct bundle bundle;       /* -A: packets waiting to go out together */
+    int agg_fd;                 /* -A: timerfd of the bundle deadline */
+    struct event_src agg_src;
+    struct batch *tx_batch, *rx_batch;
+    struct peer_ctx *pctx;      /* indexed by peer id */
+    EVP_CIPHER_CTX *hello_ctx;  /* checks HELLOs of sessions not yet known */
+    struct aead_stats seal, open;
+    struct zip *zip;
+    time_t last_report;
+    time_t last_tx;             /* CLOCK_MONOTONIC seconds of the last send */
+    int retry_budget;           /* server: RETRYs it may still send this second */
+    unsigned hello_gen;         /* client: the handshake this worker announced its path to */
+    char *l2_frame;             /* -a server: frames from the socket switched or flooded on */
+    struct mmsghdr flood_msgs[FLOOD_BATCH];     /* -a server: one flooded frame, to each peer */
+    struct sockaddr_in flood_addrs[FLOOD_BATCH];
+    int fec_fd;                 /* -F: timerfd of the deadline of open groups */
+    struct event_src fec_src;
+    int fec_armed;
+    struct fec_enc *fec_open;   /* -F: groups with packets in them */
+    int fec_rx;                 /* some peer's groups are being collected */
+    int up_fd[UPLINKS_MAX];     /* -U client: its socket on each uplink, up_fd[0] is sock_fd */
+    struct event_src up_src[UPLINKS_MAX];
+    struct uplink_state up[UPLINKS_MAX];
+    int probe_fd;               /* -U client: timerfd of the uplink probes */
+    struct event_src probe_src;
+    int bond_fd;                /* timerfd of the reorder wait, 0 writes striped packets as they come */
+    struct event_src bond_src;
+    int bond_armed;
+    struct reorder *bond_held;  /* streams holding packets back */
+    int bond_nheld;
+    struct mmsghdr *bond_msgs;  /* -U client: one uplink's share of a tx batch */
+    struct sched *sched;        /* -C: the class queues, NULL without */
+    char (*tx_ctl)[TX_CTL_LEN]; /* -D, -r: ancillary data of each tx batch slot */
+    int txtime;                 /* -r: the sockets take SO_TXTIME */
+    struct pace_wheel *wheel;   /* -r: frames held back for peers fq does not pace */
+    int pace_fd;                /* -r: timerfd ticking while the wheel holds frames */
+    struct event_src pace_src;
+    int rate_fd;                /* -r, worker 0: timerfd of the fq lookups and delay probes */
+    struct event_src rate_src;
+};
+
+/**************************************************************************
+ * dp_variant: a build of tun_to_net and net_to_tun for the features     *
+ *             in feat, DP_GENERIC for any.                              *
+ **************************************************************************/
+struct dp_variant {
+    const char *name;
+    unsigned feat;
+    int (*tx)(struct tunnel *t);
+    int (*rx)(struct tunnel *t, int fd);
+};
+
+/**************************************************************************
+ * ticket: what a client keeps in its -T file to resume its session      *
+ *         after a restart: the session, a floor above every sequence    *
+ *         number it may have sealed, and a bound above every one the    *
+ *         server may have, so neither reuses a nonce of the session     *
+ *         key, whether the other side remembers the session or not.     *
+ **************************************************************************/
+struct ticket {
+    struct sockaddr_in server;  /* only good for this server */
+    uint32_t session;
+    uint64_t tx_seq, rx_seq;
+};
+
+char *progname;
+char MAGIC_WORD[] = "Wazaaaaaaaaaaahhhh !";
+int batch_size = BATCH_DEFAULT;
+int workers = WORKERS_DEFAULT;
+int engine = ENGINE_EPOLL;
+const struct dp_variant *datapath;  /* dp_pick: the per-packet loops */
+int profile = PROFILE_BULK;  /* -L */
+int spin_usec = SPIN_USEC_DEFAULT;
+uint64_t spin_nsec;          /* latency: spin this long after the last work, 0 never */
+int sockbuf = -1;            /* -B socket buffer bytes, 0 for the kernel's, -1 by profile */
+int offload = 0;
+int pipelined = 0;
+int ring_depth = RING_DEPTH_DEFAULT;
+int agg_usec = -1;           /* -A bundle deadline, -1 for no aggregation */
+int agg_mtu = AGG_MTU_DEFAULT;
+int agg_room;                /* bundle payload bytes that fit in agg_mtu */
+const char *tun_name;        /* as the kernel named it */
+int tun_mtu;                 /* its MTU, as worker 0 last read it */
+int crypto_cpus[WORKERS_MAX], ncrypto_cpus;  /* -P placement */
+int io_cpus[WORKERS_MAX], nio_cpus;
+int cliserv = -1;    /* must be specified on cmd line */
+int compress = 0;    /* -z, receiving compressed frames needs no flag */
+int tap_mode = 0;    /* -a, on both sides */
+int fec_mode = 0;    /* -F, receiving FEC frames needs no flag */
+int fec_k, fec_m;    /* -F k/m, 0 to follow the loss the peer reports */
+struct uplink uplinks[UPLINKS_MAX];  /* -U, client */
+int nuplinks;
+int bond_tx;         /* data to bonded peers is striped, where the datapath allows */
+int bond_rx;         /* striped data is put back in order, BOND_HELD buffers a worker */
+int sched_on;        /* -C, -D */
+int dscp_copy;       /* -D: the inner DSCP goes on the datagram */
+struct sched_rule sched_rules[SCHED_RULES_MAX];
+int nsched_rules;
+int sched_sndbuf;    /* send buffer the scheduler shrinks sockets to, 0 leaves them */
+const char *sched_names[SCHED_CLASSES] = { "realtime", "interactive", "default", "bulk" };
+const int sched_weight[SCHED_CLASSES] = { 0, 4, 2, 1 };   /* DRR shares, realtime is ahead of them */
+uint64_t pace_bps;   /* -r: bits/s each peer is paced to, 0 for no pacing */
+int pace_auto;       /* -r .../auto: lowered while the RTT says the path queues */
+struct cap_ring *cap;   /* -Y: the capture ring, NULL when not capturing */
+struct cap_filter capf = { .peer = -1, .proto = -1, .lo = 0, .hi = INT_MAX,
+                           .layers = CAP_INNER | CAP_OUTER, .snap = CAP_SNAPLEN, .sample = 1 };
+__thread unsigned cap_tick;     /* -y sample: matches since the last one taken */
+int kfast;                  /* -K */
+struct kf_peer *kf_peers;   /* -K: the peer map, mapped; NULL when the kernel forwards nothing */
+struct kf_state *kf_state;  /* the control thread's, by peer */
+int kf_sock_fd;             /* worker 0's socket, the one the kernel's datagrams go out from */
+int kf_peers_fd, kf_routes_fd, kf_sessions_fd, kf_decap_fd;
+int kf_tun_ifindex;
+int kf_ifs[KF_IFS_MAX], kf_nifs;    /* where the decap program is */
+
+/* peers: clients on the server, the server alone on a client */
+pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;   /* serializes table rebuilds and path adds */
+struct peer *peers;
+struct peer_table *_Atomic ptable;
+struct lpm *_Atomic routes;
+struct peer_snap *peers_snap;       /* what the rebuild holding tables_lock builds from */
+struct retired *retired;            /* tables swapped out, under tables_lock */
+atomic_ulong tables_epoch;          /* tables swapped out so far */
+_Atomic unsigned long quiesced[WORKERS_MAX];    /* tables_epoch each worker saw at its latest housekeeping */
+atomic_int nquiesced;               /* workers that report it, 0 until they run */
+atomic_int npeers;
+_Atomic time_t coarse_now;  /* seconds, refreshed by housekeeping */
+uint32_t my_session;        /* client: our session id */
+const char *ticket_path;    /* client: -T resumption ticket */
+struct ticket ticket;       /* what it holds, worker 0 keeps it ahead */
+uint64_t resume_floor;      /* client: the server's bound from the ticket we started with */
+uint64_t tx_floor;          /* client: ours, where our sequence numbers started */
+atomic_int hello_acked;     /* client: the server answered our latest HELLO */
+atomic_uint hello_gen;      /* client: HELLO_ACKs so far, workers announce their paths on each */
+_Atomic time_t hello_sent;  /* client: when the latest HELLO went out */
+_Atomic uint64_t hello_challenge;   /* client: what the latest RETRY asked our HELLO to echo */
+atomic_int hello_echo;      /* client: a new challenge may be answered right away, once per HELLO */
+int hello_rto;              /* client worker 0: how long to wait before the next */
+_Atomic int16_t live_ids[PEERS_MAX];    /* the peers in use, what a flood goes to */
+atomic_int nlive;
+
+/* TAP bridging (-a): frames flooded by the server go to every client under
+ * the flood pseudo-peer's session and key, sealed once for all of them */
+struct peer flood;
+struct mac_slot macs[MAC_SLOTS];    /* server: which side each MAC is on */
+struct arp_slot arps[ARP_SLOTS];    /* hosts ARP requests are answered for */
+
+/* FEC: GF(2^8) arithmetic, the parity coefficients, the region kernel */
+uint8_t gf_exp[512], gf_log[256];
+uint8_t gf_nib[256][32];            /* c times each low nibble, then each high one */
+uint8_t fec_coef[FEC_M_MAX][FEC_K_MAX];
+void (*gf_madd)(uint8_t *dst, const uint8_t *src, uint8_t c, int len);
+const char *gf_kernel;
+
+/* packet buffers */
+struct pool pool;
+__thread struct pool_cache *my_cache;
+
+/* counters, summed for the stats endpoint (-S) and the reports */
+pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+struct counters *counter_blocks[COUNTERS_MAX];
+int ncounter_blocks;
+__thread struct counters *my_counters;
+char *stats_path;
+int hist_every = HIST_SAMPLE_DEFAULT;   /* -H, 0 for no timing */
+struct {
+    const char *metric, *label;
+} hist_names[HISTS] = {
+    [H_TUN_NET]   = { "latency_seconds", "path=\"tun_to_net\"" },
+    [H_NET_TUN]   = { "latency_seconds", "path=\"net_to_tun\"" },
+    [H_TX_READ]   = { "step_seconds", "path=\"tun_to_net\",step=\"read\"" },
+    [H_TX_CRYPTO] = { "step_seconds", "path=\"tun_to_net\",step=\"crypto\"" },
+    [H_TX_SEND]   = { "step_seconds", "path=\"tun_to_net\",step=\"send\"" },
+    [H_RX_READ]   = { "step_seconds", "path=\"net_to_tun\",step=\"read\"" },
+    [H_RX_CRYPTO] = { "step_seconds", "path=\"net_to_tun\",step=\"crypto\"" },
+    [H_RX_WRITE]  = { "step_seconds", "path=\"net_to_tun\",step=\"write\"" },
+    [H_ZIP]       = { "codec_seconds", "op=\"compress\"" },
+    [H_UNZIP]     = { "codec_seconds", "op=\"decompress\"" },
+};
+struct {
+    const char *metric, *label;
+} counter_names[COUNTERS] = {
+    [C_TUN_RX_PKTS]     = { "packets_total", "path=\"tun_read\"" },
+    [C_TUN_RX_BYTES]    = { "bytes_total", "path=\"tun_read\"" },
+    [C_NET_TX_PKTS]     = { "packets_total", "path=\"net_send\"" },
+    [C_NET_TX_BYTES]    = { "bytes_total", "path=\"net_send\"" },
+    [C_NET_RX_PKTS]     = { "packets_total", "path=\"net_recv\"" },
+    [C_NET_RX_BYTES]    = { "bytes_total", "path=\"net_recv\"" },
+    [C_TUN_TX_PKTS]     = { "packets_total", "path=\"tun_write\"" },
+    [C_TUN_TX_BYTES]    = { "bytes_total", "path=\"tun_write\"" },
+    [C_ZIP_PKTS]        = { "codec_packets_total", "op=\"compress\",result=\"compressed\"" },
+    [C_ZIP_NO_GAIN]     = { "codec_packets_total", "op=\"compress\",result=\"no_gain\"" },
+    [C_ZIP_ENTROPY]     = { "codec_packets_total", "op=\"compress\",result=\"bypass_entropy\"" },
+    [C_ZIP_HISTORY]     = { "codec_packets_total", "op=\"compress\",result=\"bypass_history\"" },
+    [C_ZIP_IN_BYTES]    = { "codec_bytes_total", "op=\"compress\",side=\"in\"" },
+    [C_ZIP_OUT_BYTES]   = { "codec_bytes_total", "op=\"compress\",side=\"out\"" },
+    [C_UNZIP_PKTS]      = { "codec_packets_total", "op=\"decompress\",result=\"decompressed\"" },
+    [C_BUNDLE_TX]       = { "bundles_total", "path=\"net_send\"" },
+    [C_BUNDLE_TX_PKTS]  = { "bundled_packets_total", "path=\"net_send\"" },
+    [C_BUNDLE_RX]       = { "bundles_total", "path=\"net_recv\"" },
+    [C_BUNDLE_RX_PKTS]  = { "bundled_packets_total", "path=\"net_recv\"" },
+    [C_MSS_TX]          = { "mss_clamped_total", "path=\"net_send\"" },
+    [C_MSS_RX]          = { "mss_clamped_total", "path=\"net_recv\"" },
+    [C_L2_FLOOD]        = { "l2_frames_total", "action=\"flooded\"" },
+    [C_L2_SWITCHED]     = { "l2_frames_total", "action=\"switched\"" },
+    [C_L2_ARP]          = { "l2_frames_total", "action=\"arp_answered\"" },
+    [C_FEC_PARITY_TX]   = { "fec_packets_total", "kind=\"parity_sent\"" },
+    [C_FEC_REBUILT]     = { "fec_packets_total", "kind=\"rebuilt\"" },
+    [C_FEC_LATE]        = { "fec_packets_total", "kind=\"late\"" },
+    [C_FEC_LOST]        = { "fec_packets_total", "kind=\"unrecoverable\"" },
+    [C_BOND_REORDERED]  = { "bond_packets_total", "kind=\"reordered\"" },
+    [C_BOND_LATE]       = { "bond_packets_total", "kind=\"late\"" },
+    [C_BOND_MISSING]    = { "bond_packets_total", "kind=\"missing\"" },
+    [C_SCHED_TX + SCHED_REALTIME]      = { "sched_packets_total", "class=\"realtime\",kind=\"sent\"" },
+    [C_SCHED_TX + SCHED_INTERACTIVE]   = { "sched_packets_total", "class=\"interactive\",kind=\"sent\"" },
+    [C_SCHED_TX + SCHED_DEFAULT]       = { "sched_packets_total", "class=\"default\",kind=\"sent\"" },
+    [C_SCHED_TX + SCHED_BULK]          = { "sched_packets_total", "class=\"bulk\",kind=\"sent\"" },
+    [C_SCHED_DROP + SCHED_REALTIME]    = { "sched_packets_total", "class=\"realtime\",kind=\"dropped\"" },
+    [C_SCHED_DROP + SCHED_INTERACTIVE] = { "sched_packets_total", "class=\"interactive\",kind=\"dropped\"" },
+    [C_SCHED_DROP + SCHED_DEFAULT]     = { "sched_packets_total", "class=\"default\",kind=\"dropped\"" },
+    [C_SCHED_DROP + SCHED_BULK]        = { "sched_packets_total", "class=\"bulk\",kind=\"dropped\"" },
+    [C_PACE_TXTIME]     = { "pace_packets_total", "kind=\"timestamped\"" },
+    [C_PACE_HELD]       = { "pace_packets_total", "kind=\"held\"" },
+    [C_CAP_INNER]       = { "capture_packets_total", "layer=\"inner\"" },
+    [C_CAP_OUTER]       = { "capture_packets_total", "layer=\"outer\"" },
+    [C_DROP_NO_ROUTE]   = { "drops_total", "reason=\"no_route\"" },
+    [C_DROP_SOCK_FULL]  = { "drops_total", "reason=\"socket_full\"" },
+    [C_DROP_PACED]      = { "drops_total", "reason=\"rate_limit\"" },
+    [C_DROP_MALFORMED]  = { "drops_total", "reason=\"malformed\"" },
+    [C_DROP_NO_PEER]    = { "drops_total", "reason=\"unknown_session\"" },
+    [C_DROP_REPLAY]     = { "drops_total", "reason=\"replay\"" },
+    [C_DROP_AUTH]       = { "drops_total", "reason=\"auth\"" },
+    [C_DROP_RING_FULL]  = { "drops_total", "reason=\"ring_full\"" },
+    [C_DROP_POOL_EMPTY] = { "drops_total", "reason=\"pool_empty\"" },
+    [C_ERR_READ]        = { "errors_total", "syscall=\"read\"" },
+    [C_ERR_WRITE]       = { "errors_total", "syscall=\"write\"" },
+    [C_ERR_RECVMMSG]    = { "errors_total", "syscall=\"recvmmsg\"" },
+    [C_ERR_RECVMSG]     = { "errors_total", "syscall=\"recvmsg\"" },
+    [C_ERR_SENDMMSG]    = { "errors_total", "syscall=\"sendmmsg\"" },
+    [C_ERR_SENDMSG]     = { "errors_total", "syscall=\"sendmsg\"" },
+    [C_ERR_SENDTO]      = { "errors_total", "syscall=\"sendto\"" },
+};
+
+/* AEAD, off unless a key is given */
+const EVP_CIPHER *aead;
+uint8_t psk[AEAD_KEY_LEN];
+struct route my_routes[PEER_ROUTES_MAX];
+int my_nroutes;
+
+/* what we set up on tun ourselves, nothing when no flag asks for it */
+uint32_t link_ip;            /* -I address, host order */
+int link_plen = -1;          /* its prefix length, -1 for no address */
+int link_mtu, link_txqlen;   /* -M, -Q, 0 leaves the kernel's */
+struct route link_routes[LINK_ROUTES_MAX];   /* -R */
+int link_nroutes;
+
+/* AF_XDP underlay (-X), the UDP sockets carry whatever it cannot */
+char *xdp_ifname;
+int xdp_ifindex;
+uint8_t xdp_mac[6];
+uint32_t xdp_ip;            /* network order */
+int xdp_mtu;                /* longer frames take the socket, which fragments */
+struct neigh neighs[XDP_NEIGH_SLOTS];
+
+/**************************************************************************
+ * tun_alloc: allocates or reconnects to a tun/tap device. The caller     *
+ *            needs to reserve enough space in *dev.                      *
+ **************************************************************************/
+int tun_alloc(char *dev, int flags) {
+    
+    struct ifreq ifr;
+    int fd, err;
+    
+    if( (fd = open("/dev/net/tun", O_RDWR)) < 0 ) {
+        perror("Opening /dev/net/tun");
+        return fd;
+    }
+    
+    memset(&ifr, 0, sizeof(ifr));
+    
+    ifr.ifr_flags = flags;
+    
+    if (*dev) {
+        strncpy(ifr.ifr_name, dev, IFNAMSIZ);
+    }
+    
+    if( (err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0 ) {
+        perror("ioctl(TUNSETIFF)");
+        close(fd);
+        return err;
+    }
+    
+    /* with a virtio header the kernel can hand us TSO super-packets and
+     * leave TCP checksums to us */
+    if ((flags & IFF_VNET_HDR) &&
+        ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0) {
+        perror("ioctl(TUNSETOFFLOAD)");
+        close(fd);
+        return -1;
+    }
+    
+    strcpy(dev, ifr.ifr_name);
+    
+    return fd;
+}
+
+/**************************************************************************
+ * nl_attr: appends attribute type with len bytes of data to the          *
+ *          netlink message nh.                                           *
+ **************************************************************************/
+void nl_attr(struct nlmsghdr *nh, int type, const void *data, int len) {
+    
+    struct rtattr *rta = (struct rtattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+    
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/**************************************************************************
+ * nl_talk: sends request nh on rtnetlink socket fd and waits for its     *
+ *          ack. Returns 0, or -1 after saying what failed.               *
+ **************************************************************************/
+int nl_talk(int fd, struct nlmsghdr *nh, const char *what) {
+    
+    char ack[NL_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *reply = (struct nlmsghdr *)ack;
+    struct nlmsgerr *err;
+    static unsigned seq;
+    int n;
+    
+    nh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    nh->nlmsg_seq = ++seq;
+    if (send(fd, nh, nh->nlmsg_len, 0) < 0 || (n = recv(fd, ack, sizeof(ack), 0)) < 0) {
+        perror(what);
+        return -1;
+    }
+    if (!NLMSG_OK(reply, n) || reply->nlmsg_type != NLMSG_ERROR) {
+        fprintf(stderr, "%s: unexpected netlink reply\n", what);
+        return -1;
+    }
+    err = NLMSG_DATA(reply);
+    if (err->error < 0) {
+        fprintf(stderr, "%s: %s\n", what, strerror(-err->error));
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * link_up: sets MTU and txqueuelen of tun device dev, brings it up and   *
+ *          puts the -I address and -R routes on it, straight over        *
+ *          rtnetlink. Replaces what a previous run left, so a restart    *
+ *          forwards again at once. Returns -1 if any step failed.        *
+ **************************************************************************/
+int link_up(const char *dev) {
+    
+    char buf[NL_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    struct rtmsg *rtm = NLMSG_DATA(nh);
+    struct ifreq ifr;
+    uint32_t a;
+    int fd, ifindex, i, ret = -1;
+    
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        perror("rtnetlink socket");
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+        perror(dev);
+        goto out;
+    }
+    ifindex = ifr.ifr_ifindex;
+    
+    /* the link first, a route needs its device up */
+    memset(buf, 0, sizeof(buf));
+    nh->nlmsg_len = NLMSG_LENGTH(sizeof(*ifi));
+    nh->nlmsg_type = RTM_NEWLINK;
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_index = ifindex;
+    ifi->ifi_flags = IFF_UP;
+    ifi->ifi_change = IFF_UP;
+    if (link_mtu)
+        nl_attr(nh, IFLA_MTU, &link_mtu, sizeof(link_mtu));
+    if (link_txqlen)
+        nl_attr(nh, IFLA_TXQLEN, &link_txqlen, sizeof(link_txqlen));
+    if (nl_talk(fd, nh, "Setting up the tun link") < 0)
+        goto out;
+    
+    if (link_plen >= 0) {
+        memset(buf, 0, sizeof(buf));
+        nh->nlmsg_len = NLMSG_LENGTH(sizeof(*ifa));
+        nh->nlmsg_type = RTM_NEWADDR;
+        nh->nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+        ifa->ifa_family = AF_INET;
+        ifa->ifa_prefixlen = link_plen;
+        ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+        ifa->ifa_index = ifindex;
+        a = htonl(link_ip);
+        nl_attr(nh, IFA_LOCAL, &a, sizeof(a));
+        nl_attr(nh, IFA_ADDRESS, &a, sizeof(a));
+        if (nl_talk(fd, nh, "Adding the tun address") < 0)
+            goto out;
+    }
+    
+    for (i = 0; i < link_nroutes; i++) {
+        memset(buf, 0, sizeof(buf));
+        nh->nlmsg_len = NLMSG_LENGTH(sizeof(*rtm));
+        nh->nlmsg_type = RTM_NEWROUTE;
+        nh->nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+        rtm->rtm_family = AF_INET;
+        rtm->rtm_dst_len = link_routes[i].len;
+        rtm->rtm_table = RT_TABLE_MAIN;
+        rtm->rtm_protocol = RTPROT_STATIC;
+        rtm->rtm_scope = RT_SCOPE_LINK;
+        rtm->rtm_type = RTN_UNICAST;
+        a = htonl(link_routes[i].prefix);
+        nl_attr(nh, RTA_DST, &a, sizeof(a));
+        nl_attr(nh, RTA_OIF, &ifindex, sizeof(ifindex));
+        if (nl_talk(fd, nh, "Adding a tun route") < 0)
+            goto out;
+    }
+    ret = 0;
+out:
+    close(fd);
+    return ret;
+}
+
+/**************************************************************************
+ * route_get: the interface the kernel's route to addr leaves by into     *
+ *            *oif and, where they are not NULL, the source address it    *
+ *            picks into *src and its gateway into *via (left alone if    *
+ *            addr is on link). -1 when there is no route.                *
+ **************************************************************************/
+int route_get(const struct sockaddr_in *addr, int *oif, uint32_t *src, uint32_t *via) {
+    
+    char buf[NL_DUMP_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+    struct rtmsg *rtm = NLMSG_DATA(nh);
+    struct rtattr *rta;
+    int fd, n, len;
+    
+    *oif = 0;
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+        return -1;
+    memset(buf, 0, NL_BUFSIZE);
+    nh->nlmsg_len = NLMSG_LENGTH(sizeof(*rtm));
+    nh->nlmsg_type = RTM_GETROUTE;
+    nh->nlmsg_flags = NLM_F_REQUEST;
+    rtm->rtm_family = AF_INET;
+    rtm->rtm_dst_len = 32;
+    nl_attr(nh, RTA_DST, &addr->sin_addr, sizeof(addr->sin_addr));
+    if (send(fd, nh, nh->nlmsg_len, 0) >= 0 && (n = recv(fd, buf, sizeof(buf), 0)) >= 0 &&
+        NLMSG_OK(nh, n) && nh->nlmsg_type == RTM_NEWROUTE) {
+        len = RTM_PAYLOAD(nh);
+        for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+            if (rta->rta_type == RTA_OIF)
+                memcpy(oif, RTA_DATA(rta), sizeof(*oif));
+            else if (rta->rta_type == RTA_PREFSRC && src)
+                memcpy(src, RTA_DATA(rta), sizeof(*src));
+            else if (rta->rta_type == RTA_GATEWAY && via)
+                memcpy(via, RTA_DATA(rta), sizeof(*via));
+    }
+    close(fd);
+    return *oif ? 0 : -1;
+}
+
+/**************************************************************************
+ * pace_fq: whether the route to addr leaves by an interface with an fq   *
+ *          qdisc, which keeps SO_TXTIME departure times. Asks rtnetlink  *
+ *          for the route, then for the qdiscs of its interface. 0 when   *
+ *          there is none or we cannot tell.                              *
+ **************************************************************************/
+int pace_fq(const struct sockaddr_in *addr) {
+    
+    char buf[NL_DUMP_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+    struct tcmsg *tcm = NLMSG_DATA(nh);
+    struct rtattr *rta;
+    int fd, n, len, oif, found = 0, done = 0;
+    
+    if (route_get(addr, &oif, NULL, NULL) < 0 || (fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+        return 0;
+    
+    /* fq at the root or under mq, any of them means the route's queue keeps the times */
+    memset(buf, 0, NL_BUFSIZE);
+    nh->nlmsg_len = NLMSG_LENGTH(sizeof(*tcm));
+    nh->nlmsg_type = RTM_GETQDISC;
+    nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    tcm->tcm_family = AF_UNSPEC;
+    if (send(fd, nh, nh->nlmsg_len, 0) < 0)
+        goto out;
+    while (!done && (n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+                done = 1;
+                break;
+            }
+            tcm = NLMSG_DATA(nh);
+            if (nh->nlmsg_type != RTM_NEWQDISC || tcm->tcm_ifindex != oif)
+                continue;
+            len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*tcm));
+            for (rta = (struct rtattr *)((char *)tcm + NLMSG_ALIGN(sizeof(*tcm))); RTA_OK(rta, len);
+                 rta = RTA_NEXT(rta, len))
+                if (rta->rta_type == TCA_KIND && strcmp(RTA_DATA(rta), "fq") == 0)
+                    found = 1;
+        }
+out:
+    close(fd);
+    return found;
+}
+
+/**************************************************************************
+ * counters_self: the calling thread's counter block, made on first use.  *
+ **************************************************************************/
+struct counters *counters_self(void) {
+    
+    struct counters *c;
+    
+    if (my_counters)
+        return my_counters;
+    if ((c = aligned_alloc(_Alignof(struct counters), sizeof(*c))) == NULL) {
+        perror("counters_self");
+        exit(1);
+    }
+    memset(c, 0, sizeof(*c));
+    c->worker = -1;
+    c->stage = "io";
+    pthread_mutex_lock(&counters_lock);
+    if (ncounter_blocks < COUNTERS_MAX)
+        counter_blocks[ncounter_blocks++] = c;
+    pthread_mutex_unlock(&counters_lock);
+    return my_counters = c;
+}
+
+/**************************************************************************
+ * counters_label: names the calling thread's counters after the worker   *
+ *                 and stage it runs, what the stats endpoint shows.      *
+ **************************************************************************/
+void counters_label(int worker, const char *stage) {
+    
+    struct counters *c = counters_self();
+    
+    pthread_mutex_lock(&counters_lock);
+    c->worker = worker;
+    c->stage = stage;
+    pthread_mutex_unlock(&counters_lock);
+}
+
+/**************************************************************************
+ * count: adds n to counter c of the calling thread. A plain load and     *
+ *        store, the thread is the only writer.                           *
+ **************************************************************************/
+void count(enum counter c, unsigned long n) {
+    
+    struct counters *s = counters_self();
+    
+    atomic_store_explicit(&s->v[c], atomic_load_explicit(&s->v[c], memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/**************************************************************************
+ * hist_bucket: the histogram bucket of a value of nsec.                  *
+ **************************************************************************/
+int hist_bucket(uint64_t nsec) {
+    
+    int top, b;
+    
+    if (nsec < HIST_SUB)
+        return nsec;
+    top = 63 - __builtin_clzll(nsec);
+    b = (top - HIST_SUB_BITS + 1) * HIST_SUB + ((nsec >> (top - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/**************************************************************************
+ * hist_value: the middle of what bucket b holds, inverse of hist_bucket. *
+ **************************************************************************/
+uint64_t hist_value(int b) {
+    
+    int shift;
+    
+    if (b < HIST_SUB)
+        return b;
+    shift = b / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB) << shift) + ((1ULL << shift) >> 1);
+}
+
+/**************************************************************************
+ * hist_sample: whether the calling thread times its next batch, one in   *
+ *              hist_every.                                               *
+ **************************************************************************/
+int hist_sample(void) {
+    
+    struct counters *c = counters_self();
+    
+    if (hist_every == 0 || ++c->hist_tick < hist_every)
+        return 0;
+    c->hist_tick = 0;
+    return 1;
+}
+
+/**************************************************************************
+ * hist_add: records a latency of nsec in histogram h of the calling      *
+ *           thread, single writer like count.                            *
+ **************************************************************************/
+void hist_add(enum hist_id h, uint64_t nsec) {
+    
+    struct hist *s = &counters_self()->hist[h];
+    int b = hist_bucket(nsec);
+    
+    atomic_store_explicit(&s->buckets[b], atomic_load_explicit(&s->buckets[b], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&s->count, atomic_load_explicit(&s->count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&s->sum, atomic_load_explicit(&s->sum, memory_order_relaxed) + nsec,
+                          memory_order_relaxed);
+}
+
+/**************************************************************************
+ * hist_quantile: the value below which a fraction q of the count samples *
+ *                in buckets fall.                                        *
+ **************************************************************************/
+uint64_t hist_quantile(const unsigned long *buckets, unsigned long count, double q) {
+    
+    unsigned long seen = 0, rank = q * count + 0.5;
+    int b;
+    
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < HIST_BUCKETS; b++)
+        if ((seen += buckets[b]) >= rank)
+            return hist_value(b);
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+/**************************************************************************
+ * wire_encap: fills in the wire header at the start of frame. The        *
+ *             payload must already sit right behind the header. Returns  *
+ *             the number of bytes to put on the wire.                    *
+ **************************************************************************/
+int wire_encap(char *frame, uint8_t type, int len, uint32_t session, uint64_t seq) {
+    
+    struct wire_hdr *hdr = (struct wire_hdr *)frame;
+    
+    hdr->version = WIRE_VERSION << 4;
+    hdr->type = type;
+    hdr->length = htons(len);
+    hdr->session = htonl(session);
+    hdr->seq = htobe64(seq);
+    
+    return WIRE_HDR_LEN + len;
+}
+
+/**************************************************************************
+ * wire_decap: checks the wire header of a received datagram of n bytes.  *
+ *             Returns the payload length, or -1 when the datagram is     *
+ *             truncated or speaks another version.                       *
+ **************************************************************************/
+int wire_decap(char *frame, int n, struct wire_hdr **hdrp) {
+    
+    struct wire_hdr *hdr = (struct wire_hdr *)frame;
+    int len;
+    
+    if (n < WIRE_HDR_LEN || (hdr->version >> 4) != WIRE_VERSION ||
+        (hdr->version & 0x0f & ~(WIRE_F_SEALED | WIRE_F_COMPRESSED))) {
+        count(C_DROP_MALFORMED, 1);
+        return -1;
+    }
+    
+    len = ntohs(hdr->length);
+    if (len > n - WIRE_HDR_LEN) {
+        count(C_DROP_MALFORMED, 1);
+        return -1;
+    }
+    
+    *hdrp = hdr;
+    return len;
+}
+
+
+/**************************************************************************
+ * pool_init: maps nbufs packet buffers, from 2 MB hugepages if the       *
+ *            system has some reserved, else from normal pages with a     *
+ *            transparent hugepage hint, all faulted in up front.         *
+ **************************************************************************/
+void pool_init(int nbufs) {
+    
+    int i;
+    
+    pool.size = ((size_t)nbufs * BUFSIZE + HUGEPAGE_SIZE - 1) & ~((size_t)HUGEPAGE_SIZE - 1);
+    pool.nbufs = pool.size / BUFSIZE;
+    pool.base = mmap(NULL, pool.size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    pool.huge = pool.base != MAP_FAILED;
+    if (!pool.huge) {
+        if ((pool.base = mmap(NULL, pool.size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+            perror("mmap pool");
+            exit(1);
+        }
+        madvise(pool.base, pool.size, MADV_HUGEPAGE);
+        memset(pool.base, 0, pool.size);
+    }
+    
+    if ((pool.free = malloc(pool.nbufs * sizeof(*pool.free))) == NULL) {
+        perror("pool_init");
+        exit(1);
+    }
+    for (i = 0; i < pool.nbufs; i++)
+        pool.free[i] = pool.base + (size_t)(pool.nbufs - 1 - i) * BUFSIZE;
+    pool.nfree = pool.nbufs;
+    pthread_mutex_init(&pool.lock, NULL);
+    
+    printf("Buffer pool: %d buffers, %zu MB on %s pages\n", pool.nbufs, pool.size >> 20,
+           pool.huge ? "huge" : "normal");
+}
+
+/**************************************************************************
+ * pool_cache_self: the calling thread's cache, made on first use.        *
+ **************************************************************************/
+struct pool_cache *pool_cache_self(void) {
+    
+    if (my_cache)
+        return my_cache;
+    if ((my_cache = calloc(1, sizeof(*my_cache))) == NULL) {
+        perror("pool_cache_self");
+        exit(1);
+    }
+    pthread_mutex_lock(&pool.lock);
+    if (pool.ncaches < POOL_THREADS_MAX)
+        pool.caches[pool.ncaches++] = my_cache;
+    pthread_mutex_unlock(&pool.lock);
+    return my_cache;
+}
+
+/**************************************************************************
+ * pool_get: a free packet buffer, or NULL when the pool is exhausted.    *
+ **************************************************************************/
+char *pool_get(void) {
+    
+    struct pool_cache *c = pool_cache_self();
+    int n;
+    
+    if (c->n == 0) {
+        pthread_mutex_lock(&pool.lock);
+        n = pool.nfree < POOL_BULK ? pool.nfree : POOL_BULK;
+        pool.nfree -= n;
+        memcpy(c->bufs, pool.free + pool.nfree, n * sizeof(char *));
+        pthread_mutex_unlock(&pool.lock);
+        if ((c->n = n) == 0) {
+            atomic_store_explicit(&c->empty, c->empty + 1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+    atomic_store_explicit(&c->gets, c->gets + 1, memory_order_relaxed);
+    return c->bufs[--c->n];
+}
+
+/**************************************************************************
+ * pool_put: gives back a buffer from pool_get.                           *
+ **************************************************************************/
+void pool_put(char *buf) {
+    
+    struct pool_cache *c = pool_cache_self();
+    
+    if (c->n == POOL_CACHE) {
+        pthread_mutex_lock(&pool.lock);
+        c->n -= POOL_BULK;
+        memcpy(pool.free + pool.nfree, c->bufs + c->n, POOL_BULK * sizeof(char *));
+        pool.nfree += POOL_BULK;
+        pthread_mutex_unlock(&pool.lock);
+    }
+    atomic_store_explicit(&c->puts, c->puts + 1, memory_order_relaxed);
+    c->bufs[c->n++] = buf;
+}
+
+/**************************************************************************
+ * pool_report: prints how many buffers are out and how often a get found *
+ *              the pool empty.                                           *
+ **************************************************************************/
+void pool_report(void) {
+    
+    unsigned long gets = 0, puts = 0, empty = 0;
+    int i, nfree;
+    
+    pthread_mutex_lock(&pool.lock);
+    nfree = pool.nfree;
+    for (i = 0; i < pool.ncaches; i++) {
+        gets += atomic_load_explicit(&pool.caches[i]->gets, memory_order_relaxed);
+        puts += atomic_load_explicit(&pool.caches[i]->puts, memory_order_relaxed);
+        empty += atomic_load_explicit(&pool.caches[i]->empty, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    
+    printf("Buffer pool: %lu of %d in use, %d in the shared pool, exhausted %lu times\n",
+           gets - puts, pool.nbufs, nfree, empty);
+}
+
+/**************************************************************************
+ * counters_sum: adds up counter c over all threads.                      *
+ **************************************************************************/
+unsigned long counters_sum(enum counter c) {
+    
+    unsigned long sum = 0;
+    int i;
+    
+    pthread_mutex_lock(&counters_lock);
+    for (i = 0; i < ncounter_blocks; i++)
+        sum += atomic_load_explicit(&counter_blocks[i]->v[c], memory_order_relaxed);
+    pthread_mutex_unlock(&counters_lock);
+    return sum;
+}
+
+/**************************************************************************
+ * hist_merge: adds histogram h into buckets, count and sum.              *
+ **************************************************************************/
+void hist_merge(struct hist *h, unsigned long *buckets, unsigned long *count, unsigned long *sum) {
+    
+    int b;
+    
+    *count += atomic_load_explicit(&h->count, memory_order_relaxed);
+    *sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+    for (b = 0; b < HIST_BUCKETS; b++)
+        buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+}
+
+/**************************************************************************
+ * counters_report: prints the totals of all threads, and the latencies   *
+ *                  of all threads' samples taken together.               *
+ **************************************************************************/
+void counters_report(void) {
+    
+    static const int path[2] = { H_TUN_NET, H_NET_TUN };
+    static const char *name[2] = { "tun -> net", "net -> tun" };
+    unsigned long drops = 0, errors = 0, buckets[HIST_BUCKETS], n, sum;
+    int c, i;
+    
+    for (c = C_DROP_NO_ROUTE; c <= C_DROP_POOL_EMPTY; c++)
+        drops += counters_sum(c);
+    for (c = C_ERR_READ; c < COUNTERS; c++)
+        errors += counters_sum(c);
+    printf("Counters: tun -> net %lu pkts %lu bytes, net -> tun %lu pkts %lu bytes, %lu dropped, %lu errors\n",
+           counters_sum(C_TUN_RX_PKTS), counters_sum(C_NET_TX_BYTES),
+           counters_sum(C_NET_RX_PKTS), counters_sum(C_TUN_TX_BYTES), drops, errors);
+    if ((n = counters_sum(C_ZIP_IN_BYTES)) > 0)
+        printf("Compression: %lu pkts compressed, %lu in vain, %lu bypassed, %lu -> %lu bytes (%.1f%%)\n",
+               counters_sum(C_ZIP_PKTS), counters_sum(C_ZIP_NO_GAIN),
+               counters_sum(C_ZIP_ENTROPY) + counters_sum(C_ZIP_HISTORY), n, counters_sum(C_ZIP_OUT_BYTES),
+               100.0 * counters_sum(C_ZIP_OUT_BYTES) / n);
+    
+    for (c = 0; c < 2; c++) {
+        memset(buckets, 0, sizeof(buckets));
+        n = sum = 0;
+        pthread_mutex_lock(&counters_lock);
+        for (i = 0; i < ncounter_blocks; i++)
+            hist_merge(&counter_blocks[i]->hist[path[c]], buckets, &n, &sum);
+        pthread_mutex_unlock(&counters_lock);
+        if (n > 0)
+            printf("Latency: %s %lu samples, p50 %.1f us, p99 %.1f us, p999 %.1f us\n", name[c], n,
+                   hist_quantile(buckets, n, 0.5) / 1e3, hist_quantile(buckets, n, 0.99) / 1e3,
+                   hist_quantile(buckets, n, 0.999) / 1e3);
+    }
+}
+
+/**************************************************************************
+ * stats_write: the Prometheus text exposition of all counters and        *
+ *              latency summaries, one series per thread, plus pool and   *
+ *              peer gauges.                                              *
+ **************************************************************************/
+void stats_write(FILE *f) {
+    
+    static const char *help[][2] = {
+        { "packets_total", "Packets and frames moved, by path." },
+        { "bytes_total", "Bytes moved, by path; frames count with their header and tag." },
+        { "drops_total", "Packets and frames dropped, by reason." },
+        { "errors_total", "Failed syscalls on the data path, by syscall." },
+        { "codec_packets_total", "Packets offered to the compressor (-z) by outcome, and packets decompressed." },
+        { "codec_bytes_total", "Bytes of the packets the compressor ran on, before and after; out over in is the ratio." },
+        { "bundles_total", "Frames carrying several small packets (-A), sent and received." },
+        { "bundled_packets_total", "Packets that went in such frames." },
+        { "mss_clamped_total", "TCP SYNs whose MSS option was lowered to fit the path MTU, by direction." },
+        { "l2_frames_total", "TAP bridging (-a): Ethernet frames flooded, switched between peers, ARP requests answered in place." },
+        { "fec_packets_total", "Forward error correction (-F): parity sent, lost packets rebuilt, originals that came after, packets no parity could rebuild." },
+        { "bond_packets_total", "Multipath bonding (-U): striped packets held until those before them came, packets that came after their wait ran out, gaps given up on." },
+        { "sched_packets_total", "Egress scheduling (-C): packets sent and dropped on a full queue, by class." },
+        { "pace_packets_total", "Egress pacing (-r): frames given their departure time for fq to keep, frames the timer wheel held." },
+        { "capture_packets_total", "Packet capture (-Y): records written to the ring, by layer." },
+    };
+    static const char *hist_help[][2] = {
+        { "latency_seconds", "Time sampled packets spend in the process, from their read to their send or write." },
+        { "step_seconds", "Time sampled batches spend in each step of the way." },
+        { "codec_seconds", "Time sampled packets spend in the compressor or decompressor." },
+    };
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    unsigned long gets = 0, puts = 0, empty = 0, buckets[HIST_BUCKETS], n, sum;
+    struct counters *c;
+    int h, i, k, q, nfree;
+    
+    pthread_mutex_lock(&counters_lock);
+    for (h = 0; h < (int)(sizeof(help) / sizeof(help[0])); h++) {
+        fprintf(f, "# HELP udptunnel_%s %s\n# TYPE udptunnel_%s counter\n", help[h][0], help[h][1], help[h][0]);
+        for (k = 0; k < COUNTERS; k++) {
+            if (strcmp(counter_names[k].metric, help[h][0]) != 0)
+                continue;
+            for (i = 0; i < ncounter_blocks; i++) {
+                c = counter_blocks[i];
+                fprintf(f, "udptunnel_%s{worker=\"%d\",stage=\"%s\",%s} %lu\n", help[h][0], c->worker,
+                        c->stage, counter_names[k].label, atomic_load_explicit(&c->v[k], memory_order_relaxed));
+            }
+        }
+    }
+    for (h = 0; h < (int)(sizeof(hist_help) / sizeof(hist_help[0])); h++) {
+        fprintf(f, "# HELP udptunnel_%s %s\n# TYPE udptunnel_%s summary\n", hist_help[h][0], hist_help[h][1],
+                hist_help[h][0]);
+        for (k = 0; k < HISTS; k++) {
+            if (strcmp(hist_names[k].metric, hist_help[h][0]) != 0)
+                continue;
+            for (i = 0; i < ncounter_blocks; i++) {
+                c = counter_blocks[i];
+                memset(buckets, 0, sizeof(buckets));
+                n = sum = 0;
+                hist_merge(&c->hist[k], buckets, &n, &sum);
+                /* a stage that does not take this step has nothing to show */
+                if (n == 0)
+                    continue;
+                for (q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++)
+                    fprintf(f, "udptunnel_%s{worker=\"%d\",stage=\"%s\",%s,quantile=\"%g\"} %.9f\n",
+                            hist_help[h][0], c->worker, c->stage, hist_names[k].label, quantiles[q],
+                            hist_quantile(buckets, n, quantiles[q]) / 1e9);
+                fprintf(f, "udptunnel_%s_sum{worker=\"%d\",stage=\"%s\",%s} %.9f\n", hist_help[h][0],
+                        c->worker, c->stage, hist_names[k].label, sum / 1e9);
+                fprintf(f, "udptunnel_%s_count{worker=\"%d\",stage=\"%s\",%s} %lu\n", hist_help[h][0],
+                        c->worker, c->stage, hist_names[k].label, n);
+            }
+        }
+    }
+    pthread_mutex_unlock(&counters_lock);
+    
+    pthread_mutex_lock(&pool.lock);
+    nfree = pool.nfree;
+    for (i = 0; i < pool.ncaches; i++) {
+        gets += atomic_load_explicit(&pool.caches[i]->gets, memory_order_relaxed);
+        puts += atomic_load_explicit(&pool.caches[i]->puts, memory_order_relaxed);
+        empty += atomic_load_explicit(&pool.caches[i]->empty, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    fprintf(f, "# HELP udptunnel_pool_buffers Packet buffers in the pool.\n# TYPE udptunnel_pool_buffers gauge\n"
+               "udptunnel_pool_buffers %d\n", pool.nbufs);
+    fprintf(f, "# HELP udptunnel_pool_in_use Packet buffers taken from the pool.\n# TYPE udptunnel_pool_in_use gauge\n"
+               "udptunnel_pool_in_use %lu\n", gets - puts);
+    fprintf(f, "# HELP udptunnel_pool_shared Packet buffers in the shared free stack.\n# TYPE udptunnel_pool_shared gauge\n"
+               "udptunnel_pool_shared %d\n", nfree);
+    fprintf(f, "# HELP udptunnel_pool_exhausted_total Gets that found the pool empty.\n"
+               "# TYPE udptunnel_pool_exhausted_total counter\nudptunnel_pool_exhausted_total %lu\n", empty);
+    fprintf(f, "# HELP udptunnel_peers Peers known.\n# TYPE udptunnel_peers gauge\nudptunnel_peers %d\n",
+            atomic_load(&npeers));
+    fprintf(f, "# HELP udptunnel_path_mtu_bytes Largest datagram the path to a peer carried, once probed.\n"
+               "# TYPE udptunnel_path_mtu_bytes gauge\n");
+    for (i = 0; i < PEERS_MAX; i++)
+        if (peers[i].in_use && (k = atomic_load(&peers[i].pmtu)) > 0)
+            fprintf(f, "udptunnel_path_mtu_bytes{peer=\"%d\"} %d\n", i, k);
+    if (kf_peers) {
+        fprintf(f, "# HELP udptunnel_kernel_packets_total Packets the kernel fast path (-K) forwarded for a peer, by direction.\n"
+                   "# TYPE udptunnel_kernel_packets_total counter\n");
+        for (i = 0; i < PEERS_MAX; i++)
+            if (peers[i].in_use)
+                fprintf(f, "udptunnel_kernel_packets_total{peer=\"%d\",dir=\"tx\"} %lu\n"
+                           "udptunnel_kernel_packets_total{peer=\"%d\",dir=\"rx\"} %lu\n",
+                        i, (unsigned long)atomic_load(&kf_peers[i].tx_pkts), i, (unsigned long)atomic_load(&kf_peers[i].rx_pkts));
+        fprintf(f, "# HELP udptunnel_kernel_bytes_total Bytes of those packets, without the tunnel's headers.\n"
+                   "# TYPE udptunnel_kernel_bytes_total counter\n");
+        for (i = 0; i < PEERS_MAX; i++)
+            if (peers[i].in_use)
+                fprintf(f, "udptunnel_kernel_bytes_total{peer=\"%d\",dir=\"tx\"} %lu\n"
+                           "udptunnel_kernel_bytes_total{peer=\"%d\",dir=\"rx\"} %lu\n",
+                        i, (unsigned long)atomic_load(&kf_peers[i].tx_bytes), i, (unsigned long)atomic_load(&kf_peers[i].rx_bytes));
+    }
+    if (!pace_bps)
+        return;
+    fprintf(f, "# HELP udptunnel_pace_rate_bits Rate data to a peer is paced to (-r), in bits per second.\n"
+               "# TYPE udptunnel_pace_rate_bits gauge\n");
+    for (i = 0; i < PEERS_MAX; i++)
+        if (peers[i].in_use)
+            fprintf(f, "udptunnel_pace_rate_bits{peer=\"%d\"} %lu\n", i,
+                    (unsigned long)atomic_load_explicit(&peers[i].pace_rate, memory_order_relaxed));
+    fprintf(f, "# HELP udptunnel_pace_rtt_seconds RTT of a peer as -r auto probes it, smoothed and the least of late.\n"
+               "# TYPE udptunnel_pace_rtt_seconds gauge\n");
+    for (i = 0; i < PEERS_MAX; i++)
+        if (peers[i].in_use && (k = atomic_load(&peers[i].pace_srtt)) > 0)
+            fprintf(f, "udptunnel_pace_rtt_seconds{peer=\"%d\",kind=\"smoothed\"} %.6f\n"
+                       "udptunnel_pace_rtt_seconds{peer=\"%d\",kind=\"base\"} %.6f\n",
+                    i, k / 1e6, i, atomic_load(&peers[i].pace_min) / 1e6);
+}
+
+/**************************************************************************
+ * stats_main: serves the stats endpoint. Each connection gets one HTTP   *
+ *             response with the current counters and is closed, so       *
+ *             curl --unix-socket, or a scrape proxy, can read it; a      *
+ *             client that sends no request gets it after a second. The   *
+ *             text is put together in memory first: a scraper that does  *
+ *             not read holds up nobody but this thread, and that for a   *
+ *             second at most.                                            *
+ **************************************************************************/
+void *stats_main(void *arg) {
+    
+    struct timeval tv = { .tv_sec = 1 };
+    int fd = *(int *)arg, conn;
+    char req[1024], *text;
+    size_t len, off;
+    ssize_t n;
+    FILE *f;
+    
+    for (;;) {
+        if ((conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("accept stats");
+            continue;
+        }
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if ((read(conn, req, sizeof(req)) < 0 && errno != EAGAIN) || (f = open_memstream(&text, &len)) == NULL) {
+            close(conn);
+            continue;
+        }
+        fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        stats_write(f);
+        if (fclose(f) == 0)
+            for (off = 0; off < len && (n = send(conn, text + off, len - off, MSG_NOSIGNAL)) > 0; off += n)
+                ;
+        free(text);
+        close(conn);
+    }
+    return NULL;
+}
+
+/**************************************************************************
+ * stats_init: listens on the Unix socket at path and starts the thread   *
+ *             serving it. A stale socket file is replaced.               *
+ **************************************************************************/
+void stats_init(const char *path) {
+    
+    static int fd;
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    pthread_t thread;
+    
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, 16) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if ((errno = pthread_create(&thread, NULL, stats_main, &fd)) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+    printf("Stats on %s\n", path);
+}
+
+/**************************************************************************
+ * batch_alloc: allocates a batch of size frames, exits on failure.       *
+ **************************************************************************/
+struct batch *batch_alloc(int size) {
+    
+    struct batch *b;
+    
+    char *buf;
+    int i;
+    
+    if ((b = calloc(1, sizeof(*b))) == NULL ||
+        (b->buf = calloc(size, sizeof(*b->buf))) == NULL ||
+        (b->msgs = calloc(size, sizeof(*b->msgs))) == NULL ||
+        (b->iovs = calloc(size, sizeof(*b->iovs))) == NULL ||
+        (b->addrs = calloc(size, sizeof(*b->addrs))) == NULL) {
+        perror("batch_alloc");
+        exit(1);
+    }
+    for (i = 0; i < size; i++) {
+        if ((buf = pool_get()) == NULL) {
+            fprintf(stderr, "batch_alloc: buffer pool exhausted\n");
+            exit(1);
+        }
+        b->buf[i] = PKT_FRAME(buf);
+    }
+    b->size = size;
+    
+    return b;
+}
+
+/**************************************************************************
+ * now_nsec: monotonic clock in nanoseconds, for sampled timings.         *
+ **************************************************************************/
+uint64_t now_nsec(void) {
+    
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**************************************************************************
+ * now_sec: monotonic clock in seconds, for coarse housekeeping.          *
+ **************************************************************************/
+time_t now_sec(void) {
+    
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**************************************************************************
+ * set_nonblock: puts fd in non-blocking mode, exits on failure.          *
+ **************************************************************************/
+void set_nonblock(int fd) {
+    
+    int fl;
+    
+    if ((fl = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        perror("fcntl(O_NONBLOCK)");
+        exit(1);
+    }
+}
+
+/**************************************************************************
+ * sock_tune: sizes the buffers of UDP socket fd and, in the latency      *
+ *            profile, has the kernel busy poll the device queue for it   *
+ *            rather than wait for an interrupt. Says once what it could  *
+ *            not set, then carries on.                                   *
+ **************************************************************************/
+void sock_tune(int fd) {
+    
+    static int warned;
+    int one = 1, budget = BUSY_POLL_BUDGET, fail = 0;
+    
+    /* past rmem_max and wmem_max when we may, as far as they go when not */
+    if (sockbuf > 0) {
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &sockbuf, sizeof(sockbuf)) < 0)
+            fail |= setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sockbuf, sizeof(sockbuf));
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &sockbuf, sizeof(sockbuf)) < 0)
+            fail |= setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(sockbuf));
+    }
+    if (profile == PROFILE_LATENCY)
+        fail |= setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &spin_usec, sizeof(spin_usec)) |
+                setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) |
+                setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget));
+    if (fail && !warned++)
+        perror("Tuning the UDP socket");
+}
+
+/**************************************************************************
+ * uplinks_parse: parses the -U list, comma separated source addresses    *
+ *                or interface names, into uplinks. Returns -1 if one     *
+ *                is malformed or there are more than UPLINKS_MAX.        *
+ **************************************************************************/
+int uplinks_parse(char *s) {
+    
+    char *name;
+    
+    for (name = strtok(s, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (nuplinks == UPLINKS_MAX || strlen(name) >= IFNAMSIZ)
+            return -1;
+        strcpy(uplinks[nuplinks].name, name);
+        uplinks[nuplinks].by_dev = inet_aton(name, &uplinks[nuplinks].ip) == 0;
+        nuplinks++;
+    }
+    return nuplinks ? 0 : -1;
+}
+
+/**************************************************************************
+ * sched_parse: parses a -C list into sched_rules: "dscp" adds none,      *
+ *              the DSCP classes are what is left after the rules;        *
+ *              a rule is proto[:port[-port]]=class, proto tcp, udp or    *
+ *              icmp, class one of sched_names. Returns -1 if one is      *
+ *              malformed or there are more than SCHED_RULES_MAX.         *
+ **************************************************************************/
+int sched_parse(char *s) {
+    
+    struct sched_rule *r;
+    char *rule, *eq, *colon, *end;
+    long lo, hi;
+    int c;
+    
+    for (rule = strtok(s, ","); rule != NULL; rule = strtok(NULL, ",")) {
+        if (strcmp(rule, "dscp") == 0)
+            continue;
+        if (nsched_rules == SCHED_RULES_MAX || (eq = strchr(rule, '=')) == NULL)
+            return -1;
+        *eq++ = '\0';
+        for (c = 0; c < SCHED_CLASSES && strcmp(eq, sched_names[c]) != 0; c++)
+            ;
+        if (c == SCHED_CLASSES)
+            return -1;
+        lo = 0;
+        hi = 0xffff;
+        if ((colon = strchr(rule, ':')) != NULL) {
+            *colon++ = '\0';
+            lo = hi = strtol(colon, &end, 10);
+            if (end != colon && *end == '-')
+                hi = strtol(colon = end + 1, &end, 10);
+            if (end == colon || *end != '\0' || lo < 0 || hi < lo || hi > 0xffff)
+                return -1;
+        }
+        r = &sched_rules[nsched_rules];
+        if (strcmp(rule, "tcp") == 0)
+            r->proto = IPPROTO_TCP;
+        else if (strcmp(rule, "udp") == 0)
+            r->proto = IPPROTO_UDP;
+        else if (strcmp(rule, "icmp") == 0 && colon == NULL)
+            r->proto = IPPROTO_ICMP;
+        else
+            return -1;
+        r->cls = c;
+        r->lo = lo;
+        r->hi = hi;
+        nsched_rules++;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * rate_parse: parses the -r rate, bits per second with an optional k, m  *
+ *             or g and "/auto" to have it follow the path, into pace_bps *
+ *             and pace_auto. Returns -1 if malformed or under            *
+ *             PACE_RATE_MIN.                                             *
+ **************************************************************************/
+int rate_parse(char *s) {
+    
+    char *end, *slash, *unit;
+    uint64_t bps;
+    int n;
+    
+    if ((slash = strchr(s, '/')) != NULL) {
+        if (strcmp(slash + 1, "auto") != 0)
+            return -1;
+        *slash = '\0';
+        pace_auto = 1;
+    }
+    bps = strtoull(s, &end, 10);
+    if (end == s)
+        return -1;
+    /* the units are decimal, as link speeds go */
+    if (*end != '\0' && (unit = strchr("kmg", *end)) != NULL) {
+        for (n = unit - "kmg"; n >= 0; n--)
+            bps *= 1000;
+        end++;
+    }
+    if (*end != '\0' || bps < PACE_RATE_MIN)
+        return -1;
+    pace_bps = bps;
+    return 0;
+}
+
+/**************************************************************************
+ * cap_parse: parses a -y filter into capf, comma separated: peer=<id>,   *
+ *            proto=tcp|udp|icmp|<n>, len=<lo>[-<hi>], inner or outer,    *
+ *            sample=<n> and snap=<bytes>. Returns -1 if one is           *
+ *            malformed.                                                  *
+ **************************************************************************/
+int cap_parse(char *s) {
+    
+    char *term, *val, *end;
+    long v, hi;
+    
+    for (term = strtok(s, ","); term != NULL; term = strtok(NULL, ",")) {
+        if (strcmp(term, "inner") == 0 || strcmp(term, "outer") == 0) {
+            capf.layers = term[0] == 'i' ? CAP_INNER : CAP_OUTER;
+            continue;
+        }
+        if ((val = strchr(term, '=')) == NULL)
+            return -1;
+        *val++ = '\0';
+        if (strcmp(term, "proto") == 0 && strcmp(val, "tcp") == 0) {
+            capf.proto = IPPROTO_TCP;
+            continue;
+        } else if (strcmp(term, "proto") == 0 && strcmp(val, "udp") == 0) {
+            capf.proto = IPPROTO_UDP;
+            continue;
+        } else if (strcmp(term, "proto") == 0 && strcmp(val, "icmp") == 0) {
+            capf.proto = IPPROTO_ICMP;
+            continue;
+        }
+        v = hi = strtol(val, &end, 10);
+        if (end != val && *end == '-' && strcmp(term, "len") == 0)
+            hi = strtol(val = end + 1, &end, 10);
+        if (end == val || *end != '\0' || v < 0 || hi < v)
+            return -1;
+        if (strcmp(term, "peer") == 0 && v < PEERS_MAX)
+            capf.peer = v;
+        else if (strcmp(term, "proto") == 0 && v < 256)
+            capf.proto = v;
+        else if (strcmp(term, "len") == 0) {
+            capf.lo = v;
+            capf.hi = hi;
+        } else if (strcmp(term, "sample") == 0 && v > 0)
+            capf.sample = v;
+        else if (strcmp(term, "snap") == 0 && v > 0)
+            capf.snap = v < CAP_SNAPLEN ? v : CAP_SNAPLEN;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * uplink_bind: binds UDP socket fd to port on uplink up, its address     *
+ *              or its device, or on all addresses when up is NULL.       *
+ *              Returns -1 after saying what failed.                      *
+ **************************************************************************/
+int uplink_bind(int fd, const struct uplink *up, unsigned short port) {
+    
+    struct sockaddr_in addr;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = up && !up->by_dev ? up->ip.s_addr : htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (up && up->by_dev && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, up->name, strlen(up->name)) < 0) {
+        perror(up->name);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * udp_open: opens a UDP socket bound to port on all addresses, or on     *
+ *           uplink up. With reuseport several workers can share one      *
+ *           port and the kernel spreads remote sockets over them by      *
+ *           4-tuple hash.                                                *
+ **************************************************************************/
+int udp_open(unsigned short port, int reuseport, int cpu, const struct uplink *up) {
+    
+    int fd, optval = 1;
+    
+    if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket()");
+        exit(1);
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+        (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)) {
+        perror("setsockopt");
+        exit(1);
+    }
+    /* only a hint for the kernel, not worth failing over */
+    if (cpu >= 0)
+        setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    sock_tune(fd);
+    if (uplink_bind(fd, up, port) < 0)
+        exit(1);
+    
+    return fd;
+}
+
+/**************************************************************************
+ * bond_steer: has the kernel hand striped frames and uplink probes to    *
+ *             the reuseport group of fd by session and sequence number   *
+ *             lane, rather than by 4-tuple, so everything one client     *
+ *             worker sends over its uplinks reaches one server worker    *
+ *             and is put back in order there. Both are in the clear and  *
+ *             no NAT on the way touches them, unlike the source port.    *
+ *             Other frames keep the hash.                                *
+ **************************************************************************/
+void bond_steer(int fd) {
+    
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct wire_hdr, type)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FRAME_BOND_DATA, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FRAME_LINK_PROBE, 0, 6),
+        /* the lane, the top byte of the big endian sequence number */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct wire_hdr, seq)),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct wire_hdr, session)),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+        /* out of range, the kernel falls back to its hash */
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+        perror("Steering striped frames, a client's uplinks may reach several workers");
+}
+
+/**************************************************************************
+ * flow_hash: hashes the flow of an IPv4/IPv6 packet (addresses, protocol *
+ *            and TCP/UDP ports), so all packets of a flow map to the     *
+ *            same path. Anything unparsable hashes to 0.                 *
+ **************************************************************************/
+uint32_t flow_hash(const uint8_t *pkt, int len) {
+    
+    uint64_t h = 0;
+    int ihl, proto;
+    
+    if (len < IP_HDR_LEN)
+        return 0;
+    
+    if ((pkt[0] >> 4) == 4) {
+        ihl = (pkt[0] & 0x0f) * 4;
+        proto = pkt[9];
+        h = ((uint64_t)((uint32_t)pkt[12] << 24 | pkt[13] << 16 | pkt[14] << 8 | pkt[15]) << 32) |
+            ((uint32_t)pkt[16] << 24 | pkt[17] << 16 | pkt[18] << 8 | pkt[19]);
+    } else if ((pkt[0] >> 4) == 6 && len >= 40) {
+        uint64_t a[4];
+        memcpy(a, pkt + 8, sizeof(a));
+        ihl = 40;
+        proto = pkt[6];
+        h = a[0] ^ a[1] ^ a[2] ^ a[3];
+    } else {
+        return 0;
+    }
+    h ^= proto;
+    if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && len >= ihl + 4)
+        h ^= (uint64_t)((uint32_t)pkt[ihl] << 24 | pkt[ihl + 1] << 16 | pkt[ihl + 2] << 8 | pkt[ihl + 3]) << 8;
+    
+    /* murmur3 finalizer */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    
+    return (uint32_t)h;
+}
+
+/**************************************************************************
+ * aead_derive: the key of a session, HMAC-SHA256 of its id under the     *
+ *              shared key, so no two sessions ever share a nonce space.  *
+ *              use tells apart keys of ids that may coincide: "session"  *
+ *              for a client's, "flood" for what a server floods.         *
+ **************************************************************************/
+void aead_derive(const char *use, uint32_t session, uint8_t *key) {
+    
+    uint8_t msg[64];
+    uint32_t s = htonl(session);
+    unsigned int len = AEAD_KEY_LEN;
+    int n = snprintf((char *)msg, sizeof(msg) - 4, "udptunnel %s ", use);
+    
+    memcpy(msg + n, &s, 4);
+    HMAC(EVP_sha256(), psk, sizeof(psk), msg, n + 4, key, &len);
+}
+
+/**************************************************************************
+ * path_key: packs a socket address into a path / table key.              *
+ **************************************************************************/
+uint64_t path_key(struct sockaddr_in *addr) {
+    return (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+/**************************************************************************
+ * ptable_hash: home slot of (addr, session).                             *
+ **************************************************************************/
+uint32_t ptable_hash(uint64_t addr, uint32_t session) {
+    
+    uint64_t h = addr ^ ((uint64_t)session << 29) ^ session;
+    
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (uint32_t)h & (PEER_TABLE_SIZE - 1);
+}
+
+/**************************************************************************
+ * ptable_lookup: finds the peer of (addr, session), NULL if unknown, and *
+ *                the path it is in *path. Lock free, see struct          *
+ *                peer_table.                                             *
+ **************************************************************************/
+struct peer *ptable_lookup(uint64_t addr, uint32_t session, int *path) {
+    
+    struct peer_table *pt = atomic_load_explicit(&ptable, memory_order_acquire);
+    struct peer_slot *slot;
+    unsigned seq;
+    uint32_t i;
+    int found;
+    
+    do {
+        seq = atomic_load_explicit(&pt->seq, memory_order_acquire);
+        found = PEER_SLOT_EMPTY;
+        *path = -1;
+        for (i = ptable_hash(addr, session);; i = (i + 1) & (PEER_TABLE_SIZE - 1)) {
+            slot = &pt->slots[i];
+            if (__atomic_load_n(&slot->peer, __ATOMIC_RELAXED) == PEER_SLOT_EMPTY)
+                break;
+            if (__atomic_load_n(&slot->addr, __ATOMIC_RELAXED) == addr &&
+                __atomic_load_n(&slot->session, __ATOMIC_RELAXED) == session) {
+                found = __atomic_load_n(&slot->peer, __ATOMIC_RELAXED);
+                *path = __atomic_load_n(&slot->path, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&pt->seq, memory_order_relaxed));
+    
+    return found == PEER_SLOT_EMPTY ? NULL : &peers[found];
+}
+
+/**************************************************************************
+ * ptable_put: adds a key for path of peer to pt, caller holds            *
+ *             tables_lock and is inside a seqlock write section if pt is *
+ *             live. Keys already present are kept.                       *
+ **************************************************************************/
+void ptable_put(struct peer_table *pt, uint64_t addr, uint32_t session, int peer, int path) {
+    
+    struct peer_slot *slot;
+    uint32_t i;
+    
+    if (pt->used >= PEER_TABLE_SIZE * 3 / 4) {
+        fprintf(stderr, "Peer table full, not adding a peer path\n");
+        return;
+    }
+    for (i = ptable_hash(addr, session);; i = (i + 1) & (PEER_TABLE_SIZE - 1)) {
+        slot = &pt->slots[i];
+        if (slot->peer == PEER_SLOT_EMPTY)
+            break;
+        if (slot->addr == addr && slot->session == session)
+            return;
+    }
+    __atomic_store_n(&slot->addr, addr, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->session, session, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->path, path, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->peer, peer, __ATOMIC_RELAXED);
+    pt->used++;
+}
+
+/**************************************************************************
+ * ptable_write_begin/end: seqlock write section around updates of pt.    *
+ **************************************************************************/
+void ptable_write_begin(struct peer_table *pt) {
+    atomic_fetch_add_explicit(&pt->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void ptable_write_end(struct peer_table *pt) {
+    atomic_fetch_add_explicit(&pt->seq, 1, memory_order_release);
+}
+
+/**************************************************************************
+ * ptable_build: a new table with the session key of each of the n live   *
+ *               peers in s and a key for every path it has, which is how *
+ *               keys go away without tombstones. NULL without memory.    *
+ **************************************************************************/
+struct peer_table *ptable_build(struct peer_snap *s, int n) {
+    
+    struct peer_table *pt;
+    int i, j, np;
+    
+    if ((pt = malloc(sizeof(*pt))) == NULL) {
+        perror("ptable_build");
+        return NULL;
+    }
+    atomic_init(&pt->seq, 0);
+    pt->used = 0;
+    for (i = 0; i < PEER_TABLE_SIZE; i++)
+        pt->slots[i].peer = PEER_SLOT_EMPTY;
+    for (i = 0; i < n; i++) {
+        ptable_put(pt, 0, s[i].session, s[i].id, -1);
+        /* paths are read as workers read them, a later rebuild catches up */
+        np = atomic_load(&peers[s[i].id].npaths);
+        for (j = 0; j < np; j++)
+            ptable_put(pt, atomic_load(&peers[s[i].id].paths[j]), s[i].session, s[i].id, j);
+    }
+    return pt;
+}
+
+/**************************************************************************
+ * lpm_insert: adds prefix/len -> peer to trie t. Returns -1 when out of  *
+ *             nodes.                                                     *
+ **************************************************************************/
+int lpm_insert(struct lpm *t, uint32_t prefix, int len, int peer) {
+    
+    int node = 0, level, last = len > 0 ? (len - 1) / 8 : 0;
+    int span, first, i;
+    struct lpm_entry *e;
+    
+    for (level = 0; level < last; level++) {
+        e = &t->nodes[node][(prefix >> (24 - 8 * level)) & 0xff];
+        if (e->child == 0) {
+            if (t->nnodes == LPM_NODES_MAX)
+                return -1;
+            e->child = t->nnodes++;
+            for (i = 0; i < 256; i++)
+                t->nodes[e->child][i] = (struct lpm_entry){ .child = 0, .peer = -1, .len = 0 };
+        }
+        node = e->child;
+    }
+    
+    /* expand into all entries of the last level the prefix covers */
+    span = 1 << (8 * (last + 1) - len);
+    first = (prefix >> (24 - 8 * last)) & 0xff & ~(span - 1);
+    for (i = first; i < first + span; i++) {
+        e = &t->nodes[node][i];
+        if (e->peer < 0 || e->len <= len) {
+            e->peer = peer;
+            e->len = len;
+        }
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * lpm_lookup: peer owning the longest prefix that matches ip, or -1.     *
+ **************************************************************************/
+int lpm_lookup(struct lpm *t, uint32_t ip) {
+    
+    struct lpm_entry *e;
+    int node = 0, shift, best = -1;
+    
+    for (shift = 24; shift >= 0; shift -= 8) {
+        e = &t->nodes[node][(ip >> shift) & 0xff];
+        if (e->peer >= 0)
+            best = e->peer;
+        if ((node = e->child) == 0)
+            break;
+    }
+    return best;
+}
+
+/**************************************************************************
+ * lpm_build: a new trie of the routes of the n live peers in s, NULL     *
+ *            without memory.                                             *
+ **************************************************************************/
+struct lpm *lpm_build(struct peer_snap *s, int n) {
+    
+    struct lpm *t;
+    int i, j, nnodes = 1;
+    
+    /* size for the worst case: every route opens up to 3 fresh nodes */
+    for (i = 0; i < n; i++)
+        nnodes += 3 * s[i].nroutes;
+    if (nnodes > LPM_NODES_MAX)
+        nnodes = LPM_NODES_MAX;
+    if ((t = malloc(sizeof(*t) + nnodes * sizeof(t->nodes[0]))) == NULL) {
+        perror("lpm_build");
+        return NULL;
+    }
+    t->nnodes = 1;
+    for (i = 0; i < 256; i++)
+        t->nodes[0][i] = (struct lpm_entry){ .child = 0, .peer = -1, .len = 0 };
+    
+    for (i = 0; i < n; i++)
+        for (j = 0; j < s[i].nroutes; j++)
+            if (t->nnodes + 3 > nnodes || lpm_insert(t, s[i].routes[j].prefix, s[i].routes[j].len, s[i].id) < 0)
+                fprintf(stderr, "Route trie full, dropping a route of peer %d\n", s[i].id);
+    return t;
+}
+
+/**************************************************************************
+ * tables_retire: lists the table mem, swapped out, to be freed once no   *
+ *                worker can still be in it. Caller holds tables_lock.    *
+ **************************************************************************/
+void tables_retire(struct retired *r, void *mem) {
+    
+    r->mem = mem;
+    r->epoch = atomic_fetch_add(&tables_epoch, 1) + 1;
+    r->next = retired;
+    retired = r;
+}
+
+/**************************************************************************
+ * tables_reclaim: frees the retired tables every running worker has been *
+ *                 through housekeeping since, lookups never reach across *
+ *                 it. Caller holds tables_lock.                          *
+ **************************************************************************/
+void tables_reclaim(void) {
+    
+    struct retired **r, *gone;
+    unsigned long oldest = ULONG_MAX, q;
+    int i, n = atomic_load(&nquiesced);
+    
+    for (i = 0; i < n; i++)
+        if ((q = atomic_load(&quiesced[i])) < oldest)
+            oldest = q;
+    for (r = &retired; *r != NULL;) {
+        if ((*r)->epoch > oldest) {
+            r = &(*r)->next;
+            continue;
+        }
+        gone = *r;
+        *r = gone->next;
+        free(gone->mem);
+    }
+}
+
+/**************************************************************************
+ * tables_rebuild: builds the peer table, live_ids and the route trie     *
+ *                 from the live peers and swaps them in. Only copying    *
+ *                 the peers takes peers_lock, so callers release it      *
+ *                 first: whoever changes a peer rebuilds after, and the  *
+ *                 latest rebuild saw the latest change.                  *
+ **************************************************************************/
+void tables_rebuild(void) {
+    
+    struct peer_table *pt;
+    struct lpm *t;
+    int i, n = 0;
+    
+    pthread_mutex_lock(&tables_lock);
+    pthread_mutex_lock(&peers_lock);
+    for (i = 0; i < PEERS_MAX; i++) {
+        if (!peers[i].in_use)
+            continue;
+        peers_snap[n].id = i;
+        peers_snap[n].session = peers[i].session;
+        peers_snap[n].nroutes = peers[i].nroutes;
+        memcpy(peers_snap[n].routes, peers[i].routes, peers[i].nroutes * sizeof(peers[i].routes[0]));
+        n++;
+    }
+    pthread_mutex_unlock(&peers_lock);
+    
+    if ((pt = ptable_build(peers_snap, n)) != NULL) {
+        pt = atomic_exchange(&ptable, pt);
+        if (pt != NULL)
+            tables_retire(&pt->retired, pt);
+        /* a flood racing this may miss a peer or see one twice, nothing worse */
+        for (i = 0; i < n; i++)
+            atomic_store_explicit(&live_ids[i], peers_snap[i].id, memory_order_relaxed);
+        atomic_store_explicit(&nlive, n, memory_order_release);
+    }
+    if ((t = lpm_build(peers_snap, n)) != NULL && (t = atomic_exchange(&routes, t)) != NULL)
+        tables_retire(&t->retired, t);
+    tables_reclaim();
+    pthread_mutex_unlock(&tables_lock);
+}
+
+/**************************************************************************
+ * peer_learn: records addr as a path of peer p, by which it sends in     *
+ *             sequence number lane lane. reset drops all known paths     *
+ *             first (the peer started over).                             *
+ **************************************************************************/
+void peer_learn(struct peer *p, struct sockaddr_in *addr, unsigned lane, int reset) {
+    
+    struct peer_table *pt;
+    uint64_t path = path_key(addr);
+    int i, n, added = 0;
+    
+    pthread_mutex_lock(&peers_lock);
+    n = reset ? 0 : atomic_load(&p->npaths);
+    for (i = 0; i < n; i++)
+        if (atomic_load_explicit(&p->paths[i], memory_order_relaxed) == path)
+            break;
+    if (i == n && n < WORKERS_MAX) {
+        /* alive and of average quality until its probes tell otherwise */
+        atomic_store_explicit(&p->path_srtt[n], BOND_RTT_INIT_USEC, memory_order_relaxed);
+        atomic_store_explicit(&p->path_loss[n], 0, memory_order_relaxed);
+        atomic_store_explicit(&p->path_seen[n], now_nsec(), memory_order_relaxed);
+        atomic_store_explicit(&p->path_lane[n], lane, memory_order_relaxed);
+        atomic_store_explicit(&p->path_rx[n], atomic_load(&coarse_now), memory_order_relaxed);
+        atomic_store_explicit(&p->paths[n], path, memory_order_relaxed);
+        atomic_store_explicit(&p->npaths, n + 1, memory_order_release);
+        printf("Peer %d path %d: %s:%i\n", p->id, n, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        added = 1;
+    }
+    pthread_mutex_unlock(&peers_lock);
+    
+    if (added && reset) {
+        tables_rebuild();
+    } else if (added) {
+        /* a rebuild in between has it already, or comes after */
+        pthread_mutex_lock(&tables_lock);
+        pt = atomic_load(&ptable);
+        ptable_write_begin(pt);
+        ptable_put(pt, path, p->session, p->id, n);
+        ptable_write_end(pt);
+        pthread_mutex_unlock(&tables_lock);
+    }
+}
+
+/**************************************************************************
+ * replay_reset: empties the windows for a new session, which sends       *
+ *               from floor on.                                           *
+ **************************************************************************/
+void replay_reset(struct replay *r, uint64_t floor) {
+    
+    struct replay_window *w;
+    int l, i;
+    
+    atomic_store(&r->floor, floor);
+    for (l = 0; l < SEQ_LANES; l++) {
+        if ((w = atomic_load(&r->lane[l])) == NULL)
+            continue;
+        atomic_store(&w->top, 0);
+        for (i = 0; i < REPLAY_SLOTS; i++)
+            atomic_store(&w->slots[i], 0);
+    }
+}
+
+/**************************************************************************
+ * replay_bound: a count above every one seen in any lane of r.           *
+ **************************************************************************/
+uint64_t replay_bound(struct replay *r) {
+    
+    struct replay_window *w;
+    uint64_t top, bound = 0;
+    int l;
+    
+    for (l = 0; l < SEQ_LANES; l++)
+        if ((w = atomic_load(&r->lane[l])) != NULL && (top = (atomic_load(&w->top) + 1) << 5) > bound)
+            bound = top;
+    return bound;
+}
+
+/**************************************************************************
+ * replay_check: would seq be new? Read only, so it is cheap enough to    *
+ *               run before the frame is decrypted. Returns 0 if so, -1   *
+ *               for a duplicate, a frame older than the window of its    *
+ *               lane, below the floor or of a lane there is none of.     *
+ **************************************************************************/
+int replay_check(struct replay *r, uint64_t seq) {
+    
+    struct replay_window *w;
+    uint64_t block = SEQ_COUNT(seq) >> 5, top, slot;
+    uint32_t tag = block / REPLAY_SLOTS;
+    
+    if (SEQ_LANE(seq) >= SEQ_LANES || SEQ_COUNT(seq) < atomic_load_explicit(&r->floor, memory_order_relaxed))
+        return -1;
+    /* nothing seen in the lane yet */
+    if ((w = atomic_load_explicit(&r->lane[SEQ_LANE(seq)], memory_order_acquire)) == NULL)
+        return 0;
+    top = atomic_load_explicit(&w->top, memory_order_relaxed);
+    slot = atomic_load_explicit(&w->slots[block & (REPLAY_SLOTS - 1)], memory_order_relaxed);
+    if (block < top && top - block >= REPLAY_SLOTS)
+        return -1;
+    if ((uint32_t)(slot >> 32) == tag)
+        return (slot >> (seq & 31)) & 1 ? -1 : 0;
+    /* a newer block took the slot: we are too late */
+    return (int32_t)((uint32_t)(slot >> 32) - tag) > 0 ? -1 : 0;
+}
+
+/**************************************************************************
+ * replay_update: marks seq as seen once its frame checked out. Loses     *
+ *                (returns -1) if another worker marked it meanwhile, so  *
+ *                two copies racing through never both get delivered.     *
+ **************************************************************************/
+int replay_update(struct replay *r, uint64_t seq) {
+    
+    struct replay_window *w, *made = NULL;
+    uint64_t block = SEQ_COUNT(seq) >> 5, top, slot, next, bit = 1ULL << (seq & 31);
+    _Atomic uint64_t *sp;
+    uint32_t tag = block / REPLAY_SLOTS, stag;
+    
+    if (SEQ_LANE(seq) >= SEQ_LANES)
+        return -1;
+    /* the lane's first frame: whoever gets there first puts up its window */
+    if ((w = atomic_load_explicit(&r->lane[SEQ_LANE(seq)], memory_order_acquire)) == NULL) {
+        if ((made = calloc(1, sizeof(*made))) == NULL)
+            return -1;
+        if (atomic_compare_exchange_strong_explicit(&r->lane[SEQ_LANE(seq)], &w, made, memory_order_acq_rel,
+                                                    memory_order_acquire))
+            w = made;
+        else
+            free(made);
+    }
+    sp = &w->slots[block & (REPLAY_SLOTS - 1)];
+    slot = atomic_load_explicit(sp, memory_order_relaxed);
+    do {
+        stag = slot >> 32;
+        if (stag == tag) {
+            if (slot & bit)
+                return -1;
+            next = slot | bit;
+        } else if ((int32_t)(stag - tag) > 0) {
+            return -1;
+        } else {
+            /* the slot still holds an older block, start it over */
+            next = (uint64_t)tag << 32 | bit;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(sp, &slot, next, memory_order_relaxed, memory_order_relaxed));
+    
+    /* top only moves once per 32 frames, so this rarely writes */
+    top = atomic_load_explicit(&w->top, memory_order_relaxed);
+    while (block > top &&
+           !atomic_compare_exchange_weak_explicit(&w->top, &top, block, memory_order_relaxed, memory_order_relaxed))
+        ;
+    return 0;
+}
+
+/**************************************************************************
+ * mac_key: the 48 bits of the MAC at m as a number.                      *
+ **************************************************************************/
+uint64_t mac_key(const uint8_t *m) {
+    return (uint64_t)m[0] << 40 | (uint64_t)m[1] << 32 | (uint64_t)m[2] << 24 | (uint64_t)m[3] << 16 |
+           (uint64_t)m[4] << 8 | m[5];
+}
+
+/**************************************************************************
+ * l2_home: home slot of key in the MAC and ARP tables.                   *
+ **************************************************************************/
+uint32_t l2_home(uint64_t key) {
+    return (uint32_t)(key * 0x9e3779b97f4a7c15ULL >> 32);
+}
+
+/**************************************************************************
+ * mac_learn: records side (a peer id or SIDE_LOCAL) as where the MAC     *
+ *            at mac is. Writes nothing in the common case of a MAC       *
+ *            that stays put.                                             *
+ **************************************************************************/
+void mac_learn(const uint8_t *mac, int side) {
+    
+    struct mac_slot *s;
+    uint64_t key = mac_key(mac), e = key << 16 | side, cur;
+    uint32_t i, h = l2_home(key);
+    time_t now = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+    
+    /* a multicast or zero source is bogus, nothing to learn */
+    if (key == 0 || (mac[0] & 1))
+        return;
+    for (i = 0; i < MAC_PROBE; i++) {
+        s = &macs[(h + i) & (MAC_SLOTS - 1)];
+        if ((cur = atomic_load_explicit(&s->entry, memory_order_relaxed)) >> 16 != key || cur == 0)
+            continue;
+        /* a move simply takes the new side */
+        if (cur != e)
+            atomic_store_explicit(&s->entry, e, memory_order_relaxed);
+        if (atomic_load_explicit(&s->seen, memory_order_relaxed) != now)
+            atomic_store_explicit(&s->seen, now, memory_order_relaxed);
+        return;
+    }
+    for (i = 0; i < MAC_PROBE; i++) {
+        s = &macs[(h + i) & (MAC_SLOTS - 1)];
+        if ((cur = atomic_load_explicit(&s->entry, memory_order_relaxed)) != 0)
+            continue;
+        atomic_store_explicit(&s->seen, now, memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&s->entry, &cur, e, memory_order_release, memory_order_relaxed))
+            return;
+    }
+    /* all taken, the home slot changes hands */
+    s = &macs[h & (MAC_SLOTS - 1)];
+    atomic_store_explicit(&s->seen, now, memory_order_relaxed);
+    atomic_store_explicit(&s->entry, e, memory_order_release);
+}
+
+/**************************************************************************
+ * mac_find: the side the MAC at mac was learned on, -1 if none. Slots    *
+ *           are cleared as MACs age out, so every one of its probe       *
+ *           slots is looked at.                                          *
+ **************************************************************************/
+int mac_find(const uint8_t *mac) {
+    
+    uint64_t key = mac_key(mac), cur;
+    uint32_t i, h = l2_home(key);
+    
+    for (i = 0; i < MAC_PROBE; i++)
+        if ((cur = atomic_load_explicit(&macs[(h + i) & (MAC_SLOTS - 1)].entry, memory_order_acquire)) >> 16 == key &&
+            cur != 0)
+            return cur & 0xffff;
+    return -1;
+}
+
+/**************************************************************************
+ * mac_dest: where the frame at pkt goes: a live peer's id, SIDE_LOCAL,   *
+ *           or -1 to flood it (broadcast, multicast, not learned, or     *
+ *           behind a peer that is gone).                                 *
+ **************************************************************************/
+int mac_dest(const uint8_t *pkt) {
+    
+    int side;
+    
+    if ((pkt[0] & 1) || (side = mac_find(pkt)) < 0)
+        return -1;
+    if (side != SIDE_LOCAL && (!peers[side].in_use || atomic_load_explicit(&peers[side].npaths, memory_order_relaxed) == 0))
+        return -1;
+    return side;
+}
+
+/**************************************************************************
+ * mac_expire: forgets the MACs silent for MAC_AGE_SEC, and those of      *
+ *             side (-1 for none), a peer that went away.                 *
+ **************************************************************************/
+void mac_expire(time_t now, int side) {
+    
+    struct mac_slot *s;
+    uint64_t cur;
+    int i;
+    
+    for (i = 0; i < MAC_SLOTS; i++) {
+        s = &macs[i];
+        if ((cur = atomic_load_explicit(&s->entry, memory_order_relaxed)) == 0)
+            continue;
+        if (now - atomic_load_explicit(&s->seen, memory_order_relaxed) > MAC_AGE_SEC || (int)(cur & 0xffff) == side)
+            atomic_compare_exchange_strong(&s->entry, &cur, 0);
+    }
+}
+
+/**************************************************************************
+ * arp_learn: records that ip (network order) is at mac, on side.         *
+ **************************************************************************/
+void arp_learn(uint32_t ip, const uint8_t *mac, int side) {
+    
+    struct arp_slot *a;
+    uint64_t e = mac_key(mac) << 16 | side;
+    uint32_t i, h = l2_home(ip), cur;
+    time_t now = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+    
+    for (i = 0; i < ARP_PROBE; i++) {
+        a = &arps[(h + i) & (ARP_SLOTS - 1)];
+        cur = atomic_load_explicit(&a->ip, memory_order_acquire);
+        if (cur == ip) {
+            if (atomic_load_explicit(&a->entry, memory_order_relaxed) != e)
+                atomic_store_explicit(&a->entry, e, memory_order_relaxed);
+            if (atomic_load_explicit(&a->seen, memory_order_relaxed) != now)
+                atomic_store_explicit(&a->seen, now, memory_order_relaxed);
+            return;
+        }
+        if (cur == 0) {
+            atomic_store_explicit(&a->entry, e, memory_order_relaxed);
+            atomic_store_explicit(&a->seen, now, memory_order_relaxed);
+            if (atomic_compare_exchange_strong_explicit(&a->ip, &cur, ip, memory_order_release, memory_order_relaxed))
+                return;
+        }
+    }
+    /* all taken, the home slot changes hands */
+    a = &arps[h & (ARP_SLOTS - 1)];
+    atomic_store_explicit(&a->ip, 0, memory_order_relaxed);
+    atomic_store_explicit(&a->entry, e, memory_order_release);
+    atomic_store_explicit(&a->seen, now, memory_order_relaxed);
+    atomic_store_explicit(&a->ip, ip, memory_order_release);
+}
+
+/**************************************************************************
+ * arp_find: copies what ARP told us about ip to *entry. Returns 0, or    *
+ *           -1 when the host is unknown or has not spoken ARP for        *
+ *           ARP_AGE_SEC.                                                 *
+ **************************************************************************/
+int arp_find(uint32_t ip, uint64_t *entry) {
+    
+    struct arp_slot *a;
+    uint32_t i, h = l2_home(ip), cur;
+    time_t now = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+    
+    for (i = 0; i < ARP_PROBE; i++) {
+        a = &arps[(h + i) & (ARP_SLOTS - 1)];
+        if ((cur = atomic_load_explicit(&a->ip, memory_order_acquire)) == 0)
+            return -1;
+        if (cur != ip)
+            continue;
+        *entry = atomic_load_explicit(&a->entry, memory_order_acquire);
+        if (atomic_load_explicit(&a->ip, memory_order_relaxed) != ip ||
+            now - atomic_load_explicit(&a->seen, memory_order_relaxed) > ARP_AGE_SEC)
+            return -1;
+        return 0;
+    }
+    return -1;
+}
+
+/**************************************************************************
+ * pace_reset: -r: a new session of peer p starts at the full rate with   *
+ *             a full bucket and nothing measured of its path.            *
+ **************************************************************************/
+void pace_reset(struct peer *p) {
+    
+    atomic_store_explicit(&p->pace_rate, pace_bps, memory_order_relaxed);
+    atomic_store(&p->pace_cost, pace_bps ? (8000000000ULL << 16) / pace_bps : 0);
+    atomic_store(&p->pace_next, 0);
+    atomic_store(&p->pace_srtt, 0);
+    atomic_store(&p->pace_min, 0);
+    atomic_store(&p->pace_min_next, 0);
+    p->pace_min_at = now_nsec();
+    atomic_store(&p->pace_fq, -1);
+}
+
+/**************************************************************************
+ * peer_add: creates (or restarts) the peer of session, reachable at addr *
+ *           (where it sends from in lane lane) and owning the given      *
+ *           routes. A new session seals from tx_seq on and takes what    *
+ *           is from rx_floor on; a server holds it back behind a         *
+ *           challenge for the client to echo, as a HELLO replayed after  *
+ *           we restarted may bring a tx_seq long used. Returns NULL      *
+ *           when full.                                                   *
+ **************************************************************************/
+struct peer *peer_add(uint32_t session, struct sockaddr_in *addr, unsigned lane, struct route *r, int nroutes,
+                      uint64_t tx_seq, uint64_t rx_floor) {
+    
+    struct peer *p = NULL;
+    uint64_t challenge = 0;
+    int i;
+    
+    pthread_mutex_lock(&peers_lock);
+    for (i = 0; i < PEERS_MAX; i++) {
+        if (peers[i].in_use && peers[i].session != session &&
+            atomic_load(&peers[i].paths[0]) == path_key(addr)) {
+            /* the client restarted with a new session, its old routes go */
+            peers[i].in_use = 0;
+            atomic_store(&peers[i].npaths, 0);
+            atomic_fetch_sub(&npeers, 1);
+        }
+        if (peers[i].in_use && peers[i].session == session) {
+            p = &peers[i];
+            break;
+        }
+        if (!peers[i].in_use && p == NULL)
+            p = &peers[i];
+    }
+    if (p == NULL) {
+        pthread_mutex_unlock(&peers_lock);
+        return NULL;
+    }
+    if (!p->in_use)
+        atomic_fetch_add(&npeers, 1);
+    /* a new session starts its own nonce space, the same one carries on */
+    if (!p->in_use || p->session != session) {
+        atomic_store(&p->tx_seq, tx_seq);
+        replay_reset(&p->replay, rx_floor);
+        /* and maybe another path: what was learned about the old one goes */
+        atomic_store(&p->pmtu, 0);
+        atomic_store(&p->mss, 0);
+        atomic_store(&p->probe_at, 0);
+        atomic_store(&p->fec_loss, 0);
+        atomic_store(&p->bonded, 0);
+        p->paths_down = 0;
+        pace_reset(p);
+        /* none of it is sealed for until the client shows it is there and where to go on from */
+        while (cliserv == SERVER && aead && challenge == 0)
+            if (getrandom(&challenge, sizeof(challenge), 0) < 0)
+                challenge = now_nsec();
+        atomic_store(&p->challenge, challenge);
+        /* nor is anything behind the old one */
+        if (tap_mode)
+            mac_expire(atomic_load(&coarse_now), p->id);
+    }
+    p->in_use = 1;
+    p->session = session;
+    atomic_fetch_add_explicit(&p->key_gen, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if (aead)
+        aead_derive("session", session, p->key);
+    atomic_fetch_add_explicit(&p->key_gen, 1, memory_order_release);
+    p->nroutes = nroutes < PEER_ROUTES_MAX ? nroutes : PEER_ROUTES_MAX;
+    memcpy(p->routes, r, p->nroutes * sizeof(*r));
+    atomic_store(&p->path_srtt[0], BOND_RTT_INIT_USEC);
+    atomic_store(&p->path_loss[0], 0);
+    atomic_store(&p->path_seen[0], now_nsec());
+    atomic_store(&p->path_lane[0], lane);
+    atomic_store(&p->path_rx[0], atomic_load(&coarse_now));
+    atomic_store(&p->paths[0], path_key(addr));
+    atomic_store(&p->npaths, 1);
+    atomic_store(&p->last_rx, atomic_load(&coarse_now));
+    pthread_mutex_unlock(&peers_lock);
+    tables_rebuild();
+    
+    return p;
+}
+
+/**************************************************************************
+ * peer_resume: server: a fresh HELLO from p's client, echoing the        *
+ *              challenge if one was held, says its window takes nothing  *
+ *              below resume and it seals from floor on: we seal past     *
+ *              resume, the kernel too, and take nothing below floor. A   *
+ *              client restarted from its ticket has us go on above what  *
+ *              we sealed before it went, where its floor is.             *
+ **************************************************************************/
+void peer_resume(struct peer *p, uint64_t resume, uint64_t floor) {
+    
+    uint64_t cur;
+    
+    pthread_mutex_lock(&peers_lock);
+    cur = atomic_load(&p->tx_seq);
+    while (cur < resume && !atomic_compare_exchange_weak(&p->tx_seq, &cur, resume))
+        ;
+    cur = kf_peers ? atomic_load(&kf_peers[p->id].seq) : resume;
+    while (cur < resume && !atomic_compare_exchange_weak(&kf_peers[p->id].seq, &cur, resume))
+        ;
+    cur = atomic_load(&p->replay.floor);
+    while (cur < floor && !atomic_compare_exchange_weak(&p->replay.floor, &cur, floor))
+        ;
+    /* the workers take their blocks anew, as after a rekey */
+    atomic_fetch_add_explicit(&p->key_gen, 2, memory_order_release);
+    atomic_store(&p->challenge, 0);
+    pthread_mutex_unlock(&peers_lock);
+}
+
+/**************************************************************************
+ * peer_prune: drops the paths of p silent for PATH_TIMEOUT_SEC, the ones *
+ *             left move up in order. The latest one heard from stays     *
+ *             whatever its age. Caller holds peers_lock. Returns the     *
+ *             paths dropped.                                             *
+ **************************************************************************/
+int peer_prune(struct peer *p, time_t now) {
+    
+    uint64_t down = 0;
+    int i, n = atomic_load(&p->npaths), kept = 0, latest = 0;
+    
+    for (i = 1; i < n; i++)
+        if (atomic_load(&p->path_rx[i]) > atomic_load(&p->path_rx[latest]))
+            latest = i;
+    for (i = 0; i < n; i++) {
+        if (i != latest && now - atomic_load(&p->path_rx[i]) > PATH_TIMEOUT_SEC) {
+            printf("Peer %d path %d went stale, dropping it\n", p->id, i);
+            continue;
+        }
+        /* a worker reading as this moves may pick a neighbour, nothing worse */
+        if (kept != i) {
+            atomic_store(&p->path_srtt[kept], atomic_load(&p->path_srtt[i]));
+            atomic_store(&p->path_loss[kept], atomic_load(&p->path_loss[i]));
+            atomic_store(&p->path_seen[kept], atomic_load(&p->path_seen[i]));
+            atomic_store(&p->path_lane[kept], atomic_load(&p->path_lane[i]));
+            atomic_store(&p->path_rx[kept], atomic_load(&p->path_rx[i]));
+            atomic_store(&p->paths[kept], atomic_load(&p->paths[i]));
+        }
+        down |= (p->paths_down >> i & 1) << kept;
+        kept++;
+    }
+    if (kept == n)
+        return 0;
+    p->paths_down = down;
+    atomic_store(&p->npaths, kept);
+    return n - kept;
+}
+
+/**************************************************************************
+ * peers_expire: forgets peers silent for PEER_TIMEOUT_SEC and the paths  *
+ *               of others silent for PATH_TIMEOUT_SEC, unless the kernel *
+ *               forwards their data and we cannot tell. Run by one       *
+ *               worker's housekeeping.                                   *
+ **************************************************************************/
+void peers_expire(void) {
+    
+    time_t now = atomic_load(&coarse_now);
+    int i, gone = 0;
+    
+    pthread_mutex_lock(&peers_lock);
+    for (i = 0; i < PEERS_MAX; i++) {
+        if (peers[i].in_use && !atomic_load(&peers[i].kfast) && atomic_load(&peers[i].npaths) > 1)
+            gone += peer_prune(&peers[i], now);
+        if (peers[i].in_use && now - atomic_load(&peers[i].last_rx) > PEER_TIMEOUT_SEC) {
+            printf("Peer %d (session %08x) timed out\n", i, peers[i].session);
+            peers[i].in_use = 0;
+            atomic_store(&peers[i].npaths, 0);
+            atomic_fetch_sub(&npeers, 1);
+            if (tap_mode)
+                mac_expire(now, i);
+            gone++;
+        }
+    }
+    pthread_mutex_unlock(&peers_lock);
+    if (gone)
+        tables_rebuild();
+}
+
+/**************************************************************************
+ * flood_key: keys the flood pseudo-peer for epoch, unless it already is: *
+ *            a server picks its epoch at start, clients learn it from    *
+ *            the HELLO_ACK. What is sealed for it every client can open. *
+ **************************************************************************/
+void flood_key(uint32_t epoch) {
+    
+    pthread_mutex_lock(&peers_lock);
+    if (!flood.in_use || flood.session != epoch) {
+        atomic_fetch_add_explicit(&flood.key_gen, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        if (aead)
+            aead_derive("flood", epoch, flood.key);
+        atomic_fetch_add_explicit(&flood.key_gen, 1, memory_order_release);
+        replay_reset(&flood.replay, 0);
+        flood.session = epoch;
+        flood.in_use = 1;
+    }
+    pthread_mutex_unlock(&peers_lock);
+}
+
+/**************************************************************************
+ * peers_init: allocates the peer array and builds an empty table and     *
+ *             route trie.                                                *
+ **************************************************************************/
+void peers_init(void) {
+    
+    int i;
+    
+    if ((peers = calloc(PEERS_MAX, sizeof(*peers))) == NULL ||
+        (peers_snap = calloc(PEERS_MAX, sizeof(*peers_snap))) == NULL) {
+        perror("peers_init");
+        exit(1);
+    }
+    for (i = 0; i < PEERS_MAX; i++)
+        peers[i].id = i;
+    flood.id = PEERS_MAX;
+    atomic_store(&coarse_now, now_sec());
+    tables_rebuild();
+    if (atomic_load(&ptable) == NULL || atomic_load(&routes) == NULL)
+        exit(1);
+}
+
+/**************************************************************************
+ * peer_path: fills addr with the path of peer p that carries the flow    *
+ *            with hash h.                                                *
+ **************************************************************************/
+void peer_path(struct peer *p, uint32_t h, struct sockaddr_in *addr) {
+    
+    int n = atomic_load_explicit(&p->npaths, memory_order_acquire);
+    uint64_t path = atomic_load_explicit(&p->paths[n > 1 ? h % n : 0], memory_order_relaxed);
+    
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = (uint32_t)(path >> 16);
+    addr->sin_port = (uint16_t)path;
+}
+
+/**************************************************************************
+ * tx_route: picks the peer and path for a packet read from tun/tap. A    *
+ *           client always talks to its server; a server looks up the     *
+ *           IPv4 destination in the route trie and, with a single peer,  *
+ *           sends it whatever has no route. In TAP mode a server         *
+ *           switches on the destination MAC instead and returns          *
+ *           &flood for frames every peer gets. Returns NULL to drop.     *
+ *           dp_tx_route is built for the features f, tx_route for any.   *
+ **************************************************************************/
+DP_INLINE struct peer *dp_tx_route(unsigned f, const uint8_t *pkt, int len, struct sockaddr_in *addr) {
+    
+    struct peer *p = NULL;
+    uint32_t dst;
+    int id = -1, n;
+    
+    if (DP(f, DP_TAP, tap_mode) && len < ETH_HDR_LEN)
+        return NULL;
+    if (DP(f, DP_TAP, tap_mode) && !DP(f, DP_CLIENT, cliserv == CLIENT)) {
+        /* never back out of tap to a MAC behind it */
+        if ((id = mac_dest(pkt)) < 0)
+            return &flood;
+        if (id != SIDE_LOCAL)
+            p = &peers[id];
+    } else if (DP(f, DP_CLIENT, cliserv == CLIENT)) {
+        p = &peers[0];
+    } else {
+        if (len >= IP_HDR_LEN && (pkt[0] >> 4) == 4) {
+            memcpy(&dst, pkt + 16, 4);
+            id = lpm_lookup(atomic_load_explicit(&routes, memory_order_acquire), ntohl(dst));
+        }
+        if (id >= 0)
+            p = &peers[id];
+        else if (atomic_load_explicit(&nlive, memory_order_acquire) == 1)
+            p = &peers[atomic_load_explicit(&live_ids[0], memory_order_relaxed)];
+    }
+    
+    if (p == NULL || (n = atomic_load_explicit(&p->npaths, memory_order_acquire)) == 0 ||
+        atomic_load_explicit(&p->challenge, memory_order_acquire) != 0)
+        return NULL;
+    /* one path per peer is the common case, skip hashing then; flows are IP behind Ethernet on tap */
+    if (DP(f, DP_TAP, tap_mode))
+        pkt += ETH_HDR_LEN, len -= ETH_HDR_LEN;
+    peer_path(p, n > 1 ? flow_hash(pkt, len) : 0, addr);
+    return p;
+}
+
+struct peer *tx_route(const uint8_t *pkt, int len, struct sockaddr_in *addr) {
+    return dp_tx_route(DP_GENERIC, pkt, len, addr);
+}
+
+/**************************************************************************
+ * cap_open: makes path the -Y capture ring of a tunnel on port, mapped   *
+ *           shared for a reader. Whatever was there is removed first; a  *
+ *           reader still on it has to open the new ring.                 *
+ **************************************************************************/
+void cap_open(const char *path, unsigned short port) {
+    
+    size_t size = sizeof(struct cap_ring) + CAP_SLOTS * sizeof(struct cap_rec);
+    int fd;
+    
+    /* a file of our own, made anew: whatever was planted there, a symlink say, is removed, not followed */
+    if (unlink(path) < 0 && errno != ENOENT) {
+        perror(path);
+        exit(1);
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0 || ftruncate(fd, size) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if ((cap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap capture ring");
+        exit(1);
+    }
+    close(fd);
+    cap->version = CAP_VERSION;
+    cap->nslots = CAP_SLOTS;
+    cap->linktype = tap_mode ? LINKTYPE_ETHERNET : LINKTYPE_RAW;
+    cap->port = htons(port);
+    atomic_store(&cap->head, 0);
+    /* the magic last, a reader checking it sees the rest */
+    atomic_thread_fence(memory_order_release);
+    cap->magic = CAP_MAGIC;
+}
+
+/**************************************************************************
+ * cap_proto: the IP protocol of inner packet pkt, the next header of     *
+ *            IPv6 (ICMPv6 counting as ICMP), -1 when it is not IP.       *
+ **************************************************************************/
+int cap_proto(const uint8_t *pkt, int len) {
+    
+    int type;
+    
+    if (tap_mode) {
+        type = len < ETH_HDR_LEN ? 0 : pkt[12] << 8 | pkt[13];
+        if (type != ETH_TYPE_IP && type != ETH_TYPE_IPV6)
+            return -1;
+        pkt += ETH_HDR_LEN;
+        len -= ETH_HDR_LEN;
+    }
+    if (len >= IP_HDR_LEN && pkt[0] >> 4 == 4)
+        return pkt[9];
+    if (len >= IP6_HDR_LEN && pkt[0] >> 4 == 6)
+        return pkt[6] == IPPROTO_ICMPV6 ? IPPROTO_ICMP : pkt[6];
+    return -1;
+}
+
+/**************************************************************************
+ * cap_peer: the id of the peer a datagram of session to or from addr     *
+ *           belongs to, -1 if none.                                      *
+ **************************************************************************/
+int cap_peer(struct sockaddr_in *addr, uint32_t session) {
+    
+    struct peer *p;
+    int path;
+    
+    if (cliserv == CLIENT)
+        return session == my_session ? 0 : -1;
+    return (p = ptable_lookup(path_key(addr), session, &path)) != NULL ? p->id : -1;
+}
+
+/**************************************************************************
+ * cap_add: copies the len byte packet at data, of layer and dir, peer    *
+ *          and for outer frames the remote end addr, into the capture    *
+ *          ring if the -y filter keeps it. Inner packets are matched on  *
+ *          their protocol, outer frames by peer and size only.           *
+ **************************************************************************/
+void cap_add(int layer, int dir, int peer, const void *data, int len, const struct sockaddr_in *addr) {
+    
+    struct cap_rec *r;
+    struct timespec ts;
+    uint64_t idx;
+    
+    if (!(capf.layers & layer) || (capf.peer >= 0 && peer != capf.peer) || len < capf.lo || len > capf.hi ||
+        (capf.proto >= 0 && layer == CAP_INNER && cap_proto(data, len) != capf.proto))
+        return;
+    if (capf.sample > 1 && ++cap_tick < capf.sample)
+        return;
+    cap_tick = 0;
+    
+    idx = atomic_fetch_add_explicit(&cap->head, 1, memory_order_relaxed);
+    r = &cap->rec[idx & (cap->nslots - 1)];
+    atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->stamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    r->peer = peer;
+    r->len = len;
+    r->caplen = len < capf.snap ? len : capf.snap;
+    r->layer = layer;
+    r->dir = dir;
+    r->addr = addr ? addr->sin_addr.s_addr : 0;
+    r->port = addr ? addr->sin_port : 0;
+    memcpy(r->data, data, r->caplen);
+    atomic_store_explicit(&r->seq, idx + 1, memory_order_release);
+    count(layer == CAP_INNER ? C_CAP_INNER : C_CAP_OUTER, 1);
+}
+
+/**************************************************************************
+ * cap_id: the id of peer p for the capture ring, -1 for none or the      *
+ *         flood pseudo-peer.                                             *
+ **************************************************************************/
+int cap_id(struct peer *p) {
+    return p && p != &flood ? p->id : -1;
+}
+
+/**************************************************************************
+ * count_sent: counts the n frames of msgs sendmmsg() took, and has the   *
+ *             capture ring keep them.                                    *
+ **************************************************************************/
+void count_sent(struct mmsghdr *msgs, int n) {
+    
+    struct wire_hdr *hdr;
+    unsigned long bytes = 0;
+    int i;
+    
+    for (i = 0; i < n; i++)
+        bytes += msgs[i].msg_len;
+    count(C_NET_TX_PKTS, n);
+    count(C_NET_TX_BYTES, bytes);
+    for (i = 0; cap && i < n; i++) {
+        hdr = msgs[i].msg_hdr.msg_iov[0].iov_base;
+        cap_add(CAP_OUTER, CAP_TX, cap_peer(msgs[i].msg_hdr.msg_name, ntohl(hdr->session)), hdr,
+                msgs[i].msg_len, msgs[i].msg_hdr.msg_name);
+    }
+}
+
+/**************************************************************************
+ * aead_nonce: 4 bytes saying which side sealed the frame, then the 64    *
+ *             bit sequence number.                                       *
+ **************************************************************************/
+void aead_nonce(uint8_t *nonce, int sender, uint64_t seq) {
+    
+    uint64_t s = htobe64(seq);
+    
+    memset(nonce, 0, 4);
+    nonce[3] = sender;
+    memcpy(nonce + 4, &s, 8);
+}
+
+/**************************************************************************
+ * aead_seal: encrypts len payload bytes in place and writes the tag.     *
+ *            The header is authenticated as associated data. c must be   *
+ *            keyed for encryption. Returns 0, or -1 on failure.          *
+ **************************************************************************/
+int aead_seal(EVP_CIPHER_CTX *c, struct wire_hdr *hdr, uint8_t *payload, int len, uint8_t *tag) {
+    
+    uint8_t nonce[AEAD_NONCE_LEN];
+    int outl;
+    
+    aead_nonce(nonce, cliserv, be64toh(hdr->seq));
+    if (!EVP_EncryptInit_ex(c, NULL, NULL, NULL, nonce) ||
+        !EVP_EncryptUpdate(c, NULL, &outl, (uint8_t *)hdr, WIRE_HDR_LEN) ||
+        !EVP_EncryptUpdate(c, payload, &outl, payload, len) ||
+        !EVP_EncryptFinal_ex(c, payload + outl, &outl) ||
+        !EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_LEN, tag))
+        return -1;
+    return 0;
+}
+
+/**************************************************************************
+ * aead_open: checks and decrypts in place a sealed payload of len bytes  *
+ *            (tag included) behind hdr. c must be keyed for decryption.  *
+ *            Returns the plaintext length, or -1 if it does not verify.  *
+ **************************************************************************/
+int aead_open(EVP_CIPHER_CTX *c, struct wire_hdr *hdr, int len) {
+    
+    uint8_t nonce[AEAD_NONCE_LEN], *payload = (uint8_t *)(hdr + 1);
+    int outl;
+    
+    if ((len -= AEAD_TAG_LEN) < 0)
+        return -1;
+    aead_nonce(nonce, !cliserv, be64toh(hdr->seq));
+    if (!EVP_DecryptInit_ex(c, NULL, NULL, NULL, nonce) ||
+        !EVP_DecryptUpdate(c, NULL, &outl, (uint8_t *)hdr, WIRE_HDR_LEN) ||
+        !EVP_DecryptUpdate(c, payload, &outl, payload, len) ||
+        !EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LEN, payload + len) ||
+        EVP_DecryptFinal_ex(c, payload + outl, &outl) <= 0)
+        return -1;
+    return len;
+}
+
+/**************************************************************************
+ * aead_ctx: a cipher context keyed with key, one-time setup cost only.   *
+ **************************************************************************/
+EVP_CIPHER_CTX *aead_ctx(EVP_CIPHER_CTX *c, const uint8_t *key, int enc) {
+    
+    if ((c == NULL && (c = EVP_CIPHER_CTX_new()) == NULL) ||
+        !EVP_CipherInit_ex(c, aead, NULL, key, NULL, enc)) {
+        fprintf(stderr, "Cannot set up %s\n", EVP_CIPHER_name(aead));
+        exit(1);
+    }
+    return c;
+}
+
+/**************************************************************************
+ * peer_ctx: this worker's context for peer p, (re)keyed when the peer    *
+ *           got a new key since we last looked.                          *
+ **************************************************************************/
+struct peer_ctx *peer_ctx(struct tunnel *t, struct peer *p) {
+    
+    struct peer_ctx *pc = &t->pctx[p->id];
+    uint8_t key[AEAD_KEY_LEN];
+    unsigned gen = atomic_load_explicit(&p->key_gen, memory_order_acquire);
+    
+    if (pc->key_gen == gen)
+        return pc;
+    
+    /* copy the key out, again if peer_add rewrote it meanwhile */
+    do {
+        gen = atomic_load_explicit(&p->key_gen, memory_order_acquire);
+        memcpy(key, p->key, sizeof(key));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((gen & 1) || gen != atomic_load_explicit(&p->key_gen, memory_order_relaxed));
+    
+    if (aead) {
+        pc->enc = aead_ctx(pc->enc, key, 1);
+        pc->dec = aead_ctx(pc->dec, key, 0);
+    }
+    pc->seq_next = pc->seq_end = 0;
+    pc->key_gen = gen;
+    return pc;
+}
+
+/**************************************************************************
+ * zip_init: the compression state of worker t. Every worker has one, a   *
+ *           peer may compress without us doing so.                       *
+ **************************************************************************/
+void zip_init(struct tunnel *t) {
+    
+    if ((t->zip = calloc(1, sizeof(*t->zip))) == NULL) {
+        perror("zip_init");
+        exit(1);
+    }
+    t->zip->base = ZIP_MAX_LEN;
+}
+
+/**************************************************************************
+ * lz4_len: writes the 255 byte continuation of an LZ4 length field.      *
+ **************************************************************************/
+uint8_t *lz4_len(uint8_t *op, int n) {
+    
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+/**************************************************************************
+ * lz4_wild: copies n bytes 16 at a time, so up to 15 bytes past both     *
+ *           ends are read and written. Callers make sure there is room.  *
+ **************************************************************************/
+void lz4_wild(uint8_t *dst, const uint8_t *src, int n) {
+    
+    uint8_t *end = dst + n;
+    
+    do {
+        memcpy(dst, src, 16);
+        dst += 16;
+        src += 16;
+    } while (dst < end);
+}
+
+/**************************************************************************
+ * lz4_compress: compresses the len bytes at src into an LZ4 block at     *
+ *               dst, single pass, one hash probe per position. Returns   *
+ *               the block length, or -1 once it would exceed max.        *
+ **************************************************************************/
+int lz4_compress(struct zip *z, const uint8_t *src, int len, uint8_t *dst, int max) {
+    
+    const uint8_t *ip = src, *anchor = src, *end = src + len, *match;
+    /* the format wants the last 5 bytes as literals, no match starting in the last 12 */
+    const uint8_t *mflimit = end - 12, *matchlimit = end - 5;
+    uint8_t *op = dst, *oend = dst + max, *token;
+    uint64_t a, b;
+    uint32_t seq, h, ref;
+    int lit, mlen, off;
+    
+    if (z->base > UINT32_MAX - 2 * ZIP_MAX_LEN) {
+        memset(z->table, 0, sizeof(z->table));
+        z->base = ZIP_MAX_LEN;
+    }
+    
+    while (len >= 13 && ip < mflimit) {
+        memcpy(&seq, ip, 4);
+        h = (seq * 2654435761U) >> (32 - ZIP_HASH_BITS);
+        ref = z->table[h];
+        z->table[h] = z->base + (ip - src);
+        if (ref < z->base || memcmp(src + (ref - z->base), ip, 4) != 0) {
+            ip++;
+            continue;
+        }
+        match = src + (ref - z->base);
+        while (ip > anchor && match > src && ip[-1] == match[-1]) {
+            ip--;
+            match--;
+        }
+        /* 8 bytes at a time, the first that differs is the lowest set byte */
+        for (mlen = 4; ip + mlen + 8 <= matchlimit; mlen += 8) {
+            memcpy(&a, ip + mlen, 8);
+            memcpy(&b, match + mlen, 8);
+            if (a != b)
+                break;
+        }
+        if (ip + mlen + 8 <= matchlimit)
+            mlen += __builtin_ctzll(le64toh(a ^ b)) >> 3;
+        else
+            for (; ip + mlen < matchlimit && ip[mlen] == match[mlen]; mlen++)
+                ;
+        
+        /* token, literal run, offset, match length */
+        lit = ip - anchor;
+        if (op + 1 + lit / 255 + 1 + lit + 2 + (mlen - 4) / 255 + 1 > oend)
+            return -1;
+        token = op++;
+        *token = (lit < 15 ? lit : 15) << 4;
+        if (lit >= 15)
+            op = lz4_len(op, lit - 15);
+        if (anchor + lit + 16 <= end && op + lit + 16 <= oend)
+            lz4_wild(op, anchor, lit);
+        else
+            memcpy(op, anchor, lit);
+        op += lit;
+        off = ip - match;
+        *op++ = off;
+        *op++ = off >> 8;
+        *token |= mlen - 4 < 15 ? mlen - 4 : 15;
+        if (mlen - 4 >= 15)
+            op = lz4_len(op, mlen - 4 - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+    
+    /* the block ends with a literals only sequence */
+    lit = end - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > oend)
+        return -1;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = lz4_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
+
+/**************************************************************************
+ * lz4_decompress: inflates the LZ4 block of len bytes at src into dst,   *
+ *                 checking every length and offset against both ends.    *
+ *                 Returns the bytes produced, or -1 if the block is      *
+ *                 malformed or inflates past max.                        *
+ **************************************************************************/
+int lz4_decompress(const uint8_t *src, int len, uint8_t *dst, int max) {
+    
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + max, *match;
+    int token, lit, mlen, off, b, n;
+    
+    while (ip < iend) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15)
+            do {
+                if (ip == iend)
+                    return -1;
+                lit += b = *ip++;
+            } while (b == 255);
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        if (lit + 16 <= iend - ip && lit + 16 <= oend - op)
+            lz4_wild(op, ip, lit);
+        else
+            memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+        
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > op - dst)
+            return -1;
+        mlen = token & 15;
+        if (mlen == 15)
+            do {
+                if (ip == iend)
+                    return -1;
+                mlen += b = *ip++;
+            } while (b == 255);
+        mlen += 4;
+        if (mlen > oend - op)
+            return -1;
+        /* an offset shorter than the match repeats the bytes just written,
+         * copy what is final already, twice as much each round */
+        match = op - off;
+        if (off >= 16 && mlen + 16 <= oend - op) {
+            lz4_wild(op, match, mlen);
+            op += mlen;
+            continue;
+        }
+        for (; mlen > 0; mlen -= n) {
+            n = op - match < mlen ? op - match : mlen;
+            memcpy(op, match, n);
+            op += n;
+        }
+    }
+    return op - dst;
+}
+
+/**************************************************************************
+ * zip_packet: compresses the len byte packet at pkt in place for worker  *
+ *             t, unless it is out of size range, its tail looks random   *
+ *             (encrypted or compressed already) or its flow did not      *
+ *             shrink lately. Returns the new length, or -1 to send the   *
+ *             packet as is.                                              *
+ **************************************************************************/
+int zip_packet(struct tunnel *t, uint8_t *pkt, int len) {
+    
+    struct zip *z = t->zip;
+    uint64_t seen[4] = { 0 }, t0 = 0;
+    int i, n, distinct, slot, timed;
+    
+    if (len < ZIP_MIN_LEN || len > ZIP_MAX_LEN)
+        return -1;
+    slot = flow_hash(pkt, len) & (ZIP_FLOWS - 1);
+    if (z->skip[slot]) {
+        z->skip[slot]--;
+        count(C_ZIP_HISTORY, 1);
+        return -1;
+    }
+    
+    /* distinct byte values in the tail: about 57 of 64 for random bytes, 20-40 for text */
+    for (i = len - ZIP_SAMPLE_LEN; i < len; i++)
+        seen[pkt[i] >> 6] |= 1ULL << (pkt[i] & 63);
+    distinct = __builtin_popcountll(seen[0]) + __builtin_popcountll(seen[1]) +
+               __builtin_popcountll(seen[2]) + __builtin_popcountll(seen[3]);
+    if (distinct > ZIP_DISTINCT_MAX) {
+        count(C_ZIP_ENTROPY, 1);
+        return -1;
+    }
+    
+    if ((timed = hist_every && ++z->tick % ZIP_TIME_SAMPLE == 0))
+        t0 = now_nsec();
+    n = lz4_compress(z, pkt, len, z->out, len - (len >> ZIP_GAIN_SHIFT));
+    z->base += len;
+    count(C_ZIP_IN_BYTES, len);
+    if (n < 0) {
+        z->skip[slot] = 1 << z->backoff[slot];
+        if (z->backoff[slot] < ZIP_BACKOFF_MAX)
+            z->backoff[slot]++;
+        count(C_ZIP_NO_GAIN, 1);
+        count(C_ZIP_OUT_BYTES, len);
+    } else {
+        z->backoff[slot] = 0;
+        memcpy(pkt, z->out, n);
+        count(C_ZIP_PKTS, 1);
+        count(C_ZIP_OUT_BYTES, n);
+    }
+    if (timed)
+        hist_add(H_ZIP, now_nsec() - t0);
+    return n;
+}
+
+/**************************************************************************
+ * unzip_packet: inflates in place the len byte LZ4 block at pkt, there   *
+ *               is ZIP_MAX_LEN room behind it. Returns the packet length *
+ *               or -1 to drop it.                                        *
+ **************************************************************************/
+int unzip_packet(struct tunnel *t, uint8_t *pkt, int len) {
+    
+    struct zip *z = t->zip;
+    uint64_t t0 = 0;
+    int n, timed;
+    
+    if ((timed = hist_every && ++z->tick % ZIP_TIME_SAMPLE == 0))
+        t0 = now_nsec();
+    if ((n = lz4_decompress(pkt, len, z->out, ZIP_MAX_LEN)) < 0) {
+        count(C_DROP_MALFORMED, 1);
+        return -1;
+    }
+    memcpy(pkt, z->out, n);
+    count(C_UNZIP_PKTS, 1);
+    if (timed)
+        hist_add(H_UNZIP, now_nsec() - t0);
+    return n;
+}
+
+/**************************************************************************
+ * pmtu_room: tun bytes one datagram to peer p carries unfragmented, or 0 *
+ *            while its path MTU is not known. With FEC a parity frame is *
+ *            the largest, a header and a length over the longest packet; *
+ *            striped packets have their bond_hdr behind them.            *
+ **************************************************************************/
+int pmtu_room(struct peer *p) {
+    
+    int pmtu = atomic_load_explicit(&p->pmtu, memory_order_relaxed);
+    
+    return pmtu ? pmtu - IP_HDR_LEN - UDP_HDR_LEN - WIRE_HDR_LEN - (aead ? AEAD_TAG_LEN : 0) -
+                  (fec_mode ? FEC_HDR_LEN + 2 : 0) -
+                  (bond_tx && atomic_load_explicit(&p->bonded, memory_order_relaxed) ? BOND_HDR_LEN : 0) : 0;
+}
+
+/**************************************************************************
+ * mss_clamp: lowers the MSS option of a TCP SYN in the IPv4 or IPv6      *
+ *            packet at pkt to mss (20 less for IPv6), adjusting the      *
+ *            checksum incrementally. On tap the packet is behind an      *
+ *            Ethernet header. Returns 1 if it had to.                    *
+ **************************************************************************/
+int mss_clamp(uint8_t *pkt, int len, int mss) {
+    
+    int hlen, doff, i, optlen, type;
+    uint32_t sum;
+    uint16_t old;
+    uint8_t *tcp;
+    
+    if (tap_mode) {
+        if (len < ETH_HDR_LEN || ((type = pkt[12] << 8 | pkt[13]) != ETH_TYPE_IP && type != ETH_TYPE_IPV6))
+            return 0;
+        pkt += ETH_HDR_LEN;
+        len -= ETH_HDR_LEN;
+    }
+    
+    if (len >= IP_HDR_LEN && (pkt[0] >> 4) == 4) {
+        hlen = (pkt[0] & 0x0f) * 4;
+        /* only the first fragment has the TCP header */
+        if (hlen < IP_HDR_LEN || pkt[9] != IPPROTO_TCP || ((pkt[6] & 0x1f) | pkt[7]))
+            return 0;
+    } else if (len >= 40 && (pkt[0] >> 4) == 6 && pkt[6] == IPPROTO_TCP) {
+        hlen = 40;
+        mss -= 20;
+    } else {
+        return 0;
+    }
+    tcp = pkt + hlen;
+    if (len < hlen + 20 || !(tcp[13] & 0x02))
+        return 0;
+    doff = (tcp[12] >> 4) * 4;
+    if (hlen + doff > len)
+        return 0;
+    
+    for (i = 20; i < doff && tcp[i] != 0; i += optlen) {
+        if (tcp[i] == 1) {
+            optlen = 1;
+            continue;
+        }
+        if (i + 1 >= doff || (optlen = tcp[i + 1]) < 2 || i + optlen > doff)
+            return 0;
+        if (tcp[i] != 2 || optlen != 4)
+            continue;
+        if ((old = tcp[i + 2] << 8 | tcp[i + 3]) <= mss)
+            return 0;
+        tcp[i + 2] = mss >> 8;
+        tcp[i + 3] = mss;
+        /* RFC 1624: HC' = ~(~HC + ~m + m') */
+        sum = (uint16_t)~(tcp[16] << 8 | tcp[17]) + (uint16_t)~old + mss;
+        sum = (sum & 0xffff) + (sum >> 16);
+        sum = (sum & 0xffff) + (sum >> 16);
+        tcp[16] = ~sum >> 8;
+        tcp[17] = ~sum;
+        return 1;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * frame_clamp: mss_clamp on the packet of a data payload, or each one of *
+ *              a bundle, to or from peer p when its path needs it.       *
+ *              Clamped SYNs count under c.                               *
+ **************************************************************************/
+void frame_clamp(struct peer *p, uint8_t type, uint8_t *pl, int len, enum counter c) {
+    
+    int mss = atomic_load_explicit(&p->mss, memory_order_relaxed), off, n;
+    
+    if (mss == 0)
+        return;
+    if (type == FRAME_DATA && mss_clamp(pl, len, mss))
+        count(c, 1);
+    if (type != FRAME_BUNDLE)
+        return;
+    for (off = 0; len - off >= AGG_LEN && (n = pl[off] << 8 | pl[off + 1]) > 0 && n <= len - off - AGG_LEN;
+         off += AGG_LEN + n)
+        if (mss_clamp(pl + off + AGG_LEN, n, mss))
+            count(c, 1);
+}
+
+/**************************************************************************
+ * frame_seal: fills in the header at hdr for len payload bytes bound for *
+ *             peer p and, with a key, encrypts the payload in place and  *
+ *             puts the tag at tag (usually right behind the payload).    *
+ *             A data or bundle payload first has its SYNs clamped to the *
+ *             path MTU, then with -z is compressed (FEC and striped      *
+ *             data too, clamped before), and a tag right behind it       *
+ *             moves along.                                               *
+ *             Returns the bytes on the wire, header included, or -1.     *
+ *             dp_frame_seal is built for the features f.                 *
+ **************************************************************************/
+DP_INLINE int dp_frame_seal(unsigned f, struct tunnel *t, struct peer *p, struct wire_hdr *hdr, uint8_t type,
+                            uint8_t *payload, int len, uint8_t *tag) {
+    
+    struct peer_ctx *pc = peer_ctx(t, p);
+    uint64_t seq, t0 = 0;
+    int sample, zlen = -1;
+    
+    /* sequence numbers come from the peer in blocks, one atomic per SEQ_BLOCK,
+     * and go out in the worker's lane; while the kernel forwards its data, one at
+     * a time from the same counter in the kernel's */
+    if (DP(f, DP_KFAST, kf_peers != NULL) && atomic_load_explicit(&p->kfast, memory_order_acquire)) {
+        seq = atomic_fetch_add_explicit(&kf_peers[p->id].seq, 1, memory_order_relaxed);
+        pc->seq_end = pc->seq_next;
+    } else {
+        if (pc->seq_next == pc->seq_end) {
+            pc->seq_next = atomic_fetch_add_explicit(&p->tx_seq, SEQ_BLOCK, memory_order_relaxed);
+            pc->seq_end = pc->seq_next + SEQ_BLOCK;
+        }
+        seq = (uint64_t)(t->id + 1) << SEQ_LANE_SHIFT | pc->seq_next++;
+    }
+    
+    frame_clamp(p, type, payload, len, C_MSS_TX);
+    if (DP(f, DP_ZIP, compress) && (type == FRAME_DATA || type == FRAME_BUNDLE || type == FRAME_FEC_DATA || type == FRAME_BOND_DATA) &&
+        (zlen = zip_packet(t, payload, len)) >= 0) {
+        if (tag == payload + len)
+            tag = payload + zlen;
+        len = zlen;
+    }
+    
+    if (!DP(f, DP_AEAD, aead != NULL)) {
+        wire_encap((char *)hdr, type, len, p->session, seq);
+        if (zlen >= 0)
+            hdr->version |= WIRE_F_COMPRESSED;
+        return WIRE_HDR_LEN + len;
+    }
+    
+    /* the flags are in the authenticated header */
+    wire_encap((char *)hdr, type, len + AEAD_TAG_LEN, p->session, seq);
+    hdr->version |= WIRE_F_SEALED | (zlen >= 0 ? WIRE_F_COMPRESSED : 0);
+    if ((sample = t->seal.packets++ % AEAD_SAMPLE == 0))
+        t0 = now_nsec();
+    if (aead_seal(pc->enc, hdr, payload, len, tag) < 0)
+        return -1;
+    if (sample) {
+        t->seal.nsec += now_nsec() - t0;
+        t->seal.sampled++;
+    }
+    t->seal.bytes += len;
+    return WIRE_HDR_LEN + len + AEAD_TAG_LEN;
+}
+
+int frame_seal(struct tunnel *t, struct peer *p, struct wire_hdr *hdr, uint8_t type, uint8_t *payload, int len, uint8_t *tag) {
+    return dp_frame_seal(DP_GENERIC, t, p, hdr, type, payload, len, tag);
+}
+
+/**************************************************************************
+ * frame_open: verifies and decrypts in place the payload of a frame from *
+ *             peer p, dropping replays before any crypto is done and     *
+ *             recording the frame in the window only once it verified.   *
+ *             A compressed payload is inflated in place, SYNs in it are  *
+ *             clamped to the path MTU.                                   *
+ *             Returns the plaintext length, or -1 to drop it. A frame    *
+ *             opened before (rx_frame does so for new paths) is taken as *
+ *             is. dp_frame_open is built for the features f.             *
+ **************************************************************************/
+DP_INLINE int dp_frame_open(unsigned f, struct tunnel *t, struct peer *p, struct wire_hdr *hdr) {
+    
+    int len = ntohs(hdr->length), sample;
+    uint64_t t0 = 0, seq = be64toh(hdr->seq);
+    time_t now;
+    
+    if (hdr->version & WIRE_F_OPENED)
+        return len;
+    if (replay_check(&p->replay, seq) < 0) {
+        count(C_DROP_REPLAY, 1);
+        return -1;
+    }
+    if (!DP(f, DP_AEAD, aead != NULL) != !(hdr->version & WIRE_F_SEALED)) {
+        count(C_DROP_AUTH, 1);
+        return -1;
+    }
+    
+    if (DP(f, DP_AEAD, aead != NULL)) {
+        if ((sample = t->open.packets++ % AEAD_SAMPLE == 0))
+            t0 = now_nsec();
+        if ((len = aead_open(peer_ctx(t, p)->dec, hdr, len)) < 0) {
+            count(C_DROP_AUTH, 1);
+            return -1;
+        }
+        if (sample) {
+            t->open.nsec += now_nsec() - t0;
+            t->open.sampled++;
+        }
+        t->open.bytes += len;
+    }
+    if (replay_update(&p->replay, seq) < 0) {
+        count(C_DROP_REPLAY, 1);
+        return -1;
+    }
+    if ((hdr->version & WIRE_F_COMPRESSED) && (len = unzip_packet(t, (uint8_t *)(hdr + 1), len)) < 0)
+        return -1;
+    frame_clamp(p, hdr->type, (uint8_t *)(hdr + 1), len, C_MSS_RX);
+    /* what tells the server's own frames from a RETRY anyone may send */
+    now = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+    if (DP(f, DP_CLIENT, cliserv == CLIENT) && atomic_load_explicit(&p->auth_rx, memory_order_relaxed) != now)
+        atomic_store_explicit(&p->auth_rx, now, memory_order_relaxed);
+    
+    /* so a second look neither decrypts nor counts it again */
+    hdr->version = (hdr->version & ~WIRE_F_COMPRESSED) | WIRE_F_OPENED;
+    hdr->length = htons(len);
+    return len;
+}
+
+int frame_open(struct tunnel *t, struct peer *p, struct wire_hdr *hdr) {
+    return dp_frame_open(DP_GENERIC, t, p, hdr);
+}
+
+/**************************************************************************
+ * hello_open: frame_open for a HELLO of a session we have no peer for    *
+ *             yet, keyed on the spot. Returns the plaintext length or -1.*
+ **************************************************************************/
+int hello_open(struct tunnel *t, struct wire_hdr *hdr) {
+    
+    uint8_t key[AEAD_KEY_LEN];
+    int len = ntohs(hdr->length);
+    
+    if (!aead != !(hdr->version & WIRE_F_SEALED)) {
+        count(C_DROP_AUTH, 1);
+        return -1;
+    }
+    if (!aead)
+        return len;
+    aead_derive("session", ntohl(hdr->session), key);
+    t->hello_ctx = aead_ctx(t->hello_ctx, key, 0);
+    if ((len = aead_open(t->hello_ctx, hdr, len)) < 0) {
+        count(C_DROP_AUTH, 1);
+        return -1;
+    }
+    hdr->version |= WIRE_F_OPENED;
+    hdr->length = htons(len);
+    return len;
+}
+
+/**************************************************************************
+ * send_frame_on: seals len payload bytes (already placed behind the      *
+ *                header room in frame, with AEAD_TAG_LEN spare behind    *
+ *                them) for peer p and sends exactly that frame to addr   *
+ *                on socket fd.                                           *
+ **************************************************************************/
+int send_frame_on(struct tunnel *t, int fd, struct peer *p, char *frame, uint8_t type, int len, struct sockaddr_in *addr) {
+    
+    uint8_t *payload = (uint8_t *)frame + WIRE_HDR_LEN;
+    int n;
+    
+    /* nothing for a peer still to echo its challenge, as if it went out */
+    if (atomic_load_explicit(&p->challenge, memory_order_acquire) != 0)
+        return 0;
+    if ((n = frame_seal(t, p, (struct wire_hdr *)frame, type, payload, len, payload + len)) < 0)
+        return -1;
+    if ((n = sendto(fd, frame, n, 0, (struct sockaddr *)addr, sizeof(*addr))) < 0) {
+        count(errno == EAGAIN ? C_DROP_SOCK_FULL : C_ERR_SENDTO, 1);
+        return -1;
+    }
+    count(C_NET_TX_PKTS, 1);
+    count(C_NET_TX_BYTES, n);
+    if (cap)
+        cap_add(CAP_OUTER, CAP_TX, cap_id(p), frame, n, addr);
+    return n;
+}
+
+/**************************************************************************
+ * uplink_fd: the socket worker t sends control frames on: with -U its    *
+ *            first uplink still answering probes, so the handshake and   *
+ *            keepalives fail over too.                                   *
+ **************************************************************************/
+int uplink_fd(struct tunnel *t) {
+    
+    int j;
+    
+    for (j = 0; cliserv == CLIENT && j < nuplinks; j++)
+        if (t->up[j].up)
+            return t->up_fd[j];
+    return t->sock_fd;
+}
+
+/**************************************************************************
+ * send_frame: send_frame_on the socket uplink_fd picks.                  *
+ **************************************************************************/
+int send_frame(struct tunnel *t, struct peer *p, char *frame, uint8_t type, int len, struct sockaddr_in *addr) {
+    return send_frame_on(t, uplink_fd(t), p, frame, type, len, addr);
+}
+
+/**************************************************************************
+ * aead_report: prints the sampled seal/open cost of worker t.            *
+ **************************************************************************/
+void aead_report(struct tunnel *t) {
+    
+    struct aead_stats *st[2] = { &t->seal, &t->open };
+    char *name[2] = { "seal", "open" };
+    int i;
+    
+    for (i = 0; i < 2; i++)
+        if (st[i]->sampled > 0)
+            printf("worker %d: %s %lu pkts %lu bytes, %.0f ns/pkt\n", t->id, name[i],
+                   st[i]->packets, st[i]->bytes, (double)st[i]->nsec / st[i]->sampled);
+}
+
+/**************************************************************************
+ * aead_init: per-worker crypto state, run before the worker sends.       *
+ **************************************************************************/
+void aead_init(struct tunnel *t) {
+    
+    t->last_report = now_sec();
+    /* and one for the flood pseudo-peer */
+    if ((t->pctx = calloc(PEERS_MAX + 1, sizeof(*t->pctx))) == NULL) {
+        perror("aead_init");
+        exit(1);
+    }
+}
+
+/**************************************************************************
+ * aead_load_key: reads the shared key from path, 64 hex digits or 32 raw *
+ *                bytes.                                                  *
+ **************************************************************************/
+void aead_load_key(const char *path) {
+    
+    char text[2 * AEAD_KEY_LEN + 3];
+    unsigned int byte;
+    FILE *f;
+    int n, i;
+    
+    if ((f = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    n = fread(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+    text[n] = '\0';
+    
+    if (n == AEAD_KEY_LEN) {
+        memcpy(psk, text, AEAD_KEY_LEN);
+        return;
+    }
+    for (i = 0; i < AEAD_KEY_LEN && n >= 2 * AEAD_KEY_LEN; i++) {
+        if (sscanf(text + 2 * i, "%2x", &byte) != 1)
+            break;
+        psk[i] = byte;
+    }
+    if (i != AEAD_KEY_LEN || (n > 2 * AEAD_KEY_LEN && text[2 * AEAD_KEY_LEN] != '\n')) {
+        fprintf(stderr, "%s: key must be %d raw bytes or %d hex digits\n", path, AEAD_KEY_LEN, 2 * AEAD_KEY_LEN);
+        exit(1);
+    }
+}
+
+/**************************************************************************
+ * flood_send: seals the len byte frame behind the header room of frame   *
+ *             once, for the flood pseudo-peer, and sends that to every   *
+ *             live peer but except, FLOOD_BATCH per sendmmsg().          *
+ **************************************************************************/
+void flood_send(struct tunnel *t, char *frame, int len, struct peer *except) {
+    
+    uint8_t *payload = (uint8_t *)frame + WIRE_HDR_LEN;
+    struct iovec iov;
+    struct peer *p;
+    int i, n, k = 0, sent, ret;
+    
+    if ((ret = frame_seal(t, &flood, (struct wire_hdr *)frame, FRAME_DATA, payload, len, payload + len)) < 0)
+        return;
+    iov.iov_base = frame;
+    iov.iov_len = ret;
+    count(C_L2_FLOOD, 1);
+    
+    /* the last round flushes what is left */
+    n = atomic_load_explicit(&nlive, memory_order_acquire);
+    for (i = 0; i <= n; i++) {
+        if (i < n) {
+            p = &peers[atomic_load_explicit(&live_ids[i], memory_order_relaxed)];
+            if (p == except || !p->in_use || atomic_load_explicit(&p->npaths, memory_order_acquire) == 0)
+                continue;
+            peer_path(p, 0, &t->flood_addrs[k]);
+            memset(&t->flood_msgs[k].msg_hdr, 0, sizeof(t->flood_msgs[k].msg_hdr));
+            t->flood_msgs[k].msg_hdr.msg_name = &t->flood_addrs[k];
+            t->flood_msgs[k].msg_hdr.msg_namelen = sizeof(t->flood_addrs[k]);
+            t->flood_msgs[k].msg_hdr.msg_iov = &iov;
+            t->flood_msgs[k].msg_hdr.msg_iovlen = 1;
+            if (++k < FLOOD_BATCH)
+                continue;
+        }
+        for (sent = 0; sent < k; sent += ret) {
+            if ((ret = sendmmsg(t->sock_fd, t->flood_msgs + sent, k - sent, 0)) < 0) {
+                if (errno == EINTR) {
+                    ret = 0;
+                    continue;
+                }
+                if (errno != EAGAIN) {
+                    perror("sendmmsg flood");
+                    count(C_ERR_SENDMMSG, 1);
+                }
+                count(C_DROP_SOCK_FULL, k - sent);
+                break;
+            }
+            count_sent(t->flood_msgs + sent, ret);
+        }
+        k = 0;
+    }
+}
+
+/**************************************************************************
+ * l2_arp: learns the sender of an ARP packet, on the side of from        *
+ *         (NULL for our own tap), and answers a request for a host       *
+ *         ARP lately put on another side: to tap, or sealed back to      *
+ *         the peer that asked. A client only answers its own side, the   *
+ *         server hears everyone. Returns 1 when it answered, and the     *
+ *         request need go no further.                                    *
+ **************************************************************************/
+int l2_arp(struct tunnel *t, struct peer *from, const uint8_t *pkt, int len) {
+    
+    char frame[WIRE_HDR_LEN + ETH_HDR_LEN + ARP_PKT_LEN + AEAD_TAG_LEN];
+    uint8_t *reply = (uint8_t *)frame + WIRE_HDR_LEN;
+    const uint8_t *arp = pkt + ETH_HDR_LEN;
+    struct sockaddr_in addr;
+    uint32_t sip, tip;
+    uint64_t e;
+    int side = from == NULL ? SIDE_LOCAL : cliserv == CLIENT ? 0 : from->id, where, i;
+    
+    /* Ethernet and IPv4 only */
+    if (len < ETH_HDR_LEN + ARP_PKT_LEN || (pkt[12] << 8 | pkt[13]) != ETH_TYPE_ARP ||
+        (arp[0] << 8 | arp[1]) != 1 || (arp[2] << 8 | arp[3]) != ETH_TYPE_IP || arp[4] != 6 || arp[5] != 4)
+        return 0;
+    memcpy(&sip, arp + 14, 4);
+    memcpy(&tip, arp + 24, 4);
+    /* an address probe (no sender address) teaches nothing */
+    if (sip != 0)
+        arp_learn(sip, arp + 8, side);
+    
+    /* probes and announcements go through, they are how conflicts are found */
+    if ((arp[6] << 8 | arp[7]) != 1 || sip == 0 || sip == tip || (cliserv == CLIENT && from) ||
+        arp_find(tip, &e) < 0 || (where = e & 0xffff) == side ||
+        (cliserv == SERVER && where != SIDE_LOCAL && !peers[where].in_use))
+        return 0;
+    
+    /* from the target to the requester */
+    memcpy(reply, pkt + 6, 6);
+    for (i = 0; i < 6; i++)
+        reply[6 + i] = e >> (56 - 8 * i);
+    reply[12] = ETH_TYPE_ARP >> 8;
+    reply[13] = ETH_TYPE_ARP & 0xff;
+    memcpy(reply + ETH_HDR_LEN, arp, 6);
+    reply[ETH_HDR_LEN + 6] = 0;
+    reply[ETH_HDR_LEN + 7] = 2;
+    memcpy(reply + ETH_HDR_LEN + 8, reply + 6, 6);
+    memcpy(reply + ETH_HDR_LEN + 14, &tip, 4);
+    memcpy(reply + ETH_HDR_LEN + 18, arp + 8, 10);
+    count(C_L2_ARP, 1);
+    
+    if (from != NULL) {
+        peer_path(from, t->id, &addr);
+        send_frame(t, from, frame, FRAME_DATA, ETH_HDR_LEN + ARP_PKT_LEN, &addr);
+    } else if (write(t->tap_fd, reply, ETH_HDR_LEN + ARP_PKT_LEN) < 0) {
+        perror("write to virtual");
+        count(C_ERR_WRITE, 1);
+    }
+    return 1;
+}
+
+/**************************************************************************
+ * l2_local: TAP mode, a frame read from our tap: a server learns its     *
+ *           source MAC as ours, and ARP may be answered right here.      *
+ *           Returns 1 when the frame goes no further.                    *
+ **************************************************************************/
+int l2_local(struct tunnel *t, const uint8_t *pkt, int len) {
+    
+    if (len < ETH_HDR_LEN) {
+        count(C_DROP_MALFORMED, 1);
+        return 1;
+    }
+    if (cliserv == SERVER)
+        mac_learn(pkt + 6, SIDE_LOCAL);
+    return l2_arp(t, NULL, pkt, len);
+}
+
+/**************************************************************************
+ * l2_input: TAP mode, an opened frame from peer from. A server learns    *
+ *           its source MAC as behind from, then sends it on to the       *
+ *           peer its destination is behind, or floods it to every peer   *
+ *           but from when that is not known. ARP may be answered in      *
+ *           place. Returns 1 when the frame is for our tap too.          *
+ **************************************************************************/
+int l2_input(struct tunnel *t, struct peer *from, const uint8_t *pkt, int len) {
+    
+    struct sockaddr_in addr;
+    struct peer *p;
+    int side;
+    
+    if (len < ETH_HDR_LEN) {
+        count(C_DROP_MALFORMED, 1);
+        return 0;
+    }
+    if (l2_arp(t, from, pkt, len))
+        return 0;
+    if (cliserv == CLIENT)
+        return 1;
+    
+    /* into a buffer of our own, the frame may sit in a bundle */
+    mac_learn(pkt + 6, from->id);
+    if ((side = mac_dest(pkt)) < 0) {
+        memcpy(t->l2_frame + WIRE_HDR_LEN, pkt, len);
+        flood_send(t, t->l2_frame, len, from);
+        return 1;
+    }
+    if (side == SIDE_LOCAL)
+        return 1;
+    /* the sender's own side has it already */
+    if (side == from->id)
+        return 0;
+    p = &peers[side];
+    memcpy(t->l2_frame + WIRE_HDR_LEN, pkt, len);
+    peer_path(p, flow_hash(pkt + ETH_HDR_LEN, len - ETH_HDR_LEN), &addr);
+    if (send_frame(t, p, t->l2_frame, FRAME_DATA, len, &addr) >= 0)
+        count(C_L2_SWITCHED, 1);
+    return 0;
+}
+
+/**************************************************************************
+ * gf_mul: a times b in GF(2^8).                                          *
+ **************************************************************************/
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+/**************************************************************************
+ * gf_inv: the inverse of a, which must not be 0.                         *
+ **************************************************************************/
+uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/**************************************************************************
+ * gf_madd_scalar: dst ^= c * src over len bytes, a nibble at a time      *
+ *                 through the product tables of c.                       *
+ **************************************************************************/
+void gf_madd_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    
+    const uint8_t *lo = gf_nib[c], *hi = gf_nib[c] + 16;
+    int i;
+    
+    for (i = 0; i < len; i++)
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+#if defined(__x86_64__)
+/**************************************************************************
+ * gf_madd_avx2: gf_madd_scalar 32 bytes at a time, the nibble tables     *
+ *               looked up with one byte shuffle each. Built for AVX2     *
+ *               whatever the compiler targets, picked at run time.       *
+ **************************************************************************/
+__attribute__((target("avx2")))
+void gf_madd_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_nib[c]));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(gf_nib[c] + 16)));
+    __m256i mask = _mm256_set1_epi8(0x0f), v, d;
+    int i;
+    
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(src + i));
+        d = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(v, mask)),
+                             _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+        d = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i *)(dst + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), d);
+    }
+    gf_madd_scalar(dst + i, src + i, c, len - i);
+}
+#elif defined(__aarch64__)
+/**************************************************************************
+ * gf_madd_neon: gf_madd_scalar 16 bytes at a time, the nibble tables     *
+ *               looked up with one table instruction each.               *
+ **************************************************************************/
+void gf_madd_neon(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    
+    uint8x16_t lo = vld1q_u8(gf_nib[c]), hi = vld1q_u8(gf_nib[c] + 16), mask = vdupq_n_u8(0x0f), v;
+    int i;
+    
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = vld1q_u8(src + i);
+        v = veorq_u8(vqtbl1q_u8(lo, vandq_u8(v, mask)), vqtbl1q_u8(hi, vshrq_n_u8(v, 4)));
+        vst1q_u8(dst + i, veorq_u8(v, vld1q_u8(dst + i)));
+    }
+    gf_madd_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+/**************************************************************************
+ * fec_init: GF(2^8) over x^8 + x^4 + x^3 + x^2 + 1, the nibble           *
+ *           product tables of every constant, the parity                 *
+ *           coefficients, and the widest region kernel the CPU has.      *
+ **************************************************************************/
+void fec_init(void) {
+    
+    int i, j, x = 1;
+    
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        if ((x <<= 1) & 0x100)
+            x ^= 0x11d;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 0; j < 16; j++) {
+            gf_nib[i][j] = gf_mul(i, j);
+            gf_nib[i][16 + j] = gf_mul(i, j << 4);
+        }
+    /* Cauchy, 1 / (x_j + y_i) with x_j = FEC_K_MAX + j and y_i = i: the two never
+     * meet, so the rows of any parity against any lost packets are invertible */
+    for (j = 0; j < FEC_M_MAX; j++)
+        for (i = 0; i < FEC_K_MAX; i++)
+            fec_coef[j][i] = gf_inv((FEC_K_MAX + j) ^ i);
+    
+    gf_madd = gf_madd_scalar;
+    gf_kernel = "scalar";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        gf_madd = gf_madd_avx2;
+        gf_kernel = "avx2";
+    }
+#elif defined(__aarch64__)
+    gf_madd = gf_madd_neon;
+    gf_kernel = "neon";
+#endif
+}
+
+/**************************************************************************
+ * gf_invert: inverts the n x n matrix a into inv by Gauss-Jordan         *
+ *            elimination, a is lost on the way. Returns -1 if it is      *
+ *            singular.                                                   *
+ **************************************************************************/
+int gf_invert(uint8_t a[FEC_M_MAX][FEC_M_MAX], uint8_t inv[FEC_M_MAX][FEC_M_MAX], int n) {
+    
+    uint8_t f, tmp;
+    int r, c, k;
+    
+    for (r = 0; r < n; r++)
+        for (c = 0; c < n; c++)
+            inv[r][c] = r == c;
+    for (c = 0; c < n; c++) {
+        for (r = c; r < n && a[r][c] == 0; r++)
+            ;
+        if (r == n)
+            return -1;
+        for (k = 0; k < n && r != c; k++) {
+            tmp = a[r][k], a[r][k] = a[c][k], a[c][k] = tmp;
+            tmp = inv[r][k], inv[r][k] = inv[c][k], inv[c][k] = tmp;
+        }
+        f = gf_inv(a[c][c]);
+        for (k = 0; k < n; k++) {
+            a[c][k] = gf_mul(a[c][k], f);
+            inv[c][k] = gf_mul(inv[c][k], f);
+        }
+        for (r = 0; r < n; r++)
+            if (r != c && (f = a[r][c]) != 0)
+                for (k = 0; k < n; k++) {
+                    a[r][k] ^= gf_mul(f, a[c][k]);
+                    inv[r][k] ^= gf_mul(f, inv[c][k]);
+                }
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * fec_plan: the shape of the next group to peer p: -F as given, or       *
+ *           with -F auto from the loss it reports: smaller groups on     *
+ *           a lossy path, parity for three times the losses of a group   *
+ *           on average plus one, which also keeps the loss measured.     *
+ **************************************************************************/
+void fec_plan(struct peer *p, int *k, int *m) {
+    
+    uint64_t loss = atomic_load_explicit(&p->fec_loss, memory_order_relaxed);
+    
+    if (fec_k) {
+        *k = fec_k;
+        *m = fec_m;
+        return;
+    }
+    *k = loss > FEC_LOSSY_PPM ? FEC_K_LOSSY : FEC_K_AUTO;
+    *m = 3 * *k * loss / 1000000 + 1;
+    *m = *m > FEC_M_MAX ? FEC_M_MAX : *m;
+}
+
+/**************************************************************************
+ * fec_arm: (re)starts the FEC deadline timer of t to expire in nsec.     *
+ **************************************************************************/
+void fec_arm(struct tunnel *t, uint64_t nsec) {
+    
+    struct itimerspec its;
+    
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = nsec / 1000000000;
+    its.it_value.tv_nsec = nsec % 1000000000;
+    if (timerfd_settime(t->fec_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime()");
+        exit(1);
+    }
+    t->fec_armed = 1;
+}
+
+/**************************************************************************
+ * fec_add: puts the len byte packet at pkt, bound for p on addr, in      *
+ *          the group worker t fills for p. Its SYNs are clamped          *
+ *          first, the receiver must see the bytes that were coded;       *
+ *          its shard, the length going in the two bytes of header        *
+ *          room ahead of it, is added into every parity shard, and       *
+ *          its fec_hdr goes behind it. Returns the encoder when the      *
+ *          packet closed the group, else NULL.                           *
+ **************************************************************************/
+struct fec_enc *fec_add(struct tunnel *t, struct peer *p, uint8_t *pkt, int len, struct sockaddr_in *addr) {
+    
+    struct peer_ctx *pc = &t->pctx[p->id];
+    struct fec_enc *e = pc->fec;
+    struct fec_hdr h;
+    uint8_t *shard = pkt - 2;
+    int j, slen = 2 + len;
+    
+    if (e == NULL) {
+        if ((e = pc->fec = calloc(1, sizeof(*e))) == NULL) {
+            perror("fec_add");
+            exit(1);
+        }
+        e->p = p;
+        if (getrandom(&e->group, sizeof(e->group), 0) < 0)
+            e->group = now_nsec();
+    }
+    /* a group the peer's last session began is of no use to this one */
+    if (e->session != p->session)
+        e->n = 0;
+    if (e->n == 0) {
+        fec_plan(p, &e->k, &e->m);
+        /* parity buffers stay with the encoder; a dry pool means less parity */
+        for (j = 0; j < e->m; j++) {
+            if (e->parity[j] == NULL && (e->parity[j] = pool_get()) != NULL)
+                e->parity[j] = PKT_FRAME(e->parity[j]);
+            if (e->parity[j] == NULL) {
+                e->m = j;
+                break;
+            }
+        }
+        e->group++;
+        e->len = 0;
+        e->session = p->session;
+        e->addr = *addr;
+        e->first = now_nsec();
+        if (!e->listed) {
+            e->next = t->fec_open;
+            t->fec_open = e;
+            e->listed = 1;
+        }
+        if (!t->fec_armed)
+            fec_arm(t, FEC_FLUSH_USEC * 1000ULL);
+    }
+    
+    frame_clamp(p, FRAME_DATA, pkt, len, C_MSS_TX);
+    shard[0] = len >> 8;
+    shard[1] = len;
+    /* what the parity shards have past the longest shard is not zero yet */
+    if (slen > e->len) {
+        for (j = 0; j < e->m; j++)
+            memset(FEC_SHARD(e->parity[j]) + e->len, 0, slen - e->len);
+        e->len = slen;
+    }
+    for (j = 0; j < e->m; j++)
+        gf_madd(FEC_SHARD(e->parity[j]), shard, fec_coef[j][e->n], slen);
+    
+    h.group = htonl(e->group);
+    h.index = e->n;
+    h.count = e->k;
+    h.parity = e->m;
+    h.pad = 0;
+    memcpy(pkt + len, &h, FEC_HDR_LEN);
+    return ++e->n == e->k ? e : NULL;
+}
+
+/**************************************************************************
+ * fec_close: closes the group of e with the packets it has and puts      *
+ *            the fec_hdr in front of each parity shard. Returns the      *
+ *            parity frames, each FEC_HDR_LEN + e->len payload bytes      *
+ *            behind the header room of e->parity[j].                     *
+ **************************************************************************/
+int fec_close(struct fec_enc *e) {
+    
+    struct fec_hdr h = { htonl(e->group), 0, e->n, e->m, 0 };
+    int j;
+    
+    for (j = 0; j < e->m; j++) {
+        h.index = j;
+        memcpy(e->parity[j] + WIRE_HDR_LEN, &h, FEC_HDR_LEN);
+    }
+    e->n = 0;
+    return e->m;
+}
+
+/**************************************************************************
+ * fec_take: closes the group of e, which packet n - 1 of the tx batch    *
+ *           of t filled, and puts its parity frames in the slots from    *
+ *           n on, whose buffers the encoder takes in exchange. The       *
+ *           parity so goes out right behind the group. Returns the       *
+ *           next free slot.                                              *
+ **************************************************************************/
+int fec_take(struct tunnel *t, struct fec_enc *e, int n, struct peer **owner, uint8_t *type, uint64_t *stamp) {
+    
+    struct batch *b = t->tx_batch;
+    char *frame;
+    int j, m = fec_close(e);
+    
+    for (j = 0; j < m; j++, n++) {
+        frame = b->buf[n];
+        b->buf[n] = e->parity[j];
+        e->parity[j] = frame;
+        b->iovs[n].iov_len = FEC_HDR_LEN + e->len;
+        b->addrs[n] = e->addr;
+        owner[n] = e->p;
+        type[n] = FRAME_FEC_PARITY;
+        stamp[n] = stamp[n - 1 - j];
+    }
+    count(C_FEC_PARITY_TX, m);
+    return n;
+}
+
+/**************************************************************************
+ * bond_release: gives the packets stream r holds back to the pool.       *
+ **************************************************************************/
+void bond_release(struct tunnel *t, struct reorder *r) {
+    
+    int i;
+    
+    for (i = 0; i < BOND_SLOTS && r->nheld > 0; i++)
+        if (r->buf[i] != NULL) {
+            pool_put(r->buf[i]);
+            r->buf[i] = NULL;
+            r->nheld--;
+            t->bond_nheld--;
+        }
+}
+
+/**************************************************************************
+ * bond_of: worker t's bonding state for peer p, made on first use and    *
+ *          started over, held packets dropped, when p has a new          *
+ *          session. Where our stream starts is random, so a peer         *
+ *          that missed our restart resyncs rather than waits.            *
+ **************************************************************************/
+struct bond *bond_of(struct tunnel *t, struct peer *p) {
+    
+    struct peer_ctx *pc = &t->pctx[p->id];
+    struct bond *bd = pc->bond;
+    int i;
+    
+    if (bd == NULL) {
+        if ((bd = pc->bond = calloc(1, sizeof(*bd))) == NULL) {
+            perror("bond_of");
+            exit(1);
+        }
+        bd->session = ~p->session;
+    }
+    if (bd->session != p->session) {
+        /* streams stay on the held list, on_bond drops them once empty */
+        for (i = 0; i < WORKERS_MAX; i++) {
+            bond_release(t, &bd->rx[i]);
+            bd->rx[i].started = 0;
+            bd->rx[i].peer = p->id;
+        }
+        memset(bd->credit, 0, sizeof(bd->credit));
+        bd->tx_seq = (uint32_t)now_nsec() * 2654435761u;
+        bd->session = p->session;
+    }
+    return bd;
+}
+
+/**************************************************************************
+ * bond_weight: how much of the traffic a path with smoothed RTT srtt     *
+ *              (us) and loss (ppm) gets: the faster the more, and a      *
+ *              lossy one less again, nothing from 45% loss on.           *
+ **************************************************************************/
+int bond_weight(uint32_t srtt, uint32_t loss) {
+    return (int)((1000000 - 2 * (loss < 450000 ? loss : 450000)) * 1000ULL / (srtt > 100 ? srtt : 100));
+}
+
+/**************************************************************************
+ * bond_pick: the path of the next packet worker t stripes to peer p,     *
+ *            by smooth weighted round robin over the credits in bd. A    *
+ *            client picks one of its uplinks that still answers          *
+ *            probes and sends to the server; a server picks one of       *
+ *            the paths the client probes through, among those the        *
+ *            same client worker sends by (the same lane) so one stream   *
+ *            is put back in order in one place, and fills addr with it.  *
+ *            When none is alive the default path is the best bet.        *
+ **************************************************************************/
+int bond_pick(struct tunnel *t, struct peer *p, struct bond *bd, struct sockaddr_in *addr) {
+    
+    uint64_t now, path;
+    uint8_t lane;
+    int i, n, w, total = 0, best = -1;
+    
+    if (cliserv == CLIENT) {
+        for (i = 0; i < nuplinks; i++) {
+            if (!t->up[i].up)
+                continue;
+            w = bond_weight(t->up[i].srtt ? t->up[i].srtt : BOND_RTT_INIT_USEC, t->up[i].loss);
+            bd->credit[i] += w;
+            total += w;
+            if (best < 0 || bd->credit[i] > bd->credit[best])
+                best = i;
+        }
+        if (best < 0)
+            return 0;
+        bd->credit[best] -= total;
+        return best;
+    }
+    
+    n = atomic_load_explicit(&p->npaths, memory_order_acquire);
+    lane = atomic_load_explicit(&p->path_lane[t->id % n], memory_order_relaxed);
+    now = now_nsec();
+    for (i = 0; i < n; i++) {
+        if (atomic_load_explicit(&p->path_lane[i], memory_order_relaxed) != lane ||
+            now - atomic_load_explicit(&p->path_seen[i], memory_order_relaxed) >= BOND_DEAD_MSEC * 1000000ULL)
+            continue;
+        w = bond_weight(atomic_load_explicit(&p->path_srtt[i], memory_order_relaxed),
+                        atomic_load_explicit(&p->path_loss[i], memory_order_relaxed));
+        bd->credit[i] += w;
+        total += w;
+        if (best < 0 || bd->credit[i] > bd->credit[best])
+            best = i;
+    }
+    if (best < 0) {
+        best = t->id % n;
+    } else {
+        bd->credit[best] -= total;
+    }
+    path = atomic_load_explicit(&p->paths[best], memory_order_relaxed);
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = (uint32_t)(path >> 16);
+    addr->sin_port = (uint16_t)path;
+    return best;
+}
+
+/**************************************************************************
+ * bond_send: sends the n sealed frames of worker t's tx batch, each      *
+ *            on the uplink in link, one sendmmsg() run per uplink.       *
+ *            Returns the number sent.                                    *
+ **************************************************************************/
+int bond_send(struct tunnel *t, const uint8_t *link, int n) {
+    
+    struct batch *b = t->tx_batch;
+    int i, j, m, sent, ret, total = 0;
+    
+    for (j = 0; j < nuplinks; j++) {
+        for (i = m = 0; i < n; i++)
+            if (link[i] == j)
+                t->bond_msgs[m++] = b->msgs[i];
+        for (sent = 0; sent < m; sent += ret) {
+            if ((ret = sendmmsg(t->up_fd[j], t->bond_msgs + sent, m - sent, 0)) < 0) {
+                if (errno == EINTR) {
+                    ret = 0;
+                    continue;
+                }
+                if (errno != EAGAIN) {
+                    perror("sendmmsg uplink");
+                    count(C_ERR_SENDMMSG, 1);
+                }
+                count(C_DROP_SOCK_FULL, m - sent);
+                break;
+            }
+            count_sent(t->bond_msgs + sent, ret);
+        }
+        total += sent;
+    }
+    return total;
+}
+
+/**************************************************************************
+ * tap_take: reads one packet from the tun/tap fd into frame buffer       *
+ *           buf and finds the peer it goes to and where. Returns its     *
+ *           length; 0 when it went no further: switched locally,         *
+ *           flooded at once or without a route; -1 when there is         *
+ *           nothing to read. dp_tap_take is built for the features f.    *
+ **************************************************************************/
+DP_INLINE int dp_tap_take(unsigned f, struct tunnel *t, char *buf, struct sockaddr_in *addr, struct peer **owner,
+                          unsigned long *rx_bytes) {
+    
+    int nread;
+    
+    if ((nread = read(t->tap_fd, buf + WIRE_HDR_LEN, PKT_ROOM)) < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("read from virtual");
+            count(C_ERR_READ, 1);
+        }
+        return -1;
+    }
+    *rx_bytes += nread;
+    
+    if (DP(f, DP_TAP, tap_mode) && l2_local(t, (uint8_t *)buf + WIRE_HDR_LEN, nread))
+        return 0;
+    *owner = dp_tx_route(f, (uint8_t *)buf + WIRE_HDR_LEN, nread, addr);
+    if (DP(f, DP_CAP, cap != NULL))
+        cap_add(CAP_INNER, CAP_TX, cap_id(*owner), buf + WIRE_HDR_LEN, nread, NULL);
+    if (*owner == NULL) {
+        count(C_DROP_NO_ROUTE, 1);
+        return 0;
+    }
+    /* a flood goes out at once, its buffer takes the next read */
+    if (*owner == &flood) {
+        flood_send(t, buf, nread, NULL);
+        return 0;
+    }
+    return nread;
+}
+
+int tap_take(struct tunnel *t, char *buf, struct sockaddr_in *addr, struct peer **owner, unsigned long *rx_bytes) {
+    return dp_tap_take(DP_GENERIC, t, buf, addr, owner, rx_bytes);
+}
+
+/**************************************************************************
+ * sched_class: the class of packet pkt (an Ethernet frame in TAP         *
+ *              mode): the first -C rule its protocol and ports match,    *
+ *              else the one of its DSCP. Puts the DSCP in *tos, ready    *
+ *              for IP_TOS. Non-IP and short packets go best effort;      *
+ *              of a fragment only the first has the ports.               *
+ **************************************************************************/
+int sched_class(const uint8_t *pkt, int len, uint8_t *tos) {
+    
+    const struct sched_rule *r;
+    int i, proto, hlen, dscp, ports;
+    uint16_t sport = 0, dport = 0;
+    
+    *tos = 0;
+    if (tap_mode) {
+        if (len < ETH_HDR_LEN)
+            return SCHED_DEFAULT;
+        i = pkt[12] << 8 | pkt[13];
+        if (i != ETH_TYPE_IP && i != ETH_TYPE_IPV6)
+            return SCHED_DEFAULT;
+        pkt += ETH_HDR_LEN;
+        len -= ETH_HDR_LEN;
+    }
+    if (len >= IP_HDR_LEN && pkt[0] >> 4 == 4) {
+        dscp = pkt[1] >> 2;
+        proto = pkt[9];
+        hlen = (pkt[6] & 0x1f) | pkt[7] ? len : (pkt[0] & 0xf) * 4;
+    } else if (len >= IP6_HDR_LEN && pkt[0] >> 4 == 6) {
+        dscp = (pkt[0] & 0xf) << 2 | pkt[1] >> 6;
+        proto = pkt[6] == IPPROTO_ICMPV6 ? IPPROTO_ICMP : pkt[6];
+        hlen = IP6_HDR_LEN;
+    } else {
+        return SCHED_DEFAULT;
+    }
+    *tos = dscp << 2;
+    
+    ports = (proto == IPPROTO_TCP || proto == IPPROTO_UDP) && len >= hlen + 4;
+    if (ports) {
+        sport = pkt[hlen] << 8 | pkt[hlen + 1];
+        dport = pkt[hlen + 2] << 8 | pkt[hlen + 3];
+    }
+    for (i = 0; i < nsched_rules; i++) {
+        r = &sched_rules[i];
+        if (r->proto != proto)
+            continue;
+        if ((r->lo == 0 && r->hi == 0xffff) ||
+            (ports && ((sport >= r->lo && sport <= r->hi) || (dport >= r->lo && dport <= r->hi))))
+            return r->cls;
+    }
+    
+    /* the classes of RFC 4594, more or less */
+    if (dscp >= 40)
+        return SCHED_REALTIME;
+    if (dscp >= 16)
+        return SCHED_INTERACTIVE;
+    if (dscp == 8 || dscp == 1)
+        return SCHED_BULK;
+    return SCHED_DEFAULT;
+}
+
+/**************************************************************************
+ * sched_init: makes the egress scheduler of worker t and shortens        *
+ *             the send buffer of its socket, unless -B sized it.         *
+ **************************************************************************/
+void sched_init(struct tunnel *t) {
+    
+    socklen_t len = sizeof(int);
+    char *buf;
+    
+    if ((t->sched = calloc(1, sizeof(*t->sched))) == NULL) {
+        perror("sched_init");
+        exit(1);
+    }
+    if ((buf = pool_get()) == NULL) {
+        fprintf(stderr, "sched_init: buffer pool exhausted\n");
+        exit(1);
+    }
+    t->sched->spare = PKT_FRAME(buf);
+    t->sched->rr = SCHED_INTERACTIVE;
+    /* what the kernel holds waits in arrival order, so hold little there */
+    if (sched_sndbuf)
+        setsockopt(t->sock_fd, SOL_SOCKET, SO_SNDBUF, &sched_sndbuf, sizeof(sched_sndbuf));
+    if (getsockopt(t->sock_fd, SOL_SOCKET, SO_SNDBUF, &t->sched->sndbuf, &len) < 0) {
+        perror("getsockopt(SO_SNDBUF)");
+        exit(1);
+    }
+}
+
+/**************************************************************************
+ * sched_fill: reads up to -b packets from the tun/tap fd into the        *
+ *             class queues of t, dropping those whose class is full,     *
+ *             then sees how much more the socket takes. Returns the      *
+ *             number of packets read.                                    *
+ **************************************************************************/
+int sched_fill(struct tunnel *t, unsigned long *rx_bytes) {
+    
+    struct sched *s = t->sched;
+    struct sched_queue *q;
+    struct sched_pkt *sp;
+    struct sockaddr_in addr;
+    struct peer *owner;
+    uint64_t now = now_nsec();
+    uint8_t tos;
+    char *buf;
+    int nrx = 0, nread, c, outq;
+    
+    while (nrx < batch_size && (nread = tap_take(t, s->spare, &addr, &owner, rx_bytes)) >= 0) {
+        nrx++;
+        if (nread == 0)
+            continue;
+        c = sched_class((uint8_t *)s->spare + WIRE_HDR_LEN, nread, &tos);
+        q = &s->cls[c];
+        if (q->tail - q->head == SCHED_QLEN) {
+            count(C_SCHED_DROP + c, 1);
+            continue;
+        }
+        if ((buf = pool_get()) == NULL) {
+            count(C_DROP_POOL_EMPTY, 1);
+            continue;
+        }
+        sp = &q->pkt[q->tail++ & (SCHED_QLEN - 1)];
+        sp->frame = s->spare;
+        sp->owner = owner;
+        sp->addr = addr;
+        sp->stamp = now;
+        sp->len = nread;
+        sp->tos = tos;
+        s->spare = PKT_FRAME(buf);
+        s->queued++;
+    }
+    
+    /* the kernel charges what it still holds of ours against the buffer */
+    if (ioctl(t->sock_fd, SIOCOUTQ, &outq) < 0)
+        outq = 0;
+    s->room = s->sndbuf - outq;
+    return nrx;
+}
+
+/**************************************************************************
+ * sched_pick: the class of s to send from next, -1 when all are          *
+ *             empty: realtime while it has packets, else the class       *
+ *             whose DRR deficit covers its first packet, a new round     *
+ *             topping up the next class by its weight.                   *
+ **************************************************************************/
+int sched_pick(struct sched *s) {
+    
+    struct sched_queue *q;
+    
+    if (s->cls[SCHED_REALTIME].head != s->cls[SCHED_REALTIME].tail)
+        return SCHED_REALTIME;
+    if (s->queued == 0)
+        return -1;
+    while (1) {
+        q = &s->cls[s->rr];
+        if (q->head == q->tail)
+            q->deficit = 0;
+        else if (q->deficit >= q->pkt[q->head & (SCHED_QLEN - 1)].len)
+            return s->rr;
+        s->rr = s->rr == SCHED_CLASSES - 1 ? SCHED_INTERACTIVE : s->rr + 1;
+        s->cls[s->rr].deficit += SCHED_QUANTUM * sched_weight[s->rr];
+    }
+}
+
+/**************************************************************************
+ * sched_pop: takes the next packet of t's scheduler into batch slot      *
+ *            *buf, whose buffer goes back to the pool, with where it     *
+ *            goes and when it was read. Returns its length, -1 when      *
+ *            there is none or the socket has no room for it: then it     *
+ *            waits for the socket to drain, not the kernel.              *
+ **************************************************************************/
+int sched_pop(struct tunnel *t, char **buf, struct sockaddr_in *addr, struct peer **owner, uint64_t *stamp, uint8_t *tos) {
+    
+    struct sched *s = t->sched;
+    struct sched_queue *q;
+    struct sched_pkt *sp;
+    int c;
+    
+    if ((c = sched_pick(s)) < 0)
+        return -1;
+    q = &s->cls[c];
+    sp = &q->pkt[q->head & (SCHED_QLEN - 1)];
+    if (s->room < sp->len + SCHED_SKB_COST)
+        return -1;
+    s->room -= sp->len + SCHED_SKB_COST;
+    q->deficit -= c == SCHED_REALTIME ? 0 : sp->len;
+    q->head++;
+    s->queued--;
+    
+    pool_put(PKT_BUF(*buf));
+    *buf = sp->frame;
+    *addr = sp->addr;
+    *owner = sp->owner;
+    *stamp = sp->stamp;
+    *tos = sp->tos;
+    count(C_SCHED_TX + c, 1);
+    return sp->len;
+}
+
+/**************************************************************************
+ * pace_at: takes len bytes from the bucket of peer p. Returns when they  *
+ *          may leave, now while it holds PACE_BURST bytes' worth, or 0   *
+ *          when that is past the horizon and the frame is to be dropped  *
+ *          (the bucket keeps them).                                      *
+ **************************************************************************/
+uint64_t pace_at(struct peer *p, int len, uint64_t now) {
+    
+    uint64_t cost = atomic_load_explicit(&p->pace_cost, memory_order_relaxed);
+    uint64_t burst = (PACE_BURST * cost) >> 16, next, at;
+    
+    next = atomic_load_explicit(&p->pace_next, memory_order_relaxed);
+    do {
+        at = (next + burst < now ? now - burst : next) + ((len * cost) >> 16);
+        if (at > now + PACE_HORIZON_NSEC)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&p->pace_next, &next, at));
+    return at > now ? at : now;
+}
+
+/**************************************************************************
+ * tx_cmsg: puts the ancillary data of slot i of t's tx batch on mh: the  *
+ *          IP_TOS it goes with for -D, the time fq is to send it at for  *
+ *          -r. Neither, when tos and at are 0.                           *
+ **************************************************************************/
+void tx_cmsg(struct tunnel *t, struct msghdr *mh, int i, int tos, uint64_t at) {
+    
+    char *ctl = t->tx_ctl[i];
+    struct cmsghdr *cm;
+    
+    if (tos) {
+        cm = (struct cmsghdr *)ctl;
+        cm->cmsg_level = IPPROTO_IP;
+        cm->cmsg_type = IP_TOS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &tos, sizeof(int));
+        ctl += CMSG_SPACE(sizeof(int));
+    }
+    if (at) {
+        cm = (struct cmsghdr *)ctl;
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_TXTIME;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cm), &at, sizeof(uint64_t));
+        ctl += CMSG_SPACE(sizeof(uint64_t));
+    }
+    mh->msg_control = ctl > t->tx_ctl[i] ? t->tx_ctl[i] : NULL;
+    mh->msg_controllen = ctl - t->tx_ctl[i];
+}
+
+/**************************************************************************
+ * pace_arm: starts the wheel of t ticking every PACE_TICK_USEC, or stops *
+ *           it when it holds nothing.                                    *
+ **************************************************************************/
+void pace_arm(struct tunnel *t, int on) {
+    
+    struct itimerspec its;
+    
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_interval.tv_nsec = PACE_TICK_USEC * 1000L;
+        its.it_value = its.it_interval;
+    }
+    if (timerfd_settime(t->pace_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime()");
+        exit(1);
+    }
+    t->wheel->armed = on;
+}
+
+/**************************************************************************
+ * pace_hold: has the wheel of t keep the len byte sealed frame *frame    *
+ *            for uplink link until at, and gives the batch slot a fresh  *
+ *            buffer for it. Returns -1 when the wheel or the pool is     *
+ *            full, the frame then goes now.                              *
+ **************************************************************************/
+int pace_hold(struct tunnel *t, char **frame, int len, int link, struct sockaddr_in *addr, int tos,
+              uint64_t at, uint64_t now) {
+    
+    struct pace_wheel *w = t->wheel;
+    struct paced *e;
+    char *buf;
+    int slot;
+    
+    if ((e = w->free) == NULL || (buf = pool_get()) == NULL)
+        return -1;
+    w->free = e->next;
+    e->frame = *frame;
+    *frame = PKT_FRAME(buf);
+    e->len = len;
+    e->link = link;
+    e->addr = *addr;
+    e->tos = tos;
+    e->tick = at / (PACE_TICK_USEC * 1000ULL);
+    e->next = NULL;
+    if (w->nheld++ == 0)
+        w->tick = now / (PACE_TICK_USEC * 1000ULL);
+    slot = e->tick & (PACE_SLOTS - 1);
+    *w->tail[slot] = e;
+    w->tail[slot] = &e->next;
+    if (!w->armed)
+        pace_arm(t, 1);
+    count(C_PACE_HELD, 1);
+    return 0;
+}
+
+/**************************************************************************
+ * fec_flush: closes the group of e with the packets it has and sends     *
+ *            its parity frames from the encoder's own buffers. With -r   *
+ *            they wait for the bucket of its peer like any frame does.   *
+ *            Nothing goes when the peer has a new session since, or no   *
+ *            longer has the path the group was for.                      *
+ **************************************************************************/
+void fec_flush(struct tunnel *t, struct fec_enc *e) {
+    
+    struct mmsghdr msgs[FEC_M_MAX];
+    struct iovec iovs[FEC_M_MAX];
+    uint8_t *payload;
+    uint64_t key = path_key(&e->addr), now = 0, at = 0;
+    int i, j, n, m = fec_close(e), len = FEC_HDR_LEN + e->len, ret, held = 0;
+    
+    /* a peer that went away or started over takes its group along, a path it dropped too */
+    if (!e->p->in_use || e->session != e->p->session || m == 0)
+        return;
+    n = atomic_load_explicit(&e->p->npaths, memory_order_acquire);
+    for (i = 0; i < n; i++)
+        if (atomic_load_explicit(&e->p->paths[i], memory_order_relaxed) == key)
+            break;
+    if (i == n)
+        return;
+    if (pace_bps)
+        now = now_nsec();
+    memset(msgs, 0, sizeof(msgs));
+    for (i = j = 0; j < m; j++) {
+        payload = (uint8_t *)e->parity[j] + WIRE_HDR_LEN;
+        if ((ret = frame_seal(t, e->p, (struct wire_hdr *)e->parity[j], FRAME_FEC_PARITY, payload, len, payload + len)) < 0)
+            return;
+        /* a held frame takes its buffer along, the encoder gets a fresh one */
+        if (pace_bps) {
+            if ((at = pace_at(e->p, ret, now)) == 0) {
+                count(C_DROP_PACED, 1);
+                continue;
+            }
+            if (t->txtime && atomic_load_explicit(&e->p->pace_fq, memory_order_relaxed) == 1) {
+                count(C_PACE_TXTIME, 1);
+            } else {
+                if (at > now + PACE_TICK_USEC * 1000ULL &&
+                    pace_hold(t, &e->parity[j], ret, 0, &e->addr, 0, at, now) == 0) {
+                    held++;
+                    continue;
+                }
+                at = 0;
+            }
+        }
+        iovs[i].iov_base = e->parity[j];
+        iovs[i].iov_len = ret;
+        msgs[i].msg_hdr.msg_name = &e->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(e->addr);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (t->tx_ctl != NULL)
+            tx_cmsg(t, &msgs[i].msg_hdr, i, 0, at);
+        i++;
+    }
+    count(C_FEC_PARITY_TX, held);
+    if (i == 0)
+        return;
+    if ((ret = sendmmsg(t->sock_fd, msgs, i, 0)) < 0) {
+        count(errno == EAGAIN ? C_DROP_SOCK_FULL : C_ERR_SENDMMSG, i);
+        return;
+    }
+    count_sent(msgs, ret);
+    count(C_FEC_PARITY_TX, ret);
+    t->last_tx = now_sec();
+}
+
+/**************************************************************************
+ * tun_to_net: reads packets from the tun/tap fd until it would block or  *
+ *             the batch is full, frames them and flushes them with       *
+ *             sendmmsg(); in TAP mode floods go out on their own. With   *
+ *             FEC each group's parity follows the packet that closed it, *
+ *             and a batch reads no more than -b packets. Packets to a    *
+ *             bonded peer are striped over its paths, a client sends     *
+ *             each on the socket of the uplink it picked. With -C the    *
+ *             packets wait in the class queues and a batch is what the   *
+ *             scheduler lets out, by class, while the socket has room.   *
+ *             With -r each frame leaves when its peer's bucket says: fq  *
+ *             is told the time, else frames not due yet wait in the      *
+ *             wheel, and those past the horizon are dropped.             *
+ *             Returns the number of packets read or, when more, let out. *
+ *             dp_tun_to_net is built for the features f, the variants of *
+ *             dp_pick for some, tun_to_net for any.                      *
+ **************************************************************************/
+DP_INLINE int dp_tun_to_net(unsigned f, struct tunnel *t) {
+    
+    struct batch *b = t->tx_batch;
+    struct peer *owner[BATCH_MAX];
+    struct fec_enc *e;
+    struct bond *bd;
+    struct bond_hdr bh;
+    uint64_t stamp[BATCH_MAX], t0 = 0, t1 = 0, t2 = 0, t3, now = 0, at = 0;
+    uint8_t type[BATCH_MAX], link[BATCH_MAX], tos[BATCH_MAX], *payload;
+    unsigned long rx_bytes = 0;
+    char *frame;
+    int n = 0, nrx = 0, nin = 0, i, m, nread, sent, ret, timed = hist_sample();
+    
+    if (timed)
+        t0 = now_nsec();
+    if (DP(f, DP_SCHED, t->sched != NULL))
+        nrx = sched_fill(t, &rx_bytes);
+    while (n < b->size && (!DP(f, DP_FEC, fec_mode) || nin < batch_size)) {
+        if (DP(f, DP_SCHED, t->sched != NULL)) {
+            if ((nread = sched_pop(t, &b->buf[n], &b->addrs[n], &owner[n], &stamp[n], &tos[n])) < 0)
+                break;
+            nin++;
+        } else {
+            if ((nread = dp_tap_take(f, t, b->buf[n], &b->addrs[n], &owner[n], &rx_bytes)) < 0)
+                break;
+            nin = ++nrx;
+            if (timed)
+                stamp[n] = now_nsec();
+            if (nread == 0)
+                continue;
+        }
+        b->iovs[n].iov_len = nread;
+        type[n] = FRAME_DATA;
+        e = NULL;
+        /* FEC: the groups to a peer on one path, so one worker there collects each */
+        if (DP(f, DP_FEC, fec_mode)) {
+            peer_path(owner[n], t->id, &b->addrs[n]);
+            e = fec_add(t, owner[n], (uint8_t *)b->buf[n] + WIRE_HDR_LEN, nread, &b->addrs[n]);
+            b->iovs[n].iov_len += FEC_HDR_LEN;
+            type[n] = FRAME_FEC_DATA;
+        }
+        /* striped: clamped here, frame_seal cannot tell the packet from its trailer */
+        link[n] = 0;
+        if (DP(f, DP_BOND, bond_tx) && atomic_load_explicit(&owner[n]->bonded, memory_order_relaxed)) {
+            payload = (uint8_t *)b->buf[n] + WIRE_HDR_LEN;
+            bd = bond_of(t, owner[n]);
+            frame_clamp(owner[n], FRAME_DATA, payload, nread, C_MSS_TX);
+            link[n] = bond_pick(t, owner[n], bd, &b->addrs[n]);
+            memset(&bh, 0, sizeof(bh));
+            bh.seq = htonl(bd->tx_seq++);
+            bh.stream = t->id;
+            memcpy(payload + nread, &bh, BOND_HDR_LEN);
+            b->iovs[n].iov_len += BOND_HDR_LEN;
+            type[n] = FRAME_BOND_DATA;
+        }
+        n++;
+        /* parity goes best effort, whatever the packets it covers */
+        if (DP(f, DP_FEC, 1) && e != NULL)
+            for (i = n, n = fec_take(t, e, n, owner, type, stamp); i < n; i++)
+                tos[i] = 0;
+    }
+    
+    /* seal the whole batch in one go, the cipher contexts stay hot */
+    if (timed)
+        t1 = now_nsec();
+    if (DP(f, DP_PACE, pace_bps))
+        now = now_nsec();
+    for (i = m = 0; i < n; i++) {
+        payload = (uint8_t *)b->buf[i] + WIRE_HDR_LEN;
+        nread = b->iovs[i].iov_len;
+        if ((ret = dp_frame_seal(f, t, owner[i], (struct wire_hdr *)b->buf[i], type[i], payload, nread, payload + nread)) < 0)
+            ret = 0;    /* cannot happen with a keyed context, send nothing */
+        /* paced: what is sent leaves the batch packed at the front, its slot keeps a buffer */
+        if (DP(f, DP_PACE, pace_bps)) {
+            if ((at = pace_at(owner[i], ret, now)) == 0) {
+                count(C_DROP_PACED, 1);
+                continue;
+            }
+            if (t->txtime && atomic_load_explicit(&owner[i]->pace_fq, memory_order_relaxed) == 1) {
+                count(C_PACE_TXTIME, 1);
+            } else {
+                if (at > now + PACE_TICK_USEC * 1000ULL &&
+                    pace_hold(t, &b->buf[i], ret, link[i], &b->addrs[i], dscp_copy ? tos[i] : 0, at, now) == 0)
+                    continue;
+                at = 0;
+            }
+            frame = b->buf[m];
+            b->buf[m] = b->buf[i];
+            b->buf[i] = frame;
+            b->addrs[m] = b->addrs[i];
+            link[m] = link[i];
+            stamp[m] = stamp[i];
+            tos[m] = tos[i];
+        }
+        b->iovs[m].iov_base = b->buf[m];
+        b->iovs[m].iov_len = ret;
+        memset(&b->msgs[m].msg_hdr, 0, sizeof(b->msgs[m].msg_hdr));
+        b->msgs[m].msg_hdr.msg_name = &b->addrs[m];
+        b->msgs[m].msg_hdr.msg_namelen = sizeof(b->addrs[m]);
+        b->msgs[m].msg_hdr.msg_iov = &b->iovs[m];
+        b->msgs[m].msg_hdr.msg_iovlen = 1;
+        if (DP(f, DP_TXCTL, t->tx_ctl != NULL))
+            tx_cmsg(t, &b->msgs[m].msg_hdr, m, dscp_copy ? tos[m] : 0, at);
+        m++;
+    }
+    n = m;
+    
+    /* sendmmsg() may stop early, keep going from where it left off */
+    if (timed)
+        t2 = now_nsec();
+    if (DP(f, DP_UPLINKS, cliserv == CLIENT && nuplinks > 1)) {
+        sent = bond_send(t, link, n);
+    } else {
+        for (sent = 0; sent < n; sent += ret) {
+            if ((ret = sendmmsg(t->sock_fd, b->msgs + sent, n - sent, 0)) < 0) {
+                if (errno == EINTR) {
+                    ret = 0;
+                    continue;
+                }
+                /* a full socket buffer drops the rest, anything else is worth a word */
+                if (errno != EAGAIN) {
+                    perror("sendmmsg network");
+                    count(C_ERR_SENDMMSG, 1);
+                }
+                count(C_DROP_SOCK_FULL, n - sent);
+                break;
+            }
+            count_sent(b->msgs + sent, ret);
+        }
+    }
+    count(C_TUN_RX_PKTS, nrx);
+    count(C_TUN_RX_BYTES, rx_bytes);
+    if (n > 0)
+        t->last_tx = now_sec();
+    
+    if (timed && n > 0) {
+        t3 = now_nsec();
+        hist_add(H_TX_READ, t1 - t0);
+        hist_add(H_TX_CRYPTO, t2 - t1);
+        hist_add(H_TX_SEND, t3 - t2);
+        for (i = 0; i < sent && i < n; i++)
+            hist_add(H_TUN_NET, t3 - stamp[i]);
+    }
+    
+    return nrx > nin ? nrx : nin;
+}
+
+int tun_to_net(struct tunnel *t) {
+    return dp_tun_to_net(DP_GENERIC, t);
+}
+
+/**************************************************************************
+ * bundle_type: closes the bundle of t for sending. A lone packet loses   *
+ *              its length and goes as a plain data frame. Returns the    *
+ *              frame type.                                               *
+ **************************************************************************/
+uint8_t bundle_type(struct bundle *a) {
+    
+    char *payload = a->frame + WIRE_HDR_LEN;
+    
+    if (a->npkts == 1) {
+        memmove(payload, payload + AGG_LEN, a->len - AGG_LEN);
+        a->len -= AGG_LEN;
+        return FRAME_DATA;
+    }
+    count(C_BUNDLE_TX, 1);
+    count(C_BUNDLE_TX_PKTS, a->npkts);
+    return FRAME_BUNDLE;
+}
+
+/**************************************************************************
+ * bundle_take: puts the bundle of t into slot i of its tx batch, whose   *
+ *              buffer is free and becomes the next bundle's, and empties *
+ *              the bundle.                                               *
+ **************************************************************************/
+void bundle_take(struct tunnel *t, int i, struct peer **owner, uint8_t *type, uint64_t *stamp) {
+    
+    struct batch *b = t->tx_batch;
+    struct bundle *a = &t->bundle;
+    char *frame = b->buf[i];
+    
+    type[i] = bundle_type(a);
+    b->buf[i] = a->frame;
+    a->frame = frame;
+    b->iovs[i].iov_len = a->len;
+    b->addrs[i] = a->addr;
+    owner[i] = a->p;
+    stamp[i] = a->stamp;
+    a->len = a->npkts = 0;
+}
+
+/**************************************************************************
+ * bundle_arm: (re)starts the deadline timer of t to expire in nsec.      *
+ **************************************************************************/
+void bundle_arm(struct tunnel *t, uint64_t nsec) {
+    
+    struct itimerspec its;
+    
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = nsec / 1000000000;
+    its.it_value.tv_nsec = nsec % 1000000000;
+    if (timerfd_settime(t->agg_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime()");
+        exit(1);
+    }
+    t->bundle.armed = 1;
+}
+
+/**************************************************************************
+ * tun_to_net_agg: tun_to_net for aggregation mode (-A). Packets up to    *
+ *                 half a bundle are copied into the bundle of their      *
+ *                 peer and path, larger ones go on their own; a bundle   *
+ *                 fills agg_mtu or the peer's path MTU, the smaller. It  *
+ *                 takes the batch slot of the packet that closed it, so  *
+ *                 every packet of a peer leaves in the order it was      *
+ *                 read; the last one waits up to agg_usec for company.   *
+ *                 Returns the number of packets read.                    *
+ **************************************************************************/
+int tun_to_net_agg(struct tunnel *t) {
+    
+    struct batch *b = t->tx_batch;
+    struct bundle *a = &t->bundle;
+    struct peer *owner[2 * BATCH_MAX + 1], *p;
+    uint64_t stamp[2 * BATCH_MAX + 1], t0 = 0, t1 = 0, t2 = 0, t3;
+    uint8_t type[2 * BATCH_MAX + 1], *payload;
+    unsigned long rx_bytes = 0;
+    char *frame;
+    int n = 0, nrx = 0, i, nread, sent, ret, small, room, timed = hist_sample();
+    
+    if (timed)
+        t0 = now_nsec();
+    while (nrx < batch_size) {
+        if ((nread = read(t->tap_fd, b->buf[n] + WIRE_HDR_LEN, PKT_ROOM)) < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("read from virtual");
+                count(C_ERR_READ, 1);
+            }
+            break;
+        }
+        nrx++;
+        rx_bytes += nread;
+        stamp[n] = timed ? now_nsec() : 0;
+        
+        p = tx_route((uint8_t *)b->buf[n] + WIRE_HDR_LEN, nread, &b->addrs[n]);
+        if (cap)
+            cap_add(CAP_INNER, CAP_TX, cap_id(p), b->buf[n] + WIRE_HDR_LEN, nread, NULL);
+        if (p == NULL) {
+            count(C_DROP_NO_ROUTE, 1);
+            continue;
+        }
+        
+        /* what is bundled goes first when it is for another peer or path, is
+         * full, or would be overtaken by this packet of its peer */
+        if ((room = pmtu_room(p)) == 0 || room > agg_room)
+            room = agg_room;
+        small = AGG_LEN + nread <= room / 2;
+        if (a->npkts > 0 && (small ? a->p != p || path_key(&a->addr) != path_key(&b->addrs[n]) ||
+                                     a->len + AGG_LEN + nread > room : a->p == p)) {
+            frame = b->buf[n + 1];
+            b->buf[n + 1] = b->buf[n];
+            b->buf[n] = frame;
+            b->addrs[n + 1] = b->addrs[n];
+            stamp[n + 1] = stamp[n];
+            bundle_take(t, n++, owner, type, stamp);
+        }
+        
+        if (small) {
+            if (a->npkts == 0) {
+                a->p = p;
+                a->addr = b->addrs[n];
+                a->first = now_nsec();
+                a->stamp = stamp[n];
+            }
+            payload = (uint8_t *)a->frame + WIRE_HDR_LEN + a->len;
+            payload[0] = nread >> 8;
+            payload[1] = nread;
+            memcpy(payload + AGG_LEN, b->buf[n] + WIRE_HDR_LEN, nread);
+            a->len += AGG_LEN + nread;
+            a->npkts++;
+            continue;
+        }
+        owner[n] = p;
+        type[n] = FRAME_DATA;
+        b->iovs[n].iov_len = nread;
+        n++;
+    }
+    
+    /* the tun queue is empty: a last bundle goes now or at its deadline */
+    if (a->npkts > 0) {
+        if (agg_usec == 0)
+            bundle_take(t, n++, owner, type, stamp);
+        else if (!a->armed)
+            bundle_arm(t, (uint64_t)agg_usec * 1000);
+    }
+    
+    if (timed)
+        t1 = now_nsec();
+    for (i = 0; i < n; i++) {
+        payload = (uint8_t *)b->buf[i] + WIRE_HDR_LEN;
+        nread = b->iovs[i].iov_len;
+        if ((ret = frame_seal(t, owner[i], (struct wire_hdr *)b->buf[i], type[i], payload, nread, payload + nread)) < 0)
+            ret = 0;
+        b->iovs[i].iov_base = b->buf[i];
+        b->iovs[i].iov_len = ret;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    if (timed)
+        t2 = now_nsec();
+    for (sent = 0; sent < n; sent += ret) {
+        if ((ret = sendmmsg(t->sock_fd, b->msgs + sent, n - sent, 0)) < 0) {
+            if (errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("sendmmsg network");
+                count(C_ERR_SENDMMSG, 1);
+            }
+            count(C_DROP_SOCK_FULL, n - sent);
+            break;
+        }
+        count_sent(b->msgs + sent, ret);
+    }
+    count(C_TUN_RX_PKTS, nrx);
+    count(C_TUN_RX_BYTES, rx_bytes);
+    if (n > 0)
+        t->last_tx = now_sec();
+    
+    /* a bundle carries the read time of its first packet, 0 if untimed */
+    if (timed && n > 0) {
+        t3 = now_nsec();
+        hist_add(H_TX_READ, t1 - t0);
+        hist_add(H_TX_CRYPTO, t2 - t1);
+        hist_add(H_TX_SEND, t3 - t2);
+        for (i = 0; i < sent && i < n; i++)
+            if (stamp[i])
+                hist_add(H_TUN_NET, t3 - stamp[i]);
+    }
+    
+    return nrx;
+}
+
+/**************************************************************************
+ * hello_parse: checks a HELLO payload (magic word, route count, then     *
+ *              count times address and prefix length, then maybe the     *
+ *              resume bound, the challenge echoed and the floor) and     *
+ *              fills r, *resume, *challenge and *floor, 0 for what there *
+ *              is none of. Returns the number of routes or -1 if         *
+ *              malformed.                                                *
+ **************************************************************************/
+int hello_parse(const uint8_t *pl, int len, struct route *r, uint64_t *resume, uint64_t *challenge,
+                uint64_t *floor) {
+    
+    int i, n;
+    uint32_t prefix;
+    
+    *resume = *challenge = *floor = 0;
+    if (len < (int)sizeof(MAGIC_WORD) + 1 || memcmp(pl, MAGIC_WORD, sizeof(MAGIC_WORD)) != 0)
+        return -1;
+    pl += sizeof(MAGIC_WORD);
+    n = *pl++;
+    if (n > PEER_ROUTES_MAX || len < (int)sizeof(MAGIC_WORD) + 1 + 5 * n)
+        return -1;
+    for (i = 0; i < n; i++, pl += 5) {
+        memcpy(&prefix, pl, 4);
+        r[i].len = pl[4] > 32 ? 32 : pl[4];
+        /* keep host bits out of the trie */
+        r[i].prefix = r[i].len ? ntohl(prefix) & ~0U << (32 - r[i].len) : 0;
+    }
+    /* older clients end here */
+    if (len >= (int)sizeof(MAGIC_WORD) + 1 + 5 * n + HELLO_RESUME_LEN) {
+        memcpy(resume, pl, HELLO_RESUME_LEN);
+        *resume = be64toh(*resume);
+    }
+    if (len >= (int)sizeof(MAGIC_WORD) + 1 + 5 * n + HELLO_RESUME_LEN + HELLO_CHALLENGE_LEN) {
+        memcpy(challenge, pl + HELLO_RESUME_LEN, HELLO_CHALLENGE_LEN);
+        *challenge = be64toh(*challenge);
+    }
+    if (len >= (int)sizeof(MAGIC_WORD) + 1 + 5 * n + HELLO_RESUME_LEN + HELLO_CHALLENGE_LEN + HELLO_FLOOR_LEN) {
+        memcpy(floor, pl + HELLO_RESUME_LEN + HELLO_CHALLENGE_LEN, HELLO_FLOOR_LEN);
+        *floor = be64toh(*floor);
+    }
+    return n;
+}
+
+/**************************************************************************
+ * hello_resume: client: a bound above every sequence number the server   *
+ *               may have sealed for our session, for it to go on from    *
+ *               should it have forgotten us.                             *
+ **************************************************************************/
+uint64_t hello_resume(void) {
+    
+    uint64_t seq = replay_bound(&peers[0].replay) + RESUME_SEQ_GAP;
+    
+    return seq > resume_floor ? seq : resume_floor;
+}
+
+/**************************************************************************
+ * hello_build: writes our HELLO payload behind the header of frame and   *
+ *              returns its length. frame has room for HELLO_LEN_MAX.     *
+ **************************************************************************/
+int hello_build(char *frame) {
+    
+    uint8_t *pl = (uint8_t *)frame + WIRE_HDR_LEN;
+    uint64_t resume, challenge, floor;
+    uint32_t prefix;
+    int i;
+    
+    memcpy(pl, MAGIC_WORD, sizeof(MAGIC_WORD));
+    pl += sizeof(MAGIC_WORD);
+    *pl++ = my_nroutes;
+    for (i = 0; i < my_nroutes; i++, pl += 5) {
+        prefix = htonl(my_routes[i].prefix);
+        memcpy(pl, &prefix, 4);
+        pl[4] = my_routes[i].len;
+    }
+    resume = htobe64(hello_resume());
+    memcpy(pl, &resume, HELLO_RESUME_LEN);
+    pl += HELLO_RESUME_LEN;
+    challenge = htobe64(atomic_load(&hello_challenge));
+    memcpy(pl, &challenge, HELLO_CHALLENGE_LEN);
+    pl += HELLO_CHALLENGE_LEN;
+    floor = htobe64(tx_floor);
+    memcpy(pl, &floor, HELLO_FLOOR_LEN);
+    pl += HELLO_FLOOR_LEN;
+    return pl - (uint8_t *)frame - WIRE_HDR_LEN;
+}
+
+/**************************************************************************
+ * retry_send: server: asks the client that sent hdr, for a session we    *
+ *             have no peer for (we restarted or expired it), to HELLO    *
+ *             again, or for one held to HELLO again echoing challenge.   *
+ *             Unsealed, there is no key to seal it with (or none we may  *
+ *             seal with yet); only the header, no bigger than what it    *
+ *             answers; and at most RETRY_PER_SEC a second per worker.    *
+ **************************************************************************/
+void retry_send(struct tunnel *t, struct wire_hdr *hdr, struct sockaddr_in *addr, uint64_t challenge) {
+    
+    char frame[WIRE_HDR_LEN];
+    int n;
+    
+    /* only what a client sends on its own, never an answer */
+    if ((hdr->type != FRAME_DATA && (hdr->type != FRAME_HELLO || challenge == 0) && hdr->type != FRAME_BUNDLE && hdr->type != FRAME_KEEPALIVE &&
+         hdr->type != FRAME_PROBE && hdr->type != FRAME_FEC_DATA && hdr->type != FRAME_FEC_PARITY &&
+         hdr->type != FRAME_BOND_DATA && hdr->type != FRAME_LINK_PROBE && hdr->type != FRAME_DELAY_PROBE) ||
+        t->retry_budget <= 0)
+        return;
+    t->retry_budget--;
+    n = wire_encap(frame, FRAME_RETRY, 0, ntohl(hdr->session), challenge);
+    if ((n = sendto(t->sock_fd, frame, n, 0, (struct sockaddr *)addr, sizeof(*addr))) < 0) {
+        count(errno == EAGAIN ? C_DROP_SOCK_FULL : C_ERR_SENDTO, 1);
+        return;
+    }
+    count(C_NET_TX_PKTS, 1);
+    count(C_NET_TX_BYTES, n);
+}
+
+/**************************************************************************
+ * uplink_echo: takes the RTT sample of the link_probe at pl, which the   *
+ *              server sent back down the uplink it came by, and has      *
+ *              the uplink carry data again if it had gone silent.        *
+ **************************************************************************/
+void uplink_echo(struct tunnel *t, const uint8_t *pl) {
+    
+    struct link_probe lp;
+    struct uplink_state *u;
+    uint64_t now = now_nsec();
+    int64_t rtt;
+    
+    memcpy(&lp, pl, LINK_PROBE_LEN);
+    if (lp.link >= nuplinks || lp.stamp > now)
+        return;
+    u = &t->up[lp.link];
+    rtt = (now - lp.stamp) / 1000;
+    u->srtt = u->srtt ? u->srtt + (rtt - (int64_t)u->srtt) / 8 : (rtt > 0 ? rtt : 1);
+    u->acked++;
+    u->echo_at = now;
+    if (!u->up) {
+        u->up = 1;
+        if (t->id == 0)
+            printf("Uplink %d (%s) is back\n", lp.link, uplinks[lp.link].name);
+    }
+}
+
+/**************************************************************************
+ * pace_echo: takes the RTT sample of the delay probe at pl, which peer p *
+ *            sent back: smoothed, and the least of this window and of    *
+ *            the window before.                                          *
+ **************************************************************************/
+void pace_echo(struct peer *p, const uint8_t *pl) {
+    
+    uint64_t stamp, now = now_nsec();
+    unsigned rtt, srtt, least;
+    
+    memcpy(&stamp, pl, DELAY_PROBE_LEN);
+    if (stamp > now)
+        return;
+    rtt = (now - stamp) / 1000;
+    rtt = rtt ? rtt : 1;
+    srtt = atomic_load(&p->pace_srtt);
+    atomic_store(&p->pace_srtt, srtt ? srtt + ((int)rtt - (int)srtt) / 4 : rtt);
+    if ((least = atomic_load(&p->pace_min)) == 0 || rtt < least)
+        atomic_store(&p->pace_min, rtt);
+    if ((least = atomic_load(&p->pace_min_next)) == 0 || rtt < least)
+        atomic_store(&p->pace_min_next, rtt);
+}
+
+/**************************************************************************
+ * rx_frame: common handling of a valid frame from addr. The session and *
+ *           socket pick the peer; a HELLO makes a new one, a known       *
+ *           session from a new socket adds a path once the frame checks  *
+ *           out, an unknown one is answered with a RETRY. Control        *
+ *           frames, path MTU probes among them, are opened and answered  *
+ *           here, uplink and delay probes among them. Returns the peer   *
+ *           of a data, bundle, striped or FEC data or parity frame,      *
+ *           still to be opened by the caller with frame_open (in batches *
+ *           where it can), or NULL.                                      *
+ **************************************************************************/
+struct peer *rx_frame(struct tunnel *t, struct wire_hdr *hdr, struct sockaddr_in *addr) {
+    
+    char frame[WIRE_HDR_LEN + HELLO_LEN_MAX + AEAD_TAG_LEN];
+    struct route r[PEER_ROUTES_MAX];
+    uint32_t session = ntohl(hdr->session);
+    uint64_t key = path_key(addr), resume, challenge, floor, held;
+    uint8_t *pl = (uint8_t *)(hdr + 1);
+    struct peer *p;
+    time_t now, sent;
+    uint32_t epoch, fec[2];
+    struct link_probe lp;
+    int nroutes, len, size, acked, loss, i, n, path = -1;
+    
+    if (cap)
+        cap_add(CAP_OUTER, CAP_RX, cap_peer(addr, session), hdr, WIRE_HDR_LEN + ntohs(hdr->length), addr);
+    if (cliserv == CLIENT) {
+        /* what a bridging server floods to all its clients */
+        if (tap_mode && flood.in_use && session == flood.session && hdr->type == FRAME_DATA)
+            return &flood;
+        /* only ever our server, any socket of it is fine */
+        if (session != my_session) {
+            count(C_DROP_NO_PEER, 1);
+            return NULL;
+        }
+        p = &peers[0];
+        if (hdr->type == FRAME_RETRY) {
+            /* unsealed, anyone may send one: while the server's own frames still open it has not lost us */
+            now = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+            if (now - atomic_load(&p->auth_rx) < RETRY_QUIET_SEC) {
+                count(C_DROP_AUTH, 1);
+                return NULL;
+            }
+            /* the server lost our session: HELLO again now, once a second at most */
+            sent = atomic_load(&hello_sent);
+            atomic_store(&hello_acked, 0);
+            /* or it wants a challenge echoed: that goes at once, but once per HELLO of ours */
+            if ((challenge = be64toh(hdr->seq)) != 0 && atomic_exchange(&hello_challenge, challenge) != challenge &&
+                atomic_exchange(&hello_echo, 0)) {
+                if (send_frame(t, p, frame, FRAME_HELLO, hello_build(frame), addr) < 0 && errno != EAGAIN)
+                    perror("sendto hello");
+            } else if (now - sent >= HELLO_RTO_SEC && atomic_compare_exchange_strong(&hello_sent, &sent, now)) {
+                atomic_store(&hello_echo, 1);
+                if (send_frame(t, p, frame, FRAME_HELLO, hello_build(frame), addr) < 0 && errno != EAGAIN)
+                    perror("sendto hello");
+            }
+            return NULL;
+        }
+    } else if (hdr->type == FRAME_HELLO) {
+        /* (re)connect: start the peer over with the announced routes */
+        /* a session we know has a window, so a replayed HELLO cannot reset it */
+        p = ptable_lookup(0, session, &path);
+        if (session == 0 || (len = p ? frame_open(t, p, hdr) : hello_open(t, hdr)) < 0 ||
+            (nroutes = hello_parse((uint8_t *)(hdr + 1), len, r, &resume, &challenge, &floor)) < 0)
+            return NULL;
+        if ((p = peer_add(session, addr, SEQ_LANE(be64toh(hdr->seq)), r, nroutes, resume, floor)) == NULL) {
+            fprintf(stderr, "Too many peers, refusing %s\n", inet_ntoa(addr->sin_addr));
+            return NULL;
+        }
+        /* this HELLO may be an old one played back: the client has to echo, then where it says goes */
+        if ((held = atomic_load(&p->challenge)) != 0 && challenge != held) {
+            retry_send(t, hdr, addr, held);
+            return NULL;
+        }
+        peer_resume(p, resume, floor);
+        printf("SERVER: Client connected from %s:%i as peer %d with %d route(s)\n",
+               inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), p->id, nroutes);
+    } else if ((p = ptable_lookup(key, session, &path)) == NULL) {
+        /* a known session on a new socket: another client worker, or the client moved */
+        if ((p = ptable_lookup(0, session, &path)) == NULL) {
+            count(C_DROP_NO_PEER, 1);
+            retry_send(t, hdr, addr, 0);
+            return NULL;
+        }
+        if (frame_open(t, p, hdr) < 0)
+            return NULL;
+        peer_learn(p, addr, SEQ_LANE(be64toh(hdr->seq)), 0);
+    }
+    
+    /* control frames are rare, open them right away */
+    if (hdr->type != FRAME_DATA && hdr->type != FRAME_BUNDLE && hdr->type != FRAME_FEC_DATA &&
+        hdr->type != FRAME_FEC_PARITY && hdr->type != FRAME_BOND_DATA && frame_open(t, p, hdr) < 0)
+        return NULL;
+    
+    /* avoid dirtying the shared line when nothing changed */
+    now = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+    if (atomic_load_explicit(&p->last_rx, memory_order_relaxed) != now)
+        atomic_store_explicit(&p->last_rx, now, memory_order_relaxed);
+    if (path >= 0 && atomic_load_explicit(&p->path_rx[path], memory_order_relaxed) != now)
+        atomic_store_explicit(&p->path_rx[path], now, memory_order_relaxed);
+    
+    switch (hdr->type) {
+        case FRAME_DATA:
+        case FRAME_BUNDLE:
+        case FRAME_FEC_DATA:
+        case FRAME_FEC_PARITY:
+        case FRAME_BOND_DATA:
+            return p;
+        case FRAME_HELLO:
+            /* answer so the client can carry on, bridging with the session we flood under */
+            epoch = htonl(flood.session);
+            memcpy(frame + WIRE_HDR_LEN, &epoch, FLOOD_EPOCH_LEN);
+            if (cliserv == SERVER &&
+                send_frame(t, p, frame, FRAME_HELLO_ACK, tap_mode ? FLOOD_EPOCH_LEN : 0, addr) < 0)
+                perror("sendto");
+            break;
+        case FRAME_HELLO_ACK:
+            if (cliserv == CLIENT && tap_mode && ntohs(hdr->length) >= FLOOD_EPOCH_LEN) {
+                memcpy(&epoch, pl, FLOOD_EPOCH_LEN);
+                flood_key(ntohl(epoch));
+            }
+            /* the first answer to our latest HELLO has the workers announce their paths */
+            if (cliserv == CLIENT && !atomic_exchange(&hello_acked, 1)) {
+                atomic_fetch_add(&hello_gen, 1);
+                printf("Connection with %s:%i established\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+            }
+            break;
+        case FRAME_PROBE:
+            /* say which size made it, the answer itself is small */
+            if (ntohs(hdr->length) >= PROBE_ACK_LEN) {
+                memcpy(frame + WIRE_HDR_LEN, pl, PROBE_ACK_LEN);
+                send_frame(t, p, frame, FRAME_PROBE_ACK, PROBE_ACK_LEN, addr);
+            }
+            break;
+        case FRAME_PROBE_ACK:
+            if (ntohs(hdr->length) < PROBE_ACK_LEN)
+                break;
+            size = pl[0] << 8 | pl[1];
+            acked = atomic_load(&p->probe_acked);
+            while (size > acked && !atomic_compare_exchange_weak(&p->probe_acked, &acked, size))
+                ;
+            break;
+        case FRAME_FEC_REPORT:
+            /* what -F auto sizes parity by: taken at once when it grows, let go of slowly */
+            if (ntohs(hdr->length) < FEC_REPORT_LEN)
+                break;
+            memcpy(fec, pl, FEC_REPORT_LEN);
+            if ((fec[0] = ntohl(fec[0])) == 0 || (fec[1] = ntohl(fec[1])) > fec[0])
+                break;
+            loss = (uint64_t)(fec[0] - fec[1]) * 1000000 / fec[0];
+            acked = atomic_load(&p->fec_loss);
+            atomic_store(&p->fec_loss, loss > acked ? loss : acked + (loss - acked) / 4);
+            break;
+        case FRAME_LINK_PROBE:
+            /* the path it came by is alive unless the client hears nothing back, and as good as it measured */
+            if (cliserv != SERVER || ntohs(hdr->length) < LINK_PROBE_LEN)
+                break;
+            memcpy(&lp, pl, LINK_PROBE_LEN);
+            n = atomic_load_explicit(&p->npaths, memory_order_acquire);
+            for (i = 0; i < n; i++)
+                if (atomic_load_explicit(&p->paths[i], memory_order_relaxed) == key)
+                    break;
+            if (i < n) {
+                atomic_store_explicit(&p->path_srtt[i], lp.srtt ? ntohl(lp.srtt) : BOND_RTT_INIT_USEC,
+                                      memory_order_relaxed);
+                atomic_store_explicit(&p->path_loss[i], ntohl(lp.loss), memory_order_relaxed);
+                atomic_store_explicit(&p->path_seen[i], lp.up ? now_nsec() : 0, memory_order_relaxed);
+            }
+            if (!atomic_exchange(&p->bonded, 1))
+                printf("SERVER: Peer %d bonds its uplinks\n", p->id);
+            memcpy(frame + WIRE_HDR_LEN, pl, LINK_PROBE_LEN);
+            send_frame(t, p, frame, FRAME_LINK_ECHO, LINK_PROBE_LEN, addr);
+            break;
+        case FRAME_LINK_ECHO:
+            if (cliserv == CLIENT && ntohs(hdr->length) >= LINK_PROBE_LEN)
+                uplink_echo(t, pl);
+            break;
+        case FRAME_DELAY_PROBE:
+            /* whether we pace or not, the sender's clock goes back as it came */
+            if (ntohs(hdr->length) >= DELAY_PROBE_LEN) {
+                memcpy(frame + WIRE_HDR_LEN, pl, DELAY_PROBE_LEN);
+                send_frame(t, p, frame, FRAME_DELAY_ECHO, DELAY_PROBE_LEN, addr);
+            }
+            break;
+        case FRAME_DELAY_ECHO:
+            if (pace_auto && ntohs(hdr->length) >= DELAY_PROBE_LEN)
+                pace_echo(p, pl);
+            break;
+        default:
+            /* keepalives and stray acks carry nothing for tun */
+            break;
+    }
+    return NULL;
+}
+
+/**************************************************************************
+ * dp_rx_frame: rx_frame built for the features f. A data or bundle       *
+ *              frame of a peer on a path it already has goes straight    *
+ *              through, everything else takes rx_frame.                  *
+ **************************************************************************/
+DP_INLINE struct peer *dp_rx_frame(unsigned f, struct tunnel *t, struct wire_hdr *hdr, struct sockaddr_in *addr) {
+    
+    uint32_t session = ntohl(hdr->session);
+    struct peer *p;
+    time_t now;
+    int path = -1;
+    
+    if (DP(f, DP_CAP, cap != NULL) || (hdr->type != FRAME_DATA && hdr->type != FRAME_BUNDLE))
+        return rx_frame(t, hdr, addr);
+    if (DP(f, DP_CLIENT, cliserv == CLIENT)) {
+        if (session != my_session || (DP(f, DP_TAP, tap_mode) && flood.in_use && session == flood.session))
+            return rx_frame(t, hdr, addr);
+        p = &peers[0];
+    } else if ((p = ptable_lookup(path_key(addr), session, &path)) == NULL) {
+        return rx_frame(t, hdr, addr);
+    }
+    now = atomic_load_explicit(&coarse_now, memory_order_relaxed);
+    if (atomic_load_explicit(&p->last_rx, memory_order_relaxed) != now)
+        atomic_store_explicit(&p->last_rx, now, memory_order_relaxed);
+    if (path >= 0 && atomic_load_explicit(&p->path_rx[path], memory_order_relaxed) != now)
+        atomic_store_explicit(&p->path_rx[path], now, memory_order_relaxed);
+    return p;
+}
+
+/**************************************************************************
+ * bundle_next: the next packet of the len byte bundle at pl, from offset *
+ *              *off on, which it moves past the packet. Returns NULL at  *
+ *              the end, or where the rest does not parse.                *
+ **************************************************************************/
+uint8_t *bundle_next(uint8_t *pl, int len, int *off, int *plen) {
+    
+    int n;
+    
+    if (*off == len)
+        return NULL;
+    if (len - *off < AGG_LEN || (n = pl[*off] << 8 | pl[*off + 1]) == 0 || n > len - *off - AGG_LEN) {
+        count(C_DROP_MALFORMED, 1);
+        return NULL;
+    }
+    *plen = n;
+    *off += AGG_LEN + n;
+    return pl + *off - n;
+}
+
+/**************************************************************************
+ * tun_write: writes one packet from peer from to tun/tap, l2_input       *
+ *            switching it first in TAP mode. Adds its bytes to *bytes    *
+ *            and returns 1 if it was written. dp_tun_write is built for  *
+ *            the features f.                                             *
+ **************************************************************************/
+DP_INLINE int dp_tun_write(unsigned f, struct tunnel *t, struct peer *from, uint8_t *pkt, int len, unsigned long *bytes) {
+    
+    if (DP(f, DP_TAP, tap_mode) && from && !l2_input(t, from, pkt, len))
+        return 0;
+    if (DP(f, DP_CAP, cap != NULL))
+        cap_add(CAP_INNER, CAP_RX, cap_id(from), pkt, len, NULL);
+    if (write(t->tap_fd, pkt, len) < 0) {
+        perror("write to virtual");
+        count(C_ERR_WRITE, 1);
+        return 0;
+    }
+    *bytes += len;
+    return 1;
+}
+
+int tun_write(struct tunnel *t, struct peer *from, uint8_t *pkt, int len, unsigned long *bytes) {
+    return dp_tun_write(DP_GENERIC, t, from, pkt, len, bytes);
+}
+
+/**************************************************************************
+ * fec_report_peer: tells peer i how many of its FEC shards worker t      *
+ *                  should have had since the last report, and how many   *
+ *                  came.                                                 *
+ **************************************************************************/
+void fec_report_peer(struct tunnel *t, int i) {
+    
+    char frame[WIRE_HDR_LEN + FEC_REPORT_LEN + AEAD_TAG_LEN];
+    struct peer_ctx *pc = &t->pctx[i];
+    struct sockaddr_in addr;
+    uint32_t v[2];
+    
+    if (peers[i].in_use) {
+        v[0] = htonl(pc->fec_expected);
+        v[1] = htonl(pc->fec_got);
+        memcpy(frame + WIRE_HDR_LEN, v, FEC_REPORT_LEN);
+        peer_path(&peers[i], t->id, &addr);
+        send_frame(t, &peers[i], frame, FRAME_FEC_REPORT, FEC_REPORT_LEN, &addr);
+    }
+    pc->fec_expected = pc->fec_got = 0;
+}
+
+/**************************************************************************
+ * fec_retire: group g leaves its slot: what of it came goes in the       *
+ *             next loss report to its peer, what could not be            *
+ *             rebuilt is counted lost. A group whose parity all went     *
+ *             missing cannot say how large it was and counts for         *
+ *             nothing. The report goes early once it has enough to say,  *
+ *             so -F auto sizes up before the first second is out.        *
+ **************************************************************************/
+void fec_retire(struct tunnel *t, struct fec_group *g) {
+    
+    struct peer_ctx *pc = &t->pctx[g->peer];
+    int lost;
+    
+    if (g->count == 0)
+        return;
+    pc->fec_expected += g->count + g->parity;
+    pc->fec_got += g->got;
+    if (pc->fec_expected >= FEC_REPORT_SHARDS)
+        fec_report_peer(t, g->peer);
+    if ((lost = g->count - __builtin_popcountll(g->have & ((1ULL << g->count) - 1))) > 0)
+        count(C_FEC_LOST, lost);
+}
+
+/**************************************************************************
+ * fec_slot: the slot worker t collects group of peer p in, taken         *
+ *           over from an older group it held before. The peer's slots    *
+ *           and their shard memory come with its first FEC frame.        *
+ *           NULL for a group older than the one in its slot: it is out   *
+ *           of the window, the live one stays.                           *
+ **************************************************************************/
+struct fec_group *fec_slot(struct tunnel *t, struct peer *p, uint32_t group) {
+    
+    struct peer_ctx *pc = &t->pctx[p->id];
+    struct fec_group *g;
+    uint8_t *mem;
+    int i, j;
+    
+    if (pc->fec_rx == NULL) {
+        if ((pc->fec_rx = calloc(FEC_GROUPS, sizeof(*pc->fec_rx))) == NULL ||
+            (mem = malloc((size_t)FEC_GROUPS * FEC_SHARDS * FEC_SHARD_MAX)) == NULL) {
+            perror("fec_slot");
+            exit(1);
+        }
+        for (i = 0; i < FEC_GROUPS; i++)
+            for (j = 0; j < FEC_SHARDS; j++)
+                pc->fec_rx[i].shard[j] = mem + ((size_t)i * FEC_SHARDS + j) * FEC_SHARD_MAX;
+        t->fec_rx = 1;
+    }
+    /* the peer's groups are numbered in turn, so they take the slots in turn */
+    g = &pc->fec_rx[group & (FEC_GROUPS - 1)];
+    if (g->session == p->session && g->group == group)
+        return g;
+    if (g->session == p->session && (int32_t)(group - g->group) < 0)
+        return NULL;
+    if (g->session != 0)
+        fec_retire(t, g);
+    g->session = p->session;
+    g->group = group;
+    g->peer = p->id;
+    g->count = g->parity = g->len = 0;
+    g->have = 0;
+    g->got = g->done = 0;
+    return g;
+}
+
+/**************************************************************************
+ * fec_rebuild: once group g of peer from has as many shards as it had    *
+ *              data packets, solves for those still missing: each        *
+ *              parity shard less the data that came is a sum of the      *
+ *              missing shards, and the inverse of their coefficients     *
+ *              in those sums turns the parity into them. Writes what     *
+ *              it rebuilt and returns the number.                        *
+ **************************************************************************/
+int fec_rebuild(struct tunnel *t, struct peer *from, struct fec_group *g, unsigned long *bytes) {
+    
+    uint8_t a[FEC_M_MAX][FEC_M_MAX], inv[FEC_M_MAX][FEC_M_MAX], *out, *sum;
+    int lost[FEC_K_MAX], rows[FEC_M_MAX], nlost = 0, nrows = 0, i, r, c, plen, n = 0;
+    
+    if (g->done || g->count == 0)
+        return 0;
+    for (i = 0; i < g->count; i++) {
+        if (!(g->have >> i & 1)) {
+            lost[nlost++] = i;
+        } else if (g->slen[i] > g->len) {
+            count(C_DROP_MALFORMED, 1);
+            g->done = 1;
+            return 0;
+        }
+    }
+    for (r = 0; r < g->parity && nrows < nlost; r++)
+        if (g->have >> (FEC_K_MAX + r) & 1)
+            rows[nrows++] = r;
+    if (nlost > 0 && nrows < nlost)
+        return 0;
+    g->done = 1;
+    if (nlost == 0)
+        return 0;
+    
+    for (r = 0; r < nlost; r++)
+        for (c = 0; c < nlost; c++)
+            a[r][c] = fec_coef[rows[r]][lost[c]];
+    if (gf_invert(a, inv, nlost) < 0)
+        return 0;
+    /* the parity shards become the sums of the missing ones */
+    for (r = 0; r < nlost; r++) {
+        sum = g->shard[FEC_K_MAX + rows[r]];
+        for (i = 0; i < g->count; i++)
+            if (g->have >> i & 1)
+                gf_madd(sum, g->shard[i], fec_coef[rows[r]][i], g->slen[i]);
+    }
+    for (c = 0; c < nlost; c++) {
+        out = g->shard[lost[c]];
+        memset(out, 0, g->len);
+        for (r = 0; r < nlost; r++)
+            gf_madd(out, g->shard[FEC_K_MAX + rows[r]], inv[c][r], g->len);
+        if ((plen = out[0] << 8 | out[1]) == 0 || plen > g->len - 2) {
+            count(C_DROP_MALFORMED, 1);
+            continue;
+        }
+        g->have |= 1ULL << lost[c];
+        count(C_FEC_REBUILT, 1);
+        frame_clamp(from, FRAME_DATA, out + 2, plen, C_MSS_RX);
+        n += tun_write(t, from, out + 2, plen, bytes);
+    }
+    return n;
+}
+
+/**************************************************************************
+ * fec_input: tun_deliver for the FEC frames of peer from. The packet     *
+ *            of a data frame is written at once and kept as the          *
+ *            shard it was coded as, unless it comes after it was         *
+ *            rebuilt; parity is kept; and a group with enough shards     *
+ *            has what it lacks rebuilt and written right away. Without   *
+ *            a peer (the pipeline), or for a group already out of the    *
+ *            window, data is just written, parity dropped. Returns the   *
+ *            packets written.                                            *
+ **************************************************************************/
+int fec_input(struct tunnel *t, struct peer *from, uint8_t type, uint8_t *pl, int len, unsigned long *bytes) {
+    
+    struct fec_hdr h;
+    struct fec_group *g;
+    int n = len - FEC_HDR_LEN;
+    
+    if (n < 0) {
+        count(C_DROP_MALFORMED, 1);
+        return 0;
+    }
+    if (type == FRAME_FEC_DATA) {
+        memcpy(&h, pl + n, FEC_HDR_LEN);
+        if (from == NULL || h.index >= FEC_K_MAX || n > PKT_ROOM ||
+            (g = fec_slot(t, from, ntohl(h.group))) == NULL)
+            return tun_write(t, from, pl, n, bytes);
+        if (g->have >> h.index & 1) {
+            count(C_FEC_LATE, 1);
+            return 0;
+        }
+        g->have |= 1ULL << h.index;
+        g->got++;
+        if (!g->done) {
+            g->slen[h.index] = 2 + n;
+            g->shard[h.index][0] = n >> 8;
+            g->shard[h.index][1] = n;
+            memcpy(g->shard[h.index] + 2, pl, n);
+        }
+        frame_clamp(from, FRAME_DATA, pl, n, C_MSS_RX);
+        return tun_write(t, from, pl, n, bytes) + fec_rebuild(t, from, g, bytes);
+    }
+    
+    memcpy(&h, pl, FEC_HDR_LEN);
+    if (from == NULL)
+        return 0;
+    if (h.count == 0 || h.count > FEC_K_MAX || h.parity == 0 || h.parity > FEC_M_MAX || h.index >= h.parity ||
+        n < 2 || n > FEC_SHARD_MAX) {
+        count(C_DROP_MALFORMED, 1);
+        return 0;
+    }
+    if ((g = fec_slot(t, from, ntohl(h.group))) == NULL)
+        return 0;
+    if (g->count == 0) {
+        g->count = h.count;
+        g->parity = h.parity;
+        g->len = n;
+    }
+    if (g->count != h.count || g->parity != h.parity || g->len != n) {
+        count(C_DROP_MALFORMED, 1);
+        return 0;
+    }
+    if (g->have >> (FEC_K_MAX + h.index) & 1)
+        return 0;
+    g->have |= 1ULL << (FEC_K_MAX + h.index);
+    g->got++;
+    if (g->done)
+        return 0;
+    memcpy(g->shard[FEC_K_MAX + h.index], pl + FEC_HDR_LEN, n);
+    return fec_rebuild(t, from, g, bytes);
+}
+
+/**************************************************************************
+ * fec_report: tells every peer worker t collected FEC groups of since    *
+ *             the last report how many of their shards it should have    *
+ *             had, and how many came.                                    *
+ **************************************************************************/
+void fec_report(struct tunnel *t) {
+    
+    int i;
+    
+    for (i = 0; i < PEERS_MAX; i++)
+        if (t->pctx[i].fec_expected)
+            fec_report_peer(t, i);
+}
+
+/**************************************************************************
+ * bond_arm: has worker t's reorder timer go off in nsec.                 *
+ **************************************************************************/
+void bond_arm(struct tunnel *t, uint64_t nsec) {
+    
+    struct itimerspec its;
+    
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = nsec / 1000000000;
+    its.it_value.tv_nsec = nsec % 1000000000;
+    if (timerfd_settime(t->bond_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime()");
+        exit(1);
+    }
+    t->bond_armed = 1;
+}
+
+/**************************************************************************
+ * bond_pop: writes the packet stream r holds in slot to tun/tap and      *
+ *           gives its buffer back. Returns 1 if it was written.          *
+ **************************************************************************/
+int bond_pop(struct tunnel *t, struct reorder *r, int slot, unsigned long *bytes) {
+    
+    int n = tun_write(t, &peers[r->peer], (uint8_t *)PKT_DATA(r->buf[slot]), r->len[slot], bytes);
+    
+    pool_put(r->buf[slot]);
+    r->buf[slot] = NULL;
+    r->nheld--;
+    t->bond_nheld--;
+    return n;
+}
+
+/**************************************************************************
+ * bond_advance: gives up waiting for what stream r misses before         *
+ *               upto: writes what it holds of that in order, has         *
+ *               next at upto and writes on from there as long as         *
+ *               nothing is missing. Returns the packets written.         *
+ **************************************************************************/
+int bond_advance(struct tunnel *t, struct reorder *r, uint32_t upto, unsigned long *bytes) {
+    
+    int n = 0, slot;
+    
+    for (; (int32_t)(upto - r->next) > 0 && r->nheld > 0; r->next++) {
+        slot = r->next & (BOND_SLOTS - 1);
+        if (r->buf[slot] != NULL)
+            n += bond_pop(t, r, slot, bytes);
+        else
+            count(C_BOND_MISSING, 1);
+    }
+    if ((int32_t)(upto - r->next) > 0)
+        r->next = upto;
+    for (; r->buf[slot = r->next & (BOND_SLOTS - 1)] != NULL; r->next++)
+        n += bond_pop(t, r, slot, bytes);
+    return n;
+}
+
+/**************************************************************************
+ * bond_input: tun_deliver for a striped packet of peer from. In order    *
+ *             it is written, and whatever waited for it; ahead of a      *
+ *             gap it is held until the gap fills or BOND_WAIT_USEC       *
+ *             runs out, behind one it is late and written as well.       *
+ *             Without a reorder timer, or with no room to hold, it       *
+ *             is written as it comes. Returns the packets written.       *
+ **************************************************************************/
+int bond_input(struct tunnel *t, struct peer *from, uint8_t *pl, int len, unsigned long *bytes) {
+    
+    struct reorder *r;
+    struct bond_hdr bh;
+    uint32_t seq;
+    int32_t d;
+    char *buf;
+    int slot, n = 0;
+    
+    if (len < BOND_HDR_LEN) {
+        count(C_DROP_MALFORMED, 1);
+        return 0;
+    }
+    len -= BOND_HDR_LEN;
+    memcpy(&bh, pl + len, BOND_HDR_LEN);
+    /* the sender clamped the packet before its trailer went on */
+    frame_clamp(from, FRAME_DATA, pl, len, C_MSS_RX);
+    if (!t->bond_fd || bh.stream >= WORKERS_MAX || from->id >= PEERS_MAX)
+        return tun_write(t, from, pl, len, bytes);
+    
+    r = &bond_of(t, from)->rx[bh.stream];
+    seq = ntohl(bh.seq);
+    d = (int32_t)(seq - r->next);
+    /* first of the stream, or the sender started over: what came before goes out */
+    if (!r->started || d > BOND_RESYNC || d < -BOND_RESYNC) {
+        n = bond_advance(t, r, r->next + BOND_SLOTS, bytes);
+        r->next = seq;
+        r->started = 1;
+        d = 0;
+    }
+    if (d < 0) {
+        count(C_BOND_LATE, 1);
+        return n + tun_write(t, from, pl, len, bytes);
+    }
+    /* too far ahead for the window, the oldest gaps are given up on */
+    if (d >= BOND_SLOTS) {
+        n += bond_advance(t, r, seq - BOND_SLOTS + 1, bytes);
+        d = (int32_t)(seq - r->next);
+    }
+    if (d == 0) {
+        n += tun_write(t, from, pl, len, bytes);
+        r->next++;
+        return n + bond_advance(t, r, r->next, bytes);
+    }
+    
+    slot = seq & (BOND_SLOTS - 1);
+    if (r->buf[slot] != NULL)
+        return n;
+    if (t->bond_nheld >= BOND_HELD || (buf = pool_get()) == NULL)
+        return n + tun_write(t, from, pl, len, bytes);
+    memcpy(PKT_DATA(buf), pl, len);
+    r->buf[slot] = buf;
+    r->len[slot] = len;
+    r->at[slot] = now_nsec();
+    r->nheld++;
+    t->bond_nheld++;
+    count(C_BOND_REORDERED, 1);
+    if (!r->listed) {
+        r->next_held = t->bond_held;
+        t->bond_held = r;
+        r->listed = 1;
+    }
+    if (!t->bond_armed)
+        bond_arm(t, BOND_WAIT_USEC * 1000ULL);
+    return n;
+}
+
+/**************************************************************************
+ * tun_deliver: writes the opened payload of a frame of the given type    *
+ *              from peer from to tun/tap: the packet, or each packet of  *
+ *              a bundle straight out of the receive buffer; FEC frames   *
+ *              go to fec_input, striped ones to bond_input. In TAP mode  *
+ *              l2_input switches each frame first. Adds the bytes        *
+ *              written to *bytes and returns the packets written.        *
+ *              dp_tun_deliver is built for the features f.               *
+ **************************************************************************/
+DP_INLINE int dp_tun_deliver(unsigned f, struct tunnel *t, struct peer *from, uint8_t type, uint8_t *pl, int len,
+                             unsigned long *bytes) {
+    
+    uint8_t *pkt = pl;
+    int off = 0, plen = len, n = 0, npkts = 0;
+    
+    if (type == FRAME_FEC_DATA || type == FRAME_FEC_PARITY)
+        return fec_input(t, from, type, pl, len, bytes);
+    if (type == FRAME_BOND_DATA)
+        return bond_input(t, from, pl, len, bytes);
+    if (type == FRAME_BUNDLE)
+        pkt = bundle_next(pl, len, &off, &plen);
+    for (; pkt != NULL; pkt = type == FRAME_BUNDLE ? bundle_next(pl, len, &off, &plen) : NULL) {
+        npkts++;
+        n += dp_tun_write(f, t, from, pkt, plen, bytes);
+    }
+    if (type == FRAME_BUNDLE) {
+        count(C_BUNDLE_RX, 1);
+        count(C_BUNDLE_RX_PKTS, npkts);
+    }
+    return n;
+}
+
+int tun_deliver(struct tunnel *t, struct peer *from, uint8_t type, uint8_t *pl, int len, unsigned long *bytes) {
+    return dp_tun_deliver(DP_GENERIC, t, from, type, pl, len, bytes);
+}
+
+/**************************************************************************
+ * net_to_tun: drains up to one batch of datagrams from socket fd (the    *
+ *             worker's, or one of its uplinks') with recvmmsg(), and     *
+ *             writes the payload of each data frame to the tun/tap fd.   *
+ *             Returns the number of datagrams. dp_net_to_tun is built    *
+ *             for the features f, the variants of dp_pick for some,      *
+ *             net_to_tun for any.                                        *
+ **************************************************************************/
+DP_INLINE int dp_net_to_tun(unsigned f, struct tunnel *t, int fd) {
+    
+    struct batch *b = t->rx_batch;
+    struct peer *owner[BATCH_MAX];
+    struct wire_hdr *hdr;
+    uint64_t t0 = 0, t1 = 0, t2 = 0, now;
+    unsigned long rx_bytes = 0, tx_bytes = 0;
+    int plength[BATCH_MAX], i, n, ret, ntx = 0, timed = hist_sample();
+    
+    for (i = 0; i < b->size; i++) {
+        b->iovs[i].iov_base = b->buf[i];
+        b->iovs[i].iov_len = FRAME_ROOM;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    if (timed)
+        t0 = now_nsec();
+    if ((n = recvmmsg(fd, b->msgs, b->size, MSG_DONTWAIT, NULL)) < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("recvmmsg network");
+            count(C_ERR_RECVMMSG, 1);
+        }
+        return 0;
+    }
+    
+    /* find the peers first, then open and deliver the whole batch */
+    if (timed)
+        t1 = now_nsec();
+    for (i = 0; i < n; i++) {
+        rx_bytes += b->msgs[i].msg_len;
+        owner[i] = wire_decap(b->buf[i], b->msgs[i].msg_len, &hdr) < 0 ? NULL :
+                   dp_rx_frame(f, t, hdr, &b->addrs[i]);
+    }
+    for (i = 0; i < n; i++)
+        plength[i] = owner[i] ? dp_frame_open(f, t, owner[i], (struct wire_hdr *)b->buf[i]) : -1;
+    
+    if (timed)
+        t2 = now_nsec();
+    for (i = 0; i < n; i++) {
+        if (plength[i] < 0)
+            continue;
+        if ((ret = dp_tun_deliver(f, t, owner[i], ((struct wire_hdr *)b->buf[i])->type,
+                                  (uint8_t *)b->buf[i] + WIRE_HDR_LEN, plength[i], &tx_bytes)) == 0)
+            continue;
+        ntx += ret;
+        /* all arrived at once, each is done when its write returns */
+        if (timed)
+            hist_add(H_NET_TUN, now_nsec() - t1);
+    }
+    count(C_NET_RX_PKTS, n);
+    count(C_NET_RX_BYTES, rx_bytes);
+    count(C_TUN_TX_PKTS, ntx);
+    count(C_TUN_TX_BYTES, tx_bytes);
+    
+    if (timed && n > 0) {
+        now = now_nsec();
+        hist_add(H_RX_READ, t1 - t0);
+        hist_add(H_RX_CRYPTO, t2 - t1);
+        hist_add(H_RX_WRITE, now - t2);
+    }
+    
+    return n;
+}
+
+int net_to_tun(struct tunnel *t, int fd) {
+    return dp_net_to_tun(DP_GENERIC, t, fd);
+}
+
+/* the builds for the common settings: either side, tun or tap, sealed or not */
+#define DP_VARIANTS(X) \
+    X(client_tun, DP_CLIENT | DP_BOND) \
+    X(client_tun_aead, DP_CLIENT | DP_BOND | DP_AEAD) \
+    X(client_tap, DP_CLIENT | DP_BOND | DP_TAP) \
+    X(client_tap_aead, DP_CLIENT | DP_BOND | DP_TAP | DP_AEAD) \
+    X(server_tun, DP_BOND) \
+    X(server_tun_aead, DP_BOND | DP_AEAD) \
+    X(server_tap, DP_BOND | DP_TAP) \
+    X(server_tap_aead, DP_BOND | DP_TAP | DP_AEAD) \
+    X(client_tun_kfast, DP_CLIENT | DP_BOND | DP_KFAST) \
+    X(server_tun_kfast, DP_BOND | DP_KFAST)
+#define DP_BUILD(name, f) \
+    int tun_to_net_##name(struct tunnel *t) { return dp_tun_to_net(f, t); } \
+    int net_to_tun_##name(struct tunnel *t, int fd) { return dp_net_to_tun(f, t, fd); }
+#define DP_ENTRY(name, f) { #name, f, tun_to_net_##name, net_to_tun_##name },
+
+DP_VARIANTS(DP_BUILD)
+
+const struct dp_variant dp_variants[] = {
+    DP_VARIANTS(DP_ENTRY)
+    { "generic", DP_GENERIC, tun_to_net, net_to_tun }
+};
+
+/**************************************************************************
+ * dp_features: the DP_* features the settings turn on.                   *
+ **************************************************************************/
+unsigned dp_features(void) {
+    return (cliserv == CLIENT ? DP_CLIENT : 0) | (tap_mode ? DP_TAP : 0) | (aead ? DP_AEAD : 0) |
+           (compress ? DP_ZIP : 0) | (fec_mode ? DP_FEC : 0) | (bond_tx ? DP_BOND : 0) |
+           (cliserv == CLIENT && nuplinks > 1 ? DP_UPLINKS : 0) | (sched_on ? DP_SCHED : 0) |
+           (pace_bps ? DP_PACE : 0) | (dscp_copy || pace_bps ? DP_TXCTL : 0) | (cap ? DP_CAP : 0) |
+           (kfast ? DP_KFAST : 0);
+}
+
+/**************************************************************************
+ * dp_pick: points datapath at the build for exactly the features on,     *
+ *          or the generic one. Once the settings are final, before the   *
+ *          workers start.                                                *
+ **************************************************************************/
+void dp_pick(void) {
+    
+    unsigned feat = dp_features();
+    int i;
+    
+    for (i = 0; dp_variants[i].feat != DP_GENERIC && dp_variants[i].feat != feat; i++)
+        ;
+    datapath = &dp_variants[i];
+}
+
+/**************************************************************************
+ * rd16/rd32: big endian loads from possibly unaligned packet bytes.      *
+ **************************************************************************/
+uint16_t rd16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+uint32_t rd32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/**************************************************************************
+ * csum_add: adds len bytes at p to a running ones' complement sum.       *
+ **************************************************************************/
+uint32_t csum_add(const void *p, int len, uint32_t sum) {
+    
+    const uint8_t *b = p;
+    uint64_t acc = sum;
+    uint32_t w;
+    
+    for (; len >= 4; len -= 4, b += 4) {
+        memcpy(&w, b, 4);
+        acc += w;
+    }
+    if (len >= 2) {
+        acc += (uint16_t)(b[0] | b[1] << 8);
+        b += 2;
+        len -= 2;
+    }
+    if (len)
+        acc += b[0];
+    
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    return (uint32_t)acc;
+}
+
+/**************************************************************************
+ * csum_fold: folds a 32 bit sum to 16 bits (not complemented).           *
+ **************************************************************************/
+uint16_t csum_fold(uint32_t sum) {
+    
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+/**************************************************************************
+ * tcp_pseudo: ones' complement sum of the TCP pseudo header of an IPv4   *
+ *             (v6 == 0) or IPv6 packet, for tcplen bytes of TCP.         *
+ **************************************************************************/
+uint32_t tcp_pseudo(const uint8_t *ip, int v6, int tcplen) {
+    
+    uint32_t sum;
+    
+    if (v6)
+        sum = csum_add(ip + 8, 32, 0);
+    else
+        sum = csum_add(ip + 12, 8, 0);
+    return sum + htons(IPPROTO_TCP) + htons(tcplen);
+}
+
+/**************************************************************************
+ * ip4_csum: recomputes the header checksum of an IPv4 header.            *
+ **************************************************************************/
+void ip4_csum(uint8_t *ip, int iphlen) {
+    
+    uint16_t c;
+    
+    ip[10] = ip[11] = 0;
+    c = ~csum_fold(csum_add(ip, iphlen, 0));
+    memcpy(ip + 10, &c, 2);
+}
+
+/**************************************************************************
+ * gso_segment: cuts a TSO super-packet into MSS sized TCP/IP packets,    *
+ *              smaller if the path MTU of p asks for it, each framed     *
+ *              (and sealed) for p, laid out back to back in out every    *
+ *              *stride bytes (the last one may be shorter), *total bytes *
+ *              in all. Fixes lengths, IDs, sequence numbers, flags and   *
+ *              checksums. A small MSS makes more frames than size bytes  *
+ *              of out hold: it stops at the last one that fits and moves *
+ *              *from, 0 at first, to the payload offset to go on at.     *
+ *              Returns the number of frames, 0 once the packet is done,  *
+ *              or -1 if it is unparsable.                                *
+ **************************************************************************/
+int gso_segment(struct tunnel *t, struct peer *p, struct virtio_net_hdr *vh, uint8_t *pkt, int len, int *from,
+                char *out, int size, int *stride, int *total) {
+    
+    int v6 = (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV6;
+    int iphlen = v6 ? 40 : (pkt[0] & 0x0f) * 4;
+    int tcphlen, hdrlen, mss = vh->gso_size, off, seg, nsegs, plen, room, n;
+    uint32_t seq0, seq;
+    uint16_t id0, v, c;
+    uint8_t *ip, *tcp, flags0;
+    
+    if (len < iphlen + 20 || mss == 0)
+        return -1;
+    tcphlen = (pkt[iphlen + 12] >> 4) * 4;
+    hdrlen = iphlen + tcphlen;
+    if (len <= hdrlen)
+        return -1;
+    /* segments the path carries whole, once its MTU is known */
+    if ((room = pmtu_room(p)) > hdrlen && hdrlen + mss > room)
+        mss = room - hdrlen;
+    
+    seq0 = rd32(pkt + iphlen + 4);
+    id0 = rd16(pkt + 4);
+    flags0 = pkt[iphlen + 13];
+    nsegs = (len - hdrlen + mss - 1) / mss;
+    *stride = WIRE_HDR_LEN + hdrlen + mss + (aead ? AEAD_TAG_LEN : 0);
+    /* every segment before the last is mss long, so off tells which one it is */
+    if (*from < hdrlen)
+        *from = hdrlen;
+    
+    for (n = 0, off = *from; off < len && (n + 1) * *stride <= size; n++, off += plen) {
+        seg = (off - hdrlen) / mss;
+        plen = len - off < mss ? len - off : mss;
+        ip = (uint8_t *)out + n * *stride + WIRE_HDR_LEN;
+        tcp = ip + iphlen;
+        memcpy(ip, pkt, hdrlen);
+        memcpy(ip + hdrlen, pkt + off, plen);
+        
+        if (v6) {
+            v = htons(tcphlen + plen);
+            memcpy(ip + 4, &v, 2);
+        } else {
+            v = htons(hdrlen + plen);
+            memcpy(ip + 2, &v, 2);
+            v = htons(id0 + seg);
+            memcpy(ip + 4, &v, 2);
+            ip4_csum(ip, iphlen);
+        }
+        
+        seq = htonl(seq0 + (off - hdrlen));
+        memcpy(tcp + 4, &seq, 4);
+        v = 0;
+        /* CWR only on the first segment, FIN and PSH only on the last */
+        tcp[13] = flags0 & ~(0x01 | 0x08 | (seg ? 0x80 : 0));
+        if (seg == nsegs - 1)
+            tcp[13] |= flags0 & (0x01 | 0x08);
+        memcpy(tcp + 16, &v, 2);
+        c = ~csum_fold(csum_add(tcp, tcphlen + plen, tcp_pseudo(ip, v6, tcphlen + plen)));
+        memcpy(tcp + 16, &c, 2);
+        
+        *total = n * *stride + frame_seal(t, p, (struct wire_hdr *)(ip - WIRE_HDR_LEN), FRAME_DATA,
+                                          ip, hdrlen + plen, ip + hdrlen + plen);
+    }
+    
+    *from = off;
+    return n;
+}
+
+/**************************************************************************
+ * gso_send: sends nframes frames laid out every stride bytes in out,     *
+ *           total bytes long, with as few UDP_SEGMENT sendmsg() calls as *
+ *           the kernel limits allow. Falls back to one datagram per     *
+ *           frame if the socket refuses GSO.                            *
+ **************************************************************************/
+void gso_send(struct tunnel *t, char *out, int nframes, int stride, int total, struct sockaddr_in *addr) {
+    
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct iovec iov;
+    int per_send = GSO_MAX_BYTES / stride, n, done = 0, len;
+    
+    if (per_send > GSO_MAX_SEGS)
+        per_send = GSO_MAX_SEGS;
+    
+    while (done < nframes) {
+        n = nframes - done < per_send ? nframes - done : per_send;
+        len = done + n == nframes ? total - done * stride : n * stride;
+        if (!t->udp_gso)
+            n = 1, len = done + 1 == nframes ? total - done * stride : stride;
+        
+        iov.iov_base = out + done * stride;
+        iov.iov_len = len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = addr;
+        msg.msg_namelen = sizeof(*addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (n > 1) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cm) = stride;
+        }
+        
+        if (sendmsg(t->sock_fd, &msg, 0) < 0) {
+            if ((errno == EINVAL || errno == EMSGSIZE) && n > 1) {
+                /* segments bigger than the route MTU, or no GSO at all */
+                fprintf(stderr, "UDP GSO refused, sending one datagram per frame\n");
+                t->udp_gso = 0;
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("sendmsg network");
+                count(C_ERR_SENDMSG, 1);
+            }
+            count(C_DROP_SOCK_FULL, nframes - done);
+            return;
+        }
+        count(C_NET_TX_PKTS, n);
+        count(C_NET_TX_BYTES, len);
+        done += n;
+    }
+}
+
+/**************************************************************************
+ * tun_to_net_offload: tun_to_net for offload mode. Super-packets are    *
+ *                     segmented and sent with UDP GSO, plain packets    *
+ *                     (checksum completed if the kernel left it to us)   *
+ *                     are batched for sendmmsg as usual. Returns the    *
+ *                     number of packets read from tun.                  *
+ **************************************************************************/
+int tun_to_net_offload(struct tunnel *t) {
+    
+    struct batch *b = t->tx_batch;
+    struct virtio_net_hdr vh;
+    struct sockaddr_in addr;
+    struct peer *p;
+    uint8_t *pkt = (uint8_t *)t->gso_in + VNET_HDR_LEN;
+    int n = 0, nframes = 0, nread, stride, sent, ret, total, from, i, timed = hist_sample();
+    uint64_t stamp[BATCH_MAX], now;
+    unsigned long rx_bytes = 0;
+    uint16_t c;
+    
+    while (n < b->size) {
+        if ((nread = read(t->tap_fd, t->gso_in, GSO_BUFSIZE + VNET_HDR_LEN)) < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("read from virtual");
+                count(C_ERR_READ, 1);
+            }
+            break;
+        }
+        n++;
+        if ((nread -= VNET_HDR_LEN) <= 0)
+            continue;
+        rx_bytes += nread;
+        now = timed ? now_nsec() : 0;
+        memcpy(&vh, t->gso_in, sizeof(vh));
+        
+        if ((p = tx_route(pkt, nread, &addr)) == NULL) {
+            count(C_DROP_NO_ROUTE, 1);
+            continue;
+        }
+        
+        if (vh.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+            /* keep packet order: what is batched goes first */
+            if (nframes > 0) {
+                if ((ret = sendmmsg(t->sock_fd, b->msgs, nframes, 0)) < 0) {
+                    if (errno != EAGAIN) {
+                        perror("sendmmsg network");
+                        count(C_ERR_SENDMMSG, 1);
+                    }
+                    count(C_DROP_SOCK_FULL, nframes);
+                } else {
+                    count_sent(b->msgs, ret);
+                    count(C_DROP_SOCK_FULL, nframes - ret);
+                    for (i = 0; timed && i < ret; i++)
+                        hist_add(H_TUN_NET, now_nsec() - stamp[i]);
+                }
+            }
+            nframes = 0;
+            for (from = 0; (ret = gso_segment(t, p, &vh, pkt, nread, &from, t->gso_out, GSO_OUTSIZE, &stride, &total)) > 0; )
+                gso_send(t, t->gso_out, ret, stride, total, &addr);
+            /* a super-packet counts as one, done when its last segment is */
+            if (timed)
+                hist_add(H_TUN_NET, now_nsec() - now);
+            continue;
+        }
+        
+        if ((vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+            vh.csum_start + vh.csum_offset + 2 <= nread) {
+            c = ~csum_fold(csum_add(pkt + vh.csum_start, nread - vh.csum_start, 0));
+            memcpy(pkt + vh.csum_start + vh.csum_offset, &c, 2);
+        }
+        if (nread > PKT_ROOM)
+            continue;
+        memcpy(b->buf[nframes] + WIRE_HDR_LEN, pkt, nread);
+        stamp[nframes] = now;
+        b->addrs[nframes] = addr;
+        b->iovs[nframes].iov_base = b->buf[nframes];
+        b->iovs[nframes].iov_len = frame_seal(t, p, (struct wire_hdr *)b->buf[nframes], FRAME_DATA,
+                                              (uint8_t *)b->buf[nframes] + WIRE_HDR_LEN, nread,
+                                              (uint8_t *)b->buf[nframes] + WIRE_HDR_LEN + nread);
+        memset(&b->msgs[nframes].msg_hdr, 0, sizeof(b->msgs[nframes].msg_hdr));
+        b->msgs[nframes].msg_hdr.msg_name = &b->addrs[nframes];
+        b->msgs[nframes].msg_hdr.msg_namelen = sizeof(b->addrs[nframes]);
+        b->msgs[nframes].msg_hdr.msg_iov = &b->iovs[nframes];
+        b->msgs[nframes].msg_hdr.msg_iovlen = 1;
+        nframes++;
+    }
+    
+    for (sent = 0; sent < nframes; sent += ret) {
+        if ((ret = sendmmsg(t->sock_fd, b->msgs + sent, nframes - sent, 0)) < 0) {
+            if (errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("sendmmsg network");
+                count(C_ERR_SENDMMSG, 1);
+            }
+            count(C_DROP_SOCK_FULL, nframes - sent);
+            break;
+        }
+        count_sent(b->msgs + sent, ret);
+    }
+    if (timed && nframes > 0) {
+        now = now_nsec();
+        for (i = 0; i < sent && i < nframes; i++)
+            hist_add(H_TUN_NET, now - stamp[i]);
+    }
+    count(C_TUN_RX_PKTS, n);
+    count(C_TUN_RX_BYTES, rx_bytes);
+    if (n > 0)
+        t->last_tx = now_sec();
+    
+    return n;
+}
+
+/**************************************************************************
+ * coal_flush: writes the super-packet being coalesced to tun/tap. A      *
+ *             single segment goes out as it came, several get their IP   *
+ *             lengths fixed and a GSO virtio header so the kernel takes  *
+ *             them as one TSO packet with a partial checksum.            *
+ **************************************************************************/
+void coal_flush(struct tunnel *t) {
+    
+    struct coalesce *c = &t->coal;
+    struct virtio_net_hdr vh;
+    uint8_t *ip = (uint8_t *)c->buf + VNET_HDR_LEN;
+    uint16_t v;
+    
+    if (c->len == 0)
+        return;
+    
+    memset(&vh, 0, sizeof(vh));
+    if (c->segs > 1) {
+        if (c->v6) {
+            v = htons(c->len - 40);
+            memcpy(ip + 4, &v, 2);
+        } else {
+            v = htons(c->len);
+            memcpy(ip + 2, &v, 2);
+            ip4_csum(ip, c->iphlen);
+        }
+        v = csum_fold(tcp_pseudo(ip, c->v6, c->len - c->iphlen));
+        memcpy(ip + c->iphlen + 16, &v, 2);
+        
+        vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh.gso_type = c->v6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+        vh.hdr_len = c->hdrlen;
+        vh.gso_size = c->mss;
+        vh.csum_start = c->iphlen;
+        vh.csum_offset = 16;
+    }
+    memcpy(c->buf, &vh, sizeof(vh));
+    
+    if (write(t->tap_fd, c->buf, VNET_HDR_LEN + c->len) < 0) {
+        perror("write to virtual");
+        count(C_ERR_WRITE, 1);
+    } else {
+        count(C_TUN_TX_PKTS, 1);
+        count(C_TUN_TX_BYTES, c->len);
+    }
+    c->len = 0;
+}
+
+/**************************************************************************
+ * coal_add: hands one received packet to the tun writer. TCP segments    *
+ *           that continue the flow being coalesced are appended to it,   *
+ *           anything else flushes it first.                              *
+ **************************************************************************/
+void coal_add(struct tunnel *t, uint8_t *pkt, int len) {
+    
+    struct coalesce *c = &t->coal;
+    uint8_t *cur = (uint8_t *)c->buf + VNET_HDR_LEN;
+    int v6, iphlen, tcphlen, plen;
+    uint32_t seq;
+    struct virtio_net_hdr vh;
+    struct iovec iov[2];
+    
+    /* only plain, option-less IP carrying TCP data without SYN/FIN/RST/URG/ECE/CWR */
+    if (len >= 40 && pkt[0] == 0x45 && pkt[9] == IPPROTO_TCP &&
+        (pkt[6] & 0x3f) == 0 && pkt[7] == 0 && rd16(pkt + 2) == len) {
+        v6 = 0;
+        iphlen = 20;
+    } else if (len >= 60 && (pkt[0] >> 4) == 6 && pkt[6] == IPPROTO_TCP &&
+        rd16(pkt + 4) == len - 40) {
+        v6 = 1;
+        iphlen = 40;
+    } else {
+        goto single;
+    }
+    tcphlen = (pkt[iphlen + 12] >> 4) * 4;
+    plen = len - iphlen - tcphlen;
+    if (tcphlen < 20 || plen <= 0 || (pkt[iphlen + 13] & ~(0x10 | 0x08)) != 0)
+        goto single;
+    seq = rd32(pkt + iphlen + 4);
+    
+    if (c->len > 0 && !c->closed && c->v6 == v6 && c->hdrlen == iphlen + tcphlen &&
+        plen <= c->mss && seq == c->next_seq && c->segs < GSO_MAX_SEGS &&
+        c->len + plen <= GSO_BUFSIZE - VNET_HDR_LEN &&
+        /* same addresses, ports, ack and TCP options; same TOS/TTL */
+        memcmp(cur + (v6 ? 8 : 12), pkt + (v6 ? 8 : 12), v6 ? 32 : 8) == 0 &&
+        memcmp(cur + iphlen, pkt + iphlen, 4) == 0 &&
+        memcmp(cur + iphlen + 8, pkt + iphlen + 8, 4) == 0 &&
+        memcmp(cur + iphlen + 20, pkt + iphlen + 20, tcphlen - 20) == 0 &&
+        (v6 ? memcmp(cur, pkt, 4) == 0 && cur[7] == pkt[7] : cur[1] == pkt[1] && cur[8] == pkt[8])) {
+        memcpy(cur + c->len, pkt + iphlen + tcphlen, plen);
+        c->len += plen;
+        c->segs++;
+        c->next_seq += plen;
+        /* carry the PSH of the last segment */
+        cur[iphlen + 13] |= pkt[iphlen + 13] & 0x08;
+        /* window of the latest segment */
+        memcpy(cur + iphlen + 14, pkt + iphlen + 14, 2);
+        c->closed = plen < c->mss || (pkt[iphlen + 13] & 0x08);
+        return;
+    }
+    
+    coal_flush(t);
+    memcpy(cur, pkt, len);
+    c->len = len;
+    c->v6 = v6;
+    c->iphlen = iphlen;
+    c->hdrlen = iphlen + tcphlen;
+    c->mss = plen;
+    c->segs = 1;
+    c->next_seq = seq + plen;
+    c->closed = (pkt[iphlen + 13] & 0x08) != 0;
+    return;
+    
+single:
+    coal_flush(t);
+    memset(&vh, 0, sizeof(vh));
+    iov[0].iov_base = &vh;
+    iov[0].iov_len = sizeof(vh);
+    iov[1].iov_base = pkt;
+    iov[1].iov_len = len;
+    if (writev(t->tap_fd, iov, 2) < 0) {
+        perror("write to virtual");
+        count(C_ERR_WRITE, 1);
+    } else {
+        count(C_TUN_TX_PKTS, 1);
+        count(C_TUN_TX_BYTES, len);
+    }
+}
+
+/**************************************************************************
+ * net_to_tun_offload: net_to_tun for offload mode. The socket has UDP   *
+ *                     GRO on, so one recvmsg() may return many frames of *
+ *                     gso_size bytes each; their packets go through the  *
+ *                     TCP coalescer. Returns the number of frames.       *
+ **************************************************************************/
+int net_to_tun_offload(struct tunnel *t) {
+    
+    char control[CMSG_SPACE(sizeof(int))];
+    struct sockaddr_in addr;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct iovec iov;
+    struct wire_hdr *hdr;
+    struct peer *p;
+    uint8_t *pkt;
+    uint64_t first = 0;
+    unsigned long bytes;
+    int i, n, nframes = 0, seg, off, plength, boff, blen, npkts, timed = hist_sample();
+    
+    for (i = 0; i < t->rx_batch->size; i++) {
+        iov.iov_base = t->gro_buf;
+        iov.iov_len = GSO_BUFSIZE;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        if ((n = recvmsg(t->sock_fd, &msg, MSG_DONTWAIT)) < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("recvmsg network");
+                count(C_ERR_RECVMSG, 1);
+            }
+            break;
+        }
+        count(C_NET_RX_BYTES, n);
+        if (timed && first == 0)
+            first = now_nsec();
+        
+        seg = n;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                memcpy(&seg, CMSG_DATA(cm), sizeof(int));
+        
+        for (off = 0; off < n; off += seg) {
+            nframes++;
+            if (wire_decap(t->gro_buf + off, n - off < seg ? n - off : seg, &hdr) < 0)
+                continue;
+            /* inflating in place would run into the next datagram */
+            if (hdr->version & WIRE_F_COMPRESSED) {
+                if (WIRE_HDR_LEN + ntohs(hdr->length) > (int)sizeof(t->zip->bounce)) {
+                    count(C_DROP_MALFORMED, 1);
+                    continue;
+                }
+                memcpy(t->zip->bounce, hdr, WIRE_HDR_LEN + ntohs(hdr->length));
+                hdr = (struct wire_hdr *)t->zip->bounce;
+            }
+            if ((p = rx_frame(t, hdr, &addr)) == NULL || (plength = frame_open(t, p, hdr)) < 0)
+                continue;
+            /* FEC and striped frames are written as they come, around the coalescer */
+            if (hdr->type == FRAME_FEC_DATA || hdr->type == FRAME_FEC_PARITY || hdr->type == FRAME_BOND_DATA) {
+                bytes = 0;
+                count(C_TUN_TX_PKTS, tun_deliver(t, p, hdr->type, (uint8_t *)(hdr + 1), plength, &bytes));
+                count(C_TUN_TX_BYTES, bytes);
+                continue;
+            }
+            if (hdr->type != FRAME_BUNDLE) {
+                coal_add(t, (uint8_t *)(hdr + 1), plength);
+                continue;
+            }
+            for (boff = npkts = 0; (pkt = bundle_next((uint8_t *)(hdr + 1), plength, &boff, &blen)) != NULL; npkts++)
+                coal_add(t, pkt, blen);
+            count(C_BUNDLE_RX, 1);
+            count(C_BUNDLE_RX_PKTS, npkts);
+        }
+    }
+    coal_flush(t);
+    count(C_NET_RX_PKTS, nframes);
+    /* coalescing holds packets back, so one sample: the first one in */
+    if (first)
+        hist_add(H_NET_TUN, now_nsec() - first);
+    
+    /* at least i, so on_sock keeps draining while recvmsg had more */
+    return nframes;
+}
+
+/**************************************************************************
+ * offload_init: buffers and socket options for offload mode.            *
+ **************************************************************************/
+void offload_init(struct tunnel *t) {
+    
+    int on = 1;
+    
+    if ((t->gso_in = malloc(GSO_BUFSIZE + VNET_HDR_LEN)) == NULL ||
+        (t->gso_out = malloc(GSO_OUTSIZE)) == NULL ||
+        (t->gro_buf = malloc(GSO_BUFSIZE)) == NULL ||
+        (t->coal.buf = malloc(GSO_BUFSIZE + VNET_HDR_LEN)) == NULL) {
+        perror("offload_init");
+        exit(1);
+    }
+    t->udp_gso = 1;
+    if (setsockopt(t->sock_fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0)
+        perror("setsockopt(UDP_GRO)");
+}
+
+/**************************************************************************
+ * AF_XDP underlay: an XDP program on the underlay interface redirects   *
+ * IPv4 UDP to our address and ports into one AF_XDP socket per worker   *
+ * queue, and lets everything else through to the kernel. The sockets    *
+ * share the packet pool as their UMEM, so a received frame is opened    *
+ * and written to tun/tap where the NIC put it, and a sealed one goes    *
+ * out of the buffer it was read into, behind Ethernet/IP/UDP headers we *
+ * build ourselves. Next hop MACs are learned from frames that checked   *
+ * out; until a peer's is known, and whenever a ring is full, the        *
+ * worker's UDP socket carries the frame as before.                      *
+ **************************************************************************/
+
+int sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**************************************************************************
+ * xdp_prog_load: loads the redirect program into the xsk map map_fd for  *
+ *                datagrams to xdp_ip and a port in the hash map          *
+ *                ports_fd. Returns its fd, -1 on failure with the        *
+ *                verifier's complaint printed.                           *
+ **************************************************************************/
+int xdp_prog_load(int map_fd, int ports_fd) {
+    
+#define XI(c, d, s, o, i) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+#define XDP_PROG_PASS 33    /* index of the pass instruction */
+#define XJ(at) (XDP_PROG_PASS - (at) - 1)
+    struct bpf_insn prog[] = {
+        /* r2 = data, r3 = data_end, and all our headers must be there */
+        XI(BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof(struct xdp_md, data), 0),
+        XI(BPF_LDX | BPF_MEM | BPF_W, 3, 1, offsetof(struct xdp_md, data_end), 0),
+        XI(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        XI(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, XDP_HDRS_LEN),
+        XI(BPF_JMP | BPF_JGT | BPF_X, 4, 3, XJ(4), 0),
+        /* IPv4 without options, UDP, not a fragment */
+        XI(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 12, 0),
+        XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(6), htons(0x0800)),
+        XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, ETH_HDR_LEN, 0),
+        XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(8), 0x45),
+        XI(BPF_LDX | BPF_MEM | BPF_B, 5, 2, ETH_HDR_LEN + 9, 0),
+        XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(10), IPPROTO_UDP),
+        XI(BPF_LDX | BPF_MEM | BPF_H, 5, 2, ETH_HDR_LEN + 6, 0),
+        XI(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, htons(0x3fff)),
+        XI(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XJ(13), 0),
+        /* to our address, a 32 bit move so the compare is not sign extended */
+        XI(BPF_LDX | BPF_MEM | BPF_W, 5, 2, ETH_HDR_LEN + 16, 0),
+        XI(BPF_ALU | BPF_MOV | BPF_K, 4, 0, 0, xdp_ip),
+        XI(BPF_JMP | BPF_JNE | BPF_X, 5, 4, XJ(16), 0),
+        /* and one of our ports: bpf_map_lookup_elem(ports, &port), ctx kept in r6 */
+        XI(BPF_LDX | BPF_MEM | BPF_H, 5, 2, ETH_HDR_LEN + IP_HDR_LEN + 2, 0),
+        XI(BPF_ALU | BPF_END | BPF_TO_BE, 5, 0, 0, 16),
+        XI(BPF_STX | BPF_MEM | BPF_W, 10, 5, -4, 0),
+        XI(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+        XI(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+        XI(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4),
+        XI(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, ports_fd),
+        XI(0, 0, 0, 0, 0),
+        XI(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        XI(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, XJ(26), 0),
+        /* bpf_redirect_map(xsks, rx_queue_index, XDP_PASS if the queue has none) */
+        XI(BPF_LDX | BPF_MEM | BPF_W, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0),
+        XI(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        XI(0, 0, 0, 0, 0),
+        XI(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+        XI(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        XI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* XDP_PROG_PASS: leave it to the kernel */
+        XI(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+        XI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+#undef XI
+#undef XJ
+#undef XDP_PROG_PASS
+    static char log[8192];
+    union bpf_attr attr;
+    int fd;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uintptr_t)"GPL";
+    strncpy(attr.prog_name, "udptunnel", sizeof(attr.prog_name) - 1);
+    if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) >= 0)
+        return fd;
+    
+    /* again with the verifier log, to say why */
+    attr.log_buf = (uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0)
+        fprintf(stderr, "Loading the XDP program: %s\n%s", strerror(errno), log);
+    return fd;
+}
+
+/**************************************************************************
+ * xdp_attach: attaches program prog_fd to the underlay interface in      *
+ *             XDP mode flags. The link goes away with the process.       *
+ **************************************************************************/
+int xdp_attach(int prog_fd, unsigned flags) {
+    
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = xdp_ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = flags;
+    return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+/**************************************************************************
+ * xsk_map_ring: maps ring r of socket fd, esize bytes per entry.         *
+ **************************************************************************/
+int xsk_map_ring(int fd, struct xsk_ring *r, struct xdp_ring_offset *off, off_t pgoff, size_t esize) {
+    
+    char *m;
+    
+    r->map_len = off->desc + XDP_RING * esize;
+    if ((m = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff)) == MAP_FAILED)
+        return -1;
+    r->map = m;
+    r->producer = (unsigned *)(m + off->producer);
+    r->consumer = (unsigned *)(m + off->consumer);
+    r->flags = (unsigned *)(m + off->flags);
+    r->descs = m + off->desc;
+    r->mask = XDP_RING - 1;
+    return 0;
+}
+
+/**************************************************************************
+ * xsk_free: room in the producer ring r (fill, tx).                      *
+ **************************************************************************/
+unsigned xsk_free(struct xsk_ring *r) {
+    return XDP_RING - (r->cached - __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE));
+}
+
+/**************************************************************************
+ * xsk_ready: entries waiting in the consumer ring r (rx, completion).    *
+ **************************************************************************/
+unsigned xsk_ready(struct xsk_ring *r) {
+    return __atomic_load_n(r->producer, __ATOMIC_ACQUIRE) - r->cached;
+}
+
+/**************************************************************************
+ * xsk_close: unmaps and closes x. Buffers the kernel still held are not  *
+ *            recovered, this only happens when setup fails.              *
+ **************************************************************************/
+void xsk_close(struct xsk *x) {
+    
+    struct xsk_ring *r[4] = { &x->fill, &x->comp, &x->rx, &x->tx };
+    int i;
+    
+    for (i = 0; i < 4; i++)
+        if (r[i]->map)
+            munmap(r[i]->map, r[i]->map_len);
+    close(x->fd);
+    free(x);
+}
+
+/**************************************************************************
+ * xsk_open: an AF_XDP socket on queue of the underlay interface for a    *
+ *           worker sending from port sport, with a full fill ring. The   *
+ *           first one registers the pool as UMEM, the others share it    *
+ *           through umem_fd. Returns NULL with errno set on failure.     *
+ **************************************************************************/
+struct xsk *xsk_open(int queue, int umem_fd, uint16_t sport) {
+    
+    struct xdp_umem_reg mr;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen = sizeof(off);
+    int ring = XDP_RING, i, err;
+    struct xsk *x;
+    char *buf;
+    
+    if ((x = calloc(1, sizeof(*x))) == NULL) {
+        perror("xsk_open");
+        exit(1);
+    }
+    x->sport = sport;
+    if ((x->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+        free(x);
+        return NULL;
+    }
+    if (umem_fd < 0) {
+        memset(&mr, 0, sizeof(mr));
+        mr.addr = (uintptr_t)pool.base;
+        mr.len = pool.size;
+        mr.chunk_size = BUFSIZE;
+        if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0)
+            goto fail;
+    }
+    if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring, sizeof(ring)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring, sizeof(ring)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &ring, sizeof(ring)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &ring, sizeof(ring)) < 0 ||
+        getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+        goto fail;
+    if (xsk_map_ring(x->fd, &x->fill, &off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) < 0 ||
+        xsk_map_ring(x->fd, &x->comp, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)) < 0 ||
+        xsk_map_ring(x->fd, &x->rx, &off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc)) < 0 ||
+        xsk_map_ring(x->fd, &x->tx, &off.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc)) < 0)
+        goto fail;
+    
+    for (i = 0; i < XDP_RING && (buf = pool_get()) != NULL; i++)
+        ((uint64_t *)x->fill.descs)[i] = buf - pool.base;
+    x->fill.cached = i;
+    __atomic_store_n(x->fill.producer, x->fill.cached, __ATOMIC_RELEASE);
+    
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = xdp_ifindex;
+    sxdp.sxdp_queue_id = queue;
+    if (umem_fd < 0) {
+        sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+    } else {
+        sxdp.sxdp_flags = XDP_SHARED_UMEM;
+        sxdp.sxdp_shared_umem_fd = umem_fd;
+    }
+    if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+        /* not bound, the fill ring buffers are still ours */
+        for (i = 0; i < (int)x->fill.cached; i++)
+            pool_put(pool.base + ((uint64_t *)x->fill.descs)[i]);
+        goto fail;
+    }
+    return x;
+    
+fail:
+    err = errno;
+    xsk_close(x);
+    errno = err;
+    return NULL;
+}
+
+/**************************************************************************
+ * xsk_complete: gives the buffers of finished transmits back to the      *
+ *               pool.                                                    *
+ **************************************************************************/
+void xsk_complete(struct xsk *x) {
+    
+    unsigned i, n = xsk_ready(&x->comp);
+    uint64_t addr;
+    
+    for (i = 0; i < n; i++) {
+        addr = ((uint64_t *)x->comp.descs)[(x->comp.cached + i) & x->comp.mask];
+        pool_put(pool.base + (addr & ~(uint64_t)(BUFSIZE - 1)));
+    }
+    x->comp.cached += n;
+    __atomic_store_n(x->comp.consumer, x->comp.cached, __ATOMIC_RELEASE);
+}
+
+/**************************************************************************
+ * neigh_slot: home slot of ip in neighs.                                 *
+ **************************************************************************/
+uint32_t neigh_slot(uint32_t ip) {
+    return (ip * 2654435761U) >> 16;
+}
+
+/**************************************************************************
+ * neigh_learn: records mac as the next hop towards ip.                   *
+ **************************************************************************/
+void neigh_learn(uint32_t ip, const uint8_t *mac) {
+    
+    struct neigh *e;
+    uint64_t m = 0;
+    uint32_t i, h = neigh_slot(ip), cur;
+    
+    memcpy(&m, mac, 6);
+    for (i = 0; i < XDP_NEIGH_PROBE; i++) {
+        e = &neighs[(h + i) & (XDP_NEIGH_SLOTS - 1)];
+        cur = atomic_load_explicit(&e->ip, memory_order_acquire);
+        if (cur == ip) {
+            /* the common case, nothing to write */
+            if (atomic_load_explicit(&e->mac, memory_order_relaxed) != m)
+                atomic_store_explicit(&e->mac, m, memory_order_relaxed);
+            return;
+        }
+        if (cur == 0) {
+            atomic_store_explicit(&e->mac, m, memory_order_relaxed);
+            if (atomic_compare_exchange_strong_explicit(&e->ip, &cur, ip, memory_order_release, memory_order_relaxed))
+                return;
+        }
+    }
+    /* all taken, the home slot changes hands */
+    e = &neighs[h & (XDP_NEIGH_SLOTS - 1)];
+    atomic_store_explicit(&e->ip, 0, memory_order_relaxed);
+    atomic_store_explicit(&e->mac, m, memory_order_release);
+    atomic_store_explicit(&e->ip, ip, memory_order_release);
+}
+
+/**************************************************************************
+ * neigh_find: copies the next hop MAC towards ip to mac. Returns 0, or   *
+ *             -1 when it is not known yet.                               *
+ **************************************************************************/
+int neigh_find(uint32_t ip, uint8_t *mac) {
+    
+    struct neigh *e;
+    uint64_t m;
+    uint32_t i, h = neigh_slot(ip), cur;
+    
+    for (i = 0; i < XDP_NEIGH_PROBE; i++) {
+        e = &neighs[(h + i) & (XDP_NEIGH_SLOTS - 1)];
+        if ((cur = atomic_load_explicit(&e->ip, memory_order_acquire)) == 0)
+            return -1;
+        if (cur != ip)
+            continue;
+        m = atomic_load_explicit(&e->mac, memory_order_acquire);
+        if (atomic_load_explicit(&e->ip, memory_order_relaxed) != ip)
+            return -1;
+        memcpy(mac, &m, 6);
+        return 0;
+    }
+    return -1;
+}
+
+/**************************************************************************
+ * xdp_headers: builds Ethernet, IPv4 and UDP headers at eth for a frame  *
+ *              of len bytes right behind them, from worker socket x to   *
+ *              addr via next hop mac. The UDP checksum is left out, as   *
+ *              IPv4 allows; sealed frames carry their own tag.           *
+ **************************************************************************/
+void xdp_headers(struct xsk *x, uint8_t *eth, const uint8_t *mac, struct sockaddr_in *addr, int len) {
+    
+    uint8_t *ip = eth + ETH_HDR_LEN, *udp = ip + IP_HDR_LEN;
+    uint16_t v;
+    
+    memcpy(eth, mac, 6);
+    memcpy(eth + 6, xdp_mac, 6);
+    eth[12] = 0x08;
+    eth[13] = 0x00;
+    
+    ip[0] = 0x45;
+    ip[1] = 0;
+    v = htons(IP_HDR_LEN + UDP_HDR_LEN + len);
+    memcpy(ip + 2, &v, 2);
+    ip[4] = ip[5] = 0;
+    ip[6] = 0x40;       /* DF, so no ID is needed */
+    ip[7] = 0;
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, &xdp_ip, 4);
+    memcpy(ip + 16, &addr->sin_addr.s_addr, 4);
+    ip4_csum(ip, IP_HDR_LEN);
+    
+    memcpy(udp, &x->sport, 2);
+    memcpy(udp + 2, &addr->sin_port, 2);
+    v = htons(UDP_HDR_LEN + len);
+    memcpy(udp + 4, &v, 2);
+    udp[6] = udp[7] = 0;
+}
+
+/**************************************************************************
+ * tun_to_xsk: tun_to_net for a worker with an AF_XDP socket. Frames to   *
+ *             peers whose next hop is known go on the tx ring, out of    *
+ *             the buffer they were read into (a fresh one takes its      *
+ *             place in the batch), the rest through the UDP socket.      *
+ **************************************************************************/
+int tun_to_xsk(struct tunnel *t) {
+    
+    struct batch *b = t->tx_batch;
+    struct xsk *x = t->xsk;
+    struct peer *owner[BATCH_MAX];
+    struct xdp_desc *d;
+    uint64_t stamp[BATCH_MAX], xstamp[BATCH_MAX], t0 = 0, t1 = 0, t2 = 0, t3;
+    uint8_t *payload, *eth, mac[6];
+    unsigned long rx_bytes = 0, tx_bytes = 0;
+    unsigned room;
+    char *buf;
+    int n = 0, nrx = 0, nx = 0, ns = 0, i, m, nread, sent, ret, timed = hist_sample();
+    
+    if (timed)
+        t0 = now_nsec();
+    while (n < b->size) {
+        if ((nread = read(t->tap_fd, b->buf[n] + WIRE_HDR_LEN, PKT_ROOM)) < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("read from virtual");
+                count(C_ERR_READ, 1);
+            }
+            break;
+        }
+        nrx++;
+        rx_bytes += nread;
+        if (timed)
+            stamp[n] = now_nsec();
+        
+        if ((owner[n] = tx_route((uint8_t *)b->buf[n] + WIRE_HDR_LEN, nread, &b->addrs[n])) == NULL) {
+            count(C_DROP_NO_ROUTE, 1);
+            continue;
+        }
+        b->iovs[n].iov_len = nread;
+        n++;
+    }
+    
+    if (timed)
+        t1 = now_nsec();
+    for (i = m = 0; i < n; i++) {
+        payload = (uint8_t *)b->buf[i] + WIRE_HDR_LEN;
+        nread = b->iovs[i].iov_len;
+        /* one that would not seal goes nowhere, its buffer stays behind the rest */
+        if ((ret = frame_seal(t, owner[i], (struct wire_hdr *)b->buf[i], FRAME_DATA, payload, nread, payload + nread)) < 0)
+            continue;
+        buf = b->buf[m];
+        b->buf[m] = b->buf[i];
+        b->buf[i] = buf;
+        b->addrs[m] = b->addrs[i];
+        b->iovs[m].iov_len = ret;
+        if (timed)
+            stamp[m] = stamp[i];
+        m++;
+    }
+    n = m;
+    
+    /* the tx ring first, what it cannot take moves to the front for sendmmsg() */
+    if (timed)
+        t2 = now_nsec();
+    xsk_complete(x);
+    room = xsk_free(&x->tx);
+    for (i = 0; i < n; i++) {
+        ret = b->iovs[i].iov_len;
+        if (ret > 0 && ret + IP_HDR_LEN + UDP_HDR_LEN <= xdp_mtu && (unsigned)nx < room &&
+            neigh_find(b->addrs[i].sin_addr.s_addr, mac) == 0 &&
+            (buf = pool_get()) != NULL) {
+            eth = (uint8_t *)b->buf[i] - XDP_HDRS_LEN;
+            xdp_headers(x, eth, mac, &b->addrs[i], ret);
+            d = &((struct xdp_desc *)x->tx.descs)[x->tx.cached++ & x->tx.mask];
+            d->addr = (char *)eth - pool.base;
+            d->len = XDP_HDRS_LEN + ret;
+            d->options = 0;
+            b->buf[i] = PKT_FRAME(buf);
+            tx_bytes += ret;
+            if (timed)
+                xstamp[nx] = stamp[i];
+            nx++;
+            continue;
+        }
+        buf = b->buf[ns];
+        b->buf[ns] = b->buf[i];
+        b->buf[i] = buf;
+        b->addrs[ns] = b->addrs[i];
+        b->iovs[ns].iov_base = b->buf[ns];
+        b->iovs[ns].iov_len = ret;
+        memset(&b->msgs[ns].msg_hdr, 0, sizeof(b->msgs[ns].msg_hdr));
+        b->msgs[ns].msg_hdr.msg_name = &b->addrs[ns];
+        b->msgs[ns].msg_hdr.msg_namelen = sizeof(b->addrs[ns]);
+        b->msgs[ns].msg_hdr.msg_iov = &b->iovs[ns];
+        b->msgs[ns].msg_hdr.msg_iovlen = 1;
+        if (timed)
+            stamp[ns] = stamp[i];
+        ns++;
+    }
+    if (nx > 0) {
+        __atomic_store_n(x->tx.producer, x->tx.cached, __ATOMIC_RELEASE);
+        if ((__atomic_load_n(x->tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) &&
+            sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+            perror("sendto AF_XDP");
+            count(C_ERR_SENDTO, 1);
+        }
+        count(C_NET_TX_PKTS, nx);
+        count(C_NET_TX_BYTES, tx_bytes);
+    }
+    
+    for (sent = 0; sent < ns; sent += ret) {
+        if ((ret = sendmmsg(t->sock_fd, b->msgs + sent, ns - sent, 0)) < 0) {
+            if (errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("sendmmsg network");
+                count(C_ERR_SENDMMSG, 1);
+            }
+            count(C_DROP_SOCK_FULL, ns - sent);
+            break;
+        }
+        count_sent(b->msgs + sent, ret);
+    }
+    count(C_TUN_RX_PKTS, nrx);
+    count(C_TUN_RX_BYTES, rx_bytes);
+    if (n > 0)
+        t->last_tx = now_sec();
+    
+    if (timed && n > 0) {
+        t3 = now_nsec();
+        hist_add(H_TX_READ, t1 - t0);
+        hist_add(H_TX_CRYPTO, t2 - t1);
+        hist_add(H_TX_SEND, t3 - t2);
+        for (i = 0; i < nx; i++)
+            hist_add(H_TUN_NET, t3 - xstamp[i]);
+        for (i = 0; i < sent && i < ns; i++)
+            hist_add(H_TUN_NET, t3 - stamp[i]);
+    }
+    
+    return nrx;
+}
+
+/**************************************************************************
+ * xsk_to_tun: net_to_tun for the rx ring of an AF_XDP socket. Buffers go *
+ *             straight back to the fill ring once their packet is        *
+ *             written. Returns the number of frames.                     *
+ **************************************************************************/
+int xsk_to_tun(struct tunnel *t) {
+    
+    struct xsk *x = t->xsk;
+    struct sockaddr_in addr[BATCH_MAX];
+    struct peer *owner[BATCH_MAX];
+    struct wire_hdr *hdr;
+    struct xdp_desc *d;
+    uint8_t *eth[BATCH_MAX];
+    uint64_t chunk[BATCH_MAX], t0 = 0, t1 = 0, t2 = 0, now;
+    unsigned long rx_bytes = 0, tx_bytes = 0;
+    int plength[BATCH_MAX], valid[BATCH_MAX], i, n, len, ret, ntx = 0, timed = hist_sample();
+    
+    if (timed)
+        t0 = now_nsec();
+    if ((n = xsk_ready(&x->rx)) > t->rx_batch->size)
+        n = t->rx_batch->size;
+    if (n == 0)
+        return 0;
+    
+    /* the XDP program only lets IPv4 without options and UDP through */
+    if (timed)
+        t1 = now_nsec();
+    for (i = 0; i < n; i++) {
+        d = &((struct xdp_desc *)x->rx.descs)[(x->rx.cached + i) & x->rx.mask];
+        chunk[i] = d->addr & ~(uint64_t)(BUFSIZE - 1);
+        eth[i] = (uint8_t *)pool.base + d->addr;
+        len = d->len < XDP_HDRS_LEN ? -1 : rd16(eth[i] + ETH_HDR_LEN + IP_HDR_LEN + 4) - UDP_HDR_LEN;
+        valid[i] = 0;
+        owner[i] = NULL;
+        if (len < 0 || len > (int)d->len - XDP_HDRS_LEN) {
+            count(C_DROP_MALFORMED, 1);
+            continue;
+        }
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].sin_family = AF_INET;
+        memcpy(&addr[i].sin_addr.s_addr, eth[i] + ETH_HDR_LEN + 12, 4);
+        memcpy(&addr[i].sin_port, eth[i] + ETH_HDR_LEN + IP_HDR_LEN, 2);
+        rx_bytes += len;
+        if (wire_decap((char *)eth[i] + XDP_HDRS_LEN, len, &hdr) < 0)
+            continue;
+        valid[i] = 1;
+        owner[i] = rx_frame(t, hdr, &addr[i]);
+    }
+    for (i = 0; i < n; i++)
+        plength[i] = owner[i] ? frame_open(t, owner[i], (struct wire_hdr *)(eth[i] + XDP_HDRS_LEN)) : -1;
+    
+    /* whatever checked out tells us the way back */
+    for (i = 0; i < n; i++)
+        if (valid[i] && (((struct wire_hdr *)(eth[i] + XDP_HDRS_LEN))->version & WIRE_F_OPENED))
+            neigh_learn(addr[i].sin_addr.s_addr, eth[i] + 6);
+    
+    if (timed)
+        t2 = now_nsec();
+    for (i = 0; i < n; i++) {
+        if (plength[i] < 0)
+            continue;
+        if ((ret = tun_deliver(t, owner[i], ((struct wire_hdr *)(eth[i] + XDP_HDRS_LEN))->type,
+                               eth[i] + XDP_HDRS_LEN + WIRE_HDR_LEN, plength[i], &tx_bytes)) == 0)
+            continue;
+        ntx += ret;
+        if (timed)
+            hist_add(H_NET_TUN, now_nsec() - t1);
+    }
+    
+    /* every buffer taken off rx has a place on the fill ring */
+    x->rx.cached += n;
+    __atomic_store_n(x->rx.consumer, x->rx.cached, __ATOMIC_RELEASE);
+    for (i = 0; i < n; i++)
+        ((uint64_t *)x->fill.descs)[x->fill.cached++ & x->fill.mask] = chunk[i];
+    __atomic_store_n(x->fill.producer, x->fill.cached, __ATOMIC_RELEASE);
+    if (__atomic_load_n(x->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        recvfrom(x->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    
+    count(C_NET_RX_PKTS, n);
+    count(C_NET_RX_BYTES, rx_bytes);
+    count(C_TUN_TX_PKTS, ntx);
+    count(C_TUN_TX_BYTES, tx_bytes);
+    
+    if (timed) {
+        now = now_nsec();
+        hist_add(H_RX_READ, t1 - t0);
+        hist_add(H_RX_CRYPTO, t2 - t1);
+        hist_add(H_RX_WRITE, now - t2);
+    }
+    
+    return n;
+}
+
+/**************************************************************************
+ * xdp_init: sets up the AF_XDP underlay on xdp_ifname for the workers,   *
+ *           before they start: one socket per queue a worker has, the    *
+ *           map and program that feed them. Workers left without a       *
+ *           socket, or all of them if the interface will not take the    *
+ *           program, stay on UDP.                                        *
+ **************************************************************************/
+void xdp_init(struct tunnel *tun) {
+    
+    struct ifreq ifr;
+    struct sockaddr_in local;
+    union bpf_attr attr;
+    socklen_t len;
+    uint16_t port[WORKERS_MAX];
+    uint32_t key, val;
+    int map_fd, ports_fd, prog_fd, link_fd = -1, umem_fd = -1, opts = 0, i, n = 0;
+    const char *mode = "native";
+    char ports[WORKERS_MAX * 6 + 1] = "";
+    
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, xdp_ifname, IFNAMSIZ - 1);
+    if (ioctl(tun[0].sock_fd, SIOCGIFINDEX, &ifr) < 0) {
+        perror("AF_XDP underlay interface");
+        return;
+    }
+    xdp_ifindex = ifr.ifr_ifindex;
+    if (ioctl(tun[0].sock_fd, SIOCGIFHWADDR, &ifr) < 0) {
+        perror("AF_XDP underlay MAC address");
+        return;
+    }
+    memcpy(xdp_mac, ifr.ifr_hwaddr.sa_data, 6);
+    if (ioctl(tun[0].sock_fd, SIOCGIFADDR, &ifr) < 0) {
+        perror("AF_XDP underlay IPv4 address");
+        return;
+    }
+    xdp_ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+    if (ioctl(tun[0].sock_fd, SIOCGIFMTU, &ifr) < 0) {
+        perror("AF_XDP underlay MTU");
+        return;
+    }
+    xdp_mtu = ifr.ifr_mtu;
+    
+    /* the program takes the ports of all worker sockets */
+    for (i = 0; i < workers; i++) {
+        len = sizeof(local);
+        if (getsockname(tun[i].sock_fd, (struct sockaddr *)&local, &len) < 0) {
+            perror("getsockname");
+            return;
+        }
+        port[i] = ntohs(local.sin_port);
+    }
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(key);
+    attr.value_size = sizeof(val);
+    attr.max_entries = WORKERS_MAX;
+    strncpy(attr.map_name, "udptunnel_xsks", sizeof(attr.map_name) - 1);
+    if ((map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        perror("AF_XDP: creating the socket map");
+        return;
+    }
+    attr.map_type = BPF_MAP_TYPE_HASH;
+    strncpy(attr.map_name, "udptunnel_port", sizeof(attr.map_name) - 1);
+    if ((ports_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        perror("AF_XDP: creating the port map");
+        close(map_fd);
+        return;
+    }
+    for (i = 0; i < workers; i++) {
+        key = port[i];
+        val = 1;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = ports_fd;
+        attr.key = (uintptr_t)&key;
+        attr.value = (uintptr_t)&val;
+        attr.flags = BPF_NOEXIST;
+        if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0)
+            sprintf(ports + strlen(ports), " %d", port[i]);
+        else if (errno != EEXIST)
+            perror("AF_XDP: adding a port to the map");
+    }
+    /* the program holds on to both maps */
+    prog_fd = xdp_prog_load(map_fd, ports_fd);
+    close(ports_fd);
+    if (prog_fd < 0) {
+        close(map_fd);
+        return;
+    }
+    
+    for (i = 0; i < workers; i++) {
+        if ((tun[i].xsk = xsk_open(i, umem_fd, htons(port[i]))) == NULL) {
+            fprintf(stderr, "worker %d: no AF_XDP socket on %s queue %d (%s), on UDP only\n",
+                    i, xdp_ifname, i, strerror(errno));
+            continue;
+        }
+        if (umem_fd < 0)
+            umem_fd = tun[i].xsk->fd;
+        key = i;
+        val = tun[i].xsk->fd;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = map_fd;
+        attr.key = (uintptr_t)&key;
+        attr.value = (uintptr_t)&val;
+        if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+            /* it receives nothing then, but can still send */
+            perror("AF_XDP: adding a socket to the map");
+            continue;
+        }
+        n++;
+    }
+    
+    /* native mode where the driver has it, else the generic one */
+    if (n > 0 && (link_fd = xdp_attach(prog_fd, XDP_FLAGS_DRV_MODE)) < 0) {
+        mode = "generic";
+        link_fd = xdp_attach(prog_fd, XDP_FLAGS_SKB_MODE);
+    }
+    if (link_fd < 0) {
+        if (n > 0)
+            perror("AF_XDP: attaching the XDP program");
+        for (i = 0; i < workers; i++)
+            if (tun[i].xsk) {
+                xsk_close(tun[i].xsk);
+                tun[i].xsk = NULL;
+            }
+        close(prog_fd);
+        close(map_fd);
+        return;
+    }
+    
+    len = sizeof(opts);
+    getsockopt(umem_fd, SOL_XDP, XDP_OPTIONS, &opts, &len);
+    printf("AF_XDP underlay on %s (%s XDP, %s): %d of %d workers, UDP port(s)%s\n", xdp_ifname, mode,
+           opts & XDP_OPTIONS_ZEROCOPY ? "zero-copy" : "copy", n, workers, ports);
+}
+
+/**************************************************************************
+ * Kernel fast path (-K): once a peer without encryption is connected, a *
+ * TC program on the tun device's egress puts outer Ethernet, IPv4, UDP  *
+ * and tunnel headers before the packets routed to it and redirects them *
+ * out of the underlay, and one on the underlay's ingress takes them off *
+ * data frames of its session and redirects the packets into tun.        *
+ * Neither comes up to us. The control thread keeps the maps they look   *
+ * peers up in in step with peers[], next hop MACs included; what the    *
+ * programs do not take (control frames, IPv6, packets too long for the  *
+ * underlay, other peers) reaches us as before. So does a packet whose   *
+ * TCP or UDP checksum the stack left to the device: the kernel finishes *
+ * it before we read it, where an underlay might not, a veth handing it  *
+ * on unfinished.                                                        *
+ **************************************************************************/
+
+/**************************************************************************
+ * kf_emit: appends an instruction to program pg.                         *
+ **************************************************************************/
+void kf_emit(struct kf_prog *pg, uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    if (pg->n < KF_INSNS_MAX)
+        pg->insn[pg->n++] = (struct bpf_insn){ .code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm };
+}
+
+/**************************************************************************
+ * kf_load: ends program pg with the exit its KF_TO_PASS jumps go to      *
+ *          and loads it as TC program name. Returns its fd, -1 on        *
+ *          failure with the verifier's complaint printed.                *
+ **************************************************************************/
+int kf_load(struct kf_prog *pg, const char *name) {
+    
+    static char log[65536];
+    union bpf_attr attr;
+    int pass = pg->n, fd, i;
+    
+    /* leave it to the kernel */
+    kf_emit(pg, BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, TC_ACT_OK);
+    kf_emit(pg, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    if (pg->n == KF_INSNS_MAX) {
+        fprintf(stderr, "Kernel fast path: %s does not fit in %d instructions\n", name, KF_INSNS_MAX);
+        return -1;
+    }
+    for (i = 0; i < pass; i++)
+        if (BPF_CLASS(pg->insn[i].code) == BPF_JMP && pg->insn[i].off == KF_TO_PASS)
+            pg->insn[i].off = pass - i - 1;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+    attr.insns = (uintptr_t)pg->insn;
+    attr.insn_cnt = pg->n;
+    attr.license = (uintptr_t)"GPL";
+    strncpy(attr.prog_name, name, sizeof(attr.prog_name) - 1);
+    if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) >= 0)
+        return fd;
+    
+    /* again with the verifier log, to say why */
+    attr.log_buf = (uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0)
+        fprintf(stderr, "Loading the TC program %s: %s\n%s", name, strerror(errno), log);
+    return fd;
+}
+
+/* instructions of the TC programs, into struct kf_prog pg */
+#define KI(c, d, s, o, i) kf_emit(&pg, (c), (d), (s), (int16_t)(o), (int32_t)(i))
+#define KMOV(d, i) KI(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define KMOVX(d, s) KI(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define KADDI(d, i) KI(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define KBE16(d) KI(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define KLD(sz, d, s, o) KI(BPF_LDX | BPF_MEM | BPF_##sz, d, s, o, 0)
+#define KST(sz, d, o, s) KI(BPF_STX | BPF_MEM | BPF_##sz, d, s, o, 0)
+#define KSTI(sz, d, o, i) KI(BPF_ST | BPF_MEM | BPF_##sz, d, 0, o, i)
+#define KATOMIC(d, o, s, op) KI(BPF_STX | BPF_ATOMIC | BPF_DW, d, s, o, op)
+#define KPASS(op, d, i) KI(BPF_JMP | BPF_##op | BPF_K, d, 0, KF_TO_PASS, i)
+#define KMAP(d, fd) (KI(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), KI(0, 0, 0, 0, 0))
+#define KCALL(fn) KI(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_##fn)
+#define KEXIT() KI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/**************************************************************************
+ * kf_encap_load: loads the program for the tun device's egress:          *
+ *                IPv4 packets routed to a peer that is on get our        *
+ *                headers and go out of its interface to its next hop,    *
+ *                but for those with a checksum still to finish. Returns  *
+ *                its fd, or -1.                                          *
+ **************************************************************************/
+int kf_encap_load(void) {
+
+#define KF_ETH (-82)        /* stack: the headers being built, KF_HDRS_LEN up to -24 */
+#define KF_IP (KF_ETH + ETH_HDR_LEN)
+#define KF_UDP (KF_IP + IP_HDR_LEN)
+#define KF_WIRE (KF_UDP + UDP_HDR_LEN)
+    struct kf_prog pg = { .n = 0 };
+    int i, ja;
+
+    /* r6 = skb; an IPv4 packet, not a GSO one, its header in the linear part */
+    KMOVX(6, 1);
+    KLD(W, 4, 6, offsetof(struct __sk_buff, gso_size));
+    KPASS(JNE, 4, 0);
+    KLD(W, 2, 6, offsetof(struct __sk_buff, data));
+    KLD(W, 3, 6, offsetof(struct __sk_buff, data_end));
+    KMOVX(4, 2);
+    KADDI(4, IP_HDR_LEN);
+    KI(BPF_JMP | BPF_JGT | BPF_X, 4, 3, KF_TO_PASS, 0);
+    KLD(B, 4, 2, 0);
+    KI(BPF_ALU64 | BPF_AND | BPF_K, 4, 0, 0, 0xf0);
+    KPASS(JNE, 4, 0x40);
+
+    /* not one whose TCP or UDP checksum the stack left to the device (CHECKSUM_PARTIAL): its field holds
+     * no more than the pseudo header's sum then, and the kernel finishes it on the way up to us */
+    KLD(B, 5, 2, 9);
+    KMOV(0, IP_HDR_LEN + 16);
+    KI(BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 3, IPPROTO_TCP);
+    KMOV(0, IP_HDR_LEN + 6);
+    KI(BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 1, IPPROTO_UDP);
+    ja = pg.n;
+    KI(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+    KLD(B, 4, 2, 0);
+    KPASS(JNE, 4, 0x45);
+    KMOVX(4, 2);
+    KI(BPF_ALU64 | BPF_ADD | BPF_X, 4, 0, 0, 0);
+    KMOVX(1, 4);
+    KADDI(1, 2);
+    KI(BPF_JMP | BPF_JGT | BPF_X, 1, 3, KF_TO_PASS, 0);
+    KLD(H, 4, 4, 0);
+    KLD(H, 0, 2, 2);
+    KBE16(0);
+    KADDI(0, -IP_HDR_LEN);
+    KBE16(0);
+    KBE16(5);
+    KI(BPF_ALU64 | BPF_ADD | BPF_X, 0, 5, 0, 0);
+    for (i = 12; i < 20; i += 2) {
+        KLD(H, 1, 2, i);
+        KI(BPF_ALU64 | BPF_ADD | BPF_X, 0, 1, 0, 0);
+    }
+    for (i = 0; i < 2; i++) {
+        KMOVX(1, 0);
+        KI(BPF_ALU64 | BPF_RSH | BPF_K, 1, 0, 0, 16);
+        KI(BPF_ALU64 | BPF_AND | BPF_K, 0, 0, 0, 0xffff);
+        KI(BPF_ALU64 | BPF_ADD | BPF_X, 0, 1, 0, 0);
+    }
+    KI(BPF_JMP | BPF_JEQ | BPF_X, 0, 4, KF_TO_PASS, 0);
+    pg.insn[ja].off = pg.n - ja - 1;
+
+    /* r7 = the peer its destination is routed to, if the kernel forwards for it */
+    KLD(W, 4, 2, 16);
+    KST(W, 10, -4, 4);
+    KSTI(W, 10, -8, 32);
+    KMAP(1, kf_routes_fd);
+    KMOVX(2, 10);
+    KADDI(2, -8);
+    KCALL(map_lookup_elem);
+    KPASS(JEQ, 0, 0);
+    KLD(W, 4, 0, 0);
+    KST(W, 10, -12, 4);
+    KMAP(1, kf_peers_fd);
+    KMOVX(2, 10);
+    KADDI(2, -12);
+    KCALL(map_lookup_elem);
+    KPASS(JEQ, 0, 0);
+    KMOVX(7, 0);
+    KLD(W, 4, 7, offsetof(struct kf_peer, on));
+    KPASS(JEQ, 4, 0);
+
+    /* r8 = its length; the datagram must fit the underlay, we fragment or clamp the rest */
+    KLD(W, 8, 6, offsetof(struct __sk_buff, len));
+    KLD(W, 5, 7, offsetof(struct kf_peer, mtu));
+    KMOVX(4, 8);
+    KADDI(4, KF_OUTER_LEN);
+    KI(BPF_JMP | BPF_JGT | BPF_X, 4, 5, KF_TO_PASS, 0);
+
+    /* the headers, on the stack: Ethernet, IPv4 with DF as xdp_headers has it, UDP without checksum */
+    for (i = KF_ETH - 6; i < KF_WIRE + WIRE_HDR_LEN; i += 8)
+        KSTI(DW, 10, i, 0);
+    for (i = 0; i < 6; i += 2) {
+        KLD(H, 4, 7, offsetof(struct kf_peer, dmac) + i);
+        KST(H, 10, KF_ETH + i, 4);
+        KLD(H, 4, 7, offsetof(struct kf_peer, smac) + i);
+        KST(H, 10, KF_ETH + 6 + i, 4);
+    }
+    KSTI(H, 10, KF_ETH + 12, htons(ETH_TYPE_IP));
+    KSTI(B, 10, KF_IP, 0x45);
+    KMOVX(4, 8);
+    KADDI(4, KF_OUTER_LEN);
+    KBE16(4);
+    KST(H, 10, KF_IP + 2, 4);
+    KSTI(H, 10, KF_IP + 6, htons(0x4000));
+    KSTI(B, 10, KF_IP + 8, 64);
+    KSTI(B, 10, KF_IP + 9, IPPROTO_UDP);
+    KLD(W, 4, 7, offsetof(struct kf_peer, saddr));
+    KST(W, 10, KF_IP + 12, 4);
+    KLD(W, 4, 7, offsetof(struct kf_peer, daddr));
+    KST(W, 10, KF_IP + 16, 4);
+    KLD(H, 4, 7, offsetof(struct kf_peer, sport));
+    KST(H, 10, KF_UDP, 4);
+    KLD(H, 4, 7, offsetof(struct kf_peer, dport));
+    KST(H, 10, KF_UDP + 2, 4);
+    KMOVX(4, 8);
+    KADDI(4, UDP_HDR_LEN + WIRE_HDR_LEN);
+    KBE16(4);
+    KST(H, 10, KF_UDP + 4, 4);
+    KSTI(B, 10, KF_WIRE + offsetof(struct wire_hdr, version), WIRE_VERSION << 4);
+    KSTI(B, 10, KF_WIRE + offsetof(struct wire_hdr, type), FRAME_DATA);
+    KMOVX(4, 8);
+    KBE16(4);
+    KST(H, 10, KF_WIRE + offsetof(struct wire_hdr, length), 4);
+    KLD(W, 4, 7, offsetof(struct kf_peer, session));
+    KST(W, 10, KF_WIRE + offsetof(struct wire_hdr, session), 4);
+    KMOV(4, 1);
+    KATOMIC(7, offsetof(struct kf_peer, seq), 4, BPF_ADD | BPF_FETCH);
+    KI(BPF_ALU | BPF_END | BPF_TO_BE, 4, 0, 0, 64);
+    KST(DW, 10, KF_WIRE + offsetof(struct wire_hdr, seq), 4);
+    
+    /* IPv4 header checksum: the sum bpf_csum_diff leaves, folded to 16 bits */
+    KMOV(1, 0);
+    KMOV(2, 0);
+    KMOVX(3, 10);
+    KADDI(3, KF_IP);
+    KMOV(4, IP_HDR_LEN);
+    KMOV(5, 0);
+    KCALL(csum_diff);
+    KI(BPF_ALU | BPF_MOV | BPF_X, 0, 0, 0, 0);
+    for (i = 0; i < 2; i++) {
+        KMOVX(4, 0);
+        KI(BPF_ALU64 | BPF_RSH | BPF_K, 4, 0, 0, 16);
+        KI(BPF_ALU64 | BPF_AND | BPF_K, 0, 0, 0, 0xffff);
+        KI(BPF_ALU64 | BPF_ADD | BPF_X, 0, 4, 0, 0);
+    }
+    KI(BPF_ALU64 | BPF_XOR | BPF_K, 0, 0, 0, 0xffff);
+    KST(H, 10, KF_IP + 10, 0);
+    
+    /* in front of the packet, which cannot go back to us once it has them */
+    KMOVX(1, 6);
+    KMOV(2, KF_HDRS_LEN);
+    KMOV(3, 0);
+    KCALL(skb_change_head);
+    KPASS(JNE, 0, 0);
+    KMOVX(1, 6);
+    KMOV(2, 0);
+    KMOVX(3, 10);
+    KADDI(3, KF_ETH);
+    KMOV(4, KF_HDRS_LEN);
+    KMOV(5, 0);
+    KCALL(skb_store_bytes);
+    KI(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2, 0);
+    KMOV(0, TC_ACT_SHOT);
+    KEXIT();
+    KMOV(4, 1);
+    KATOMIC(7, offsetof(struct kf_peer, tx_pkts), 4, BPF_ADD);
+    KATOMIC(7, offsetof(struct kf_peer, tx_bytes), 8, BPF_ADD);
+    KLD(W, 1, 7, offsetof(struct kf_peer, oif));
+    KMOV(2, 0);
+    KCALL(redirect);
+    KEXIT();
+#undef KF_ETH
+#undef KF_IP
+#undef KF_UDP
+#undef KF_WIRE
+    return kf_load(&pg, "udptunnel_encap");
+}
+
+/**************************************************************************
+ * kf_decap_load: loads the program for the underlay's ingress: data      *
+ *                frames to UDP ports [lo, hi) of a session that is on    *
+ *                lose the headers in front of their IPv4 packet, which   *
+ *                goes into tun, device tun_ifindex. Returns its fd, or   *
+ *                -1.                                                     *
+ **************************************************************************/
+int kf_decap_load(int tun_ifindex, uint16_t lo, uint16_t hi) {
+
+#define KF_WIRE (ETH_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN)
+    struct kf_prog pg = { .n = 0 };
+    
+    /* r6 = skb; IPv4 without options, UDP, not a fragment, to one of our ports */
+    KMOVX(6, 1);
+    KLD(W, 2, 6, offsetof(struct __sk_buff, data));
+    KLD(W, 3, 6, offsetof(struct __sk_buff, data_end));
+    KMOVX(4, 2);
+    KADDI(4, KF_HDRS_LEN + IP_HDR_LEN);
+    KI(BPF_JMP | BPF_JGT | BPF_X, 4, 3, KF_TO_PASS, 0);
+    KLD(H, 4, 2, 12);
+    KPASS(JNE, 4, htons(ETH_TYPE_IP));
+    KLD(B, 4, 2, ETH_HDR_LEN);
+    KPASS(JNE, 4, 0x45);
+    KLD(B, 4, 2, ETH_HDR_LEN + 9);
+    KPASS(JNE, 4, IPPROTO_UDP);
+    KLD(H, 4, 2, ETH_HDR_LEN + 6);
+    KI(BPF_ALU64 | BPF_AND | BPF_K, 4, 0, 0, htons(0x3fff));
+    KPASS(JNE, 4, 0);
+    KLD(H, 4, 2, ETH_HDR_LEN + IP_HDR_LEN + 2);
+    KBE16(4);
+    KPASS(JLT, 4, lo);
+    KPASS(JGE, 4, hi);
+    
+    /* a plain data frame of this version, an IPv4 packet in it */
+    KLD(B, 4, 2, KF_WIRE + offsetof(struct wire_hdr, version));
+    KPASS(JNE, 4, WIRE_VERSION << 4);
+    KLD(B, 4, 2, KF_WIRE + offsetof(struct wire_hdr, type));
+    KPASS(JNE, 4, FRAME_DATA);
+    KLD(B, 4, 2, KF_HDRS_LEN);
+    KI(BPF_ALU64 | BPF_AND | BPF_K, 4, 0, 0, 0xf0);
+    KPASS(JNE, 4, 0x40);
+    
+    /* r7 = the peer of its session, if the kernel forwards for it */
+    KLD(W, 4, 2, KF_WIRE + offsetof(struct wire_hdr, session));
+    KST(W, 10, -4, 4);
+    KMAP(1, kf_sessions_fd);
+    KMOVX(2, 10);
+    KADDI(2, -4);
+    KCALL(map_lookup_elem);
+    KPASS(JEQ, 0, 0);
+    KLD(W, 4, 0, 0);
+    KST(W, 10, -8, 4);
+    KMAP(1, kf_peers_fd);
+    KMOVX(2, 10);
+    KADDI(2, -8);
+    KCALL(map_lookup_elem);
+    KPASS(JEQ, 0, 0);
+    KMOVX(7, 0);
+    KLD(W, 4, 7, offsetof(struct kf_peer, on));
+    KPASS(JEQ, 4, 0);
+    
+    /* behind the Ethernet header comes the packet, the redirect removes that too */
+    KLD(W, 8, 6, offsetof(struct __sk_buff, len));
+    KADDI(8, -KF_HDRS_LEN);
+    KMOVX(1, 6);
+    KMOV(2, -KF_OUTER_LEN);
+    KMOV(3, BPF_ADJ_ROOM_MAC);
+    KMOV(4, 0);
+    KCALL(skb_adjust_room);
+    KPASS(JNE, 0, 0);
+    KMOV(4, 1);
+    KATOMIC(7, offsetof(struct kf_peer, rx_pkts), 4, BPF_ADD);
+    KATOMIC(7, offsetof(struct kf_peer, rx_bytes), 8, BPF_ADD);
+    KMOV(1, tun_ifindex);
+    KMOV(2, BPF_F_INGRESS);
+    KCALL(redirect);
+    KEXIT();
+#undef KF_WIRE
+    return kf_load(&pg, "udptunnel_decap");
+}
+#undef KI
+#undef KMOV
+#undef KMOVX
+#undef KADDI
+#undef KBE16
+#undef KLD
+#undef KST
+#undef KSTI
+#undef KATOMIC
+#undef KPASS
+#undef KMAP
+#undef KCALL
+#undef KEXIT
+
+/**************************************************************************
+ * kf_attach: attaches TC program prog_fd to interface ifindex at         *
+ *            attach point type. The link goes away with the process.     *
+ **************************************************************************/
+int kf_attach(int prog_fd, int ifindex, int type) {
+    
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = type;
+    return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+/**************************************************************************
+ * kf_map: creates a BPF map named name. Returns its fd, -1 on            *
+ *         failure.                                                       *
+ **************************************************************************/
+int kf_map(int type, int key_size, int value_size, int max, unsigned flags, const char *name) {
+    
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max;
+    attr.map_flags = flags;
+    strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/**************************************************************************
+ * kf_update: sets key to val in map fd, or with val NULL deletes it.     *
+ **************************************************************************/
+int kf_update(int fd, const void *key, const void *val) {
+    
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (uintptr_t)key;
+    attr.value = (uintptr_t)val;
+    return sys_bpf(val ? BPF_MAP_UPDATE_ELEM : BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/**************************************************************************
+ * kfast_init: the maps and programs of the kernel fast path, before      *
+ *             the workers start; peers get in as kfast_sync finds them   *
+ *             connected. Decap goes on underlay interfaces as routes     *
+ *             to peers need it. Without -K, or when the kernel will      *
+ *             not have them, everything stays in userspace.              *
+ **************************************************************************/
+void kfast_init(struct tunnel *tun, uint16_t lo, uint16_t hi) {
+    
+    char buf[NL_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    struct ifreq ifr;
+    uint32_t one = 1;
+    size_t size = (PEERS_MAX * sizeof(struct kf_peer) + sysconf(_SC_PAGESIZE) - 1) & ~(sysconf(_SC_PAGESIZE) - 1);
+    void *mem;
+    int encap_fd, fd;
+    
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, tun_name, IFNAMSIZ - 1);
+    if (ioctl(tun[0].sock_fd, SIOCGIFINDEX, &ifr) < 0) {
+        perror("Kernel fast path: tun interface");
+        kfast = 0;
+        return;
+    }
+    kf_tun_ifindex = ifr.ifr_ifindex;
+    
+    /* TCP then hands tun one segment per packet, where it would build GSO ones the programs cannot take */
+    memset(buf, 0, sizeof(buf));
+    nh->nlmsg_len = NLMSG_LENGTH(sizeof(*ifi));
+    nh->nlmsg_type = RTM_NEWLINK;
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_index = kf_tun_ifindex;
+    nl_attr(nh, IFLA_GSO_MAX_SEGS, &one, sizeof(one));
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) >= 0) {
+        nl_talk(fd, nh, "Kernel fast path: one segment per packet on the tun link");
+        close(fd);
+    }
+    
+    if ((kf_peers_fd = kf_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(struct kf_peer), PEERS_MAX,
+                              BPF_F_MMAPABLE, "udptun_peers")) < 0 ||
+        (kf_routes_fd = kf_map(BPF_MAP_TYPE_LPM_TRIE, 2 * sizeof(uint32_t), sizeof(uint32_t),
+                               PEERS_MAX * PEER_ROUTES_MAX, BPF_F_NO_PREALLOC, "udptun_routes")) < 0 ||
+        (kf_sessions_fd = kf_map(BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint32_t), PEERS_MAX, 0,
+                                 "udptun_session")) < 0) {
+        perror("Kernel fast path: creating the maps");
+        kfast = 0;
+        return;
+    }
+    if ((mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, kf_peers_fd, 0)) == MAP_FAILED) {
+        perror("Kernel fast path: mapping the peer map");
+        kfast = 0;
+        return;
+    }
+    if ((encap_fd = kf_encap_load()) < 0 || (kf_decap_fd = kf_decap_load(kf_tun_ifindex, lo, hi)) < 0) {
+        kfast = 0;
+        return;
+    }
+    if (kf_attach(encap_fd, kf_tun_ifindex, BPF_TCX_EGRESS) < 0) {
+        perror("Kernel fast path: attaching to the tun interface");
+        kfast = 0;
+        return;
+    }
+    if ((kf_state = calloc(PEERS_MAX, sizeof(*kf_state))) == NULL) {
+        perror("kfast_init");
+        exit(1);
+    }
+    kf_sock_fd = tun[0].sock_fd;
+    kf_peers = mem;
+    printf("Kernel fast path on %s: TC programs forward the data of connected peers, UDP ports %d-%d\n",
+           tun_name, lo, hi - 1);
+}
+
+/**************************************************************************
+ * kfast_seq: moves p's own sequence numbers past those the kernel        *
+ *            sealed with, to go on from there when it stops.             *
+ **************************************************************************/
+void kfast_seq(struct peer *p) {
+    
+    uint64_t seq = atomic_load(&kf_peers[p->id].seq) + KF_SEQ_GAP, cur = atomic_load(&p->tx_seq);
+    
+    while (cur < seq && !atomic_compare_exchange_weak(&p->tx_seq, &cur, seq))
+        ;
+}
+
+/**************************************************************************
+ * kfast_unmap: removes the session and routes st has from the maps.      *
+ **************************************************************************/
+void kfast_unmap(struct kf_state *st) {
+    
+    uint32_t session = htonl(st->session), key[2];
+    int i;
+    
+    kf_update(kf_sessions_fd, &session, NULL);
+    for (i = 0; i < st->nroutes; i++) {
+        key[0] = st->routes[i].len;
+        key[1] = htonl(st->routes[i].prefix);
+        kf_update(kf_routes_fd, key, NULL);
+    }
+}
+
+/**************************************************************************
+ * kfast_off: takes peer p out of the maps, its data back to us.          *
+ **************************************************************************/
+void kfast_off(struct peer *p, struct kf_state *st) {
+    
+    atomic_store(&kf_peers[p->id].on, 0);
+    kfast_seq(p);
+    atomic_store(&p->kfast, 0);
+    kfast_unmap(st);
+    st->on = 0;
+    printf("Peer %d: forwarded in userspace again\n", p->id);
+}
+
+/**************************************************************************
+ * kfast_nexthop: where datagrams to addr go, into v: the interface       *
+ *                and source address of the kernel's route, the MTU       *
+ *                and MAC of the one and the MAC of the next hop. -1      *
+ *                when the route is no underlay, 1 when the neighbour     *
+ *                is not resolved yet (our own datagrams to it will).     *
+ **************************************************************************/
+int kfast_nexthop(int fd, const struct sockaddr_in *addr, struct kf_peer *v) {
+    
+    struct arpreq arp;
+    struct ifreq ifr;
+    uint32_t via = 0;
+    int oif;
+    
+    v->saddr = 0;
+    if (route_get(addr, &oif, &v->saddr, &via) < 0 || oif == kf_tun_ifindex || v->saddr == 0)
+        return -1;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_ifindex = oif;
+    if (ioctl(fd, SIOCGIFNAME, &ifr) < 0 || ioctl(fd, SIOCGIFHWADDR, &ifr) < 0 ||
+        ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+        return -1;
+    memcpy(v->smac, ifr.ifr_hwaddr.sa_data, 6);
+    if (ioctl(fd, SIOCGIFMTU, &ifr) < 0)
+        return -1;
+    v->mtu = ifr.ifr_mtu;
+    v->oif = oif;
+    
+    memset(&arp, 0, sizeof(arp));
+    ((struct sockaddr_in *)&arp.arp_pa)->sin_family = AF_INET;
+    ((struct sockaddr_in *)&arp.arp_pa)->sin_addr.s_addr = via ? via : addr->sin_addr.s_addr;
+    memcpy(arp.arp_dev, ifr.ifr_name, sizeof(arp.arp_dev));
+    if (ioctl(fd, SIOCGARP, &arp) < 0 || !(arp.arp_flags & ATF_COM))
+        return 1;
+    memcpy(v->dmac, arp.arp_ha.sa_data, 6);
+    return 0;
+}
+
+/**************************************************************************
+ * kfast_want: the path peer p is to go in the maps on, 0 while it is     *
+ *             not to: not connected over a single path, or needing what  *
+ *             the programs cannot do (bonding, an MSS to clamp to).      *
+ *             Caller holds peers_lock.                                   *
+ **************************************************************************/
+uint64_t kfast_want(struct peer *p) {
+    
+    if (!p->in_use || atomic_load(&p->npaths) != 1 || atomic_load(&p->bonded) || atomic_load(&p->mss) != 0 ||
+        atomic_load(&p->challenge) != 0 || (cliserv == CLIENT && !atomic_load(&hello_acked)))
+        return 0;
+    return atomic_load(&p->paths[0]);
+}
+
+/**************************************************************************
+ * kfast_on: puts peer p in the maps as st has it, to remote addr from    *
+ *           local port sport by the next hop kfast_nexthop found. It     *
+ *           only goes on if p is still as st has it, under peers_lock so *
+ *           nothing moves its sequence numbers meanwhile; they start a   *
+ *           gap past ours, so blocks workers take meanwhile stay below   *
+ *           them.                                                        *
+ **************************************************************************/
+void kfast_on(struct peer *p, struct kf_state *st, const struct sockaddr_in *addr, uint16_t sport) {
+    
+    struct kf_peer *v = &kf_peers[p->id];
+    uint32_t session = htonl(st->session), id = p->id, key[2];
+    int i;
+    
+    v->session = session;
+    v->daddr = addr->sin_addr.s_addr;
+    v->sport = sport;
+    v->dport = addr->sin_port;
+    if (kf_update(kf_sessions_fd, &session, &id) < 0) {
+        perror("Kernel fast path: adding a session");
+        return;
+    }
+    for (i = 0; i < st->nroutes; i++) {
+        key[0] = st->routes[i].len;
+        key[1] = htonl(st->routes[i].prefix);
+        if (kf_update(kf_routes_fd, key, &id) < 0)
+            perror("Kernel fast path: adding a route");
+    }
+    st->rx_pkts = atomic_load(&v->rx_pkts);
+    pthread_mutex_lock(&peers_lock);
+    if (kfast_want(p) == st->path && p->session == st->session) {
+        atomic_store(&v->seq, atomic_load(&p->tx_seq) + KF_SEQ_GAP);
+        atomic_store(&p->kfast, 1);
+        atomic_store(&v->on, 1);
+        st->on = 1;
+    }
+    pthread_mutex_unlock(&peers_lock);
+    if (!st->on) {
+        /* it changed while we asked the kernel, the next sync takes it as it is now */
+        kfast_unmap(st);
+        st->path = 0;
+        return;
+    }
+    printf("Peer %d: forwarded in the kernel, to %s:%d out of interface %d\n", p->id,
+           inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), v->oif);
+}
+
+/**************************************************************************
+ * kfast_decap_on: the decap program on underlay interface oif, if it     *
+ *                 is not there yet. -1 when it will not go there.        *
+ **************************************************************************/
+int kfast_decap_on(int oif) {
+    
+    int i;
+    
+    for (i = 0; i < kf_nifs; i++)
+        if (kf_ifs[i] == oif)
+            return 0;
+    if (kf_nifs == KF_IFS_MAX || kf_attach(kf_decap_fd, oif, BPF_TCX_INGRESS) < 0)
+        return -1;
+    kf_ifs[kf_nifs++] = oif;
+    return 0;
+}
+
+/**************************************************************************
+ * kfast_hop: looks up the next hop to addr of peer p, which is on,       *
+ *            again and rewrites its entry when the route or neighbour    *
+ *            moved. Takes p out when there is no underlay route to it    *
+ *            any more, or until the new neighbour is resolved.           *
+ **************************************************************************/
+void kfast_hop(struct peer *p, struct kf_state *st, const struct sockaddr_in *addr) {
+    
+    struct kf_peer *v = &kf_peers[p->id], hop;
+    int ret;
+    
+    memset(&hop, 0, sizeof(hop));
+    if ((ret = kfast_nexthop(kf_sock_fd, addr, &hop)) == 0 && hop.oif == v->oif && hop.saddr == v->saddr &&
+        hop.mtu == v->mtu && memcmp(hop.smac, v->smac, 6) == 0 && memcmp(hop.dmac, v->dmac, 6) == 0)
+        return;
+    if (ret != 0 || kfast_decap_on(hop.oif) < 0) {
+        kfast_off(p, st);
+        if (ret > 0)
+            st->path = 0;
+        return;
+    }
+    /* the programs leave its packets to us while the entry is rewritten */
+    atomic_store(&v->on, 0);
+    v->saddr = hop.saddr;
+    v->oif = hop.oif;
+    v->mtu = hop.mtu;
+    memcpy(v->smac, hop.smac, 6);
+    memcpy(v->dmac, hop.dmac, 6);
+    atomic_store(&v->on, 1);
+    printf("Peer %d: next hop moved, out of interface %d\n", p->id, v->oif);
+}
+
+/**************************************************************************
+ * kfast_sync: the control thread brings the maps in line with peers[]:   *
+ *             a peer goes in once kfast_want says so and out again when  *
+ *             that changes, as does one whose session, path or routes    *
+ *             changed, to go in anew; one that stays in has its next hop *
+ *             looked up again. Takes back the sequence numbers and signs *
+ *             of life of the kernel's. What it asks the kernel it asks   *
+ *             with peers_lock released, from a copy of the peer.         *
+ **************************************************************************/
+void kfast_sync(void) {
+    
+    static const struct route all;  /* client: everything goes to the server */
+    struct route r[PEER_ROUTES_MAX];
+    struct sockaddr_in addr, local;
+    socklen_t len;
+    struct kf_state *st;
+    struct peer *p;
+    uint64_t path, rx;
+    uint32_t session;
+    int i, nroutes, hop;
+    
+    for (i = 0; i < PEERS_MAX; i++) {
+        p = &peers[i];
+        st = &kf_state[i];
+        if (st->on) {
+            kfast_seq(p);
+            if ((rx = atomic_load(&kf_peers[i].rx_pkts)) != st->rx_pkts) {
+                st->rx_pkts = rx;
+                atomic_store(&p->last_rx, atomic_load(&coarse_now));
+                atomic_store(&p->auth_rx, atomic_load(&coarse_now));
+            }
+        }
+        pthread_mutex_lock(&peers_lock);
+        path = kfast_want(p);
+        session = p->session;
+        nroutes = cliserv == CLIENT ? 1 : p->nroutes;
+        memcpy(r, cliserv == CLIENT ? &all : p->routes, nroutes * sizeof(*r));
+        peer_path(p, 0, &addr);
+        pthread_mutex_unlock(&peers_lock);
+        /* as it was installed, or as it failed to be */
+        if (path == st->path && (!path || (session == st->session && nroutes == st->nroutes &&
+                                           memcmp(r, st->routes, nroutes * sizeof(*r)) == 0))) {
+            if (st->on)
+                kfast_hop(p, st, &addr);
+            continue;
+        }
+        if (st->on)
+            kfast_off(p, st);
+        st->path = path;
+        if (!path)
+            continue;
+        st->session = session;
+        st->nroutes = nroutes;
+        memcpy(st->routes, r, nroutes * sizeof(*r));
+    
+        len = sizeof(local);
+        if ((hop = kfast_nexthop(kf_sock_fd, &addr, &kf_peers[i])) > 0) {
+            st->path = 0;
+            continue;
+        }
+        if (hop < 0 || getsockname(kf_sock_fd, (struct sockaddr *)&local, &len) < 0) {
+            fprintf(stderr, "Peer %d: no underlay route for the kernel fast path, forwarded in userspace\n", i);
+            continue;
+        }
+        if (kfast_decap_on(kf_peers[i].oif) < 0) {
+            perror("Kernel fast path: attaching to the underlay interface");
+            continue;
+        }
+        kfast_on(p, st, &addr, local.sin_port);
+    }
+}
+
+/**************************************************************************
+ * ev_add: registers src for edge-triggered events on src->fd.            *
+ **************************************************************************/
+int ev_add(int epoll_fd, struct event_src *src, uint32_t events) {
+    
+    struct epoll_event ev;
+    
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET;
+    ev.data.ptr = src;
+    src->pending = 0;
+    
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+/**************************************************************************
+ * ev_loop: runs the handlers of ready sources forever. Sources that hit  *
+ *          their budget stay queued, and epoll is only polled (timeout   *
+ *          0) until they are done, so one busy fd cannot starve others.  *
+ *          In the latency profile it also polls for spin_nsec after the  *
+ *          last event before it blocks, to skip the wakeup.              *
+ **************************************************************************/
+void ev_loop(int epoll_fd) {
+    
+    struct epoll_event events[EVENTS_MAX];
+    struct event_src *queue[EVENTS_MAX], *src;
+    uint64_t now, busy_at = 0;
+    int i, n = 0, nqueued = 0, nkept, timeout;
+    
+    while (1) {
+        timeout = nqueued ? 0 : -1;
+        if (spin_nsec && !nqueued) {
+            now = now_nsec();
+            if (n > 0)
+                busy_at = now;
+            if (now - busy_at < spin_nsec)
+                timeout = 0;
+        }
+        n = epoll_wait(epoll_fd, events, EVENTS_MAX, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait()");
+            exit(1);
+        }
+        
+        for (i = 0; i < n; i++) {
+            src = events[i].data.ptr;
+            if (!src->pending && nqueued < EVENTS_MAX) {
+                src->pending = 1;
+                queue[nqueued++] = src;
+            }
+        }
+        
+        for (i = 0, nkept = 0; i < nqueued; i++) {
+            src = queue[i];
+            if (src->handler(src))
+                queue[nkept++] = src;
+            else
+                src->pending = 0;
+        }
+        nqueued = nkept;
+    }
+}
+
+/**************************************************************************
+ * ring_init: a ring of depth slots, depth a power of 2.                  *
+ **************************************************************************/
+void ring_init(struct ring *r, int depth) {
+    
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->tail_cache = r->head_cache = 0;
+    r->mask = depth - 1;
+    if ((r->slots = calloc(depth, sizeof(*r->slots))) == NULL) {
+        perror("ring_init");
+        exit(1);
+    }
+}
+
+/**************************************************************************
+ * ring_push: producer side, queues buf. Returns -1 if the ring is full.  *
+ **************************************************************************/
+int ring_push(struct ring *r, char *buf) {
+    
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    
+    if (head - r->tail_cache > r->mask) {
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head - r->tail_cache > r->mask)
+            return -1;
+    }
+    r->slots[head & r->mask] = buf;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 0;
+}
+
+/**************************************************************************
+ * ring_pop: consumer side, the oldest buffer or NULL if the ring is      *
+ *           empty.                                                       *
+ **************************************************************************/
+char *ring_pop(struct ring *r) {
+    
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    char *buf;
+    
+    if (tail == r->head_cache) {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail == r->head_cache)
+            return NULL;
+    }
+    buf = r->slots[tail & r->mask];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return buf;
+}
+
+/**************************************************************************
+ * ring_empty: consumer side check, without taking anything.              *
+ **************************************************************************/
+int ring_empty(struct ring *r) {
+    return atomic_load_explicit(&r->tail, memory_order_relaxed) ==
+           atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+/**************************************************************************
+ * efd_kick/efd_drain: wake the thread sleeping on an eventfd, and clear  *
+ *                     it on the sleeping side.                           *
+ **************************************************************************/
+void efd_kick(int efd) {
+    
+    uint64_t one = 1;
+    
+    if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write eventfd");
+}
+
+void efd_drain(int efd) {
+    
+    uint64_t n;
+    
+    if (read(efd, &n, sizeof(n)) < 0 && errno != EAGAIN && errno != EINTR)
+        perror("read eventfd");
+}
+
+/**************************************************************************
+ * pipeline_kick: after the I/O stage queued work, wakes the crypto stage *
+ *                if it went to sleep. The fence pairs with the one in    *
+ *                crypto_main so one side always sees the other.          *
+ **************************************************************************/
+void pipeline_kick(struct pipeline *pl) {
+    
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pl->crypto_idle, memory_order_relaxed))
+        efd_kick(pl->crypto_efd);
+}
+
+/**************************************************************************
+ * pipeline_tap: I/O stage, reads packets from tun/tap into pool buffers  *
+ *               and queues them for sealing. Returns the packets read.   *
+ **************************************************************************/
+int pipeline_tap(struct tunnel *t) {
+    
+    struct pipeline *pl = t->pl;
+    unsigned long bytes = 0;
+    uint64_t t0 = 0;
+    int n = 0, nread, timed = hist_sample();
+    char *buf;
+    
+    if (timed)
+        t0 = now_nsec();
+    while (n < t->tx_batch->size) {
+        /* with the pool dry keep draining tun anyway, the edge must re-arm */
+        if ((buf = pool_get()) == NULL)
+            buf = pl->scratch;
+        if ((nread = read(t->tap_fd, PKT_DATA(buf), PKT_ROOM)) < 0) {
+            if (buf != pl->scratch)
+                pool_put(buf);
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("read from virtual");
+                count(C_ERR_READ, 1);
+            }
+            break;
+        }
+        n++;
+        bytes += nread;
+        
+        PKT_META(buf)->len = nread;
+        PKT_META(buf)->type = FRAME_DATA;
+        PKT_META(buf)->stamp = timed ? now_nsec() : 0;
+        if (buf == pl->scratch) {
+            count(C_DROP_POOL_EMPTY, 1);
+        } else if (ring_push(&pl->tx_in, buf) < 0) {
+            pool_put(buf);
+            count(C_DROP_RING_FULL, 1);
+        }
+    }
+    count(C_TUN_RX_PKTS, n);
+    count(C_TUN_RX_BYTES, bytes);
+    if (timed && n > 0)
+        hist_add(H_TX_READ, now_nsec() - t0);
+    if (n > 0)
+        pipeline_kick(pl);
+    
+    return n;
+}
+
+/**************************************************************************
+ * pipeline_sock: I/O stage, receives a batch with recvmmsg() and queues  *
+ *                the datagrams for opening, giving the batch fresh pool  *
+ *                buffers in their place. Returns the datagrams.          *
+ **************************************************************************/
+int pipeline_sock(struct tunnel *t) {
+    
+    struct pipeline *pl = t->pl;
+    struct batch *b = t->rx_batch;
+    unsigned long bytes = 0;
+    uint64_t t0 = 0, t1 = 0;
+    char *buf, *fresh;
+    int i, n, timed = hist_sample();
+    
+    for (i = 0; i < b->size; i++) {
+        b->iovs[i].iov_base = b->buf[i];
+        b->iovs[i].iov_len = FRAME_ROOM;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    if (timed)
+        t0 = now_nsec();
+    if ((n = recvmmsg(t->sock_fd, b->msgs, b->size, MSG_DONTWAIT, NULL)) < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("recvmmsg network");
+            count(C_ERR_RECVMMSG, 1);
+        }
+        return 0;
+    }
+    if (timed) {
+        t1 = now_nsec();
+        if (n > 0)
+            hist_add(H_RX_READ, t1 - t0);
+    }
+    
+    for (i = 0; i < n; i++) {
+        buf = PKT_BUF(b->buf[i]);
+        PKT_META(buf)->len = b->msgs[i].msg_len;
+        PKT_META(buf)->addr = b->addrs[i];
+        PKT_META(buf)->stamp = t1;
+        bytes += b->msgs[i].msg_len;
+        /* the datagram is dropped and its buffer reused if we cannot pass it on */
+        if ((fresh = pool_get()) == NULL) {
+            count(C_DROP_POOL_EMPTY, 1);
+        } else if (ring_push(&pl->rx_in, buf) < 0) {
+            pool_put(fresh);
+            count(C_DROP_RING_FULL, 1);
+        } else {
+            b->buf[i] = PKT_FRAME(fresh);
+        }
+    }
+    count(C_NET_RX_PKTS, n);
+    count(C_NET_RX_BYTES, bytes);
+    if (n > 0)
+        pipeline_kick(pl);
+    
+    return n;
+}
+
+/**************************************************************************
+ * pipeline_drain: I/O stage, sends what the crypto stage sealed (one     *
+ *                 sendmmsg() per batch) and writes what it opened to     *
+ *                 tun/tap. Returns non-zero when it stopped on the       *
+ *                 budget with work left.                                 *
+ **************************************************************************/
+int pipeline_drain(struct tunnel *t) {
+    
+    struct pipeline *pl = t->pl;
+    struct batch *b = t->tx_batch;
+    char *bufs[BATCH_MAX], *buf;
+    unsigned long bytes;
+    uint64_t t0, now;
+    int i, n, ntx, round, sent, ret, timed;
+    
+    efd_drain(pl->io_efd);
+    
+    for (round = 0; round < EVENT_BUDGET; round++) {
+        for (n = timed = 0; n < b->size && (buf = ring_pop(&pl->tx_out)) != NULL; n++) {
+            bufs[n] = buf;
+            timed |= PKT_META(buf)->stamp != 0;
+            b->iovs[n].iov_base = PKT_FRAME(buf);
+            b->iovs[n].iov_len = PKT_META(buf)->len;
+            memset(&b->msgs[n].msg_hdr, 0, sizeof(b->msgs[n].msg_hdr));
+            b->msgs[n].msg_hdr.msg_name = &PKT_META(buf)->addr;
+            b->msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            b->msgs[n].msg_hdr.msg_iov = &b->iovs[n];
+            b->msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+        t0 = timed ? now_nsec() : 0;
+        for (sent = 0; sent < n; sent += ret) {
+            if ((ret = sendmmsg(t->sock_fd, b->msgs + sent, n - sent, 0)) < 0) {
+                if (errno == EINTR) {
+                    ret = 0;
+                    continue;
+                }
+                if (errno != EAGAIN) {
+                    perror("sendmmsg network");
+                    count(C_ERR_SENDMMSG, 1);
+                }
+                count(C_DROP_SOCK_FULL, n - sent);
+                break;
+            }
+            count_sent(b->msgs + sent, ret);
+        }
+        if (timed) {
+            now = now_nsec();
+            hist_add(H_TX_SEND, now - t0);
+            for (i = 0; i < sent && i < n; i++)
+                if (PKT_META(bufs[i])->stamp)
+                    hist_add(H_TUN_NET, now - PKT_META(bufs[i])->stamp);
+        }
+        for (i = 0; i < n; i++)
+            pool_put(bufs[i]);
+        if (n > 0)
+            t->last_tx = now_sec();
+        
+        /* the write step is timed from the first write of a timed packet */
+        for (i = ntx = 0, bytes = 0, t0 = 0; i < b->size && (buf = ring_pop(&pl->rx_out)) != NULL; i++) {
+            if (PKT_META(buf)->stamp && t0 == 0)
+                t0 = now_nsec();
+            if ((ret = tun_deliver(t, NULL, PKT_META(buf)->type, (uint8_t *)PKT_DATA(buf), PKT_META(buf)->len, &bytes)) > 0) {
+                ntx += ret;
+                if (PKT_META(buf)->stamp)
+                    hist_add(H_NET_TUN, now_nsec() - PKT_META(buf)->stamp);
+            }
+            pool_put(buf);
+        }
+        if (t0)
+            hist_add(H_RX_WRITE, now_nsec() - t0);
+        count(C_TUN_TX_PKTS, ntx);
+        count(C_TUN_TX_BYTES, bytes);
+        
+        if (n < b->size && i < b->size)
+            return 0;
+    }
+    return 1;
+}
+
+/**************************************************************************
+ * pipeline_control: queues a keepalive or HELLO to the server, so only   *
+ *                   the crypto stage ever seals and the per-peer state   *
+ *                   stays single writer.                                 *
+ **************************************************************************/
+void pipeline_control(struct tunnel *t, uint8_t type) {
+    
+    char *buf;
+    
+    if ((buf = pool_get()) == NULL)
+        return;
+    PKT_META(buf)->len = type == FRAME_HELLO ? hello_build(PKT_FRAME(buf)) : 0;
+    PKT_META(buf)->type = type;
+    PKT_META(buf)->stamp = 0;
+    if (ring_push(&t->pl->tx_in, buf) < 0) {
+        pool_put(buf);
+        return;
+    }
+    pipeline_kick(t->pl);
+}
+
+/**************************************************************************
+ * crypto_tx: crypto stage, routes and seals one buffer from tun.         *
+ **************************************************************************/
+void crypto_tx(struct tunnel *t, char *buf) {
+    
+    struct pkt_meta *m = PKT_META(buf);
+    uint8_t *payload = (uint8_t *)PKT_DATA(buf);
+    struct peer *p;
+    
+    if (m->type == FRAME_DATA) {
+        if ((p = tx_route(payload, m->len, &m->addr)) == NULL) {
+            count(C_DROP_NO_ROUTE, 1);
+            pool_put(buf);
+            return;
+        }
+    } else {
+        p = &peers[0];
+        peer_path(p, t->id, &m->addr);
+    }
+    
+    if ((m->len = frame_seal(t, p, (struct wire_hdr *)PKT_FRAME(buf), m->type, payload, m->len, payload + m->len)) < 0 ||
+        ring_push(&t->pl->tx_out, buf) < 0) {
+        count(C_DROP_RING_FULL, 1);
+        pool_put(buf);
+    }
+}
+
+/**************************************************************************
+ * crypto_rx: crypto stage, finds the peer of one received datagram,      *
+ *            opens it and passes the packet on to be written to tun.     *
+ **************************************************************************/
+void crypto_rx(struct tunnel *t, char *buf) {
+    
+    struct pkt_meta *m = PKT_META(buf);
+    struct wire_hdr *hdr;
+    struct peer *p;
+    
+    if (wire_decap(PKT_FRAME(buf), m->len, &hdr) < 0 || (p = rx_frame(t, hdr, &m->addr)) == NULL ||
+        (m->len = frame_open(t, p, hdr)) < 0) {
+        pool_put(buf);
+        return;
+    }
+    m->type = hdr->type;
+    if (ring_push(&t->pl->rx_out, buf) < 0) {
+        count(C_DROP_RING_FULL, 1);
+        pool_put(buf);
+    }
+}
+
+/**************************************************************************
+ * crypto_main: the crypto stage thread of worker t. Works both rings a   *
+ *              batch at a time and wakes the I/O stage after each round  *
+ *              that produced something; sleeps when both are empty (in   *
+ *              the latency profile once they stayed so for spin_nsec).   *
+ **************************************************************************/
+void *crypto_main(void *arg) {
+    
+    struct tunnel *t = arg;
+    struct pipeline *pl = t->pl;
+    cpu_set_t set;
+    char *buf;
+    uint64_t t0 = 0, t1, busy_at = 0;
+    int i, work, err, timed;
+    
+    CPU_ZERO(&set);
+    CPU_SET(pl->cpu, &set);
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+        fprintf(stderr, "worker %d crypto: cannot pin to CPU %d: %s\n", t->id, pl->cpu, strerror(err));
+    counters_label(t->id, "crypto");
+    
+    while (1) {
+        work = 0;
+        if ((timed = hist_sample()))
+            t0 = now_nsec();
+        for (i = 0; i < batch_size && (buf = ring_pop(&pl->tx_in)) != NULL; i++, work++)
+            crypto_tx(t, buf);
+        if (timed && i > 0) {
+            t1 = now_nsec();
+            hist_add(H_TX_CRYPTO, t1 - t0);
+            t0 = t1;
+        }
+        for (i = 0; i < batch_size && (buf = ring_pop(&pl->rx_in)) != NULL; i++, work++)
+            crypto_rx(t, buf);
+        if (timed && i > 0)
+            hist_add(H_RX_CRYPTO, now_nsec() - t0);
+        if (work) {
+            efd_kick(pl->io_efd);
+            if (spin_nsec)
+                busy_at = now_nsec();
+            continue;
+        }
+        if (spin_nsec && now_nsec() - busy_at < spin_nsec)
+            continue;
+        
+        /* announce the nap, then look once more before taking it */
+        atomic_store_explicit(&pl->crypto_idle, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring_empty(&pl->tx_in) && ring_empty(&pl->rx_in))
+            efd_drain(pl->crypto_efd);
+        atomic_store_explicit(&pl->crypto_idle, 0, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/**************************************************************************
+ * on_pipe: the crypto stage has output for the I/O stage.                *
+ **************************************************************************/
+int on_pipe(struct event_src *src) {
+    return pipeline_drain(src->arg);
+}
+
+/**************************************************************************
+ * pipeline_init: rings, eventfds and the crypto thread of worker t, run  *
+ *                by the worker once its event loop is set up.            *
+ **************************************************************************/
+void pipeline_init(struct tunnel *t, int cpu) {
+    
+    struct pipeline *pl;
+    
+    if ((pl = calloc(1, sizeof(*pl))) == NULL ||
+        (pl->scratch = malloc(BUFSIZE)) == NULL) {
+        perror("pipeline_init");
+        exit(1);
+    }
+    ring_init(&pl->tx_in, ring_depth);
+    ring_init(&pl->tx_out, ring_depth);
+    ring_init(&pl->rx_in, ring_depth);
+    ring_init(&pl->rx_out, ring_depth);
+    /* the I/O side polls its eventfd through epoll, the crypto side blocks on its own */
+    if ((pl->io_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        (pl->crypto_efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    pl->cpu = cpu;
+    t->pl = pl;
+    
+    t->pipe_src = (struct event_src){ .fd = pl->io_efd, .handler = on_pipe, .arg = t };
+    if (ev_add(t->epoll_fd, &t->pipe_src, EPOLLIN) < 0) {
+        perror("epoll_ctl()");
+        exit(1);
+    }
+    if ((errno = pthread_create(&pl->thread, NULL, crypto_main, t)) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+/**************************************************************************
+ * on_tap: tun/tap readable, forward until drained or out of budget.      *
+ **************************************************************************/
+int on_tap(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    int i, n;
+    
+    for (i = 0; i < EVENT_BUDGET; i++) {
+        n = offload ? tun_to_net_offload(t) : t->pl ? pipeline_tap(t) : t->xsk ? tun_to_xsk(t) :
+            agg_usec >= 0 ? tun_to_net_agg(t) : datapath->tx(t);
+        if (n < batch_size)
+            return 0;
+    }
+    return 1;
+}
+
+/**************************************************************************
+ * on_sock: socket readable, forward until drained or out of budget.      *
+ *          With -C it may have become writable too, the class queues     *
+ *          then send what it has room for.                               *
+ **************************************************************************/
+int on_sock(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    int i, n, m;
+    
+    for (i = 0; i < EVENT_BUDGET; i++) {
+        n = offload ? net_to_tun_offload(t) : t->pl ? pipeline_sock(t) : datapath->rx(t, src->fd);
+        m = t->sched && t->sched->queued ? datapath->tx(t) : 0;
+        if (n < t->rx_batch->size && m < batch_size)
+            return 0;
+    }
+    return 1;
+}
+
+/**************************************************************************
+ * on_xsk: AF_XDP rx ring has frames, forward until drained or out of     *
+ *         budget.                                                        *
+ **************************************************************************/
+int on_xsk(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    int i;
+    
+    for (i = 0; i < EVENT_BUDGET; i++)
+        if (xsk_to_tun(t) < t->rx_batch->size)
+            return 0;
+    return 1;
+}
+
+/**************************************************************************
+ * on_agg: the bundle deadline timer expired. The bundle it was armed for *
+ *         may have gone out already; a younger one gets the rest of its  *
+ *         own time.                                                      *
+ **************************************************************************/
+int on_agg(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    struct bundle *a = &t->bundle;
+    uint64_t expirations, age;
+    uint8_t type;
+    
+    if (read(t->agg_fd, &expirations, sizeof(expirations)) < 0)
+        return 0;
+    a->armed = 0;
+    if (a->npkts == 0)
+        return 0;
+    if ((age = now_nsec() - a->first) < (uint64_t)agg_usec * 1000) {
+        bundle_arm(t, (uint64_t)agg_usec * 1000 - age);
+        return 0;
+    }
+    type = bundle_type(a);
+    if (send_frame(t, a->p, a->frame, type, a->len, &a->addr) >= 0)
+        t->last_tx = now_sec();
+    a->len = a->npkts = 0;
+    return 0;
+}
+
+/**************************************************************************
+ * on_fec: the FEC deadline timer expired. Groups open FEC_FLUSH_USEC     *
+ *         go out with the packets they have, so the last ones before a   *
+ *         pause are covered too, and the timer is armed again for the    *
+ *         oldest still open. Closed groups leave the list.               *
+ **************************************************************************/
+int on_fec(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    struct fec_enc *e, **prev;
+    uint64_t expirations, now = now_nsec(), age, next = 0, left;
+    
+    if (read(t->fec_fd, &expirations, sizeof(expirations)) < 0)
+        return 0;
+    t->fec_armed = 0;
+    for (prev = &t->fec_open; (e = *prev) != NULL;) {
+        if (e->n > 0 && (age = now - e->first) < FEC_FLUSH_USEC * 1000ULL) {
+            left = FEC_FLUSH_USEC * 1000ULL - age;
+            if (next == 0 || left < next)
+                next = left;
+            prev = &e->next;
+            continue;
+        }
+        if (e->n > 0)
+            fec_flush(t, e);
+        *prev = e->next;
+        e->listed = 0;
+    }
+    if (next)
+        fec_arm(t, next);
+    return 0;
+}
+
+/**************************************************************************
+ * pace_flush: sends the n frames gathered in the wheel of t, all for     *
+ *             uplink link, and gives their buffers and entries back.     *
+ **************************************************************************/
+void pace_flush(struct tunnel *t, int n, int link) {
+    
+    struct pace_wheel *w = t->wheel;
+    struct paced *e;
+    int i, sent, ret;
+    
+    for (i = 0; i < n; i++) {
+        e = w->out[i];
+        w->iovs[i].iov_base = e->frame;
+        w->iovs[i].iov_len = e->len;
+        memset(&w->msgs[i].msg_hdr, 0, sizeof(w->msgs[i].msg_hdr));
+        w->msgs[i].msg_hdr.msg_name = &e->addr;
+        w->msgs[i].msg_hdr.msg_namelen = sizeof(e->addr);
+        w->msgs[i].msg_hdr.msg_iov = &w->iovs[i];
+        w->msgs[i].msg_hdr.msg_iovlen = 1;
+        if (e->tos)
+            tx_cmsg(t, &w->msgs[i].msg_hdr, i, e->tos, 0);
+    }
+    for (sent = 0; sent < n; sent += ret) {
+        if ((ret = sendmmsg(t->up_fd[link], w->msgs + sent, n - sent, 0)) < 0) {
+            if (errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("sendmmsg paced");
+                count(C_ERR_SENDMMSG, 1);
+            }
+            count(C_DROP_SOCK_FULL, n - sent);
+            break;
+        }
+        count_sent(w->msgs + sent, ret);
+    }
+    for (i = 0; i < n; i++) {
+        e = w->out[i];
+        pool_put(PKT_BUF(e->frame));
+        e->next = w->free;
+        w->free = e;
+    }
+}
+
+/**************************************************************************
+ * on_pace: the wheel of t ticked. The frames of every tick up to now go  *
+ *          out, in the order they were held, and the wheel stops when it *
+ *          holds no more. A late tick may have fallen a lap behind, a    *
+ *          slot keeps what is not yet due.                               *
+ **************************************************************************/
+int on_pace(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    struct pace_wheel *w = t->wheel;
+    struct paced *e, **prev;
+    uint64_t expirations, now = now_nsec() / (PACE_TICK_USEC * 1000ULL);
+    int k, slot, n = 0, link = 0;
+    
+    if (read(t->pace_fd, &expirations, sizeof(expirations)) < 0)
+        return 0;
+    for (k = 0; w->nheld > 0 && w->tick <= now && k < PACE_SLOTS; k++, w->tick++) {
+        slot = w->tick & (PACE_SLOTS - 1);
+        for (prev = &w->head[slot]; (e = *prev) != NULL;) {
+            if (e->tick > now) {
+                prev = &e->next;
+                continue;
+            }
+            *prev = e->next;
+            w->nheld--;
+            if (n == PACE_FLUSH || (n > 0 && e->link != link)) {
+                pace_flush(t, n, link);
+                n = 0;
+            }
+            link = e->link;
+            w->out[n++] = e;
+        }
+        w->tail[slot] = prev;
+    }
+    if (w->tick <= now)
+        w->tick = now + 1;
+    if (n > 0)
+        pace_flush(t, n, link);
+    if (w->nheld == 0)
+        pace_arm(t, 0);
+    return 0;
+}
+
+/**************************************************************************
+ * on_bond: the reorder timer of worker t expired. A stream whose         *
+ *          oldest held packet waited BOND_WAIT_USEC gives up on the      *
+ *          gaps before it and writes on; the timer is armed again for    *
+ *          the next packet whose wait runs out. Streams holding          *
+ *          nothing leave the list.                                       *
+ **************************************************************************/
+int on_bond(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    struct reorder *r, **prev;
+    uint64_t expirations, now = now_nsec(), wait = BOND_WAIT_USEC * 1000ULL, next = 0, left, at;
+    unsigned long bytes = 0;
+    int k, oldest, slot, ntx = 0;
+    
+    if (read(t->bond_fd, &expirations, sizeof(expirations)) < 0)
+        return 0;
+    t->bond_armed = 0;
+    for (prev = &t->bond_held; (r = *prev) != NULL;) {
+        while (r->nheld > 0) {
+            for (k = 0, oldest = -1, at = 0; k < BOND_SLOTS; k++) {
+                slot = (r->next + k) & (BOND_SLOTS - 1);
+                if (r->buf[slot] != NULL && (oldest < 0 || r->at[slot] < at)) {
+                    oldest = k;
+                    at = r->at[slot];
+                }
+            }
+            if (now - at < wait) {
+                left = wait - (now - at);
+                if (next == 0 || left < next)
+                    next = left;
+                break;
+            }
+            ntx += bond_advance(t, r, r->next + oldest, &bytes);
+        }
+        if (r->nheld > 0) {
+            prev = &r->next_held;
+            continue;
+        }
+        *prev = r->next_held;
+        r->listed = 0;
+    }
+    count(C_TUN_TX_PKTS, ntx);
+    count(C_TUN_TX_BYTES, bytes);
+    if (next)
+        bond_arm(t, next);
+    return 0;
+}
+
+/**************************************************************************
+ * on_probe: the uplink probe timer of client worker t expired. Each      *
+ *           uplink gets a link_probe with what we measured of it;        *
+ *           one no echo came back on for BOND_DEAD_MSEC carries no       *
+ *           more data until one does, and every BOND_LOSS_PROBES         *
+ *           probes the echoes missing make a loss sample.                *
+ **************************************************************************/
+int on_probe(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    char frame[WIRE_HDR_LEN + LINK_PROBE_LEN + AEAD_TAG_LEN];
+    struct sockaddr_in addr;
+    struct link_probe lp;
+    struct uplink_state *u;
+    uint64_t expirations, now = now_nsec();
+    int j, loss;
+    
+    if (read(t->probe_fd, &expirations, sizeof(expirations)) < 0)
+        return 0;
+    /* a server that does not know us yet answers nothing, that is no reason to fail over */
+    if (!atomic_load(&hello_acked)) {
+        for (j = 0; j < nuplinks; j++)
+            t->up[j].echo_at = now;
+        return 0;
+    }
+    peer_path(&peers[0], 0, &addr);
+    for (j = 0; j < nuplinks; j++) {
+        u = &t->up[j];
+        if (u->up && now - u->echo_at >= BOND_DEAD_MSEC * 1000000ULL) {
+            u->up = 0;
+            if (t->id == 0)
+                printf("Uplink %d (%s) went silent, failing over\n", j, uplinks[j].name);
+        }
+        if (u->sent == BOND_LOSS_PROBES) {
+            loss = (u->sent - (u->acked < u->sent ? u->acked : u->sent)) * 1000000 / u->sent;
+            u->loss = (int)u->loss + (loss - (int)u->loss) / 4;
+            u->sent = u->acked = 0;
+        }
+        memset(&lp, 0, sizeof(lp));
+        lp.stamp = now;
+        lp.srtt = htonl(u->srtt);
+        lp.loss = htonl(u->loss);
+        lp.link = j;
+        lp.up = u->up;
+        memcpy(frame + WIRE_HDR_LEN, &lp, LINK_PROBE_LEN);
+        send_frame_on(t, t->up_fd[j], &peers[0], frame, FRAME_LINK_PROBE, LINK_PROBE_LEN, &addr);
+        u->sent++;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * pace_adapt: -r auto: sets the rate of peer p by the RTT its probes     *
+ *             measure, an eighth lower when it is PACE_TARGET_USEC above *
+ *             the base RTT, a 32nd of -r higher when it is not. The base *
+ *             forgets a window every PACE_MIN_SEC, the path may change.  *
+ **************************************************************************/
+void pace_adapt(struct peer *p, uint64_t now) {
+    
+    uint64_t rate = atomic_load_explicit(&p->pace_rate, memory_order_relaxed);
+    uint64_t floor = pace_bps < PACE_RATE_MIN ? pace_bps : PACE_RATE_MIN;
+    unsigned srtt = atomic_load(&p->pace_srtt), base = atomic_load(&p->pace_min);
+    
+    if (now - p->pace_min_at >= PACE_MIN_SEC * 1000000000ULL) {
+        atomic_store(&p->pace_min, atomic_exchange(&p->pace_min_next, 0));
+        p->pace_min_at = now;
+    }
+    if (srtt == 0 || base == 0)
+        return;
+    if (srtt > base + PACE_TARGET_USEC)
+        rate -= rate / 8;
+    else
+        rate += pace_bps / 32;
+    rate = rate < floor ? floor : rate > pace_bps ? pace_bps : rate;
+    if (rate != atomic_load_explicit(&p->pace_rate, memory_order_relaxed)) {
+        atomic_store_explicit(&p->pace_rate, rate, memory_order_relaxed);
+        atomic_store(&p->pace_cost, (8000000000ULL << 16) / rate);
+    }
+}
+
+/**************************************************************************
+ * pace_lookup: a peer new to pacing has its route looked up for fq, on   *
+ *              the control thread: rtnetlink may keep us waiting.        *
+ **************************************************************************/
+void pace_lookup(void) {
+    
+    struct sockaddr_in addr;
+    struct peer *p;
+    int i;
+    
+    for (i = 0; i < PEERS_MAX; i++) {
+        p = &peers[i];
+        if (!p->in_use || atomic_load(&p->pace_fq) >= 0)
+            continue;
+        peer_path(p, 0, &addr);
+        atomic_store(&p->pace_fq, pace_fq(&addr));
+        if (atomic_load(&p->pace_fq))
+            printf("Route to peer %d has fq, it keeps departure times\n", p->id);
+    }
+}
+
+/**************************************************************************
+ * on_rate: the pacing timer of worker 0 expired. With -r auto every     *
+ *          peer sent to in the last second has its rate set by what the  *
+ *          probes said and is probed again. A client waits for its       *
+ *          server to answer the HELLO, as with path MTU probes.          *
+ **************************************************************************/
+int on_rate(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    char frame[WIRE_HDR_LEN + DELAY_PROBE_LEN + AEAD_TAG_LEN];
+    struct sockaddr_in addr;
+    struct peer *p;
+    uint64_t expirations, now = now_nsec();
+    int i;
+    
+    if (read(t->rate_fd, &expirations, sizeof(expirations)) < 0)
+        return 0;
+    for (i = 0; i < PEERS_MAX; i++) {
+        p = &peers[i];
+        if (!p->in_use)
+            continue;
+        if (!pace_auto || (cliserv == CLIENT && !atomic_load(&hello_acked)) ||
+            atomic_load(&p->pace_next) + 1000000000ULL < now)
+            continue;
+        peer_path(p, 0, &addr);
+        pace_adapt(p, now);
+        memcpy(frame + WIRE_HDR_LEN, &now, DELAY_PROBE_LEN);
+        send_frame(t, p, frame, FRAME_DELAY_PROBE, DELAY_PROBE_LEN, &addr);
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * pmtu_size: the size of probe k of the round over (lo, hi].             *
+ **************************************************************************/
+int pmtu_size(int lo, int hi, int k) {
+    return lo + (hi - lo) * (k + 1) / PMTU_PROBES;
+}
+
+/**************************************************************************
+ * pmtu_send: sends peer p a round of probes spread over (probe_lo,       *
+ *            probe_hi], with DF set and the kernel's idea of the path    *
+ *            MTU ignored for them. Data keeps the socket's own setting.  *
+ **************************************************************************/
+void pmtu_send(struct tunnel *t, struct peer *p) {
+    
+    struct sockaddr_in addr;
+    socklen_t optlen = sizeof(int);
+    int k, size, len, n, was, probe = IP_PMTUDISC_PROBE;
+    char *buf, *frame;
+    uint8_t *pl;
+    
+    if ((buf = pool_get()) == NULL)
+        return;
+    frame = PKT_FRAME(buf);
+    pl = (uint8_t *)PKT_DATA(buf);
+    if (getsockopt(t->sock_fd, IPPROTO_IP, IP_MTU_DISCOVER, &was, &optlen) < 0 ||
+        setsockopt(t->sock_fd, IPPROTO_IP, IP_MTU_DISCOVER, &probe, sizeof(probe)) < 0) {
+        perror("IP_MTU_DISCOVER");
+        pool_put(buf);
+        return;
+    }
+    peer_path(p, 0, &addr);
+    for (k = 0; k < PMTU_PROBES; k++) {
+        if ((size = pmtu_size(p->probe_lo, p->probe_hi, k)) <= p->probe_lo)
+            continue;
+        len = size - IP_HDR_LEN - UDP_HDR_LEN - WIRE_HDR_LEN - (aead ? AEAD_TAG_LEN : 0);
+        memset(pl, 0, len);
+        pl[0] = size >> 8;
+        pl[1] = size;
+        /* larger than the interface fails right here, as good as lost */
+        if ((n = frame_seal(t, p, (struct wire_hdr *)frame, FRAME_PROBE, pl, len, pl + len)) > 0 &&
+            (n = sendto(t->sock_fd, frame, n, 0, (struct sockaddr *)&addr, sizeof(addr))) > 0) {
+            count(C_NET_TX_PKTS, 1);
+            count(C_NET_TX_BYTES, n);
+        }
+    }
+    setsockopt(t->sock_fd, IPPROTO_IP, IP_MTU_DISCOVER, &was, sizeof(was));
+    pool_put(buf);
+}
+
+/**************************************************************************
+ * pmtu_probe: one housekeeping step of the path MTU search for peer p.  *
+ *             The answers to the last round raise probe_lo to the        *
+ *             largest size that arrived. The next size up did not, and   *
+ *             after PMTU_TRIES such rounds probe_hi goes below it, one   *
+ *             lost probe is no reason to stop short. Then the next round *
+ *             goes out. A settled search sets the path MTU and, when     *
+ *             tun's MTU is more than a datagram carries, the MSS clamp.  *
+ *             A peer that never answers stays at 0: not known, not       *
+ *             clamped.                                                   *
+ **************************************************************************/
+void pmtu_probe(struct tunnel *t, struct peer *p, time_t now) {
+    
+    int acked, k, size, lo = p->probe_lo, hi = p->probe_hi, pmtu, room, mss = 0;
+    
+    if (p->probe_round) {
+        acked = atomic_exchange(&p->probe_acked, 0);
+        if (acked > lo && acked <= hi)
+            p->probe_lo = acked;
+        for (k = 0; k < PMTU_PROBES; k++)
+            if ((size = pmtu_size(lo, hi, k)) > p->probe_lo) {
+                if (++p->probe_misses >= PMTU_TRIES) {
+                    p->probe_hi = size - 1;
+                    p->probe_misses = 0;
+                }
+                break;
+            }
+        p->probe_round = 0;
+    }
+    if (now >= atomic_load(&p->probe_at)) {
+        p->probe_lo = PMTU_MIN - 1;
+        p->probe_hi = PMTU_MAX;
+        p->probe_misses = 0;
+        atomic_store(&p->probe_acked, 0);
+        atomic_store(&p->probe_at, now + PMTU_REPROBE_SEC);
+    }
+    if (p->probe_lo < p->probe_hi) {
+        pmtu_send(t, p);
+        p->probe_round = 1;
+        return;
+    }
+    
+    pmtu = p->probe_lo >= PMTU_MIN ? p->probe_lo : 0;
+    if (atomic_load(&p->pmtu) != pmtu) {
+        atomic_store(&p->pmtu, pmtu);
+        if (pmtu)
+            printf("Path MTU to peer %d is %d\n", p->id, pmtu);
+    }
+    /* tap frames carry their Ethernet header through the tunnel */
+    if (pmtu && tun_mtu + (tap_mode ? ETH_HDR_LEN : 0) > (room = pmtu_room(p)))
+        mss = room - (tap_mode ? ETH_HDR_LEN : 0) - IP_HDR_LEN - 20;
+    if (atomic_load(&p->mss) != mss) {
+        atomic_store(&p->mss, mss);
+        if (mss)
+            printf("Clamping TCP MSS to and from peer %d at %d, %s MTU is %d\n", p->id, mss, tun_name, tun_mtu);
+    }
+}
+
+/**************************************************************************
+ * pmtu_tick: worker 0 rereads tun's MTU, which may be set after we       *
+ *            start, and takes the search of each peer a step further. A  *
+ *            client waits for its server to answer the HELLO, probes     *
+ *            nobody answers would end the search far too low.            *
+ **************************************************************************/
+void pmtu_tick(struct tunnel *t, time_t now) {
+    
+    struct ifreq ifr;
+    int i;
+    
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, tun_name, IFNAMSIZ - 1);
+    if (ioctl(t->sock_fd, SIOCGIFMTU, &ifr) == 0)
+        tun_mtu = ifr.ifr_mtu;
+    if (cliserv == CLIENT && !atomic_load(&hello_acked))
+        return;
+    for (i = 0; i < PEERS_MAX; i++)
+        if (peers[i].in_use && atomic_load(&peers[i].challenge) == 0)
+            pmtu_probe(t, &peers[i], now);
+}
+
+/**************************************************************************
+ * ticket_load: reads the -T ticket at path. Returns 1 when it holds a    *
+ *              session with server to resume, 0 when there is none yet,  *
+ *              it is for another server or does not parse.               *
+ **************************************************************************/
+int ticket_load(const char *path, struct sockaddr_in *server) {
+    
+    char ip[16];
+    unsigned short port;
+    unsigned int session;
+    unsigned long long tx, rx;
+    struct in_addr in;
+    FILE *f;
+    int n;
+    
+    if ((f = fopen(path, "r")) == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        perror(path);
+        exit(1);
+    }
+    n = fscanf(f, "%15[0-9.]:%hu %x %llx %llx", ip, &port, &session, &tx, &rx);
+    fclose(f);
+    if (n != 5 || session == 0 || inet_aton(ip, &in) == 0) {
+        fprintf(stderr, "%s: not a ticket, starting a new session\n", path);
+        return 0;
+    }
+    if (in.s_addr != server->sin_addr.s_addr || port != ntohs(server->sin_port))
+        return 0;
+    ticket.session = session;
+    ticket.tx_seq = tx;
+    ticket.rx_seq = rx;
+    return 1;
+}
+
+/**************************************************************************
+ * ticket_save: replaces the ticket file with ticket, on disk before any  *
+ *              sequence number it reserves gets used. Exits when it      *
+ *              cannot, going on would risk reusing them after a restart.  *
+ **************************************************************************/
+void ticket_save(void) {
+    
+    char tmp[PATH_MAX];
+    FILE *f;
+    
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ticket_path);
+    if ((f = fopen(tmp, "w")) == NULL ||
+        fprintf(f, "%s:%d %x %llx %llx\n", inet_ntoa(ticket.server.sin_addr), ntohs(ticket.server.sin_port),
+                ticket.session, (unsigned long long)ticket.tx_seq, (unsigned long long)ticket.rx_seq) < 0 ||
+        fflush(f) != 0 || fsync(fileno(f)) < 0 || fclose(f) != 0 || rename(tmp, ticket_path) < 0) {
+        perror(ticket_path);
+        exit(1);
+    }
+}
+
+/**************************************************************************
+ * ticket_update: moves the ticket's reservations TICKET_SEQ_GAP ahead    *
+ *                and saves it once our sequence numbers or the server's  *
+ *                come within half of them.                               *
+ **************************************************************************/
+void ticket_update(void) {
+    
+    uint64_t tx = atomic_load(&peers[0].tx_seq), rx = hello_resume();
+    
+    if (tx + TICKET_SEQ_GAP / 2 < ticket.tx_seq && rx + TICKET_SEQ_GAP / 2 < ticket.rx_seq)
+        return;
+    ticket.tx_seq = tx + TICKET_SEQ_GAP;
+    ticket.rx_seq = rx + TICKET_SEQ_GAP;
+    ticket_save();
+}
+
+/**************************************************************************
+ * hello_tick: client worker 0 sends our HELLO again while the server has *
+ *             not answered, waiting twice as long each time up to        *
+ *             HELLO_RTO_MAX_SEC, and keeps the -T ticket ahead.          *
+ **************************************************************************/
+void hello_tick(struct tunnel *t, time_t now) {
+    
+    struct sockaddr_in addr;
+    char frame[WIRE_HDR_LEN + HELLO_LEN_MAX + AEAD_TAG_LEN];
+    time_t sent = atomic_load(&hello_sent);
+    
+    if (ticket_path)
+        ticket_update();
+    if (atomic_load(&hello_acked)) {
+        hello_rto = HELLO_RTO_SEC;
+        return;
+    }
+    if (now - sent < hello_rto || !atomic_compare_exchange_strong(&hello_sent, &sent, now))
+        return;
+    atomic_store(&hello_echo, 1);
+    if (t->pl) {
+        pipeline_control(t, FRAME_HELLO);
+    } else {
+        peer_path(&peers[0], t->id, &addr);
+        if (send_frame(t, &peers[0], frame, FRAME_HELLO, hello_build(frame), &addr) < 0 && errno != EAGAIN)
+            perror("sendto hello");
+    }
+    hello_rto = hello_rto * 2 < HELLO_RTO_MAX_SEC ? hello_rto * 2 : HELLO_RTO_MAX_SEC;
+}
+
+/**************************************************************************
+ * bond_watch: says which paths of bonded peers went silent, so data      *
+ *             to them fails over, and which came back. Run by server     *
+ *             worker 0's housekeeping.                                   *
+ **************************************************************************/
+void bond_watch(void) {
+    
+    uint64_t now = now_nsec(), bit;
+    int i, j, n, down;
+    
+    for (i = 0; i < PEERS_MAX; i++) {
+        if (!peers[i].in_use || !atomic_load_explicit(&peers[i].bonded, memory_order_relaxed))
+            continue;
+        n = atomic_load_explicit(&peers[i].npaths, memory_order_acquire);
+        for (j = 0; j < n; j++) {
+            down = now - atomic_load_explicit(&peers[i].path_seen[j], memory_order_relaxed) >= BOND_DEAD_MSEC * 1000000ULL;
+            bit = 1ULL << j;
+            if (down == !!(peers[i].paths_down & bit))
+                continue;
+            peers[i].paths_down ^= bit;
+            printf(down ? "SERVER: Peer %d path %d went silent, failing over\n" : "SERVER: Peer %d path %d is back\n", i, j);
+        }
+    }
+}
+
+/**************************************************************************
+ * housekeeping: runs every HOUSEKEEPING_MS whatever the engine. Each     *
+ *               worker reports it is between lookups, worker 0 frees the *
+ *               tables none can still be in. A client sends a keepalive  *
+ *               when it has been quiet for KEEPALIVE_SEC or the server   *
+ *               answered a HELLO, worker 0 sends the HELLO again until   *
+ *               it does. A server hands its workers their RETRY budget,  *
+ *               worker 0 expires silent peers. Worker 0 probes the path  *
+ *               MTU of every peer (not pipelined, where only the crypto  *
+ *               stage may seal). Flushes buffered stdout.                *
+ **************************************************************************/
+void housekeeping(struct tunnel *t) {
+    
+    struct sockaddr_in addr;
+    char frame[WIRE_HDR_LEN + AEAD_TAG_LEN];
+    time_t now = now_sec();
+    unsigned gen;
+    
+    if (t->id == 0)
+        atomic_store(&coarse_now, now);
+    /* between lookups: the tables swapped out before now are not in use here */
+    atomic_store(&quiesced[t->id], atomic_load(&tables_epoch));
+    if (t->id == 0 && pthread_mutex_trylock(&tables_lock) == 0) {
+        tables_reclaim();
+        pthread_mutex_unlock(&tables_lock);
+    }
+    
+    if (cliserv == CLIENT) {
+        if (t->id == 0)
+            hello_tick(t, now);
+        /* (re)connected: let the server know this worker's path right away */
+        if ((gen = atomic_load(&hello_gen)) != t->hello_gen) {
+            t->hello_gen = gen;
+            t->last_tx = now - KEEPALIVE_SEC;
+        }
+    }
+    if (cliserv == CLIENT && now - t->last_tx >= KEEPALIVE_SEC) {
+        if (t->pl) {
+            pipeline_control(t, FRAME_KEEPALIVE);
+        } else {
+            peer_path(&peers[0], t->id, &addr);
+            if (send_frame(t, &peers[0], frame, FRAME_KEEPALIVE, 0, &addr) < 0 && errno != EAGAIN)
+                perror("sendto keepalive");
+        }
+        t->last_tx = now;
+    } else if (cliserv == SERVER) {
+        t->retry_budget = RETRY_PER_SEC;
+        if (t->id == 0)
+            peers_expire();
+        if (t->id == 0 && bond_tx)
+            bond_watch();
+        if (t->id == 0 && tap_mode)
+            mac_expire(now, -1);
+    }
+    if (t->id == 0 && !t->pl)
+        pmtu_tick(t, now);
+    if (t->fec_rx)
+        fec_report(t);
+    
+    /* an idle tx ring still owes us its buffers */
+    if (t->xsk)
+        xsk_complete(t->xsk);
+    
+    if (now - t->last_report >= REPORT_SEC) {
+        if (aead)
+            aead_report(t);
+        if (t->id == 0) {
+            pool_report();
+            counters_report();
+        }
+        t->last_report = now;
+    }
+    
+    fflush(stdout);
+}
+
+/**************************************************************************
+ * control_main: thread body for what asks the kernel and may wait on it, *
+ *               kept off the workers' loops: every HOUSEKEEPING_MS the   *
+ *               fq lookup of peers new to pacing and the kernel fast     *
+ *               path's sync.                                             *
+ **************************************************************************/
+void *control_main(void *arg) {
+    
+    struct timespec tick = { .tv_sec = HOUSEKEEPING_MS / 1000, .tv_nsec = (HOUSEKEEPING_MS % 1000) * 1000000L };
+    
+    (void)arg;
+    for (;;) {
+        nanosleep(&tick, NULL);
+        if (pace_bps)
+            pace_lookup();
+        if (kf_peers)
+            kfast_sync();
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/**************************************************************************
+ * control_init: starts the control thread, unpinned.                     *
+ **************************************************************************/
+void control_init(void) {
+    
+    pthread_t thread;
+    
+    if ((errno = pthread_create(&thread, NULL, control_main, NULL)) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/**************************************************************************
+ * on_timer: housekeeping timerfd expired.                                *
+ **************************************************************************/
+int on_timer(struct event_src *src) {
+    
+    struct tunnel *t = src->arg;
+    uint64_t expirations;
+    
+    while (read(t->timer_fd, &expirations, sizeof(expirations)) > 0)
+        ;
+    
+    housekeeping(t);
+    return 0;
+}
+
+/**************************************************************************
+ * pace_init: the wheel of worker t and its timer, and SO_TXTIME on its   *
+ *            sockets for the peers whose route has fq, where the kernel  *
+ *            knows it.                                                   *
+ **************************************************************************/
+void pace_init(struct tunnel *t) {
+    
+    struct sock_txtime st = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+    struct pace_wheel *w;
+    int i, j;
+    
+    if ((t->wheel = w = calloc(1, sizeof(*w))) == NULL) {
+        perror("pace_init");
+        exit(1);
+    }
+    for (i = 0; i < PACE_HELD; i++) {
+        w->held[i].next = w->free;
+        w->free = &w->held[i];
+    }
+    for (i = 0; i < PACE_SLOTS; i++)
+        w->tail[i] = &w->head[i];
+    if ((t->pace_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("timerfd_create()");
+        exit(1);
+    }
+    t->txtime = 1;
+    for (j = 0; j < (nuplinks > 1 ? nuplinks : 1); j++)
+        if (setsockopt(t->up_fd[j], SOL_SOCKET, SO_TXTIME, &st, sizeof(st)) < 0)
+            t->txtime = 0;
+    if (!t->txtime && t->id == 0)
+        perror("SO_TXTIME, pacing with the timer wheel");
+}
+
+/**************************************************************************
+ * tunnel_init: makes the descriptors non-blocking, sets up epoll with    *
+ *              the tun/tap, socket and housekeeping timer sources, the   *
+ *              AF_XDP socket if the worker has one, the bundle and its   *
+ *              deadline timer when aggregating, the buffer a TAP server  *
+ *              switches frames in, and the deadline timer of FEC groups. *
+ **************************************************************************/
+void tunnel_init(struct tunnel *t) {
+    
+    struct itimerspec its;
+    struct epoll_params ep;
+    int j;
+    
+    set_nonblock(t->tap_fd);
+    set_nonblock(t->sock_fd);
+    t->up_fd[0] = t->sock_fd;
+    for (j = 1; j < nuplinks; j++)
+        set_nonblock(t->up_fd[j]);
+    /* aggregating, a bundle may go in front of every packet read and one behind;
+     * with FEC every packet read may close a group and bring its parity */
+    t->tx_batch = batch_alloc(agg_usec >= 0 ? 2 * batch_size + 1 : fec_mode ? batch_size * (1 + FEC_M_MAX) : batch_size);
+    t->rx_batch = batch_alloc(batch_size);
+    t->last_tx = now_sec();
+    if (offload)
+        offload_init(t);
+    if (sched_on)
+        sched_init(t);
+    if (pace_bps)
+        pace_init(t);
+    /* the wheel may send a flush of its own in between batches */
+    if ((dscp_copy || pace_bps) &&
+        (t->tx_ctl = calloc(t->tx_batch->size > PACE_FLUSH ? t->tx_batch->size : PACE_FLUSH, TX_CTL_LEN)) == NULL) {
+        perror("tunnel_init");
+        exit(1);
+    }
+    
+    if ((t->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1()");
+        exit(1);
+    }
+    /* latency: epoll_wait busy polls the device queues itself, where the kernel can */
+    if (profile == PROFILE_LATENCY) {
+        memset(&ep, 0, sizeof(ep));
+        ep.busy_poll_usecs = spin_usec;
+        ep.busy_poll_budget = BUSY_POLL_BUDGET;
+        ep.prefer_busy_poll = 1;
+        ioctl(t->epoll_fd, EPIOCSPARAMS, &ep);
+    }
+    if ((t->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("timerfd_create()");
+        exit(1);
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = HOUSEKEEPING_MS / 1000;
+    its.it_interval.tv_nsec = (HOUSEKEEPING_MS % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(t->timer_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime()");
+        exit(1);
+    }
+    
+    t->tap_src = (struct event_src){ .fd = t->tap_fd, .handler = on_tap, .arg = t };
+    t->sock_src = (struct event_src){ .fd = t->sock_fd, .handler = on_sock, .arg = t };
+    t->timer_src = (struct event_src){ .fd = t->timer_fd, .handler = on_timer, .arg = t };
+    if (ev_add(t->epoll_fd, &t->tap_src, EPOLLIN) < 0 ||
+        ev_add(t->epoll_fd, &t->sock_src, t->sched ? EPOLLIN | EPOLLOUT : EPOLLIN) < 0 ||
+        ev_add(t->epoll_fd, &t->timer_src, EPOLLIN) < 0) {
+        perror("epoll_ctl()");
+        exit(1);
+    }
+    if (t->xsk) {
+        t->xsk_src = (struct event_src){ .fd = t->xsk->fd, .handler = on_xsk, .arg = t };
+        if (ev_add(t->epoll_fd, &t->xsk_src, EPOLLIN) < 0) {
+            perror("epoll_ctl()");
+            exit(1);
+        }
+    }
+    if (tap_mode && cliserv == SERVER) {
+        if ((t->l2_frame = pool_get()) == NULL) {
+            fprintf(stderr, "tunnel_init: buffer pool exhausted\n");
+            exit(1);
+        }
+        t->l2_frame = PKT_FRAME(t->l2_frame);
+    }
+    if (agg_usec >= 0) {
+        if ((t->bundle.frame = pool_get()) == NULL) {
+            fprintf(stderr, "tunnel_init: buffer pool exhausted\n");
+            exit(1);
+        }
+        t->bundle.frame = PKT_FRAME(t->bundle.frame);
+        if ((t->agg_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            perror("timerfd_create()");
+            exit(1);
+        }
+        t->agg_src = (struct event_src){ .fd = t->agg_fd, .handler = on_agg, .arg = t };
+        if (ev_add(t->epoll_fd, &t->agg_src, EPOLLIN) < 0) {
+            perror("epoll_ctl()");
+            exit(1);
+        }
+    }
+    if (fec_mode) {
+        if ((t->fec_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            perror("timerfd_create()");
+            exit(1);
+        }
+        t->fec_src = (struct event_src){ .fd = t->fec_fd, .handler = on_fec, .arg = t };
+        if (ev_add(t->epoll_fd, &t->fec_src, EPOLLIN) < 0) {
+            perror("epoll_ctl()");
+            exit(1);
+        }
+    }
+    /* bonding: the other uplinks' sockets, alive until their probes say otherwise */
+    if (cliserv == CLIENT && nuplinks > 1) {
+        for (j = 0; j < nuplinks; j++) {
+            t->up[j].up = 1;
+            t->up[j].echo_at = now_nsec();
+        }
+        for (j = 1; j < nuplinks; j++) {
+            t->up_src[j] = (struct event_src){ .fd = t->up_fd[j], .handler = on_sock, .arg = t };
+            if (ev_add(t->epoll_fd, &t->up_src[j], EPOLLIN) < 0) {
+                perror("epoll_ctl()");
+                exit(1);
+            }
+        }
+        if ((t->probe_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            perror("timerfd_create()");
+            exit(1);
+        }
+        memset(&its, 0, sizeof(its));
+        its.it_interval.tv_sec = BOND_PROBE_MSEC / 1000;
+        its.it_interval.tv_nsec = (BOND_PROBE_MSEC % 1000) * 1000000L;
+        its.it_value = its.it_interval;
+        if (timerfd_settime(t->probe_fd, 0, &its, NULL) < 0) {
+            perror("timerfd_settime()");
+            exit(1);
+        }
+        t->probe_src = (struct event_src){ .fd = t->probe_fd, .handler = on_probe, .arg = t };
+        if (ev_add(t->epoll_fd, &t->probe_src, EPOLLIN) < 0) {
+            perror("epoll_ctl()");
+            exit(1);
+        }
+        if ((t->bond_msgs = calloc(t->tx_batch->size, sizeof(*t->bond_msgs))) == NULL) {
+            perror("tunnel_init");
+            exit(1);
+        }
+    }
+    if (pace_bps) {
+        t->pace_src = (struct event_src){ .fd = t->pace_fd, .handler = on_pace, .arg = t };
+        if (ev_add(t->epoll_fd, &t->pace_src, EPOLLIN) < 0) {
+            perror("epoll_ctl()");
+            exit(1);
+        }
+    }
+    if (pace_bps && t->id == 0) {
+        if ((t->rate_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            perror("timerfd_create()");
+            exit(1);
+        }
+        memset(&its, 0, sizeof(its));
+        its.it_interval.tv_sec = PACE_PROBE_MSEC / 1000;
+        its.it_interval.tv_nsec = (PACE_PROBE_MSEC % 1000) * 1000000L;
+        its.it_value = its.it_interval;
+        if (timerfd_settime(t->rate_fd, 0, &its, NULL) < 0) {
+            perror("timerfd_settime()");
+            exit(1);
+        }
+        t->rate_src = (struct event_src){ .fd = t->rate_fd, .handler = on_rate, .arg = t };
+        if (ev_add(t->epoll_fd, &t->rate_src, EPOLLIN) < 0) {
+            perror("epoll_ctl()");
+            exit(1);
+        }
+    }
+    /* striped packets are put back in order where they reach the event loop in one piece */
+    if (bond_rx) {
+        if ((t->bond_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            perror("timerfd_create()");
+            exit(1);
+        }
+        t->bond_src = (struct event_src){ .fd = t->bond_fd, .handler = on_bond, .arg = t };
+        if (ev_add(t->epoll_fd, &t->bond_src, EPOLLIN) < 0) {
+            perror("epoll_ctl()");
+            exit(1);
+        }
+    }
+}
+
+/**************************************************************************
+ * io_uring engine: the kernel reads tun/tap and the socket on its own   *
+ * through multishot requests into provided buffer rings, and we only    *
+ * queue the matching sendmsg / write_fixed. Both descriptors are fixed  *
+ * files and the buffer memory is one registered buffer. One            *
+ * io_uring_enter() submits everything queued and reaps a whole batch of *
+ * completions, so per-packet syscalls and wakeups go away.              *
+ **************************************************************************/
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**************************************************************************
+ * uring_buf: address of buffer bid of group.                             *
+ **************************************************************************/
+char *uring_buf(struct uring *r, int group, int bid) {
+    return r->bufs + ((size_t)group * URING_BUFS + bid) * BUFSIZE;
+}
+
+/**************************************************************************
+ * uring_recycle: hands buffer bid back to the kernel's ring for group.   *
+ **************************************************************************/
+void uring_recycle(struct uring *r, int group, int bid) {
+    
+    struct io_uring_buf_ring *br = r->br[group];
+    unsigned short tail = br->tail;
+    struct io_uring_buf *buf = &br->bufs[tail & (URING_BUFS - 1)];
+    
+    buf->addr = (uintptr_t)uring_buf(r, group, bid);
+    buf->len = BUFSIZE;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**************************************************************************
+ * uring_submit: publishes queued sqes and enters the kernel, waiting for *
+ *               wait completions. Returns -1 on a real error.            *
+ **************************************************************************/
+int uring_submit(struct uring *r, unsigned wait) {
+    
+    int ret;
+    
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    ret = sys_io_uring_enter(r->fd, r->sq_pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0)
+        return (errno == EINTR || errno == EAGAIN || errno == EBUSY) ? 0 : -1;
+    r->sq_pending -= (unsigned)ret < r->sq_pending ? (unsigned)ret : r->sq_pending;
+    return 0;
+}
+
+/**************************************************************************
+ * uring_sqe: returns a zeroed sqe, submitting first if the SQ is full.   *
+ **************************************************************************/
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+    
+    struct io_uring_sqe *sqe;
+    
+    while (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (uring_submit(r, 0) < 0) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+    
+    sqe = &r->sqes[r->sq_local & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local++;
+    r->sq_pending++;
+    return sqe;
+}
 
-char *progname;
-char MAGIC_WORD[] = "Wazaaaaaaaaaaahhhh !";
+/**************************************************************************
+ * uring_arm_tap: (re)arms the read on tun/tap. Multishot when the kernel *
+ *                has it, otherwise one read that is re-armed per packet. *
+ **************************************************************************/
+void uring_arm_tap(struct uring *r) {
+    
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    
+    sqe->opcode = r->read_multishot ? IORING_OP_READ_MULTISHOT : IORING_OP_READ;
+    sqe->fd = URING_FILE_TAP;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP_TAP;
+    sqe->len = r->read_multishot ? 0 : BUFSIZE;    /* multishot takes the buffer size */
+    sqe->user_data = UD_TAP_READ;
+    r->starved[URING_GROUP_TAP] = 0;
+}
 
 /**************************************************************************
- * tun_alloc: allocates or reconnects to a tun/tap device. The caller     *
- *            needs to reserve enough space in *dev.                      *
+ * uring_arm_sock: (re)arms the multishot recvmsg on the socket.          *
  **************************************************************************/
-int tun_alloc(char *dev, int flags) {
+void uring_arm_sock(struct uring *r) {
     
-    struct ifreq ifr;
-    int fd, err;
+    struct io_uring_sqe *sqe = uring_sqe(r);
     
-    if( (fd = open("/dev/net/tun", O_RDWR)) < 0 ) {
-        perror("Opening /dev/net/tun");
-        return fd;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = URING_FILE_SOCK;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = URING_GROUP_SOCK;
+    sqe->addr = (uintptr_t)&r->recv_msg;
+    sqe->len = 1;
+    sqe->user_data = UD_SOCK_RECV;
+    r->starved[URING_GROUP_SOCK] = 0;
+}
+
+/**************************************************************************
+ * uring_arm_tick: queues the next housekeeping timeout.                  *
+ **************************************************************************/
+void uring_arm_tick(struct uring *r) {
+    
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&r->tick;
+    sqe->len = 1;
+    sqe->user_data = UD_TICK;
+}
+
+/**************************************************************************
+ * uring_probe: checks that the kernel has every op the engine needs, and *
+ *              whether it can do multishot reads.                        *
+ **************************************************************************/
+int uring_probe(int fd, int *read_multishot) {
+    
+    static const int needed[] = { IORING_OP_READ, IORING_OP_RECVMSG, IORING_OP_SENDMSG,
+                                  IORING_OP_WRITE_FIXED, IORING_OP_TIMEOUT };
+    struct io_uring_probe *probe;
+    size_t i, nops = 256;
+    int ok = 1;
+    
+    if ((probe = calloc(1, sizeof(*probe) + nops * sizeof(probe->ops[0]))) == NULL)
+        return 0;
+    if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, nops) < 0) {
+        free(probe);
+        return 0;
     }
+    for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++)
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    *read_multishot = IORING_OP_READ_MULTISHOT <= probe->last_op &&
+                      (probe->ops[IORING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
     
-    memset(&ifr, 0, sizeof(ifr));
+    return ok;
+}
+
+/**************************************************************************
+ * uring_open: sets up a ring and maps its queues. Returns -1 when the    *
+ *             kernel cannot run the engine.                              *
+ **************************************************************************/
+int uring_open(struct uring *r) {
     
-    ifr.ifr_flags = flags;
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    unsigned i, *array;
     
-    if (*dev) {
-        strncpy(ifr.ifr_name, dev, IFNAMSIZ);
+    memset(&p, 0, sizeof(p));
+    /* multishot completions arrive in bursts, give the CQ some slack */
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    if ((r->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0 && errno == EINVAL) {
+        /* kernels before 6.1 have no single issuer mode */
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
     }
+    if (r->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+        !uring_probe(r->fd, &r->read_multishot))
+        goto fail;
     
-    if( (err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0 ) {
-        perror("ioctl(TUNSETIFF)");
-        close(fd);
-        return err;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size)
+        sq_size = cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    r->rings = cq = sq;
+    r->rings_size = sq_size;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
     }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
     
-    strcpy(dev, ifr.ifr_name);
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+    array = (unsigned *)(sq + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
     
-    return fd;
+    return 0;
+    
+fail:
+    if (r->rings != NULL)
+        munmap(r->rings, r->rings_size);
+    close(r->fd);
+    return -1;
+}
+
+/**************************************************************************
+ * uring_close: unmaps whatever of r uring_open and uring_init got to and *
+ *              closes the ring. r itself stays with the caller.          *
+ **************************************************************************/
+void uring_close(struct uring *r) {
+    
+    int g;
+    
+    for (g = 0; g < URING_GROUPS; g++)
+        if (r->br[g] != NULL)
+            munmap(r->br[g], URING_BUFS * sizeof(struct io_uring_buf));
+    if (r->bufs != NULL)
+        munmap(r->bufs, (size_t)URING_GROUPS * URING_BUFS * BUFSIZE);
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->rings, r->rings_size);
+    free(r->sends);
+    free(r->recv_stamps);
+    close(r->fd);
+}
+
+/**************************************************************************
+ * uring_available: startup check whether this kernel can run the engine. *
+ **************************************************************************/
+int uring_available(void) {
+    
+    struct uring r;
+    
+    memset(&r, 0, sizeof(r));
+    if (uring_open(&r) < 0)
+        return 0;
+    uring_close(&r);
+    return 1;
+}
+
+/**************************************************************************
+ * uring_init: builds the io_uring engine for worker t: fixed files,      *
+ *             registered buffer memory and one provided buffer ring per  *
+ *             direction. Returns -1 if the kernel refuses any of it.     *
+ **************************************************************************/
+int uring_init(struct tunnel *t) {
+    
+    struct uring *r;
+    struct io_uring_buf_reg reg;
+    struct iovec iov;
+    int files[2], g, i;
+    size_t br_size = URING_BUFS * sizeof(struct io_uring_buf);
+    
+    if ((r = calloc(1, sizeof(*r))) == NULL || uring_open(r) < 0) {
+        free(r);
+        return -1;
+    }
+    
+    files[URING_FILE_TAP] = t->tap_fd;
+    files[URING_FILE_SOCK] = t->sock_fd;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_FILES, files, 2) < 0)
+        goto fail;
+    
+    iov.iov_len = (size_t)URING_GROUPS * URING_BUFS * BUFSIZE;
+    iov.iov_base = mmap(NULL, iov.iov_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (iov.iov_base == MAP_FAILED)
+        goto fail;
+    r->bufs = iov.iov_base;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+        goto fail;
+    
+    for (g = 0; g < URING_GROUPS; g++) {
+        r->br[g] = mmap(NULL, br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r->br[g] == MAP_FAILED) {
+            r->br[g] = NULL;
+            goto fail;
+        }
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uintptr_t)r->br[g];
+        reg.ring_entries = URING_BUFS;
+        reg.bgid = g;
+        if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            goto fail;
+        for (i = 0; i < URING_BUFS; i++)
+            uring_recycle(r, g, i);
+    }
+    
+    if ((r->sends = calloc(URING_BUFS, sizeof(*r->sends))) == NULL ||
+        (r->recv_stamps = calloc(URING_BUFS, sizeof(*r->recv_stamps))) == NULL)
+        goto fail;
+    r->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    r->tick.tv_sec = HOUSEKEEPING_MS / 1000;
+    r->tick.tv_nsec = (HOUSEKEEPING_MS % 1000) * 1000000L;
+    
+    t->ring = r;
+    t->last_tx = now_sec();
+    return 0;
+    
+fail:
+    /* closing the fd drops what was registered, the mappings are ours */
+    uring_close(r);
+    free(r);
+    return -1;
+}
+
+/**************************************************************************
+ * uring_tap_read: a packet from tun/tap landed in a provided buffer;     *
+ *                 queue its sendmsg. The buffer returns to the ring when *
+ *                 the send completes. Returns the packets forwarded.     *
+ **************************************************************************/
+int uring_tap_read(struct tunnel *t, struct io_uring_cqe *cqe) {
+    
+    struct uring *r = t->ring;
+    struct io_uring_sqe *sqe;
+    struct uring_send *snd;
+    struct peer *p;
+    char *buf;
+    int bid, len;
+    
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* out of buffers: re-arm once a send hands one back */
+        if (cqe->res == -ENOBUFS) {
+            r->starved[URING_GROUP_TAP] = 1;
+        } else {
+            /* the device may not take multishot reads, go one at a time */
+            if (cqe->res == -EINVAL && r->read_multishot)
+                r->read_multishot = 0;
+            uring_arm_tap(r);
+        }
+    }
+    if (cqe->res <= 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EAGAIN) {
+            fprintf(stderr, "read from virtual: %s\n", strerror(-cqe->res));
+            count(C_ERR_READ, 1);
+        }
+        return 0;
+    }
+    count(C_TUN_RX_PKTS, 1);
+    count(C_TUN_RX_BYTES, cqe->res);
+    
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = uring_buf(r, URING_GROUP_TAP, bid);
+    snd = &r->sends[bid];
+    snd->stamp = hist_sample() ? now_nsec() : 0;
+    
+    if ((p = tx_route((uint8_t *)buf, cqe->res, &snd->addr)) == NULL) {
+        count(C_DROP_NO_ROUTE, 1);
+        uring_recycle(r, URING_GROUP_TAP, bid);
+        return 0;
+    }
+    /* sealed in place, the tag goes out of the send slot */
+    if ((len = frame_seal(t, p, &snd->hdr, FRAME_DATA, (uint8_t *)buf, cqe->res, snd->tag)) < 0) {
+        uring_recycle(r, URING_GROUP_TAP, bid);
+        return 0;
+    }
+    snd->iov[0].iov_base = &snd->hdr;
+    snd->iov[0].iov_len = WIRE_HDR_LEN;
+    snd->iov[1].iov_base = buf;
+    snd->iov[1].iov_len = len - WIRE_HDR_LEN - (aead ? AEAD_TAG_LEN : 0);    /* compression may shrink it */
+    snd->iov[2].iov_base = snd->tag;
+    snd->iov[2].iov_len = aead ? AEAD_TAG_LEN : 0;
+    memset(&snd->msg, 0, sizeof(snd->msg));
+    snd->msg.msg_name = &snd->addr;
+    snd->msg.msg_namelen = sizeof(snd->addr);
+    snd->msg.msg_iov = snd->iov;
+    snd->msg.msg_iovlen = 3;
+    
+    sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = URING_FILE_SOCK;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)&snd->msg;
+    sqe->len = 1;
+    sqe->user_data = UD_SOCK_SEND | (uint64_t)bid << 8;
+    
+    return 1;
+}
+
+/**************************************************************************
+ * uring_sock_recv: a datagram landed in a provided buffer; queue the     *
+ *                  write of its payload to tun/tap straight from there.  *
+ *                  Returns the datagrams received.                       *
+ **************************************************************************/
+int uring_sock_recv(struct tunnel *t, struct io_uring_cqe *cqe) {
+    
+    struct uring *r = t->ring;
+    struct io_uring_recvmsg_out *out;
+    struct io_uring_sqe *sqe;
+    struct wire_hdr *hdr;
+    struct sockaddr_in addr;
+    struct peer *p;
+    char *buf, *payload;
+    unsigned long bytes;
+    int bid, plength;
+    size_t skip = sizeof(*out) + r->recv_msg.msg_namelen + r->recv_msg.msg_controllen;
+    
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (cqe->res == -ENOBUFS)
+            r->starved[URING_GROUP_SOCK] = 1;
+        else
+            uring_arm_sock(r);
+    }
+    if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EAGAIN) {
+            fprintf(stderr, "recvmsg network: %s\n", strerror(-cqe->res));
+            count(C_ERR_RECVMSG, 1);
+        }
+        return 0;
+    }
+    
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = uring_buf(r, URING_GROUP_SOCK, bid);
+    out = (struct io_uring_recvmsg_out *)buf;
+    count(C_NET_RX_PKTS, 1);
+    if ((size_t)cqe->res < skip || (out->flags & MSG_TRUNC) || out->namelen < sizeof(addr)) {
+        count(C_DROP_MALFORMED, 1);
+        goto recycle;
+    }
+    count(C_NET_RX_BYTES, out->payloadlen);
+    
+    memcpy(&addr, buf + sizeof(*out), sizeof(addr));
+    payload = buf + skip;
+    r->recv_stamps[bid] = hist_sample() ? now_nsec() : 0;
+    if (wire_decap(payload, out->payloadlen, &hdr) < 0 || (p = rx_frame(t, hdr, &addr)) == NULL ||
+        (plength = frame_open(t, p, hdr)) < 0)
+        goto recycle;
+    
+    /* bundles, FEC and striped frames are written out right here, one write_fixed per buffer is all the slot tracks */
+    if (hdr->type == FRAME_BUNDLE || hdr->type == FRAME_FEC_DATA || hdr->type == FRAME_FEC_PARITY ||
+        hdr->type == FRAME_BOND_DATA) {
+        bytes = 0;
+        count(C_TUN_TX_PKTS, tun_deliver(t, p, hdr->type, (uint8_t *)(hdr + 1), plength, &bytes));
+        count(C_TUN_TX_BYTES, bytes);
+        goto recycle;
+    }
+    
+    sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = URING_FILE_TAP;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)(payload + WIRE_HDR_LEN);
+    sqe->len = plength;
+    sqe->buf_index = 0;
+    sqe->user_data = UD_TAP_WRITE | (uint64_t)bid << 8;
+    return 1;
+    
+recycle:
+    uring_recycle(r, URING_GROUP_SOCK, bid);
+    return 1;
+}
+
+/**************************************************************************
+ * uring_loop: the io_uring counterpart of ev_loop, runs forever.         *
+ **************************************************************************/
+void uring_loop(struct tunnel *t) {
+    
+    struct uring *r = t->ring;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    uint64_t now, busy_at = 0;
+    int ntap, bid, wait = 1, reaped = 0;
+    
+    uring_arm_tap(r);
+    uring_arm_sock(r);
+    uring_arm_tick(r);
+    
+    while (1) {
+        /* latency profile: only flush and reap for a while before waiting */
+        if (spin_nsec) {
+            now = now_nsec();
+            if (reaped)
+                busy_at = now;
+            wait = now - busy_at >= spin_nsec;
+        }
+        if (uring_submit(r, wait) < 0) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        
+        ntap = 0;
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        reaped = head != tail;
+        for (; head != tail; head++) {
+            cqe = &r->cqes[head & r->cq_mask];
+            bid = cqe->user_data >> 8;
+            
+            switch (cqe->user_data & 0xff) {
+                case UD_TAP_READ:
+                    ntap += uring_tap_read(t, cqe);
+                    break;
+                case UD_SOCK_RECV:
+                    uring_sock_recv(t, cqe);
+                    break;
+                case UD_SOCK_SEND:
+                    if (cqe->res >= 0) {
+                        count(C_NET_TX_PKTS, 1);
+                        count(C_NET_TX_BYTES, cqe->res);
+                        if (r->sends[bid].stamp)
+                            hist_add(H_TUN_NET, now_nsec() - r->sends[bid].stamp);
+                    } else {
+                        if (cqe->res != -EAGAIN && cqe->res != -ENOBUFS)
+                            count(C_ERR_SENDMSG, 1);
+                        count(C_DROP_SOCK_FULL, 1);
+                    }
+                    uring_recycle(r, URING_GROUP_TAP, bid);
+                    if (r->starved[URING_GROUP_TAP])
+                        uring_arm_tap(r);
+                    break;
+                case UD_TAP_WRITE:
+                    if (cqe->res < 0) {
+                        fprintf(stderr, "write to virtual: %s\n", strerror(-cqe->res));
+                        count(C_ERR_WRITE, 1);
+                    } else {
+                        count(C_TUN_TX_PKTS, 1);
+                        count(C_TUN_TX_BYTES, cqe->res);
+                        if (r->recv_stamps[bid])
+                            hist_add(H_NET_TUN, now_nsec() - r->recv_stamps[bid]);
+                    }
+                    uring_recycle(r, URING_GROUP_SOCK, bid);
+                    if (r->starved[URING_GROUP_SOCK])
+                        uring_arm_sock(r);
+                    break;
+                case UD_TICK:
+                    housekeeping(t);
+                    uring_arm_tick(r);
+                    break;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        
+        if (ntap > 0)
+            t->last_tx = now_sec();
+    }
 }
 
+/**************************************************************************
+ * worker_main: thread body of one worker, pinned to its CPU. The loop   *
+ *              state is set up here so it is allocated on that CPU's    *
+ *              node.                                                    *
+ **************************************************************************/
+void *worker_main(void *arg) {
+    
+    struct tunnel *t = arg;
+    cpu_set_t set;
+    int err;
+    
+    CPU_ZERO(&set);
+    CPU_SET(t->cpu, &set);
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+        fprintf(stderr, "worker %d: cannot pin to CPU %d: %s\n", t->id, t->cpu, strerror(err));
+    counters_label(t->id, "io");
+    
+    if (engine == ENGINE_URING) {
+        if (uring_init(t) == 0) {
+            uring_loop(t);
+            return NULL;
+        }
+        fprintf(stderr, "worker %d: io_uring setup failed, using epoll\n", t->id);
+    }
+    tunnel_init(t);
+    if (pipelined)
+        pipeline_init(t, ncrypto_cpus ? crypto_cpus[t->id % ncrypto_cpus] : t->cpu);
+    ev_loop(t->epoll_fd);
+    
+    return NULL;
+}
 
 /**************************************************************************
  * usage: prints usage and exits.                                         *
  **************************************************************************/
 void usage(void) {
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "%s -i <ifacename> [-s|-c <serverIP>] [-p <port>]\n", progname);
+    fprintf(stderr, "%s -i <ifacename> [-s|-c <serverIP>] [-p <port>] [-b <batch>] [-w <workers>] [-e epoll|uring] [-g] [-l <prefix/len>] [-k <keyfile> [-x <cipher>]] [-P <cpus>[/<cpus>]] [-q <depth>] [-S <socket>] [-H <n>] [-X <ifacename>] [-z] [-A <usec>[/<mtu>]] [-T <file>]\n"
+                    "    [-I <addr/len>] [-M <mtu>] [-Q <qlen>] [-R <prefix/len>] [-L bulk|latency[/<usec>]] [-B <bytes>] [-u|-a]\n"
+                    "    [-F <k>/<m>|auto] [-U <uplink>,<uplink>...] [-C dscp|<rule>,<rule>...] [-D] [-r <rate>[/auto]]\n"
+                    "    [-Y <file> [-y <filter>]] [-K]\n", progname);
     fprintf(stderr, "%s -h\n", progname);
     fprintf(stderr, "\n");
     fprintf(stderr, "-i <ifacename>: Name of interface to use (mandatory)\n");
     fprintf(stderr, "-s|-c <serverIP>: run in server mode (-s), or specify server address (-c <serverIP>) (mandatory)\n");
     fprintf(stderr, "-p <port>: port to listen on (if run in server mode) or to connect to (in client mode), default 55566\n");
+    fprintf(stderr, "-b <batch>: datagrams moved per recvmmsg/sendmmsg call, 1-%d, default %d\n", BATCH_MAX, BATCH_DEFAULT);
+    fprintf(stderr, "-w <workers>: worker threads, each with its own tun queue and UDP socket, 1-%d, default %d\n", WORKERS_MAX, WORKERS_DEFAULT);
+    fprintf(stderr, "-e epoll|uring: datapath engine, uring falls back to epoll on kernels without support, default epoll\n");
+    fprintf(stderr, "-g: offload mode, take TSO super-packets from tun, send with UDP GSO, receive with UDP GRO\n");
+    fprintf(stderr, "-l <prefix/len>: client only, IPv4 subnet behind this client the server routes to it, up to %d\n", PEER_ROUTES_MAX);
+    fprintf(stderr, "-k <keyfile>: encrypt with this shared key, %d hex digits or %d raw bytes, the same on both sides\n", 2 * AEAD_KEY_LEN, AEAD_KEY_LEN);
+    fprintf(stderr, "-x aes-256-gcm|chacha20-poly1305: cipher used with -k, default aes-256-gcm\n");
+    fprintf(stderr, "-P <cpus>[/<cpus>]: pipelined mode, each worker's crypto stage in its own thread on these CPUs (comma list,\n"
+                    "    used in turn), optionally its I/O thread on the second list; '-P -' keeps the default placement\n");
+    fprintf(stderr, "-q <depth>: pipelined mode ring depth, a power of 2 up to %d, default %d\n", RING_DEPTH_MAX, RING_DEPTH_DEFAULT);
+    fprintf(stderr, "-S <socket>: serve counters in Prometheus text format over HTTP on this Unix socket\n");
+    fprintf(stderr, "-H <n>: time one batch in n (one packet in n with uring) for the latency histograms, 0 for none, default %d\n", HIST_SAMPLE_DEFAULT);
+    fprintf(stderr, "-X <ifacename>: AF_XDP underlay, tunnel datagrams on this network interface bypass the kernel UDP stack\n"
+                    "    (epoll engine, no -g or -P), the UDP socket carries what it cannot\n");
+    fprintf(stderr, "-z: compress data packets of %d-%d bytes unless they look random or their flow does not shrink (no -g),\n"
+                    "    the peer needs no flag to take them\n", ZIP_MIN_LEN, ZIP_MAX_LEN);
+    fprintf(stderr, "-A <usec>[/<mtu>]: bundle small packets to one peer into datagrams of up to mtu bytes (default %d),\n"
+                    "    holding the first up to usec microseconds, 0 for only what one read brings (epoll engine, no -g, -P\n"
+                    "    or -X), the peer needs no flag to take them\n", AGG_MTU_DEFAULT);
+    fprintf(stderr, "-T <file>: client only, keep the session in this ticket file and resume it after a restart\n");
+    fprintf(stderr, "-I <addr/len>: put this IPv4 address on the interface and bring it up\n");
+    fprintf(stderr, "-M <mtu>: set the interface MTU, 68-%d\n", PKT_ROOM);
+    fprintf(stderr, "-Q <qlen>: set the interface transmit queue length\n");
+    fprintf(stderr, "-R <prefix/len>: route this IPv4 subnet into the interface, up to %d\n", LINK_ROUTES_MAX);
+    fprintf(stderr, "-L bulk|latency[/<usec>]: bulk blocks as soon as there is nothing to do (default); latency busy polls the\n"
+                    "    sockets and spins usec (default %d) before blocking, on the isolated CPUs unless -P places the threads\n", SPIN_USEC_DEFAULT);
+    fprintf(stderr, "-B <bytes>: UDP socket send and receive buffers, 0 for the kernel's, default %d KB with -L latency\n", SOCKBUF_LATENCY / 1024);
+    fprintf(stderr, "-u|-a: use a tun (default) or tap interface, the same on both sides. With tap the server is a switch between\n"
+                    "    its tap and the clients: it learns MACs, floods broadcasts and unknown destinations sealed once for all,\n"
+                    "    and answers ARP for hosts it knows are elsewhere (epoll engine, no -g, -P, -X or -A)\n");
+    fprintf(stderr, "-F <k>/<m>|auto: forward error correction, m parity packets (up to %d) for every k packets (up to %d)\n"
+                    "    to a peer, the receiver rebuilds up to m lost ones of each group; auto sizes both by the loss the peer\n"
+                    "    reports (epoll engine, no -g, -P, -X or -A), the peer needs no flag to take them\n", FEC_M_MAX, FEC_K_MAX);
+    fprintf(stderr, "-U <uplink>,<uplink>...: client only, bond these underlays, each a local address or interface name (up to %d):\n"
+                    "    data is striped over them by the RTT and loss their probes measure, put back in order at the other end\n"
+                    "    after a wait of %d ms at most, and moved off one that goes silent for %d ms (epoll engine, no -g, -P, -X,\n"
+                    "    -A or -F); the server needs no flag\n", UPLINKS_MAX, BOND_WAIT_USEC / 1000, BOND_DEAD_MSEC);
+    fprintf(stderr, "-C dscp|<rule>,<rule>...: queue packets by class and send realtime first, then interactive, default and\n"
+                    "    bulk by deficit round robin (4:2:1), keeping the socket send buffer short (%d KB unless -B); a rule\n"
+                    "    tcp|udp[:<port>[-<port>]]=<class> or icmp=<class> matches either port and goes before the DSCP,\n"
+                    "    EF and CS5-7 realtime, CS2-4 and AF2x-4x interactive, CS1 bulk (epoll engine, no -g, -P, -X, -A\n"
+                    "    or -U), up to %d rules, %d packets per class and worker\n", SCHED_SNDBUF / 1024, SCHED_RULES_MAX, SCHED_QLEN);
+    fprintf(stderr, "-D: copy the DSCP of each packet onto the datagram carrying it, so the underlay can honour it (implies -C)\n");
+    fprintf(stderr, "-r <rate>[/auto]: pace what goes to each peer to rate bits per second (k, m or g), bursts of %d KB at most\n"
+                    "    and %d ms of backlog before dropping; fq keeps the departure times where the route has it, a timer\n"
+                    "    wheel of %d us ticks where not. auto lowers the rate while the RTT it probes is %d ms above the base\n"
+                    "    RTT, raises it again when not (epoll engine, no -g, -P, -X or -A)\n",
+                    PACE_BURST / 1024, (int)(PACE_HORIZON_NSEC / 1000000), PACE_TICK_USEC, PACE_TARGET_USEC / 1000);
+    fprintf(stderr, "-Y <file>: capture packets into a ring of %d records mapped from this file (in /dev/shm, say), for\n"
+                    "    tunnelcap to write out as pcapng: tun/tap packets and the tunnel datagrams, with the peer (epoll\n"
+                    "    engine, no -g, -P or -X)\n", CAP_SLOTS);
+    fprintf(stderr, "-y <filter>: what -Y keeps, comma separated: peer=<id>, proto=tcp|udp|icmp|<n> (of tun/tap packets),\n"
+                    "    len=<lo>[-<hi>], inner or outer only, sample=<n> for one in n of those, snap=<bytes> (at most %d)\n",
+                    CAP_SNAPLEN);
+    fprintf(stderr, "-K: kernel fast path, TC programs on tun and the underlay forward the data of connected peers\n"
+                    "    without reaching us (tun, no -k, -z, -F, -A, -U, -C, -r, -Y, -g or -X; linux 6.6 or later); TCP\n"
+                    "    this host sends still goes through us, for the kernel to finish its checksum\n");
     exit(1);
 }
 
+/**************************************************************************
+ * cpus_parse: parses a comma separated list of CPUs and CPU ranges       *
+ *             ("0,2-5") into at most max cpus, returns the count or -1   *
+ *             if malformed. "-" is the empty list.                       *
+ **************************************************************************/
+int cpus_parse(const char *s, int *cpus, int max) {
+    
+    char *end;
+    long lo, hi;
+    int n = 0;
+    
+    if (strcmp(s, "-") == 0 || *s == '\0')
+        return 0;
+    while (1) {
+        lo = hi = strtol(s, &end, 10);
+        if (end != s && *end == '-')
+            hi = strtol(s = end + 1, &end, 10);
+        if (end == s || lo < 0 || hi < lo || hi >= CPU_SETSIZE || n + hi - lo >= max)
+            return -1;
+        while (lo <= hi)
+            cpus[n++] = lo++;
+        if (*end != ',')
+            return *end == '\0' ? n : -1;
+        s = end + 1;
+    }
+}
+
+/**************************************************************************
+ * cpus_isolated: the CPUs the kernel keeps other tasks off (isolcpus=),  *
+ *                the first max of them into cpus. Returns the count, 0   *
+ *                when there are none or we cannot tell.                  *
+ **************************************************************************/
+int cpus_isolated(int *cpus, int max) {
+    
+    char text[4096];
+    int all[CPU_SETSIZE];
+    FILE *f;
+    int n;
+    
+    if ((f = fopen("/sys/devices/system/cpu/isolated", "r")) == NULL)
+        return 0;
+    n = fread(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+    while (n > 0 && (text[n - 1] == '\n' || text[n - 1] == ' '))
+        n--;
+    text[n] = '\0';
+    if ((n = cpus_parse(text, all, CPU_SETSIZE)) <= 0)
+        return 0;
+    if (n > max)
+        n = max;
+    memcpy(cpus, all, n * sizeof(*cpus));
+    return n;
+}
+
+/**************************************************************************
+ * addr_parse: parses "a.b.c.d[/len]" into *addr (host order) and *len,   *
+ *             32 when it has none. Returns -1 if malformed.              *
+ **************************************************************************/
+int addr_parse(const char *s, uint32_t *addr, int *plen) {
+    
+    char ip[16];
+    const char *slash = strchr(s, '/');
+    struct in_addr a;
+    int len = 32;
+    
+    if (slash == NULL)
+        slash = s + strlen(s);
+    else if ((len = atoi(slash + 1)) < 0 || len > 32)
+        return -1;
+    if (slash - s > 15)
+        return -1;
+    memcpy(ip, s, slash - s);
+    ip[slash - s] = '\0';
+    if (inet_aton(ip, &a) == 0)
+        return -1;
+    *addr = ntohl(a.s_addr);
+    *plen = len;
+    return 0;
+}
+
+/**************************************************************************
+ * route_parse: parses "a.b.c.d/len" into r. Returns -1 if malformed.    *
+ **************************************************************************/
+int route_parse(const char *s, struct route *r) {
+    
+    uint32_t addr;
+    int len;
+    
+    if (addr_parse(s, &addr, &len) < 0)
+        return -1;
+    r->len = len;
+    r->prefix = len ? addr & ~0U << (32 - len) : 0;
+    return 0;
+}
+
+/* bench/microbench.c builds this file without main to time its kernels */
+#ifndef TUNNEL_NO_MAIN
 int main(int argc, char *argv[]) {
     
-    int tap_fd, option;
+    int option;
     int flags = IFF_TUN;
     char if_name[IFNAMSIZ] = "";
     int header_len = IP_HDR_LEN;
-    int maxfd;
-    uint16_t nread, nwrite, plength;
     //  uint16_t total_len, ethertype;
-    char buffer[BUFSIZE];
-    struct sockaddr_in server_addr, client_addr, remote_addr, read_addr;
+    char *buffer, *end;
+    struct tunnel *tun;
+    int i, j, ncpus;
+    struct sockaddr_in server_addr;
     char server_ip[16] = "";
     unsigned short int port = PORT;
     int sock_fd, optval = 1;
-    socklen_t clientlen = sizeof(client_addr);
-    socklen_t serverlen = sizeof(server_addr);
-    socklen_t readlen = sizeof(read_addr);
-    int cliserv = -1;    /* must be specified on cmd line */
-    int tap_count = 0, sock_count = 0;
+    char *keyfile = NULL, *cipher = "aes-256-gcm", *slash, *cap_path = NULL;
     
     progname = argv[0];
     
     /* Check command line options */
-    while((option = getopt(argc, argv, "i:sc:p:uahd")) > 0){
+    while((option = getopt(argc, argv, "i:sc:p:b:w:e:gl:k:x:P:q:S:H:X:zA:T:I:M:Q:R:L:B:F:U:C:Dr:Y:y:Kuahd")) > 0){
         switch(option) {
             case 'h':
                 usage();
@@ -159,6 +11181,169 @@ int main(int argc, char *argv[]) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'b':
+                batch_size = atoi(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'e':
+                if (strcmp(optarg, "epoll") == 0) {
+                    engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    engine = ENGINE_URING;
+                } else {
+                    fprintf(stderr, "Unknown engine %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'g':
+                offload = 1;
+                break;
+            case 'l':
+                if (my_nroutes == PEER_ROUTES_MAX || route_parse(optarg, &my_routes[my_nroutes]) < 0) {
+                    fprintf(stderr, "Bad or too many routes: %s\n", optarg);
+                    usage();
+                }
+                my_nroutes++;
+                break;
+            case 'k':
+                keyfile = optarg;
+                break;
+            case 'x':
+                cipher = optarg;
+                break;
+            case 'P':
+                pipelined = 1;
+                if ((slash = strchr(optarg, '/')) != NULL) {
+                    *slash++ = '\0';
+                    nio_cpus = cpus_parse(slash, io_cpus, WORKERS_MAX);
+                }
+                if ((ncrypto_cpus = cpus_parse(optarg, crypto_cpus, WORKERS_MAX)) < 0 || nio_cpus < 0) {
+                    fprintf(stderr, "Bad CPU list for -P\n");
+                    usage();
+                }
+                break;
+            case 'q':
+                ring_depth = atoi(optarg);
+                break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            case 'H':
+                hist_every = atoi(optarg);
+                break;
+            case 'X':
+                xdp_ifname = optarg;
+                break;
+            case 'z':
+                compress = 1;
+                break;
+            case 'A':
+                agg_usec = strtol(optarg, &end, 10);
+                if (end == optarg || (*end != '\0' && *end != '/'))
+                    agg_usec = -1;
+                else if (*end == '/')
+                    agg_mtu = atoi(end + 1);
+                if (agg_usec < 0) {
+                    fprintf(stderr, "Bad aggregation %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'T':
+                ticket_path = optarg;
+                break;
+            case 'I':
+                if (addr_parse(optarg, &link_ip, &link_plen) < 0) {
+                    fprintf(stderr, "Bad interface address %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'M':
+                link_mtu = atoi(optarg);
+                break;
+            case 'Q':
+                link_txqlen = atoi(optarg);
+                break;
+            case 'R':
+                if (link_nroutes == LINK_ROUTES_MAX || route_parse(optarg, &link_routes[link_nroutes]) < 0) {
+                    fprintf(stderr, "Bad or too many routes: %s\n", optarg);
+                    usage();
+                }
+                link_nroutes++;
+                break;
+            case 'L':
+                if ((slash = strchr(optarg, '/')) != NULL) {
+                    *slash++ = '\0';
+                    spin_usec = atoi(slash);
+                }
+                if (strcmp(optarg, "bulk") == 0) {
+                    profile = PROFILE_BULK;
+                } else if (strcmp(optarg, "latency") == 0) {
+                    profile = PROFILE_LATENCY;
+                } else {
+                    fprintf(stderr, "Unknown profile %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'u':
+                flags = IFF_TUN;
+                tap_mode = 0;
+                break;
+            case 'a':
+                flags = IFF_TAP;
+                tap_mode = 1;
+                break;
+            case 'B':
+                if ((sockbuf = atoi(optarg)) < 0) {
+                    fprintf(stderr, "Bad socket buffer size %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'U':
+                if (uplinks_parse(optarg) < 0) {
+                    fprintf(stderr, "Bad or too many uplinks: %s, up to %d\n", optarg, UPLINKS_MAX);
+                    usage();
+                }
+                break;
+            case 'C':
+                if (sched_parse(optarg) < 0) {
+                    fprintf(stderr, "Bad or too many class rules: %s, up to %d\n", optarg, SCHED_RULES_MAX);
+                    usage();
+                }
+                sched_on = 1;
+                break;
+            case 'D':
+                dscp_copy = sched_on = 1;
+                break;
+            case 'Y':
+                cap_path = optarg;
+                break;
+            case 'K':
+                kfast = 1;
+                break;
+            case 'y':
+                if (cap_parse(optarg) < 0) {
+                    fprintf(stderr, "Bad capture filter %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'r':
+                if (rate_parse(optarg) < 0) {
+                    fprintf(stderr, "Bad rate %s, bits per second with k, m or g, at least %d, and /auto to follow the path\n",
+                            optarg, PACE_RATE_MIN);
+                    usage();
+                }
+                break;
+            case 'F':
+                fec_mode = 1;
+                if (strcmp(optarg, "auto") != 0 && (sscanf(optarg, "%d/%d", &fec_k, &fec_m) != 2 ||
+                    fec_k < 1 || fec_k > FEC_K_MAX || fec_m < 1 || fec_m > FEC_M_MAX)) {
+                    fprintf(stderr, "Bad FEC group %s, k/m with k up to %d and m up to %d, or auto\n", optarg,
+                            FEC_K_MAX, FEC_M_MAX);
+                    usage();
+                }
+                break;
             default:
                 printf("Unknown option %c\n", option);
                 usage();
@@ -182,15 +11367,224 @@ int main(int argc, char *argv[]) {
     }else if((cliserv == CLIENT)&&(*server_ip == '\0')){
         perror("Must specify server address!\n");
         usage();
+    }else if(batch_size < 1 || batch_size > BATCH_MAX){
+        fprintf(stderr, "Batch size must be between 1 and %d!\n", BATCH_MAX);
+        usage();
+    }else if(workers < 1 || workers > WORKERS_MAX){
+        fprintf(stderr, "Workers must be between 1 and %d!\n", WORKERS_MAX);
+        usage();
+    }else if(ring_depth < 2 || ring_depth > RING_DEPTH_MAX || (ring_depth & (ring_depth - 1))){
+        fprintf(stderr, "Ring depth must be a power of 2 up to %d!\n", RING_DEPTH_MAX);
+        usage();
+    }else if(hist_every < 0){
+        fprintf(stderr, "Histogram sampling must be 0 or more!\n");
+        usage();
+    }else if(agg_mtu < 576 || agg_mtu > PKT_ROOM){
+        fprintf(stderr, "Aggregation MTU must be between 576 and %d!\n", PKT_ROOM);
+        usage();
+    }else if(link_mtu != 0 && (link_mtu < 68 || link_mtu > PKT_ROOM)){
+        fprintf(stderr, "Interface MTU must be between 68 and %d!\n", PKT_ROOM);
+        usage();
+    }else if(link_txqlen < 0){
+        fprintf(stderr, "Transmit queue length must be 0 or more!\n");
+        usage();
+    }else if(spin_usec <= 0){
+        fprintf(stderr, "Spin time must be 1 microsecond or more!\n");
+        usage();
     }
     
-    /* initialize tun/tap interface */
-    if ((tap_fd = tun_alloc(if_name, flags | IFF_NO_PI)) < 0 ) {
-        printf("Error connecting to tun/tap interface %s!\n", if_name);
+    /* OpenSSL picks the AES-NI/VAES or AVX2/NEON code for the CPU itself */
+    if (keyfile) {
+        if (strcmp(cipher, "aes-256-gcm") == 0) {
+            aead = EVP_aes_256_gcm();
+        } else if (strcmp(cipher, "chacha20-poly1305") == 0) {
+            aead = EVP_chacha20_poly1305();
+        } else {
+            fprintf(stderr, "Unknown cipher %s\n", cipher);
+            usage();
+        }
+        aead_load_key(keyfile);
+        printf("Encrypting with %s\n", cipher);
+    } else {
+        fprintf(stderr, "No key (-k), tunnel traffic is not encrypted\n");
+    }
+    
+    if (tap_mode && (engine == ENGINE_URING || offload || pipelined || xdp_ifname || agg_usec >= 0)) {
+        fprintf(stderr, "TAP mode runs on the epoll engine without offload, pipelining, AF_XDP or aggregation\n");
+        engine = ENGINE_EPOLL;
+        offload = pipelined = 0;
+        xdp_ifname = NULL;
+        agg_usec = -1;
+    }
+    if (pipelined && (engine == ENGINE_URING || offload)) {
+        fprintf(stderr, "Pipelined mode runs on the epoll engine without offload, not pipelining\n");
+        pipelined = 0;
+    }
+    if (engine == ENGINE_URING && offload) {
+        fprintf(stderr, "Offload mode runs on the epoll engine only, using epoll\n");
+        engine = ENGINE_EPOLL;
+    }
+    if (engine == ENGINE_URING && !uring_available()) {
+        fprintf(stderr, "Kernel lacks io_uring support for this engine, using epoll\n");
+        engine = ENGINE_EPOLL;
+    }
+    if (xdp_ifname && (engine == ENGINE_URING || offload || pipelined)) {
+        fprintf(stderr, "The AF_XDP underlay runs on the epoll engine without offload or pipelining, using UDP\n");
+        xdp_ifname = NULL;
+    }
+    if (compress && offload) {
+        fprintf(stderr, "Compression leaves segments of unequal size, UDP GSO cannot send them; not compressing\n");
+        compress = 0;
+    }
+    if (agg_usec >= 0 && (engine == ENGINE_URING || offload || pipelined || xdp_ifname)) {
+        fprintf(stderr, "Aggregation runs on the epoll engine without offload, pipelining or AF_XDP, not aggregating\n");
+        agg_usec = -1;
+    }
+    if (ticket_path && cliserv == SERVER) {
+        fprintf(stderr, "Tickets are for clients, a server does not keep one\n");
+        ticket_path = NULL;
+    }
+    if (fec_mode && (engine == ENGINE_URING || offload || pipelined || xdp_ifname || agg_usec >= 0)) {
+        fprintf(stderr, "FEC runs on the epoll engine without offload, pipelining, AF_XDP or aggregation, not sending parity\n");
+        fec_mode = 0;
+    }
+    if (fec_mode && batch_size * (1 + FEC_M_MAX) > BATCH_MAX) {
+        batch_size = BATCH_MAX / (1 + FEC_M_MAX);
+        fprintf(stderr, "FEC leaves room for parity in each batch, batches of %d\n", batch_size);
+    }
+    /* every worker may take FEC frames, whatever it sends */
+    fec_init();
+    if (fec_mode && fec_k)
+        printf("FEC: %d parity for every %d packets, %s kernels\n", fec_m, fec_k, gf_kernel);
+    else if (fec_mode)
+        printf("FEC: parity following the loss the peer reports, %s kernels\n", gf_kernel);
+    /* a server stripes to whichever client bonds, where the datapath lets it */
+    if (nuplinks && cliserv == SERVER) {
+        fprintf(stderr, "Uplinks are for clients, a server stripes to the ones its clients bond\n");
+        nuplinks = 0;
+    }
+    bond_tx = engine == ENGINE_EPOLL && !offload && !pipelined && !xdp_ifname && agg_usec < 0 && !fec_mode;
+    if (nuplinks > 1 && !bond_tx) {
+        fprintf(stderr, "Bonding runs on the epoll engine without offload, pipelining, AF_XDP, aggregation or FEC, "
+                        "using the first uplink\n");
+        nuplinks = 1;
+    }
+    /* the server keeps a path per worker and uplink */
+    if (nuplinks > 1 && workers * nuplinks > WORKERS_MAX) {
+        workers = WORKERS_MAX / nuplinks;
+        fprintf(stderr, "Every worker has a path per uplink, %d workers\n", workers);
+    }
+    if (nuplinks > 1)
+        printf("Bonding %d uplinks\n", nuplinks);
+    /* a server puts back in order where it could stripe itself, a client where it bonds */
+    bond_rx = !pipelined && !offload && (cliserv == SERVER ? bond_tx : nuplinks > 1);
+    /* the scheduler holds packets between the read and a send on one socket */
+    if (sched_on && (engine == ENGINE_URING || offload || pipelined || xdp_ifname || agg_usec >= 0 || nuplinks > 1)) {
+        fprintf(stderr, "Egress scheduling runs on the epoll engine without offload, pipelining, AF_XDP, aggregation "
+                        "or bonding, not scheduling\n");
+        sched_on = dscp_copy = 0;
+    }
+    if (sched_on) {
+        if (sockbuf < 0)
+            sched_sndbuf = SCHED_SNDBUF;
+        printf("Egress scheduling: %d rules ahead of the DSCP classes%s\n", nsched_rules,
+               dscp_copy ? ", DSCP copied to the tunnel datagrams" : "");
+    }
+    /* pacing times each frame between the seal and the send of a tx batch */
+    if (pace_bps && (engine == ENGINE_URING || offload || pipelined || xdp_ifname || agg_usec >= 0)) {
+        fprintf(stderr, "Pacing runs on the epoll engine without offload, pipelining, AF_XDP or aggregation, not pacing\n");
+        pace_bps = pace_auto = 0;
+    }
+    if (pace_bps)
+        printf("Pacing each peer to %.3f Mbit/s%s\n", pace_bps / 1e6, pace_auto ? ", lower while its RTT says the path queues" : "");
+    /* the other engines read and write some packets where the hooks do not see them */
+    if (cap_path && (engine == ENGINE_URING || offload || pipelined || xdp_ifname)) {
+        fprintf(stderr, "Capture runs on the epoll engine without offload, pipelining or AF_XDP, not capturing\n");
+        cap_path = NULL;
+    }
+    if (cap_path) {
+        cap_open(cap_path, port);
+        printf("Capturing into %s, %d records\n", cap_path, CAP_SLOTS);
+    }
+    /* the programs only frame plain packets, one to a datagram, whatever would change that stays with us */
+    if (kfast && (tap_mode || aead || compress || fec_mode || agg_usec >= 0 || nuplinks > 1 || sched_on || pace_bps ||
+                  cap_path || offload || xdp_ifname)) {
+        fprintf(stderr, "The kernel fast path is for tun peers without -k, -z, -F, -A, -U, -C, -r, -Y, -g or -X, not using it\n");
+        kfast = 0;
+    }
+    /* latency: spin before blocking, on the cores kept for us unless told otherwise */
+    if (profile == PROFILE_LATENCY) {
+        spin_nsec = spin_usec * 1000ULL;
+        if (sockbuf < 0)
+            sockbuf = SOCKBUF_LATENCY;
+        if (nio_cpus == 0 && (nio_cpus = cpus_isolated(io_cpus, WORKERS_MAX)) == 0)
+            fprintf(stderr, "No isolated CPUs (isolcpus=), latency profile keeps the default placement\n");
+        if (pipelined && ncrypto_cpus == 0 && nio_cpus > workers)
+            for (i = workers; i < nio_cpus; i++)
+                crypto_cpus[ncrypto_cpus++] = io_cpus[i];
+        printf("Latency profile: spinning %d us before blocking, busy polling, socket buffers %d KB\n",
+               spin_usec, sockbuf / 1024);
+    }
+    /* the per-packet loops built for these settings, if there is one */
+    dp_pick();
+    if (engine == ENGINE_EPOLL && !offload && !pipelined && !xdp_ifname && agg_usec < 0)
+        printf("Datapath: %s%s\n", datapath->name, datapath->feat == DP_GENERIC ? "" : ", specialized");
+    /* what a bundle may carry once the outer headers and tag are paid for */
+    agg_room = agg_mtu - IP_HDR_LEN - UDP_HDR_LEN - WIRE_HDR_LEN - (aead ? AEAD_TAG_LEN : 0);
+    
+    if ((tun = calloc(workers, sizeof(*tun))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 0; i < workers; i++) {
+        tun[i].id = i;
+        tun[i].cpu = nio_cpus ? io_cpus[i % nio_cpus] : i % (ncpus > 0 ? ncpus : 1);
+        tun[i].retry_budget = RETRY_PER_SEC;
+        aead_init(&tun[i]);
+        zip_init(&tun[i]);
+    }
+    /* every worker's two batches, what the caches may hold, what its rings
+     * may hold when pipelined or its AF_XDP fill and tx rings, the longer
+     * tx batch and open bundle when aggregating, the switching buffer of
+     * a TAP server, the longer tx batch and one peer's parity with FEC,
+     * what the reorder buffers hold back, the class queues, the pacing
+     * wheel, and some spare */
+    pool_init(workers * (2 * batch_size + POOL_CACHE * (pipelined ? 2 : 1) +
+                         (pipelined ? 4 * ring_depth : 0) + (xdp_ifname ? 2 * XDP_RING : 0) +
+                         (agg_usec >= 0 ? batch_size + 2 : 0) + tap_mode +
+                         (fec_mode ? (batch_size + 1) * FEC_M_MAX : 0) +
+                         (bond_rx ? BOND_HELD : 0) +
+                         (sched_on ? SCHED_CLASSES * SCHED_QLEN + 1 : 0) + (pace_bps ? PACE_HELD : 0)) + POOL_SPARE);
+    if ((buffer = pool_get()) == NULL) {
+        fprintf(stderr, "Buffer pool exhausted\n");
         exit(1);
     }
+    buffer = PKT_FRAME(buffer);
+    peers_init();
+    if (stats_path)
+        stats_init(stats_path);
+    
+    /* initialize tun/tap interface, one queue per worker */
+    if (workers > 1)
+        flags |= IFF_MULTI_QUEUE;
+    if (offload)
+        flags |= IFF_VNET_HDR;
+    for (i = 0; i < workers; i++) {
+        if ((tun[i].tap_fd = tun_alloc(if_name, flags | IFF_NO_PI)) < 0 ) {
+            printf("Error connecting to tun/tap interface %s!\n", if_name);
+            exit(1);
+        }
+    }
     
     printf("Successfully connected to interface %s\n", if_name);
+    tun_name = if_name;
+    /* no waiting for a script to race us to it */
+    if (link_plen >= 0 || link_mtu || link_txqlen || link_nroutes) {
+        if (link_up(if_name) < 0)
+            exit(1);
+        printf("Interface %s is up\n", if_name);
+    }
     
     // socket(PF_INET, SOCK_DGRAM, 0) is socket with UDP
     // socket(AF_INET, SOCK_STREAM, 0) is socket with TCP
@@ -198,39 +11592,52 @@ int main(int argc, char *argv[]) {
         perror("socket()");
         exit(1);
     }
+    sock_tune(sock_fd);
     
     if(cliserv==CLIENT){
-        memset(&client_addr, 0, sizeof(client_addr));
-        client_addr.sin_family = AF_INET;
-        client_addr.sin_addr.s_addr = htonl(INADDR_ANY); // self
-        client_addr.sin_port = htons(port);
-        
         memset(&server_addr, 0, sizeof(server_addr));
         server_addr.sin_family = AF_INET;
         server_addr.sin_port = htons(port);
         inet_aton(server_ip, &server_addr.sin_addr);
         
-        if (bind(sock_fd,(struct sockaddr *)&client_addr, sizeof(client_addr)) < 0){
-            perror("bind");
+        /* on the first uplink with -U, the others get sockets of their own */
+        if (uplink_bind(sock_fd, nuplinks ? &uplinks[0] : NULL, port) < 0)
             exit(1);
-        }
-        
-        if (sendto(sock_fd, MAGIC_WORD, sizeof(MAGIC_WORD), 0, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-            perror("sendto magic word");
         
-        if (recvfrom(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&server_addr, &serverlen) < 0)
-            perror("recvfrom");
-        if (strncmp(MAGIC_WORD, buffer, sizeof(MAGIC_WORD) != 0)){
-            perror("Bad magic word for peer\n");
-            exit(1);
+        /* a ticket resumes its session above what it may have sealed, or
+         * the session tells our frames apart from other clients' at the server */
+        if (ticket_path && ticket_load(ticket_path, &server_addr)) {
+            my_session = ticket.session;
+            tx_floor = ticket.tx_seq;
+            resume_floor = ticket.rx_seq;
+            printf("Resuming session %08x from %s\n", my_session, ticket_path);
         }
+        while (my_session == 0)
+            if (getrandom(&my_session, sizeof(my_session), 0) < 0) {
+                perror("getrandom");
+                exit(1);
+            }
         
-        printf("Connection with %s:%i established\n", (char *)inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
-        
-        remote_addr = server_addr;
+        /* our peer is the server from the start, its key seals the HELLO */
+        peer_add(my_session, &server_addr, 0, my_routes, 0, tx_floor, resume_floor);
+        if (nuplinks > 1)
+            atomic_store(&peers[0].bonded, 1);
+        if (ticket_path) {
+            ticket.server = server_addr;
+            ticket.session = my_session;
+            ticket_update();
+        }
+        /* data may follow right away, the workers resend the HELLO until answered */
+        tun[0].sock_fd = sock_fd;
+        atomic_store(&hello_sent, now_sec());
+        atomic_store(&hello_echo, 1);
+        hello_rto = HELLO_RTO_SEC;
+        if (send_frame(&tun[0], &peers[0], buffer, FRAME_HELLO, hello_build(buffer), &server_addr) < 0)
+            perror("sendto magic word");
+        printf("Connecting to %s:%i\n", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
     } else {
-        /* Server, wait for connections */
-        
+        /* Server, clients connect to the workers with their HELLO */
+
         /* avoid EADDRINUSE error on bind() */
         // SO_REUSEADDR: allow to reuse (socket address) port number, optval=1 allow, 0 deny
         // for setsockopt() and getsockopt() function:
@@ -239,6 +11646,11 @@ int main(int argc, char *argv[]) {
             perror("setsockopt");
             exit(1);
         }
+        // SO_REUSEPORT: the other workers bind the same port later on
+        if(workers > 1 && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&optval, sizeof(optval)) < 0){
+            perror("setsockopt");
+            exit(1);
+        }
         
         memset(&server_addr, 0, sizeof(server_addr));
         server_addr.sin_family = AF_INET;
@@ -248,67 +11660,55 @@ int main(int argc, char *argv[]) {
             perror("bind");
             exit(1);
         }
-
-        /* wait for connection request */
-        
-        // below are UDP connection
-        // server side waiting for a UDP connection
-        if (recvfrom(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &clientlen) < 0)
-                perror("recvfrom");
-        if (strncmp(MAGIC_WORD, buffer, sizeof(MAGIC_WORD)) != 0){
-            perror("Bad magic word for peer\n");
-            exit(1);
+        /* a new epoch each start, clients learn it from the HELLO_ACK */
+        if (tap_mode) {
+            while (flood.session == 0)
+                if (getrandom(&flood.session, sizeof(flood.session), 0) < 0) {
+                    perror("getrandom");
+                    exit(1);
+                }
+            flood_key(flood.session);
+            printf("SERVER: Bridging tap, flooding under session %08x\n", flood.session);
         }
-        
-        // once receive connect request, resend to check
-        if (sendto(sock_fd, MAGIC_WORD, sizeof(MAGIC_WORD), 0, (struct sockaddr *)&client_addr, clientlen) < 0)
-            perror("sendto");
- 
-        printf("SERVER: Client connected from %s\n", inet_ntoa(client_addr.sin_addr));
-        remote_addr = client_addr;
+        printf("SERVER: Waiting for clients on port %i\n", port);
     }
     
-    /* use select() to handle two descriptors at once */
-    maxfd = (tap_fd > sock_fd)?tap_fd:sock_fd;
+    /* hand over to the workers */
+    tun[0].sock_fd = sock_fd;
     
-    while(1) {
-        int ret;
-        fd_set rd_set;
-        
-        FD_ZERO(&rd_set);
-        FD_SET(sock_fd, &rd_set);
-        FD_SET(tap_fd, &rd_set);
-        
-        ret = select(maxfd + 1, &rd_set, NULL, NULL, NULL);
-        
-        if (ret < 0 && errno == EINTR) continue;
-
-        if (ret < 0) {
-            perror("select()");
-            exit(1);
-        }
-        if(FD_ISSET(tap_fd, &rd_set)){
-              /* data from tun/tap: just read it and write it to the network */
-            if(read(tap_fd, buffer, sizeof(buffer)))
-                perror("read from virtual");
-            if(sendto(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0)
-                perror("sendto network");
-         
-            printf("Get packet from virtual -> real NIC %d\n", tap_count++);
+    for (i = 1; i < workers; i++) {
+        /* a server shares its port, client workers each get their own
+         * source port so the server's kernel spreads them over its sockets */
+        if (cliserv == SERVER) {
+            tun[i].sock_fd = udp_open(port, 1, tun[i].cpu, NULL);
+        } else {
+            tun[i].sock_fd = udp_open(port + i, 0, tun[i].cpu, nuplinks ? &uplinks[0] : NULL);
         }
-        
-        if(FD_ISSET(sock_fd, &rd_set)){
-            /* data from the network: read it, and write it to the tun/tap interface.
-             * We need to read the length first, and then the packet */
-            if(recvfrom(sock_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&read_addr, &readlen))
-                perror("read from network");
-            remote_addr = read_addr;
-            if(write(tap_fd, buffer, sizeof(buffer)) < 0)
-                perror("write to virtual");
-            
-            printf("Get packet from real -> virtual NIC %d\n", sock_count++);
+    }
+    /* bonding: each worker's source port on every uplink, one client worker's paths differ by address only */
+    for (i = 0; i < workers; i++)
+        for (j = 1; j < nuplinks; j++)
+            tun[i].up_fd[j] = udp_open(port + i, 0, tun[i].cpu, &uplinks[j]);
+    if (cliserv == SERVER && workers > 1)
+        bond_steer(tun[0].sock_fd);
+    if (kfast)
+        kfast_init(tun, port, cliserv == CLIENT ? port + workers : port + 1);
+    if (xdp_ifname)
+        xdp_init(tun);
+    if (pace_bps || kf_peers)
+        control_init();
+    /* from here on tables are only freed once every worker is past them */
+    atomic_store(&nquiesced, workers);
+    for (i = 1; i < workers; i++) {
+        if ((errno = pthread_create(&tun[i].thread, NULL, worker_main, &tun[i])) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
     }
+    pool_put(PKT_BUF(buffer));
+    
+    worker_main(&tun[0]);
     
     return(0);
 }
+#endif